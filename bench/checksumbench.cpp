@@ -0,0 +1,97 @@
+/**
+ * Microbenchmark for chunk checksums
+ *
+ * Checksums a buffer in pieces of a chunk, a run and a whole piece with
+ * every algorithm at every implementation level the CPU supports, and
+ * reports GB/s. Each level has to agree with the portable one, so this
+ * doubles as a check of the accelerated code.
+ */
+
+#include <iostream>
+#include "../common/P2PCommon.cpp"
+#include "../common/P2PChecksum.cpp"
+using namespace std;
+
+// A chunk, a run of 16 chunks, and a piece
+static const unsigned int BLOCK_SIZES[] = { 16 * 1024, 256 * 1024, 4 * 1024 * 1024 };
+static const unsigned int BUFFER_SIZE = 64 * 1024 * 1024;
+static const int ROUNDS = 5;
+
+double wallSeconds()
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+// Checksums of every block, and the best time over a few rounds
+double runAlgorithm(unsigned int algorithm, const vector<char> & buffer, unsigned int block_size, vector<unsigned int> & checksums)
+{
+	unsigned int blocks = buffer.size() / block_size;
+	checksums.assign(blocks, 0);
+
+	double best_seconds = 1e9;
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		double start_time = wallSeconds();
+		for (unsigned int b = 0; b < blocks; b++)
+		{
+			checksums[b] = P2PChecksum::compute(algorithm, &buffer[(size_t) b * block_size], block_size);
+		}
+		best_seconds = min(best_seconds, wallSeconds() - start_time);
+	}
+
+	return best_seconds;
+}
+
+int main(int argc, const char* argv[])
+{
+	const unsigned int algorithms[] = { P2PChecksum::ALGORITHM_SUM32, P2PChecksum::ALGORITHM_CRC32C, P2PChecksum::ALGORITHM_XXH3 };
+
+	vector<char> buffer(BUFFER_SIZE);
+	unsigned int state = 2463534242U;
+	for (unsigned int i = 0; i < BUFFER_SIZE; i++)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		buffer[i] = (char)(state >> 24);
+	}
+
+	bool b_success = true;
+	printf("%-8s %-9s %10s %10s\n", "checksum", "level", "block", "GB/s");
+	for (int a = 0; a < 3; a++)
+	{
+		for (unsigned int s = 0; s < sizeof(BLOCK_SIZES) / sizeof(BLOCK_SIZES[0]); s++)
+		{
+			vector<unsigned int> expected;
+			for (int level = P2PChecksum::LEVEL_PORTABLE; level <= P2PChecksum::detectLevel(); level++)
+			{
+				// The sum has no accelerated version
+				if (algorithms[a] == P2PChecksum::ALGORITHM_SUM32 && level > P2PChecksum::LEVEL_PORTABLE)
+					break;
+
+				P2PChecksum::setLevel(level);
+				vector<unsigned int> checksums;
+				double seconds = runAlgorithm(algorithms[a], buffer, BLOCK_SIZES[s], checksums);
+
+				if (level == P2PChecksum::LEVEL_PORTABLE)
+				{
+					expected = checksums;
+				}
+				else if (checksums != expected)
+				{
+					printf("Error: %s at %s disagrees with the portable version\n",
+						P2PChecksum::describeAlgorithm(algorithms[a]).c_str(), P2PChecksum::describeLevel(level).c_str());
+					b_success = false;
+				}
+
+				printf("%-8s %-9s %9uK %10.2f\n", P2PChecksum::describeAlgorithm(algorithms[a]).c_str(),
+					P2PChecksum::describeLevel(level).c_str(), BLOCK_SIZES[s] / 1024,
+					(double) checksums.size() * BLOCK_SIZES[s] / seconds / 1e9);
+			}
+		}
+	}
+
+	return b_success ? 0 : 1;
+}
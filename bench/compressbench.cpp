@@ -0,0 +1,146 @@
+/**
+ * Microbenchmark for chunk compression
+ *
+ * Compresses a log-like text corpus and a random binary corpus in runs of
+ * the size the uploader sends, with every codec that's available, and
+ * reports compress and decompress speed and the ratio. It then works out the
+ * throughput a transfer would see over links of different speeds with
+ * compression off, always on, and adaptive (the uploader's sample test).
+ * Compression, the wire and decompression run on different threads, so the
+ * slowest of the three sets the pace.
+ */
+
+#include <iostream>
+#include "../common/P2PCommon.cpp"
+#include "../common/P2PCompression.cpp"
+using namespace std;
+
+// Same run as the uploader compresses - 16 chunks of 16 KiB
+static const int RUN_SIZE = 16 * 16 * 1024;
+static const int CORPUS_SIZE = 16 * 1024 * 1024;
+static const int ROUNDS = 3;
+
+typedef struct {
+	double compress_seconds;
+	double decompress_seconds;
+	double compressed_bytes;
+	bool b_compressible;
+} CodecResult;
+
+double wallSeconds()
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+string makeLogCorpus()
+{
+	const char * levels[] = { "INFO", "DEBUG", "WARN", "INFO" };
+	string corpus;
+	char line[160];
+	for (unsigned int i = 0; corpus.length() < (unsigned int) CORPUS_SIZE; i++)
+	{
+		sprintf(line, "2026-10-18 07:%02u:%02u.%03u %-5s [worker-%u] request %u for /files/%u.tar served in %u ms\n",
+			(i / 6000) % 60, (i / 100) % 60, i % 1000, levels[i % 4], i % 8, i, (i * 7919) % 5000, (i * 31) % 97);
+		corpus += line;
+	}
+
+	corpus.resize(CORPUS_SIZE);
+	return corpus;
+}
+
+string makeRandomCorpus()
+{
+	string corpus(CORPUS_SIZE, '\0');
+	unsigned int state = 2463534242U;
+	for (int i = 0; i < CORPUS_SIZE; i++)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		corpus[i] = (char)(state >> 24);
+	}
+
+	return corpus;
+}
+
+CodecResult runCodec(const string & corpus)
+{
+	CodecResult result;
+	result.b_compressible = P2PCompression::isCompressible(corpus.data(), RUN_SIZE);
+
+	int runs = CORPUS_SIZE / RUN_SIZE;
+	int bound = P2PCompression::compressBound(RUN_SIZE);
+	vector<char> compressed((size_t) runs * bound);
+	vector<int> compressed_sizes(runs);
+	vector<char> output(RUN_SIZE);
+
+	// Best of a few rounds
+	result.compress_seconds = 1e9;
+	result.decompress_seconds = 1e9;
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		double start_time = wallSeconds();
+		result.compressed_bytes = 0;
+		for (int r = 0; r < runs; r++)
+		{
+			compressed_sizes[r] = P2PCompression::compress(&corpus[(size_t) r * RUN_SIZE],
+				&compressed[(size_t) r * bound], RUN_SIZE, bound);
+			result.compressed_bytes += compressed_sizes[r];
+		}
+		result.compress_seconds = min(result.compress_seconds, wallSeconds() - start_time);
+
+		start_time = wallSeconds();
+		for (int r = 0; r < runs; r++)
+		{
+			int size = P2PCompression::decompress(&compressed[(size_t) r * bound], &output[0], compressed_sizes[r], RUN_SIZE);
+			if (size != RUN_SIZE || memcmp(&output[0], &corpus[(size_t) r * RUN_SIZE], RUN_SIZE) != 0)
+			{
+				printf("Error: run %d did not round trip\n", r);
+				exit(1);
+			}
+		}
+		result.decompress_seconds = min(result.decompress_seconds, wallSeconds() - start_time);
+	}
+
+	return result;
+}
+
+void runCorpus(string name, const string & corpus)
+{
+	const double total_bytes = (double)(CORPUS_SIZE / RUN_SIZE) * RUN_SIZE;
+	const double MB = 1024 * 1024;
+	const double links[] = { 10e6 / 8, 100e6 / 8, 1e9 / 8, 10e9 / 8 };
+	const char * link_names[] = { "10M", "100M", "1G", "10G" };
+
+	for (int codec = P2PCompression::CODEC_BUILTIN; codec <= P2PCompression::detectCodec(); codec++)
+	{
+		P2PCompression::setCodec(codec);
+		CodecResult result = runCodec(corpus);
+
+		printf("%-7s %-16s compress %7.0f MB/s  decompress %7.0f MB/s  ratio %5.2f  %s\n", name.c_str(),
+			P2PCompression::describeCodec(codec).c_str(), total_bytes / MB / result.compress_seconds,
+			total_bytes / MB / result.decompress_seconds, total_bytes / result.compressed_bytes,
+			result.b_compressible ? "compressed" : "bypassed");
+
+		// Effective MB/s of file data per link speed: off, always on, adaptive
+		for (int l = 0; l < 4; l++)
+		{
+			double off = total_bytes / links[l];
+			double on = max(max(result.compress_seconds, result.decompress_seconds), result.compressed_bytes / links[l]);
+			double adaptive = result.b_compressible ? on : off;
+
+			printf("        %-5s link  off %8.1f MB/s  on %8.1f MB/s  adaptive %8.1f MB/s\n", link_names[l],
+				total_bytes / MB / off, total_bytes / MB / on, total_bytes / MB / adaptive);
+		}
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+	runCorpus("text", makeLogCorpus());
+	runCorpus("random", makeRandomCorpus());
+
+	return 0;
+}
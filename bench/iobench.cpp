@@ -0,0 +1,243 @@
+/**
+ * Loopback benchmark comparing the syscall and io_uring I/O backends
+ *
+ * Streams a file from a sender thread to a receiver thread over 127.0.0.1,
+ * the same way an upload is read from disk, sent, received and written back.
+ */
+
+#include <iostream>
+#include <sys/resource.h>
+#include "../common/P2PCommon.cpp"
+#include "../common/P2PIOBackend.cpp"
+using namespace std;
+
+typedef struct {
+	int backend;
+	int socket_id;
+	int descriptor;
+	unsigned long long length;
+	unsigned long syscalls;
+} BenchSide;
+
+static const unsigned int CHUNK_SIZE = 64 * 1024;
+static const unsigned int BATCH_CHUNKS = 16;
+
+void * runSender(void * arg)
+{
+	BenchSide * side = (BenchSide *) arg;
+	P2PIOBackend io_backend;
+	io_backend.open(side->backend);
+
+	vector<char *> buffers;
+	for (unsigned int b = 0; b < BATCH_CHUNKS; b++)
+	{
+		buffers.push_back(new char[CHUNK_SIZE]);
+	}
+
+	vector<P2PIORequest> requests;
+	unsigned long long offset = 0;
+	while (offset < side->length)
+	{
+		// Read a batch of chunks
+		requests.clear();
+		for (unsigned int b = 0; b < BATCH_CHUNKS && offset + (unsigned long long) b * CHUNK_SIZE < side->length; b++)
+		{
+			requests.push_back(P2PIOBackend::makeRequest(P2PIOBackend::IO_READ, side->descriptor,
+				buffers[b], CHUNK_SIZE, offset + (unsigned long long) b * CHUNK_SIZE, 0));
+		}
+
+		io_backend.submit(requests);
+
+		// Send the whole batch
+		vector<P2PIORequest> sends;
+		for (unsigned int b = 0; b < requests.size(); b++)
+		{
+			sends.push_back(P2PIOBackend::makeRequest(P2PIOBackend::IO_SEND, side->socket_id,
+				buffers[b], max(requests[b].result, 0), 0, MSG_NOSIGNAL));
+			offset += max(requests[b].result, 0);
+		}
+
+		io_backend.submit(sends);
+
+		// Finish off any partial sends
+		for (unsigned int b = 0; b < sends.size(); b++)
+		{
+			if (sends[b].result >= 0 && (unsigned int) sends[b].result < sends[b].length)
+			{
+				io_backend.sendFully(side->socket_id, &buffers[b][sends[b].result], sends[b].length - sends[b].result, MSG_NOSIGNAL);
+			}
+		}
+	}
+
+	shutdown(side->socket_id, SHUT_WR);
+	side->syscalls = io_backend.getSyscallCount();
+
+	for (unsigned int b = 0; b < BATCH_CHUNKS; b++)
+	{
+		delete[] buffers[b];
+	}
+
+	pthread_exit(NULL);
+}
+
+void * runReceiver(void * arg)
+{
+	BenchSide * side = (BenchSide *) arg;
+	P2PIOBackend io_backend;
+	io_backend.open(side->backend);
+
+	char * buffer = new char[CHUNK_SIZE * BATCH_CHUNKS];
+	vector<P2PIORequest> requests(1);
+	unsigned long long offset = 0;
+
+	while (true)
+	{
+		requests[0] = P2PIOBackend::makeRequest(P2PIOBackend::IO_RECV, side->socket_id, buffer, CHUNK_SIZE * BATCH_CHUNKS, 0, 0);
+		io_backend.submit(requests);
+		if (requests[0].result <= 0)
+			break;
+
+		requests[0] = P2PIOBackend::makeRequest(P2PIOBackend::IO_WRITE, side->descriptor, buffer, requests[0].result, offset, 0);
+		io_backend.submit(requests);
+		offset += max(requests[0].result, 0);
+	}
+
+	side->length = offset;
+	side->syscalls = io_backend.getSyscallCount();
+	delete[] buffer;
+
+	pthread_exit(NULL);
+}
+
+double cpuSeconds()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+double wallSeconds()
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+bool runBenchmark(int backend, string input_path, string output_path, unsigned long long length)
+{
+	// Loopback listener
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	socklen_t address_length = sizeof(address);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+
+	if (::bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(listener, 1) < 0)
+	{
+		perror("Error: could not open loopback listener");
+		return false;
+	}
+
+	getsockname(listener, (struct sockaddr *) &address, &address_length);
+
+	int sender_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(sender_socket, (struct sockaddr *) &address, sizeof(address)) < 0)
+	{
+		perror("Error: could not connect over loopback");
+		return false;
+	}
+
+	int receiver_socket = accept(listener, NULL, NULL);
+	close(listener);
+
+	BenchSide sender;
+	sender.backend = backend;
+	sender.socket_id = sender_socket;
+	sender.descriptor = open(input_path.c_str(), O_RDONLY);
+	sender.length = length;
+
+	BenchSide receiver;
+	receiver.backend = backend;
+	receiver.socket_id = receiver_socket;
+	receiver.descriptor = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	receiver.length = 0;
+
+	// Report which backend actually ran
+	P2PIOBackend probe;
+	probe.open(backend);
+	string backend_name = (probe.getBackend() == P2PIOBackend::BACKEND_URING) ? "io_uring" : "syscall";
+	if (backend != probe.getBackend())
+	{
+		backend_name += " (fallback)";
+	}
+
+	double cpu_start = cpuSeconds();
+	double wall_start = wallSeconds();
+
+	pthread_t sender_thread, receiver_thread;
+	pthread_create(&receiver_thread, NULL, &runReceiver, (void *) &receiver);
+	pthread_create(&sender_thread, NULL, &runSender, (void *) &sender);
+	pthread_join(sender_thread, NULL);
+	pthread_join(receiver_thread, NULL);
+
+	double cpu_used = cpuSeconds() - cpu_start;
+	double wall_used = wallSeconds() - wall_start;
+	double gigabytes = receiver.length / (1024.0 * 1024.0 * 1024.0);
+
+	printf("%-20s %10.2f %16.0f %14.2f %12.2f\n", backend_name.c_str(),
+		receiver.length / (1024.0 * 1024.0), (sender.syscalls + receiver.syscalls) / gigabytes,
+		cpu_used / gigabytes, gigabytes / wall_used);
+
+	close(sender.descriptor);
+	close(receiver.descriptor);
+	close(sender_socket);
+	close(receiver_socket);
+
+	return receiver.length == length;
+}
+
+int main(int argc, const char* argv[])
+{
+	// Size of the transfer in MB
+	unsigned long long megabytes = 256;
+	if (argc == 2)
+	{
+		megabytes = atoi(argv[1]);
+	}
+
+	unsigned long long length = megabytes * 1024 * 1024;
+	string input_path = "iobench.in";
+	string output_path = "iobench.out";
+
+	// Build the input file
+	int descriptor = open(input_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	char * block = new char[CHUNK_SIZE];
+	for (unsigned int i = 0; i < CHUNK_SIZE; i++)
+	{
+		block[i] = rand();
+	}
+
+	for (unsigned long long written = 0; written < length; written += CHUNK_SIZE)
+	{
+		if (write(descriptor, block, min((unsigned long long) CHUNK_SIZE, length - written)) < 0)
+		{
+			perror("Error: could not build benchmark input");
+			exit(1);
+		}
+	}
+
+	close(descriptor);
+	delete[] block;
+
+	printf("%-20s %10s %16s %14s %12s\n", "backend", "MB", "syscalls/GB", "CPU s/GB", "GB/s");
+	bool b_success = runBenchmark(P2PIOBackend::BACKEND_SYSCALL, input_path, output_path, length);
+	b_success = runBenchmark(P2PIOBackend::BACKEND_URING, input_path, output_path, length) && b_success;
+
+	remove(input_path.c_str());
+	remove(output_path.c_str());
+
+	return b_success ? 0 : 1;
+}
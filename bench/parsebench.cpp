@@ -0,0 +1,123 @@
+/**
+ * Microbenchmark for text request parsing
+ *
+ * Parses the text messages that sit on the hot paths - a chunk header, an
+ * addFiles request and a fileAddress reply - with the allocating
+ * P2PCommon helpers and with the tokenizer, and reports the cost per message.
+ */
+
+#include <iostream>
+#include "../common/P2PCommon.cpp"
+#include "../common/P2PTokenizer.cpp"
+using namespace std;
+
+static const unsigned int ITERATIONS = 200000;
+
+double wallSeconds()
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+// Same work as the old receive paths: split into lines, split a line into fields, trim and convert
+unsigned long parseOld(const string & message, char delimiter, unsigned int line)
+{
+	vector<string> request = P2PCommon::parseRequest(message);
+	string command = P2PCommon::trimWhitespace(request[0]);
+
+	unsigned long total = command.length();
+	for (unsigned int i = line; i < request.size(); i++)
+	{
+		vector<string> fields = P2PCommon::splitString(request[i], delimiter);
+		for (unsigned int f = 0; f < fields.size(); f++)
+		{
+			total += P2PCommon::trimWhitespace(fields[f]).length();
+		}
+	}
+
+	return total;
+}
+
+unsigned long parseNew(const string & message, char delimiter, unsigned int line,
+	vector<P2PStringView> & lines, vector<P2PStringView> & fields)
+{
+	P2PTokenizer::splitLines(P2PStringView(message), lines);
+	P2PStringView command = lines[0].trim();
+
+	unsigned long total = command.length;
+	for (unsigned int i = line; i < lines.size(); i++)
+	{
+		P2PTokenizer::split(lines[i], delimiter, fields);
+		for (unsigned int f = 0; f < fields.size(); f++)
+		{
+			total += fields[f].trim().length;
+		}
+	}
+
+	return total;
+}
+
+void runCase(string name, const string & message, char delimiter, unsigned int line, unsigned int header_length)
+{
+	// The chunk path only ever looks at the header
+	string parsed = message.substr(0, header_length);
+	vector<P2PStringView> lines;
+	vector<P2PStringView> fields;
+	unsigned long check = 0;
+
+	double start_time = wallSeconds();
+	for (unsigned int i = 0; i < ITERATIONS; i++)
+	{
+		check += parseOld(parsed, delimiter, line);
+	}
+	double old_ns = (wallSeconds() - start_time) * 1e9 / ITERATIONS;
+	printf("%-12s %-8s %8.0f ns/message\n", name.c_str(), "old", old_ns);
+
+	for (int scanner = P2PTokenizer::SCANNER_SCALAR; scanner <= P2PTokenizer::detectScanner(); scanner++)
+	{
+		P2PTokenizer::setScanner(scanner);
+
+		start_time = wallSeconds();
+		for (unsigned int i = 0; i < ITERATIONS; i++)
+		{
+			check += parseNew(parsed, delimiter, line, lines, fields);
+		}
+		double new_ns = (wallSeconds() - start_time) * 1e9 / ITERATIONS;
+		printf("%-12s %-8s %8.0f ns/message (%.1fx)\n", name.c_str(),
+			P2PTokenizer::describeScanner(scanner).c_str(), new_ns, old_ns / new_ns);
+	}
+
+	// Keep the work from being optimized away
+	if (check == 0)
+		printf("\n");
+}
+
+int main(int argc, const char* argv[])
+{
+	// A text chunk header with its payload
+	char header[64];
+	sprintf(header, "%12s\r\n%10d\t%5d\t%10d\t%10d\t%8s\r\n", "fileTransfer", 17, 449, 2228, 1031, "5d1e2a7c");
+	string chunk = string(header) + string(449, 'x');
+
+	// An addFiles request for ten files
+	string add_files = "addFiles\r\n192.168.1.20:27891\r\n";
+	for (int i = 0; i < 10; i++)
+	{
+		add_files += "holiday-photos-" + to_string(i) + ".tar\t" + to_string(1048576 * (i + 1))
+			+ "\t/home/user/shared/holiday-photos-" + to_string(i) + ".tar\r\n";
+	}
+
+	// A fileAddress reply naming four peers
+	string file_address = "fileAddress\r\n17\r\nholiday-photos-3.tar\r\n4194304";
+	for (int i = 0; i < 4; i++)
+	{
+		file_address += "\r\n192.168.1." + to_string(20 + i) + ":27891";
+	}
+
+	runCase("chunk", chunk, '\t', 1, strlen(header));
+	runCase("addFiles", add_files, '\t', 2, add_files.length());
+	runCase("fileAddress", file_address, ':', 4, file_address.length());
+
+	return 0;
+}
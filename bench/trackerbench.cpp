@@ -0,0 +1,212 @@
+/**
+ * Load generator for the tracker
+ *
+ * Opens a number of connections to the tracker and issues list, getFile and
+ * addFiles requests back to back, reporting the request throughput. Then
+ * times finding the peers of a thousand files, with a getFile per file and
+ * with one locate request.
+ * P2P_PROTOCOL=text sends the text encodings instead of the binary ones.
+ */
+
+#include <iostream>
+#include "../common/P2PCommon.cpp"
+#include "../common/P2PSha256.cpp"
+#include "../common/P2PFraming.cpp"
+#include "../common/P2PProtocol.cpp"
+#include "../common/P2PPieceMap.cpp"
+using namespace std;
+
+typedef struct {
+	string host;
+	int port;
+	int seconds;
+	unsigned long requests;
+} LoadSide;
+
+bool request(int socket_id, string message, char * buffer, unsigned int length)
+{
+	message = P2PFraming::frameMessage(message);
+	if (write(socket_id, message.c_str(), message.length()) < 0)
+		return false;
+
+	// Read until we have the whole reply frame
+	unsigned int received = 0;
+	while (received < P2PFraming::FRAME_HEADER_SIZE
+		|| received < P2PFraming::FRAME_HEADER_SIZE + P2PFraming::readFrameHeader(buffer))
+	{
+		int bytes_read = read(socket_id, &buffer[received], length - received);
+		if (bytes_read <= 0)
+			return false;
+
+		received += bytes_read;
+	}
+
+	return true;
+}
+
+int connectTracker(string host, int port)
+{
+	struct sockaddr_in server_address;
+	memset(&server_address, 0, sizeof(server_address));
+	server_address.sin_family = AF_INET;
+	server_address.sin_port = htons(port);
+	inet_pton(AF_INET, host.c_str(), &server_address.sin_addr);
+
+	int new_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(new_socket, (struct sockaddr *) &server_address, sizeof(server_address)) < 0)
+	{
+		perror("Error: could not connect to tracker");
+		exit(1);
+	}
+
+	// Say hello, and take the tracker's hello off the wire before the first request
+	char buffer[256];
+	P2PCapabilities capabilities = P2PProtocol::localCapabilities(0);
+	request(new_socket, P2PProtocol::encodeHello(capabilities), buffer, sizeof(buffer));
+
+	return new_socket;
+}
+
+double wallSeconds()
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+void * runLoad(void * arg)
+{
+	LoadSide * side = (LoadSide *) arg;
+	int socket_id = connectTracker(side->host, side->port);
+	char buffer[65536];
+
+	// Cycle through the three tracker verbs
+	vector<FileItem> files(1);
+	files[0].name = "bench-0.bin";
+	files[0].size = 1000;
+	files[0].path = "/tmp/bench-0.bin";
+
+	string requests[3];
+	requests[0] = P2PProtocol::encodeList();
+	requests[1] = P2PProtocol::encodeGetFile(1);
+	requests[2] = P2PProtocol::encodeAddFiles("127.0.0.1", 27891, files, false);
+
+	double end_time = wallSeconds() + side->seconds;
+	while (wallSeconds() < end_time)
+	{
+		if (!request(socket_id, requests[side->requests % 3], buffer, sizeof(buffer)))
+			break;
+
+		side->requests++;
+	}
+
+	close(socket_id);
+	pthread_exit(NULL);
+}
+
+void runLocate(string host, int port)
+{
+	const unsigned int BULK_FILES = 1000;
+	vector<char> buffer(4 * 1024 * 1024);
+	int socket_id = connectTracker(host, port);
+
+	// Register the files to look up
+	vector<FileItem> catalog(BULK_FILES);
+	for (unsigned int i = 0; i < BULK_FILES; i++)
+	{
+		catalog[i].name = "bulk-" + to_string(i) + ".bin";
+		catalog[i].size = 1000 + i;
+		catalog[i].path = "/tmp/bulk-" + to_string(i) + ".bin";
+	}
+	request(socket_id, P2PProtocol::encodeAddFiles("127.0.0.1", 27891, catalog, false), &buffer[0], buffer.size());
+
+	// Find out the ids the tracker gave them - binary requests always get binary replies
+	P2PWireWriter writer;
+	writer.putString("bulk-*");
+	writer.putU32(0);
+	request(socket_id, P2PProtocol::makeMessage(P2PProtocol::MSG_LOCATE, 0, 0, writer.getData()), &buffer[0], buffer.size());
+
+	P2PWireReader reader(&buffer[P2PFraming::FRAME_HEADER_SIZE + P2PProtocol::WIRE_HEADER_SIZE],
+		P2PFraming::readFrameHeader(&buffer[0]) - P2PProtocol::WIRE_HEADER_SIZE);
+	vector<unsigned int> file_ids(reader.getU32());
+	for (unsigned int i = 0; i < file_ids.size() && !reader.failed(); i++)
+	{
+		file_ids[i] = reader.getU32();
+		reader.getString();
+		reader.getU64();
+		unsigned int address_count = reader.getU32();
+		for (unsigned int a = 0; a < address_count; a++)
+		{
+			reader.getString();
+			reader.getU16();
+		}
+	}
+
+	double start_time = wallSeconds();
+	for (unsigned int i = 0; i < file_ids.size(); i++)
+	{
+		request(socket_id, P2PProtocol::encodeGetFile(file_ids[i]), &buffer[0], buffer.size());
+	}
+	double get_file_ms = (wallSeconds() - start_time) * 1000;
+
+	start_time = wallSeconds();
+	request(socket_id, P2PProtocol::encodeLocate(file_ids, ""), &buffer[0], buffer.size());
+	double locate_ms = (wallSeconds() - start_time) * 1000;
+
+	printf("locate %u files: %u getFile requests %.2f ms, one locate %.2f ms (%u bytes)\n", (unsigned int) file_ids.size(),
+		(unsigned int) file_ids.size(), get_file_ms, locate_ms, P2PFraming::readFrameHeader(&buffer[0]));
+
+	close(socket_id);
+}
+
+int main(int argc, const char* argv[])
+{
+	// [connections] [seconds] [host] [port]
+	int connections = (argc > 1) ? atoi(argv[1]) : 16;
+	int seconds = (argc > 2) ? atoi(argv[2]) : 5;
+	string host = (argc > 3) ? argv[3] : "127.0.0.1";
+	int port = (argc > 4) ? atoi(argv[4]) : 27890;
+
+	if (getenv("P2P_PROTOCOL") != NULL)
+	{
+		P2PProtocol::setPreferredProtocol(P2PProtocol::parseProtocol(getenv("P2P_PROTOCOL")));
+	}
+
+	// Register a small catalog so list and getFile have something to return
+	char buffer[65536];
+	int seed_socket = connectTracker(host, port);
+	vector<FileItem> catalog(10);
+	for (int i = 0; i < 10; i++)
+	{
+		catalog[i].name = "bench-" + to_string(i) + ".bin";
+		catalog[i].size = 1000;
+		catalog[i].path = "/tmp/bench-" + to_string(i) + ".bin";
+	}
+	request(seed_socket, P2PProtocol::encodeAddFiles("127.0.0.1", 27891, catalog, false), buffer, sizeof(buffer));
+
+	vector<LoadSide> sides(connections);
+	vector<pthread_t> threads(connections);
+	for (int i = 0; i < connections; i++)
+	{
+		sides[i].host = host;
+		sides[i].port = port;
+		sides[i].seconds = seconds;
+		sides[i].requests = 0;
+		pthread_create(&threads[i], NULL, &runLoad, (void *) &sides[i]);
+	}
+
+	unsigned long total = 0;
+	for (int i = 0; i < connections; i++)
+	{
+		pthread_join(threads[i], NULL);
+		total += sides[i].requests;
+	}
+
+	close(seed_socket);
+
+	printf("%d connections, %d s: %lu requests, %.0f requests/s\n", connections, seconds, total, total / (double) seconds);
+
+	runLocate(host, port);
+
+	return 0;
+}
@@ -0,0 +1,302 @@
+/**
+ * Loopback benchmark for the upload path
+ *
+ * Seeds one warm file to a number of peers at once through the node's own
+ * upload code and outbound queues, the way block requests are served, and
+ * reports the CPU the uploading side spends per GB. Runs with chunks read
+ * and copied into frames, with runs sent by sendfile(), and with MSG_ZEROCOPY.
+ */
+
+#include <iostream>
+#include <poll.h>
+#include <sys/resource.h>
+#include "../node/P2PPeerNode.cpp"
+using namespace std;
+
+typedef struct {
+	P2POutbound * outbound;
+	FileItem file_item;
+	int socket_id;
+	bool b_chunk_runs;
+	double cpu_seconds;
+
+	// Woken by the flusher once the queue has drained - the node hands the session back to its pool instead
+	pthread_mutex_t space_lock;
+	pthread_cond_t space_available;
+	bool b_space;
+} UploadSide;
+
+typedef struct {
+	int socket_id;
+	unsigned long long received;
+} ReceiveSide;
+
+typedef struct {
+	P2POutbound * outbound;
+	vector<int> sockets;
+	volatile bool b_running;
+	double cpu_seconds;
+} FlushSide;
+
+double threadCpuSeconds()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+double wallSeconds()
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+void wakeUpload(void * arg)
+{
+	UploadSide * side = (UploadSide *) arg;
+	pthread_mutex_lock(&side->space_lock);
+	side->b_space = true;
+	pthread_cond_signal(&side->space_available);
+	pthread_mutex_unlock(&side->space_lock);
+}
+
+void * runUpload(void * arg)
+{
+	UploadSide * side = (UploadSide *) arg;
+	double cpu_start = threadCpuSeconds();
+
+	// The whole file, as one upload session that stops whenever the queue fills up
+	P2PFileTransfer file_transfer;
+	file_transfer.setBounds(0, 0);
+	file_transfer.setOutbound(side->outbound);
+	file_transfer.setProtocol(P2PProtocol::PROTOCOL_BINARY);
+	file_transfer.setChunkRuns(side->b_chunk_runs);
+	while (file_transfer.startTransferFile(side->file_item, side->socket_id) == P2PFileTransfer::TRANSFER_QUEUE_FULL)
+	{
+		pthread_mutex_lock(&side->space_lock);
+		side->b_space = !side->outbound->notifyWhenSpace(side->socket_id, &wakeUpload, side);
+		while (!side->b_space)
+		{
+			pthread_cond_wait(&side->space_available, &side->space_lock);
+		}
+		pthread_mutex_unlock(&side->space_lock);
+
+		file_transfer.setBounds(file_transfer.getStart(), file_transfer.getCount());
+	}
+
+	side->cpu_seconds = threadCpuSeconds() - cpu_start;
+	pthread_exit(NULL);
+}
+
+void * runFlush(void * arg)
+{
+	// Stands in for the reactor - flushes whatever the sockets wouldn't take right away
+	FlushSide * side = (FlushSide *) arg;
+	double cpu_start = threadCpuSeconds();
+
+	vector<struct pollfd> descriptors;
+	while (side->b_running)
+	{
+		descriptors.clear();
+		for (unsigned int i = 0; i < side->sockets.size(); i++)
+		{
+			if (side->outbound->hasPending(side->sockets[i]))
+			{
+				struct pollfd descriptor = { side->sockets[i], POLLOUT, 0 };
+				descriptors.push_back(descriptor);
+			}
+		}
+
+		if (descriptors.size() == 0)
+		{
+			usleep(100);
+			continue;
+		}
+
+		poll(&descriptors[0], descriptors.size(), 10);
+		for (unsigned int i = 0; i < descriptors.size(); i++)
+		{
+			if (descriptors[i].revents != 0)
+				side->outbound->flush(descriptors[i].fd);
+		}
+	}
+
+	side->cpu_seconds = threadCpuSeconds() - cpu_start;
+	pthread_exit(NULL);
+}
+
+void * runReceive(void * arg)
+{
+	ReceiveSide * side = (ReceiveSide *) arg;
+	char * buffer = new char[256 * 1024];
+
+	int bytes_read;
+	while ((bytes_read = read(side->socket_id, buffer, 256 * 1024)) > 0)
+	{
+		side->received += bytes_read;
+	}
+
+	delete[] buffer;
+	pthread_exit(NULL);
+}
+
+bool connectPair(int &sender_socket, int &receiver_socket)
+{
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	socklen_t address_length = sizeof(address);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+
+	if (::bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(listener, 1) < 0)
+	{
+		perror("Error: could not open loopback listener");
+		return false;
+	}
+
+	getsockname(listener, (struct sockaddr *) &address, &address_length);
+
+	sender_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(sender_socket, (struct sockaddr *) &address, sizeof(address)) < 0)
+	{
+		perror("Error: could not connect over loopback");
+		return false;
+	}
+
+	receiver_socket = accept(listener, NULL, NULL);
+	close(listener);
+
+	// The node's sockets never block
+	fcntl(sender_socket, F_SETFL, fcntl(sender_socket, F_GETFL, 0) | O_NONBLOCK);
+
+	return true;
+}
+
+bool runBenchmark(string mode, FileItem file_item, int peers)
+{
+	P2POutbound::setZeroCopy(mode == "zerocopy");
+	P2POutbound outbound;
+
+	vector<UploadSide> uploads(peers);
+	vector<ReceiveSide> receivers(peers);
+	FlushSide flusher;
+	flusher.outbound = &outbound;
+	flusher.b_running = true;
+
+	for (int i = 0; i < peers; i++)
+	{
+		int sender_socket, receiver_socket;
+		if (!connectPair(sender_socket, receiver_socket))
+			return false;
+
+		outbound.addSocket(sender_socket);
+		flusher.sockets.push_back(sender_socket);
+
+		uploads[i].outbound = &outbound;
+		uploads[i].file_item = file_item;
+		uploads[i].socket_id = sender_socket;
+		uploads[i].b_chunk_runs = (mode != "buffered");
+		pthread_mutex_init(&uploads[i].space_lock, NULL);
+		pthread_cond_init(&uploads[i].space_available, NULL);
+		receivers[i].socket_id = receiver_socket;
+		receivers[i].received = 0;
+	}
+
+	double wall_start = wallSeconds();
+
+	vector<pthread_t> upload_threads(peers), receive_threads(peers);
+	pthread_t flush_thread;
+	pthread_create(&flush_thread, NULL, &runFlush, (void *) &flusher);
+	for (int i = 0; i < peers; i++)
+	{
+		pthread_create(&receive_threads[i], NULL, &runReceive, (void *) &receivers[i]);
+		pthread_create(&upload_threads[i], NULL, &runUpload, (void *) &uploads[i]);
+	}
+
+	// Wait for the uploads, then for their queues to drain
+	for (int i = 0; i < peers; i++)
+	{
+		pthread_join(upload_threads[i], NULL);
+	}
+
+	for (int i = 0; i < peers; i++)
+	{
+		while (outbound.hasPending(uploads[i].socket_id))
+			usleep(1000);
+
+		shutdown(uploads[i].socket_id, SHUT_WR);
+	}
+
+	unsigned long long received = 0;
+	for (int i = 0; i < peers; i++)
+	{
+		pthread_join(receive_threads[i], NULL);
+		received += receivers[i].received;
+	}
+
+	double wall_used = wallSeconds() - wall_start;
+	flusher.b_running = false;
+	pthread_join(flush_thread, NULL);
+
+	double cpu_used = flusher.cpu_seconds;
+	for (int i = 0; i < peers; i++)
+	{
+		cpu_used += uploads[i].cpu_seconds;
+		outbound.removeSocket(uploads[i].socket_id);
+		close(uploads[i].socket_id);
+		close(receivers[i].socket_id);
+	}
+
+	// Payload, not counting the headers
+	double gigabytes = (double) file_item.size * peers / (1024.0 * 1024.0 * 1024.0);
+	printf("%-10s %6d %12.2f %14.2f %12.2f\n", mode.c_str(), peers, received / (1024.0 * 1024.0),
+		cpu_used / gigabytes, gigabytes / wall_used);
+
+	return received >= (unsigned long long) file_item.size * peers;
+}
+
+int main(int argc, const char* argv[])
+{
+	// [MB] [peers]
+	unsigned int megabytes = (argc > 1) ? atoi(argv[1]) : 128;
+	int peers = (argc > 2) ? atoi(argv[2]) : 4;
+
+	FileItem file_item;
+	file_item.file_id = 1;
+	file_item.name = "uploadbench.in";
+	file_item.path = "uploadbench.in";
+	file_item.size = megabytes * 1024 * 1024;
+	file_item.piece_size = P2PFileTransfer::choosePieceSize(file_item.size);
+
+	// Build the input file - it stays in the page cache, like a file being seeded
+	int descriptor = open(file_item.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	vector<char> block(1024 * 1024);
+	for (unsigned int i = 0; i < block.size(); i++)
+	{
+		block[i] = rand();
+	}
+
+	for (unsigned int i = 0; i < megabytes; i++)
+	{
+		if (write(descriptor, &block[0], block.size()) < 0)
+		{
+			perror("Error: could not build benchmark input");
+			exit(1);
+		}
+	}
+
+	close(descriptor);
+
+	printf("%-10s %6s %12s %14s %12s\n", "mode", "peers", "MB", "CPU s/GB", "GB/s");
+	bool b_success = runBenchmark("buffered", file_item, peers);
+	b_success = runBenchmark("sendfile", file_item, peers) && b_success;
+	b_success = runBenchmark("zerocopy", file_item, peers) && b_success;
+
+	remove(file_item.path.c_str());
+
+	return b_success ? 0 : 1;
+}
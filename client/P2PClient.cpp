@@ -13,6 +13,36 @@ using namespace std;
 P2PClient::P2PClient()
 {
 	b_awaiting_response = false;
+	chunk_workers = 4;
+	upload_workers = 8;
+	window_size = 0;
+	block_chunks = 0;
+}
+
+void P2PClient::setWorkerThreads(unsigned int chunk_threads, unsigned int upload_threads)
+{
+	chunk_workers = chunk_threads;
+	upload_workers = upload_threads;
+}
+
+void P2PClient::setRequestWindow(unsigned int window_size, unsigned int block_chunks)
+{
+	this->window_size = window_size;
+	this->block_chunks = block_chunks;
+}
+
+bool P2PClient::addRateLimit(string limit)
+{
+	// Checked now, applied when the node starts
+	int direction, scope, key;
+	unsigned int rate;
+	if (!P2PRateLimiter::parseLimit(limit, direction, scope, rate, key))
+	{
+		return false;
+	}
+
+	rate_limits.push_back(limit);
+	return true;
 }
 
 void P2PClient::start(string address, int port)
@@ -23,6 +53,17 @@ void P2PClient::start(string address, int port)
 	// Open the socket and listen for connections
 	node = P2PPeerNode(27891, 512);
 	node.setBindMaxOffset(100);
+	node.setWorkerThreads(chunk_workers, upload_workers);
+	if (window_size > 0)
+	{
+		node.setRequestWindow(window_size, block_chunks, P2PRequestWindow::DEFAULT_REQUEST_TIMEOUT);
+	}
+
+	for (unsigned int i = 0; i < rate_limits.size(); i++)
+	{
+		node.setRateLimit(rate_limits[i]);
+	}
+
 	node.start();
 	server_socket = node.makeConnection("central_server", address, port);
 
@@ -74,29 +115,29 @@ void * P2PClient::startTransferThread(void * arg)
 
 void P2PClient::runProgram()
 {
+	P2PMessage message;
 	bool b_program_active = true;
 	while (b_program_active)
 	{
-		if (node.countQueueMessages() > 0)
+		if (b_awaiting_response)
 		{
-			// Get the oldest message
-			P2PMessage message = node.popQueueMessage();
-
-			// Show response
-			cout << message.message << endl;
-
-			// If we think we've got everything, wait to be certain
-			if (node.countQueueMessages() == 0 && b_awaiting_response)
+			// Each reply arrives as a single frame - wait for it. Anything
+			// else that came in alongside it is shown on the next pass.
+			if (node.waitQueueMessage(message, RESPONSE_TIMEOUT))
 			{
-				usleep(50000);
+				cout << P2PProtocol::describeReply(message.message) << endl;
+			}
+			else
+			{
+				cout << "No response from the server." << endl;
 			}
 
-			// Determine if we've gotten the full response
-			b_awaiting_response = (node.countQueueMessages() > 0);
+			b_awaiting_response = false;
 		}
-		else if (b_awaiting_response)
+		else if (node.tryPopQueueMessage(message))
 		{
-			usleep(5000);
+			// Show any unsolicited messages
+			cout << P2PProtocol::describeReply(message.message) << endl;
 		}
 		else
 		{
@@ -126,7 +167,12 @@ bool P2PClient::runUI()
 			P2PCommon::clearScreen();
 			showProgress();
 			break;
+		case 'l':
+			setRateLimit();
+			break;
 		case 'q':
+			// Downloads still going pick up from here next time
+			node.saveDownloads();
 			break;
 		default:
 			cout << endl << "Error command! Please try again." << endl;
@@ -144,6 +190,7 @@ char P2PClient::showMenu()
 	cout << "\t (a) Add files to the server" << endl;
 	cout << "\t (d) Download a chosen file" << endl;
 	cout << "\t (p) Progress of downloading" << endl;
+	cout << "\t (l) Limit upload or download rates" << endl;
 	cout << "\t (q) Quit" << endl;
     cout << "Type the character:\t" << endl;
 	// Take the client's order
@@ -157,7 +204,7 @@ char P2PClient::showMenu()
 void P2PClient::viewFiles()
 {
 	b_awaiting_response = true;
-	node.sendMessageToSocket("list", server_socket);
+	node.sendMessageToSocket(P2PProtocol::encodeList(), server_socket);
 }
 
 bool isLineBreak(char c) { return isspace(c) && !isblank(c); }
@@ -202,74 +249,19 @@ void P2PClient::selectFiles()
 
 vector<FileItem> P2PClient::collectFiles(vector<string> files)
 {
-	// For each item, if it's a folder, get all files in that folder
-	// If it's a file, add it directly
-	// If the item isn't found, drop it
-	vector<FileItem> clean_files;
-	vector<string>::iterator iter;
-	struct stat s;
-
-	for (iter = files.begin(); iter < files.end(); iter++)
+	// Folders are searched all the way down, and every file is hashed -
+	// files shared before come straight from the hash cache
+	vector<FileItem> clean_files = node.scanFiles(files);
+
+	// Notify user
+	vector<FileItem>::iterator iter;
+	for (iter = clean_files.begin(); iter < clean_files.end(); iter++)
 	{
-		if (stat((*iter).c_str(), &s) == 0)
-		{
-			if (s.st_mode & S_IFDIR)
-			{
-				// Add all files in the directory
-				DIR *directory;
-				struct dirent *ep;
-
-				// Open the directory
-				directory = opendir((*iter).c_str());
-				if (directory != NULL)
-				{
-					// Collect all files
-					while ((ep = readdir(directory)) != NULL)
-					{
-						string file_path = (*iter) + "/" + string(ep->d_name);
-						if (stat(file_path.c_str(), &s) == 0 && (s.st_mode & S_IFREG))
-						{
-							// Get the absolute path
-							char *real_path = realpath(file_path.c_str(), NULL);
-
-							FileItem file_item;
-							file_item.name = ep->d_name;
-							file_item.size = s.st_size;
-							file_item.path = string(real_path);
-							clean_files.push_back(file_item);
-
-							// Notify user
-							cout << "Adding file successfully: " << real_path << endl;
-							free(real_path);
-						}
-					}
-
-					// Close the directory
-					closedir(directory);
-				}
-			}
-			else if (s.st_mode & S_IFREG)
-			{
-				// Get the absolute path
-				char *real_path = realpath((*iter).c_str(), NULL);
-				
-				FileItem file_item;
-				file_item.name = (*iter);
-				file_item.size = s.st_size;
-				file_item.path = string(real_path);
-				clean_files.push_back(file_item);
-
-				// Notify user
-				cout << "Adding file successfully: " << real_path << endl;
-				free(real_path);
-			}
-		}
-		else
-		{
-			cout << "Could not find file or folder: " << (*iter) << endl;
-		}
+		cout << "Adding file successfully: " << (*iter).path << endl;
 	}
 
+	cout << node.getScanStats() << endl;
+
 	return clean_files;
 }
 
@@ -289,24 +281,17 @@ void P2PClient::sendFiles(vector<FileItem> files)
 	string address = inet_ntoa(primary_address.sin_addr);
 
 	// Prepare the request
+	// Trackers that know content hashes get each file's root and piece size too
 	b_awaiting_response = true;
-	string add_files_message = "addFiles\r\n" + address + ":" + to_string(node.getPublicPort()) + "\r\n";
-
-	// Separate each file with newlines
-	vector<FileItem>::iterator iter;
-	for (iter = files.begin(); iter < files.end(); iter++)
-	{
-		add_files_message += (*iter).name + '\t' + to_string((*iter).size) + '\t' + (*iter).path + "\r\n";
-	}
-
-	node.sendMessageToSocket(add_files_message, server_socket);
+	node.sendMessageToSocket(P2PProtocol::encodeAddFiles(address, node.getPublicPort(), files,
+		node.hasContentHashes(server_socket)), server_socket);
 }
 
 void P2PClient::getFile()
 {
-	cout << endl << "Enter the key of the file you'd like to download: ";
+	cout << endl << "Enter the keys of the files you'd like to download (e.g. 3 5 10-20), or a name pattern (e.g. *.log): ";
 
-	// Get the file ID
+	// Get the file IDs
 	string option;
 	getline(cin, option, '\n');
 	option = P2PCommon::trimWhitespace(option);
@@ -316,11 +301,47 @@ void P2PClient::getFile()
 		return;
 	}
 
-	// Cleanse the input
-	int i_option = stoi(option);
+	// Keys and ranges of keys, separated by spaces or commas - anything else is a name pattern
+	vector<unsigned int> file_ids;
+	string pattern;
+	replace(option.begin(), option.end(), ',', ' ');
+
+	stringstream keys(option);
+	string key;
+	while (keys >> key)
+	{
+		unsigned int first, last;
+		char dash;
+		stringstream range(key);
+		if (!(range >> first) || first == 0)
+		{
+			pattern = option;
+			file_ids.clear();
+			break;
+		}
+
+		if (!(range >> dash))
+		{
+			last = first;
+		}
+		else if (dash != '-' || !(range >> last) || last < first || !range.eof())
+		{
+			pattern = option;
+			file_ids.clear();
+			break;
+		}
 
-	// Submit the request
-	node.sendMessageToSocket("getFile\r\n" + to_string(i_option), server_socket);
+		for (unsigned int i = first; i <= last && file_ids.size() < MAX_DOWNLOAD_KEYS; i++)
+		{
+			file_ids.push_back(i);
+		}
+	}
+
+	// Submit the request - the tracker finds them all at once
+	if (!node.locateFiles(file_ids, pattern))
+	{
+		cout << "Error: the server can't search by name, enter file keys instead." << endl;
+	}
 }
 
 void P2PClient::showProgress()
@@ -330,4 +351,32 @@ void P2PClient::showProgress()
 	// Find all files that were requested, get current progress:
 	string progress = node.getFileProgress();
 	cout << progress << endl;
+
+	// Show how busy the workers are
+	cout << node.getWorkerStats() << endl;
+	cout << node.getConnectionStats() << endl;
+	cout << node.getRequestStats() << endl;
+	cout << node.getRateStats() << endl;
+}
+
+void P2PClient::setRateLimit()
+{
+	cout << endl << node.getRateStats() << endl;
+	cout << "Enter a limit as up|down global|peer|file <KB/s> [file key], 0 for none (e.g. up peer 500): ";
+
+	string limit;
+	getline(cin, limit, '\n');
+	if (P2PCommon::trimWhitespace(limit).length() == 0)
+	{
+		return;
+	}
+
+	if (node.setRateLimit(limit))
+	{
+		cout << node.getRateStats() << endl;
+	}
+	else
+	{
+		cout << "Error: could not read that limit." << endl;
+	}
 }
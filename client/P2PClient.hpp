@@ -20,10 +20,17 @@ class P2PClient
 		void sendFiles(vector<FileItem>);
 		void getFile();
 		void showProgress();
+		void setRateLimit();
 
 		// UI Management
 		bool b_awaiting_response;
 
+		// How long (in ms) to wait for the server to reply
+		static const int RESPONSE_TIMEOUT = 5000;
+
+		// Most files one download can ask for
+		static const unsigned int MAX_DOWNLOAD_KEYS = 100000;
+
 		// Thread worker functions
 		static void * startActivityListenerThread(void *);
 		static void * startTransferThread(void *);
@@ -31,10 +38,13 @@ class P2PClient
 		// Keep track of the peer node
 		P2PPeerNode node;
 		int server_socket;
+		unsigned int chunk_workers;
+		unsigned int upload_workers;
 
-		// File transfer
-		static const unsigned int FILE_CHUNK_SIZE = 224;
-		static const unsigned int HEADER_SIZE = 63;
+		// Settings given before the node starts, applied once it has
+		unsigned int window_size;
+		unsigned int block_chunks;
+		vector<string> rate_limits;
 
 		// File List
 		vector<FileItem> local_file_list;
@@ -44,6 +54,9 @@ class P2PClient
 
 	public:
 		P2PClient();
+		void setWorkerThreads(unsigned int, unsigned int);
+		void setRequestWindow(unsigned int, unsigned int);
+		bool addRateLimit(string);
 		void start(string, int);
 };
 
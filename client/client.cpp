@@ -21,8 +21,89 @@ int main(int argc, const char* argv[])
 		port = 27890;
 	}
 
+	// Pick the I/O backend - P2P_IO_BACKEND=io_uring enables the ring
+	if (getenv("P2P_IO_BACKEND") != NULL)
+	{
+		P2PIOBackend::setPreferredBackend(P2PIOBackend::parseBackend(getenv("P2P_IO_BACKEND")));
+	}
+
+	// Pick the wire protocol - P2P_PROTOCOL=text talks to nodes that predate the binary one
+	if (getenv("P2P_PROTOCOL") != NULL)
+	{
+		P2PProtocol::setPreferredProtocol(P2PProtocol::parseProtocol(getenv("P2P_PROTOCOL")));
+	}
+
+	// Chunk compression - P2P_COMPRESSION=off turns it off, builtin skips the system liblz4
+	if (getenv("P2P_COMPRESSION") != NULL)
+	{
+		if (string(getenv("P2P_COMPRESSION")) == "off")
+		{
+			P2PCompression::setEnabled(false);
+		}
+		else
+		{
+			P2PCompression::setCodec(P2PCompression::parseCodec(getenv("P2P_COMPRESSION")));
+		}
+	}
+
+	// Pin large uploads in place with MSG_ZEROCOPY instead of sendfile() - P2P_ZEROCOPY=1
+	if (getenv("P2P_ZEROCOPY") != NULL && atoi(getenv("P2P_ZEROCOPY")) != 0)
+	{
+		P2POutbound::setZeroCopy(true);
+	}
+
+	// Piece size for every file - P2P_PIECE_SIZE in bytes, otherwise it's picked from each file's size
+	if (getenv("P2P_PIECE_SIZE") != NULL)
+	{
+		P2PFileTransfer::setPieceSize(atoi(getenv("P2P_PIECE_SIZE")));
+	}
+
+	// Threads reading and hashing shared files - P2P_SCAN_READERS and P2P_SCAN_HASHERS, otherwise 2 and one per core
+	if (getenv("P2P_SCAN_READERS") != NULL || getenv("P2P_SCAN_HASHERS") != NULL)
+	{
+		P2PShareScanner::setThreads(getenv("P2P_SCAN_READERS") ? atoi(getenv("P2P_SCAN_READERS")) : 0,
+			getenv("P2P_SCAN_HASHERS") ? atoi(getenv("P2P_SCAN_HASHERS")) : 0);
+	}
+
+	// Hashes of files shared before - P2P_HASH_CACHE moves the cache, P2P_HASH_CACHE=off does without
+	if (getenv("P2P_HASH_CACHE") != NULL)
+	{
+		P2PShareScanner::setCachePath((string(getenv("P2P_HASH_CACHE")) == "off") ? "" : getenv("P2P_HASH_CACHE"));
+	}
+
 	// Start up the client server
 	P2PClient client;
+
+	// Worker pool sizes - P2P_CHUNK_WORKERS and P2P_UPLOAD_WORKERS override the defaults
+	if (getenv("P2P_CHUNK_WORKERS") != NULL && getenv("P2P_UPLOAD_WORKERS") != NULL)
+	{
+		client.setWorkerThreads(atoi(getenv("P2P_CHUNK_WORKERS")), atoi(getenv("P2P_UPLOAD_WORKERS")));
+	}
+
+	// Block requests kept in flight per peer - P2P_REQUEST_WINDOW, with P2P_BLOCK_CHUNKS chunks each
+	if (getenv("P2P_REQUEST_WINDOW") != NULL)
+	{
+		unsigned int block_chunks = P2PRequestWindow::DEFAULT_BLOCK_CHUNKS;
+		if (getenv("P2P_BLOCK_CHUNKS") != NULL)
+		{
+			block_chunks = atoi(getenv("P2P_BLOCK_CHUNKS"));
+		}
+
+		client.setRequestWindow(atoi(getenv("P2P_REQUEST_WINDOW")), block_chunks);
+	}
+
+	// Rate limits, separated by semicolons - e.g. P2P_RATE_LIMITS="up global 2000; down peer 500"
+	if (getenv("P2P_RATE_LIMITS") != NULL)
+	{
+		vector<string> limits = P2PCommon::splitString(getenv("P2P_RATE_LIMITS"), ';');
+		for (unsigned int i = 0; i < limits.size(); i++)
+		{
+			if (P2PCommon::trimWhitespace(limits[i]).length() > 0 && !client.addRateLimit(limits[i]))
+			{
+				cout << "Error: could not read rate limit \"" << limits[i] << "\"" << endl;
+			}
+		}
+	}
 	client.start(address, port);
 
 	return 0;
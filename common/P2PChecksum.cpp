@@ -0,0 +1,536 @@
+/**
+ * Peer-to-peer checksum class
+ */
+
+#include "P2PChecksum.hpp"
+
+// CRC32C polynomial, bit-reflected
+static const unsigned int CRC32C_POLYNOMIAL = 0x82F63B78;
+
+// XXH3 primes and default secret
+static const unsigned long long XXH_PRIME32_1 = 0x9E3779B1ULL;
+static const unsigned long long XXH_PRIME32_2 = 0x85EBCA77ULL;
+static const unsigned long long XXH_PRIME32_3 = 0xC2B2AE3DULL;
+static const unsigned long long XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const unsigned long long XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const unsigned long long XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const unsigned long long XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const unsigned long long XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+static const unsigned long long XXH_PRIME_MX1 = 0x165667919E3779F9ULL;
+static const unsigned long long XXH_PRIME_MX2 = 0x9FB21C651E98DF25ULL;
+
+static const unsigned int XXH_SECRET_SIZE = 192;
+static const unsigned int XXH_STRIPE_SIZE = 64;
+static const unsigned char XXH_SECRET[XXH_SECRET_SIZE] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static inline unsigned int readLE32(const char * data)
+{
+	unsigned int value;
+	memcpy(&value, data, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	return value;
+}
+
+static inline unsigned long long readLE64(const char * data)
+{
+	unsigned long long value;
+	memcpy(&value, data, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap64(value);
+#endif
+	return value;
+}
+
+static inline unsigned long long rotateLeft64(unsigned long long value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static inline unsigned long long multiplyFold64(unsigned long long a, unsigned long long b)
+{
+	unsigned __int128 product = (unsigned __int128) a * b;
+	return (unsigned long long) product ^ (unsigned long long)(product >> 64);
+}
+
+static inline unsigned long long xxh64Avalanche(unsigned long long hash)
+{
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME64_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+static inline unsigned long long xxh3Avalanche(unsigned long long hash)
+{
+	hash ^= hash >> 37;
+	hash *= XXH_PRIME_MX1;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+static inline unsigned long long xxh3Mix16(const char * data, const char * secret)
+{
+	return multiplyFold64(readLE64(data) ^ readLE64(secret), readLE64(data + 8) ^ readLE64(secret + 8));
+}
+
+int P2PChecksum::level = P2PChecksum::detectLevel();
+unsigned int (*P2PChecksum::crc32c_function)(unsigned int, const char *, size_t) = NULL;
+void (*P2PChecksum::accumulate_function)(unsigned long long *, const char *, const char *, size_t) = NULL;
+void (*P2PChecksum::scramble_function)(unsigned long long *, const char *) = NULL;
+unsigned int P2PChecksum::crc32c_table[8][256];
+bool P2PChecksum::b_tables_built = P2PChecksum::buildTables();
+#ifdef P2P_CHECKSUM_X86
+unsigned int P2PChecksum::crc32c_shift = 0;
+#endif
+
+unsigned int P2PChecksum::compute(unsigned int algorithm, const char * data, size_t size)
+{
+	if (algorithm == ALGORITHM_CRC32C)
+		return crc32c(data, size);
+	if (algorithm == ALGORITHM_XXH3)
+		return (unsigned int) xxh3(data, size);
+
+	return sum32(data, size);
+}
+
+unsigned int P2PChecksum::sum32(const char * data, size_t size)
+{
+	// The original checksum, bytes sign-extended and all, so older nodes still agree with it
+	unsigned int checksum = 0;
+	unsigned int value = 0;
+	size_t i = 0;
+	while (i < size)
+	{
+		// Add on the next value
+		value <<= 8;
+		value |= data[i];
+
+		// If we have a full value, add it to the checksum
+		if ((i+1)%4 == 0)
+		{
+			checksum += value;
+			checksum += (checksum <= value) ? 1 : 0; // Overflow -> Wraparound, add 1 bit
+			value = 0;
+		}
+
+		// Move to the next iteration
+		i++;
+	}
+
+	// Handle leftover values
+	if (value > 0)
+	{
+		checksum += value;
+		checksum += (checksum <= value) ? 1 : 0;
+	}
+
+	return checksum;
+}
+
+unsigned int P2PChecksum::crc32c(const char * data, size_t size)
+{
+	if (crc32c_function == NULL)
+	{
+		selectFunctions();
+	}
+
+	return ~crc32c_function(0xFFFFFFFF, data, size);
+}
+
+unsigned long long P2PChecksum::xxh3(const char * data, size_t size)
+{
+	if (size <= 240)
+	{
+		return xxh3Short(data, size);
+	}
+
+	if (accumulate_function == NULL)
+	{
+		selectFunctions();
+	}
+
+	return xxh3Long(data, size);
+}
+
+unsigned int P2PChecksum::supportedAlgorithms()
+{
+	return ALGORITHM_SUM32 | ALGORITHM_CRC32C | ALGORITHM_XXH3;
+}
+
+string P2PChecksum::describeAlgorithm(unsigned int algorithm)
+{
+	if (algorithm == ALGORITHM_CRC32C)
+		return "CRC32C";
+	if (algorithm == ALGORITHM_XXH3)
+		return "XXH3";
+
+	return "sum32";
+}
+
+int P2PChecksum::detectLevel()
+{
+#ifdef P2P_CHECKSUM_X86
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("sse4.2") || !__builtin_cpu_supports("pclmul"))
+		return LEVEL_PORTABLE;
+	if (__builtin_cpu_supports("avx2"))
+		return LEVEL_AVX2;
+	return LEVEL_SSE42;
+#else
+	return LEVEL_PORTABLE;
+#endif
+}
+
+void P2PChecksum::setLevel(int requested_level)
+{
+	// Never pick something the CPU can't run
+	level = min(requested_level, detectLevel());
+	crc32c_function = NULL;
+	accumulate_function = NULL;
+	scramble_function = NULL;
+}
+
+int P2PChecksum::getLevel()
+{
+	return level;
+}
+
+string P2PChecksum::describeLevel(int level_value)
+{
+	if (level_value == LEVEL_AVX2)
+		return "AVX2";
+	if (level_value == LEVEL_SSE42)
+		return "SSE4.2";
+
+	return "portable";
+}
+
+void P2PChecksum::selectFunctions()
+{
+	unsigned int (*crc32c_choice)(unsigned int, const char *, size_t) = &P2PChecksum::crc32cPortable;
+	void (*accumulate_choice)(unsigned long long *, const char *, const char *, size_t) = &P2PChecksum::accumulatePortable;
+	void (*scramble_choice)(unsigned long long *, const char *) = &P2PChecksum::scramblePortable;
+
+#ifdef P2P_CHECKSUM_X86
+	if (level >= LEVEL_SSE42)
+		crc32c_choice = &P2PChecksum::crc32cSSE42;
+
+	if (level >= LEVEL_AVX2)
+	{
+		accumulate_choice = &P2PChecksum::accumulateAVX2;
+		scramble_choice = &P2PChecksum::scrambleAVX2;
+	}
+#endif
+
+	// Callers check the accumulate function, so the scramble function goes in first
+	scramble_function = scramble_choice;
+	accumulate_function = accumulate_choice;
+	crc32c_function = crc32c_choice;
+}
+
+bool P2PChecksum::buildTables()
+{
+	for (unsigned int n = 0; n < 256; n++)
+	{
+		unsigned int crc = n;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+
+		crc32c_table[0][n] = crc;
+	}
+
+	// Each further table moves a byte one place further along
+	for (unsigned int n = 0; n < 256; n++)
+	{
+		for (int k = 1; k < 8; k++)
+			crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][n] & 0xFF];
+	}
+
+#ifdef P2P_CHECKSUM_X86
+	// x^(8 * CRC32C_STREAM - 33) mod P, to move a stream's CRC past the stream after it
+	unsigned int shift = 0x80000000;
+	for (unsigned int i = 0; i < 8 * CRC32C_STREAM - 33; i++)
+		shift = (shift & 1) ? (shift >> 1) ^ CRC32C_POLYNOMIAL : shift >> 1;
+
+	crc32c_shift = shift;
+#endif
+
+	return true;
+}
+
+unsigned int P2PChecksum::crc32cPortable(unsigned int crc, const char * data, size_t size)
+{
+	// Eight bytes at a time through the tables
+	while (size >= 8)
+	{
+		crc ^= readLE32(data);
+		unsigned int high = readLE32(data + 4);
+		crc = crc32c_table[7][crc & 0xFF] ^ crc32c_table[6][(crc >> 8) & 0xFF]
+			^ crc32c_table[5][(crc >> 16) & 0xFF] ^ crc32c_table[4][crc >> 24]
+			^ crc32c_table[3][high & 0xFF] ^ crc32c_table[2][(high >> 8) & 0xFF]
+			^ crc32c_table[1][(high >> 16) & 0xFF] ^ crc32c_table[0][high >> 24];
+
+		data += 8;
+		size -= 8;
+	}
+
+	while (size > 0)
+	{
+		crc = crc32c_table[0][(crc ^ (unsigned char) *data++) & 0xFF] ^ (crc >> 8);
+		size--;
+	}
+
+	return crc;
+}
+
+unsigned long long P2PChecksum::xxh3Short(const char * data, size_t size)
+{
+	const char * secret = (const char *) XXH_SECRET;
+
+	if (size == 0)
+	{
+		return xxh64Avalanche(readLE64(secret + 56) ^ readLE64(secret + 64));
+	}
+
+	if (size <= 3)
+	{
+		unsigned int combined = ((unsigned int)(unsigned char) data[0] << 16) | ((unsigned int)(unsigned char) data[size >> 1] << 24)
+			| (unsigned int)(unsigned char) data[size - 1] | ((unsigned int) size << 8);
+		unsigned long long bitflip = readLE32(secret) ^ readLE32(secret + 4);
+		return xxh64Avalanche(combined ^ bitflip);
+	}
+
+	if (size <= 8)
+	{
+		unsigned long long bitflip = readLE64(secret + 8) ^ readLE64(secret + 16);
+		unsigned long long input = readLE32(data + size - 4) + ((unsigned long long) readLE32(data) << 32);
+		unsigned long long hash = input ^ bitflip;
+
+		hash ^= rotateLeft64(hash, 49) ^ rotateLeft64(hash, 24);
+		hash *= XXH_PRIME_MX2;
+		hash ^= (hash >> 35) + size;
+		hash *= XXH_PRIME_MX2;
+		return hash ^ (hash >> 28);
+	}
+
+	if (size <= 16)
+	{
+		unsigned long long low = readLE64(data) ^ (readLE64(secret + 24) ^ readLE64(secret + 32));
+		unsigned long long high = readLE64(data + size - 8) ^ (readLE64(secret + 40) ^ readLE64(secret + 48));
+		return xxh3Avalanche(size + __builtin_bswap64(low) + high + multiplyFold64(low, high));
+	}
+
+	unsigned long long hash = size * XXH_PRIME64_1;
+	if (size <= 128)
+	{
+		// Pairs of 16 bytes from each end, working inwards
+		if (size > 32)
+		{
+			if (size > 64)
+			{
+				if (size > 96)
+				{
+					hash += xxh3Mix16(data + 48, secret + 96);
+					hash += xxh3Mix16(data + size - 64, secret + 112);
+				}
+
+				hash += xxh3Mix16(data + 32, secret + 64);
+				hash += xxh3Mix16(data + size - 48, secret + 80);
+			}
+
+			hash += xxh3Mix16(data + 16, secret + 32);
+			hash += xxh3Mix16(data + size - 32, secret + 48);
+		}
+
+		hash += xxh3Mix16(data, secret);
+		hash += xxh3Mix16(data + size - 16, secret + 16);
+		return xxh3Avalanche(hash);
+	}
+
+	// 129 to 240 bytes - the first 128 against the secret, the rest against it again from a few bytes in
+	unsigned int rounds = size / 16;
+	for (unsigned int i = 0; i < 8; i++)
+	{
+		hash += xxh3Mix16(data + 16 * i, secret + 16 * i);
+	}
+
+	unsigned long long hash_end = xxh3Mix16(data + size - 16, secret + 136 - 17);
+	hash = xxh3Avalanche(hash);
+	for (unsigned int i = 8; i < rounds; i++)
+	{
+		hash_end += xxh3Mix16(data + 16 * i, secret + 16 * (i - 8) + 3);
+	}
+
+	return xxh3Avalanche(hash + hash_end);
+}
+
+unsigned long long P2PChecksum::xxh3Long(const char * data, size_t size)
+{
+	const char * secret = (const char *) XXH_SECRET;
+	unsigned long long accumulators[8] = { XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+		XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1 };
+
+	// Blocks of 16 stripes, each stripe against the secret 8 bytes further on, scrambled after every block
+	size_t stripes_per_block = (XXH_SECRET_SIZE - XXH_STRIPE_SIZE) / 8;
+	size_t block_size = XXH_STRIPE_SIZE * stripes_per_block;
+	size_t blocks = (size - 1) / block_size;
+	for (size_t n = 0; n < blocks; n++)
+	{
+		accumulate_function(accumulators, data + n * block_size, secret, stripes_per_block);
+		scramble_function(accumulators, secret + XXH_SECRET_SIZE - XXH_STRIPE_SIZE);
+	}
+
+	// Whole stripes of the last block, then the last 64 bytes
+	size_t stripes = ((size - 1) - block_size * blocks) / XXH_STRIPE_SIZE;
+	accumulate_function(accumulators, data + blocks * block_size, secret, stripes);
+	accumulate_function(accumulators, data + size - XXH_STRIPE_SIZE, secret + XXH_SECRET_SIZE - XXH_STRIPE_SIZE - 7, 1);
+
+	unsigned long long hash = size * XXH_PRIME64_1;
+	for (int i = 0; i < 4; i++)
+	{
+		hash += multiplyFold64(accumulators[2 * i] ^ readLE64(secret + 11 + 16 * i),
+			accumulators[2 * i + 1] ^ readLE64(secret + 11 + 16 * i + 8));
+	}
+
+	return xxh3Avalanche(hash);
+}
+
+void P2PChecksum::accumulatePortable(unsigned long long * accumulators, const char * data, const char * secret, size_t stripes)
+{
+	for (size_t n = 0; n < stripes; n++)
+	{
+		const char * stripe = data + n * XXH_STRIPE_SIZE;
+		const char * key = secret + n * 8;
+		for (int i = 0; i < 8; i++)
+		{
+			unsigned long long value = readLE64(stripe + 8 * i);
+			unsigned long long keyed = value ^ readLE64(key + 8 * i);
+			accumulators[i ^ 1] += value;
+			accumulators[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+		}
+	}
+}
+
+void P2PChecksum::scramblePortable(unsigned long long * accumulators, const char * secret)
+{
+	for (int i = 0; i < 8; i++)
+	{
+		unsigned long long accumulator = accumulators[i];
+		accumulator ^= accumulator >> 47;
+		accumulator ^= readLE64(secret + 8 * i);
+		accumulators[i] = accumulator * XXH_PRIME32_1;
+	}
+}
+
+#ifdef P2P_CHECKSUM_X86
+__attribute__((target("sse4.2,pclmul")))
+static inline unsigned int crc32cShift(unsigned int crc, unsigned int shift)
+{
+	// crc * x^(8 * CRC32C_STREAM) mod P - the product comes out a bit along, and crc32 adds x^32
+	__m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(shift), 0);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+unsigned int P2PChecksum::crc32cSSE42(unsigned int crc, const char * data, size_t size)
+{
+	// crc32 takes three cycles but starts one a cycle, so three streams run side by side and are joined after
+	unsigned long long crc0 = crc;
+	while (size >= 3 * CRC32C_STREAM)
+	{
+		unsigned long long crc1 = 0;
+		unsigned long long crc2 = 0;
+		const char * end = data + CRC32C_STREAM;
+		while (data < end)
+		{
+			crc0 = _mm_crc32_u64(crc0, readLE64(data));
+			crc1 = _mm_crc32_u64(crc1, readLE64(data + CRC32C_STREAM));
+			crc2 = _mm_crc32_u64(crc2, readLE64(data + 2 * CRC32C_STREAM));
+			data += 8;
+		}
+
+		crc0 = crc32cShift(crc0, crc32c_shift) ^ crc1;
+		crc0 = crc32cShift(crc0, crc32c_shift) ^ crc2;
+		data += 2 * CRC32C_STREAM;
+		size -= 3 * CRC32C_STREAM;
+	}
+
+	while (size >= 8)
+	{
+		crc0 = _mm_crc32_u64(crc0, readLE64(data));
+		data += 8;
+		size -= 8;
+	}
+
+	while (size > 0)
+	{
+		crc0 = _mm_crc32_u8(crc0, *data++);
+		size--;
+	}
+
+	return crc0;
+}
+
+__attribute__((target("avx2")))
+void P2PChecksum::accumulateAVX2(unsigned long long * accumulators, const char * data, const char * secret, size_t stripes)
+{
+	// The eight accumulators stay in two registers for the whole run
+	__m256i accumulator0 = _mm256_loadu_si256((const __m256i *) accumulators);
+	__m256i accumulator1 = _mm256_loadu_si256((const __m256i *) (accumulators + 4));
+	for (size_t n = 0; n < stripes; n++)
+	{
+		const char * stripe = data + n * XXH_STRIPE_SIZE;
+		const char * key = secret + n * 8;
+
+		__m256i value0 = _mm256_loadu_si256((const __m256i *) stripe);
+		__m256i value1 = _mm256_loadu_si256((const __m256i *) (stripe + 32));
+		__m256i keyed0 = _mm256_xor_si256(value0, _mm256_loadu_si256((const __m256i *) key));
+		__m256i keyed1 = _mm256_xor_si256(value1, _mm256_loadu_si256((const __m256i *) (key + 32)));
+
+		// Low half times high half of each keyed lane, plus the neighbouring lane's value
+		__m256i product0 = _mm256_mul_epu32(keyed0, _mm256_srli_epi64(keyed0, 32));
+		__m256i product1 = _mm256_mul_epu32(keyed1, _mm256_srli_epi64(keyed1, 32));
+		accumulator0 = _mm256_add_epi64(accumulator0,
+			_mm256_add_epi64(product0, _mm256_shuffle_epi32(value0, _MM_SHUFFLE(1, 0, 3, 2))));
+		accumulator1 = _mm256_add_epi64(accumulator1,
+			_mm256_add_epi64(product1, _mm256_shuffle_epi32(value1, _MM_SHUFFLE(1, 0, 3, 2))));
+	}
+
+	_mm256_storeu_si256((__m256i *) accumulators, accumulator0);
+	_mm256_storeu_si256((__m256i *) (accumulators + 4), accumulator1);
+}
+
+__attribute__((target("avx2")))
+void P2PChecksum::scrambleAVX2(unsigned long long * accumulators, const char * secret)
+{
+	const __m256i prime = _mm256_set1_epi32((int) XXH_PRIME32_1);
+	for (int i = 0; i < 2; i++)
+	{
+		__m256i accumulator = _mm256_loadu_si256((const __m256i *) (accumulators + 4 * i));
+		accumulator = _mm256_xor_si256(accumulator, _mm256_srli_epi64(accumulator, 47));
+		accumulator = _mm256_xor_si256(accumulator, _mm256_loadu_si256((const __m256i *) (secret + 32 * i)));
+
+		// 64-bit multiply by a 32-bit prime, from two 32-bit halves
+		__m256i low = _mm256_mul_epu32(accumulator, prime);
+		__m256i high = _mm256_mul_epu32(_mm256_srli_epi64(accumulator, 32), prime);
+		_mm256_storeu_si256((__m256i *) (accumulators + 4 * i), _mm256_add_epi64(low, _mm256_slli_epi64(high, 32)));
+	}
+}
+#endif
@@ -0,0 +1,79 @@
+#ifndef P2PCHECKSUM_H
+#define P2PCHECKSUM_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define P2P_CHECKSUM_X86 1
+#endif
+
+using namespace std;
+
+/**
+ * Chunk checksums. Three algorithms, picked per connection in the hello:
+ * the original 32-bit sum, CRC32C and XXH3 (the low 32 bits of its 64-bit
+ * hash). CRC32C runs on the SSE4.2 crc32 instruction, three streams at a
+ * time joined with PCLMUL, and XXH3 on AVX2, where the CPU has them; the
+ * portable versions give the same results everywhere else.
+ */
+class P2PChecksum
+{
+	private:
+		static int level;
+		static unsigned int (*crc32c_function)(unsigned int, const char *, size_t);
+		static void (*accumulate_function)(unsigned long long *, const char *, const char *, size_t);
+		static void (*scramble_function)(unsigned long long *, const char *);
+
+		static unsigned int sum32(const char *, size_t);
+
+		// CRC32C - slice-by-8 tables, built at startup, and the hardware version
+		static unsigned int crc32c_table[8][256];
+		static bool b_tables_built;
+		static bool buildTables();
+		static unsigned int crc32cPortable(unsigned int, const char *, size_t);
+
+		// XXH3 - only the long-input loop differs between versions
+		static unsigned long long xxh3Short(const char *, size_t);
+		static unsigned long long xxh3Long(const char *, size_t);
+		static void accumulatePortable(unsigned long long *, const char *, const char *, size_t);
+		static void scramblePortable(unsigned long long *, const char *);
+
+#ifdef P2P_CHECKSUM_X86
+		static unsigned int crc32c_shift;
+		static unsigned int crc32cSSE42(unsigned int, const char *, size_t);
+		static void accumulateAVX2(unsigned long long *, const char *, const char *, size_t);
+		static void scrambleAVX2(unsigned long long *, const char *);
+#endif
+
+		static void selectFunctions();
+
+	public:
+		// Checksum of the data with one of the algorithms below
+		static unsigned int compute(unsigned int, const char *, size_t);
+
+		static unsigned int crc32c(const char *, size_t);
+		static unsigned long long xxh3(const char *, size_t);
+
+		// Every algorithm this build can check - sent in the hello
+		static unsigned int supportedAlgorithms();
+		static string describeAlgorithm(unsigned int);
+
+		// Implementation level - the best the CPU supports is picked at startup
+		static void setLevel(int);
+		static int getLevel();
+		static int detectLevel();
+		static string describeLevel(int);
+
+		// Algorithms, as sent in the hello - fastest last
+		static const unsigned int ALGORITHM_SUM32 = 1;
+		static const unsigned int ALGORITHM_CRC32C = 2;
+		static const unsigned int ALGORITHM_XXH3 = 4;
+
+		static const int LEVEL_PORTABLE = 0;
+		static const int LEVEL_SSE42 = 1;
+		static const int LEVEL_AVX2 = 2;
+
+		// Bytes in each of the three CRC32C streams
+		static const unsigned int CRC32C_STREAM = 1024;
+};
+
+#endif
@@ -7,8 +7,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <vector>
+#include <deque>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <fstream>
 #include <sstream>
@@ -18,6 +22,7 @@
 
 // Directory Management
 #include <dirent.h>
+#include <fnmatch.h>
 
 // Network Includes
 #include <sys/socket.h>
@@ -29,6 +34,9 @@
 // Multithreading
 #include <pthread.h>
 
+// Pieces each peer holds
+#include "P2PPieceMap.hpp"
+
 using namespace std;
 
 typedef struct {
@@ -47,11 +55,14 @@ typedef struct {
 	string public_address;
 	unsigned int public_port;
 	string remote_path;
+	bool b_partial;     // Still downloading - only the pieces below can be asked for
+	P2PPieceMap pieces;
 } FileAddress;
 
 typedef struct {
 	unsigned int file_id;
 	unsigned int size;
+	unsigned int piece_size;
 	vector<FileAddress> addresses;
 	string name;
 	string path;
@@ -60,16 +71,35 @@ typedef struct {
 	vector<unsigned int> missing_pieces;
 } FileItem;
 
+class P2POutbound;
+class P2PUploadRegistry;
+class P2PRateLimiter;
+class P2PPeerNode;
+
 typedef struct {
 	FileItem file_item;
 	int socket_id;
 	unsigned int start;
 	unsigned int count;
+	int protocol;
+	P2POutbound * outbound;
+	unsigned int request_id; // 0 for a plain fileRequest
+	P2PUploadRegistry * uploads;
+	bool b_compress;
+	bool b_chunk_runs;
+	unsigned int chunk_size;
+	unsigned int checksum;
+	P2PRateLimiter * rate_limiter;
+	P2PPeerNode * node; // Takes the request back when it has to wait for room or tokens
+	unsigned int generation; // The connection it was asked on, in case the socket is handed out again
 } FileDataRequest;
 
 typedef struct {
 	FileItem file_item;
 	char * packet;
+	unsigned int length;
+	unsigned int checksum;
+	P2PPeerNode * node;
 } FileDataPacket;
 
 class P2PCommon
@@ -85,6 +115,9 @@ class P2PCommon
 
 		// Some variables used throughout the program
 		static const unsigned int MAX_FILENAME_LENGTH = 255;
+
+		// Largest file that can be shared - text requests and file lookups carry sizes as int
+		static const unsigned int MAX_FILE_SIZE = 0x7FFFFFFF;
 };
 
 #endif
\ No newline at end of file
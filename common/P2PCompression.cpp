@@ -0,0 +1,344 @@
+/**
+ * Peer-to-peer compression class
+ */
+
+#include "P2PCompression.hpp"
+
+int P2PCompression::codec = -1;
+bool P2PCompression::b_enabled = true;
+int (*P2PCompression::compress_function)(const char *, char *, int, int) = NULL;
+int (*P2PCompression::decompress_function)(const char *, char *, int, int) = NULL;
+int (*P2PCompression::system_compress)(const char *, char *, int, int) = NULL;
+int (*P2PCompression::system_decompress)(const char *, char *, int, int) = NULL;
+const char * (*P2PCompression::version_function)() = NULL;
+
+int P2PCompression::compress(const char * source, char * destination, int source_size, int destination_capacity)
+{
+	if (codec < 0)
+	{
+		setCodec(detectCodec());
+	}
+
+	return compress_function(source, destination, source_size, destination_capacity);
+}
+
+int P2PCompression::decompress(const char * source, char * destination, int source_size, int destination_capacity)
+{
+	if (codec < 0)
+	{
+		setCodec(detectCodec());
+	}
+
+	return decompress_function(source, destination, source_size, destination_capacity);
+}
+
+int P2PCompression::compressBound(int source_size)
+{
+	// Same bound as LZ4_COMPRESSBOUND - incompressible data grows by a length byte per 255
+	return source_size + source_size / 255 + 16;
+}
+
+bool P2PCompression::isCompressible(const char * data, int size)
+{
+	// Sample from the middle, past any header the data starts with
+	int sample_size = min(size, (int) SAMPLE_SIZE);
+	const char * sample = data + (size - sample_size) / 2;
+
+	char compressed[SAMPLE_SIZE + SAMPLE_SIZE / 255 + 16];
+	int compressed_size = compress(sample, compressed, sample_size, sizeof(compressed));
+
+	return (compressed_size > 0 && compressed_size * 100 <= sample_size * (100 - MIN_SAVINGS_PERCENT));
+}
+
+int P2PCompression::detectCodec()
+{
+	return loadSystemLibrary() ? CODEC_SYSTEM : CODEC_BUILTIN;
+}
+
+void P2PCompression::setCodec(int requested_codec)
+{
+	// Never pick a library that isn't there
+	if (requested_codec == CODEC_SYSTEM && loadSystemLibrary())
+	{
+		codec = CODEC_SYSTEM;
+		compress_function = system_compress;
+		decompress_function = system_decompress;
+		return;
+	}
+
+	codec = CODEC_BUILTIN;
+	compress_function = &P2PCompression::compressBuiltin;
+	decompress_function = &P2PCompression::decompressBuiltin;
+}
+
+int P2PCompression::getCodec()
+{
+	if (codec < 0)
+	{
+		setCodec(detectCodec());
+	}
+
+	return codec;
+}
+
+int P2PCompression::parseCodec(string name)
+{
+	if (name == "builtin")
+	{
+		return CODEC_BUILTIN;
+	}
+
+	return CODEC_SYSTEM;
+}
+
+string P2PCompression::describeCodec(int codec_value)
+{
+	if (codec_value == CODEC_SYSTEM && loadSystemLibrary())
+	{
+		return string("liblz4 ") + (version_function != NULL ? version_function() : "");
+	}
+
+	return "built-in LZ4";
+}
+
+void P2PCompression::setEnabled(bool b_enabled_value)
+{
+	b_enabled = b_enabled_value;
+}
+
+bool P2PCompression::isEnabled()
+{
+	return b_enabled;
+}
+
+bool P2PCompression::loadSystemLibrary()
+{
+	static void * library = NULL;
+	static bool b_tried = false;
+
+	// Only look once - the answer doesn't change while we run
+	if (!b_tried)
+	{
+		b_tried = true;
+		library = dlopen("liblz4.so.1", RTLD_NOW | RTLD_LOCAL);
+		if (library == NULL)
+		{
+			library = dlopen("liblz4.so", RTLD_NOW | RTLD_LOCAL);
+		}
+
+		if (library != NULL)
+		{
+			system_compress = (int (*)(const char *, char *, int, int)) dlsym(library, "LZ4_compress_default");
+			system_decompress = (int (*)(const char *, char *, int, int)) dlsym(library, "LZ4_decompress_safe");
+			version_function = (const char * (*)()) dlsym(library, "LZ4_versionString");
+
+			if (system_compress == NULL || system_decompress == NULL)
+			{
+				dlclose(library);
+				library = NULL;
+			}
+		}
+	}
+
+	return (library != NULL);
+}
+
+/**
+ * Built-in codec - a greedy, single-pass LZ4 block writer and a bounds-checked reader
+ */
+
+static inline unsigned int readWord(const unsigned char * position)
+{
+	unsigned int value;
+	memcpy(&value, position, sizeof(value));
+	return value;
+}
+
+static inline unsigned char * writeLength(unsigned char * output, unsigned int length)
+{
+	// Lengths past the token's 15 continue in bytes of 255
+	while (length >= 255)
+	{
+		*output++ = 255;
+		length -= 255;
+	}
+
+	*output++ = (unsigned char) length;
+	return output;
+}
+
+int P2PCompression::compressBuiltin(const char * source, char * destination, int source_size, int destination_capacity)
+{
+	const unsigned char * input = (const unsigned char *) source;
+	const unsigned char * input_end = input + source_size;
+	const unsigned char * match_limit = input_end - LAST_LITERALS;
+	const unsigned char * find_limit = input_end - MATCH_FIND_LIMIT;
+	const unsigned char * anchor = input;
+	unsigned char * output = (unsigned char *) destination;
+	unsigned char * output_end = output + destination_capacity;
+
+	// Last position each 4-byte sequence was seen at
+	unsigned int table[1 << HASH_LOG];
+	memset(table, 0, sizeof(table));
+
+	const unsigned char * position = input + 1;
+	unsigned int misses = 0;
+	while (source_size > MATCH_FIND_LIMIT && position < find_limit)
+	{
+		unsigned int sequence = readWord(position);
+		unsigned int hash = (sequence * 2654435761U) >> (32 - HASH_LOG);
+		const unsigned char * reference = input + table[hash];
+		table[hash] = position - input;
+
+		if (reference >= position || position - reference > MAX_OFFSET || readWord(reference) != sequence)
+		{
+			// Skip ahead faster through data that isn't matching
+			position += 1 + (misses++ >> 6);
+			continue;
+		}
+
+		misses = 0;
+
+		// Extend the match as far as it goes
+		const unsigned char * match_end = position + MIN_MATCH;
+		const unsigned char * reference_end = reference + MIN_MATCH;
+		while (match_end < match_limit && *match_end == *reference_end)
+		{
+			match_end++;
+			reference_end++;
+		}
+
+		unsigned int literal_length = position - anchor;
+		unsigned int match_length = match_end - position - MIN_MATCH;
+
+		// Token, literal length, literals, offset and match length must all fit
+		if (output + 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1 > output_end)
+		{
+			return 0;
+		}
+
+		unsigned char * token = output++;
+		*token = (unsigned char)((min(literal_length, 15u) << 4) | min(match_length, 15u));
+		if (literal_length >= 15)
+			output = writeLength(output, literal_length - 15);
+
+		memcpy(output, anchor, literal_length);
+		output += literal_length;
+
+		unsigned int offset = position - reference;
+		*output++ = (unsigned char)(offset & 0xFF);
+		*output++ = (unsigned char)(offset >> 8);
+
+		if (match_length >= 15)
+			output = writeLength(output, match_length - 15);
+
+		position = match_end;
+		anchor = position;
+	}
+
+	// Whatever is left goes out as literals
+	unsigned int literal_length = input_end - anchor;
+	if (output + 1 + literal_length / 255 + 1 + literal_length > output_end)
+	{
+		return 0;
+	}
+
+	unsigned char * token = output++;
+	*token = (unsigned char)(min(literal_length, 15u) << 4);
+	if (literal_length >= 15)
+		output = writeLength(output, literal_length - 15);
+
+	memcpy(output, anchor, literal_length);
+	output += literal_length;
+
+	return output - (unsigned char *) destination;
+}
+
+int P2PCompression::decompressBuiltin(const char * source, char * destination, int source_size, int destination_capacity)
+{
+	const unsigned char * input = (const unsigned char *) source;
+	const unsigned char * input_end = input + source_size;
+	unsigned char * output = (unsigned char *) destination;
+	unsigned char * output_start = output;
+	unsigned char * output_end = output + destination_capacity;
+
+	while (input < input_end)
+	{
+		unsigned int token = *input++;
+
+		// Literals
+		unsigned int literal_length = token >> 4;
+		if (literal_length == 15)
+		{
+			unsigned int extra;
+			do
+			{
+				if (input >= input_end)
+					return -1;
+				extra = *input++;
+				literal_length += extra;
+			} while (extra == 255);
+		}
+
+		if ((unsigned int)(input_end - input) < literal_length || (unsigned int)(output_end - output) < literal_length)
+		{
+			return -1;
+		}
+
+		memcpy(output, input, literal_length);
+		output += literal_length;
+		input += literal_length;
+
+		// The last sequence has no match
+		if (input >= input_end)
+		{
+			break;
+		}
+
+		if (input_end - input < 2)
+		{
+			return -1;
+		}
+
+		unsigned int offset = input[0] | (input[1] << 8);
+		input += 2;
+		if (offset == 0 || offset > (unsigned int)(output - output_start))
+		{
+			return -1;
+		}
+
+		unsigned int match_length = token & 15;
+		if (match_length == 15)
+		{
+			unsigned int extra;
+			do
+			{
+				if (input >= input_end)
+					return -1;
+				extra = *input++;
+				match_length += extra;
+			} while (extra == 255);
+		}
+		match_length += MIN_MATCH;
+
+		if ((unsigned int)(output_end - output) < match_length)
+		{
+			return -1;
+		}
+
+		// Overlapping matches repeat the bytes just written, so copy those one at a time
+		const unsigned char * match = output - offset;
+		if (offset >= match_length)
+		{
+			memcpy(output, match, match_length);
+			output += match_length;
+		}
+		else
+		{
+			for (unsigned int i = 0; i < match_length; i++)
+				*output++ = *match++;
+		}
+	}
+
+	return output - output_start;
+}
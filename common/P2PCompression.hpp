@@ -0,0 +1,63 @@
+#ifndef P2PCOMPRESSION_H
+#define P2PCOMPRESSION_H
+
+#include <dlfcn.h>
+
+using namespace std;
+
+/**
+ * LZ4 block compression for chunk runs. The system liblz4 is loaded at
+ * startup when it's installed; otherwise a built-in codec writes the same
+ * block format, so either end can read what the other sends.
+ */
+class P2PCompression
+{
+	private:
+		static int codec;
+		static bool b_enabled;
+		static int (*compress_function)(const char *, char *, int, int);
+		static int (*decompress_function)(const char *, char *, int, int);
+
+		// Entry points of the system library, when it loads
+		static int (*system_compress)(const char *, char *, int, int);
+		static int (*system_decompress)(const char *, char *, int, int);
+		static const char * (*version_function)();
+
+		static bool loadSystemLibrary();
+		static int compressBuiltin(const char *, char *, int, int);
+		static int decompressBuiltin(const char *, char *, int, int);
+
+	public:
+		// Both return the bytes written, or 0 / negative when the output doesn't fit or the input is corrupt
+		static int compress(const char *, char *, int, int);
+		static int decompress(const char *, char *, int, int);
+		static int compressBound(int);
+
+		// Compresses a sample of the data to see whether the whole is worth compressing
+		static bool isCompressible(const char *, int);
+
+		// Codec selection - the system library is used when it can be loaded
+		static void setCodec(int);
+		static int getCodec();
+		static int detectCodec();
+		static int parseCodec(string);
+		static string describeCodec(int);
+		static void setEnabled(bool);
+		static bool isEnabled();
+
+		static const int CODEC_BUILTIN = 0;
+		static const int CODEC_SYSTEM = 1;
+
+		// Bytes compressed to judge a run, and the share of them that has to be saved
+		static const int SAMPLE_SIZE = 4096;
+		static const int MIN_SAVINGS_PERCENT = 10;
+
+		// LZ4 block format limits
+		static const int MIN_MATCH = 4;
+		static const int LAST_LITERALS = 5;
+		static const int MATCH_FIND_LIMIT = 12;
+		static const int MAX_OFFSET = 65535;
+		static const int HASH_LOG = 12;
+};
+
+#endif
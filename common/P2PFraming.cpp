@@ -0,0 +1,108 @@
+/**
+ * Peer-to-peer message framing
+ */
+
+#include "P2PFraming.hpp"
+
+P2PFrameBuffer::P2PFrameBuffer()
+{
+	read_offset = 0;
+	write_offset = 0;
+}
+
+char * P2PFrameBuffer::reserve(unsigned int length)
+{
+	// Move any partial frame to the front before growing
+	if (data.size() - write_offset < length)
+	{
+		compact();
+	}
+
+	if (data.size() - write_offset < length)
+	{
+		data.resize(write_offset + length);
+	}
+
+	return &data[write_offset];
+}
+
+void P2PFrameBuffer::commit(unsigned int length)
+{
+	write_offset += length;
+}
+
+bool P2PFrameBuffer::nextFrame(char *& frame, unsigned int &length)
+{
+	unsigned int available = write_offset - read_offset;
+	if (available < P2PFraming::FRAME_HEADER_SIZE)
+	{
+		return false;
+	}
+
+	length = P2PFraming::readFrameHeader(&data[read_offset]);
+	if (length > P2PFraming::MAX_FRAME_SIZE || available - P2PFraming::FRAME_HEADER_SIZE < length)
+	{
+		return false;
+	}
+
+	frame = &data[read_offset + P2PFraming::FRAME_HEADER_SIZE];
+	read_offset += P2PFraming::FRAME_HEADER_SIZE + length;
+
+	return true;
+}
+
+bool P2PFrameBuffer::isOversized()
+{
+	return (write_offset - read_offset >= P2PFraming::FRAME_HEADER_SIZE
+		&& P2PFraming::readFrameHeader(&data[read_offset]) > P2PFraming::MAX_FRAME_SIZE);
+}
+
+void P2PFrameBuffer::compact()
+{
+	if (read_offset == 0)
+	{
+		return;
+	}
+
+	unsigned int remaining = write_offset - read_offset;
+	if (remaining > 0)
+	{
+		memmove(&data[0], &data[read_offset], remaining);
+	}
+
+	read_offset = 0;
+	write_offset = remaining;
+}
+
+void P2PFrameBuffer::clear()
+{
+	// Drop any partial frame and give the memory back
+	vector<char>().swap(data);
+	read_offset = 0;
+	write_offset = 0;
+}
+
+unsigned int P2PFrameBuffer::size()
+{
+	return write_offset - read_offset;
+}
+
+string P2PFraming::frameMessage(string message)
+{
+	char header[FRAME_HEADER_SIZE];
+	writeFrameHeader(header, message.length());
+	return string(header, FRAME_HEADER_SIZE) + message;
+}
+
+void P2PFraming::writeFrameHeader(char * destination, unsigned int length)
+{
+	uint32_t network_length = htonl(length);
+	memcpy(destination, &network_length, FRAME_HEADER_SIZE);
+}
+
+unsigned int P2PFraming::readFrameHeader(const char * source)
+{
+	uint32_t network_length;
+	memcpy(&network_length, source, FRAME_HEADER_SIZE);
+	return ntohl(network_length);
+}
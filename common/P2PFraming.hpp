@@ -0,0 +1,46 @@
+#ifndef P2PFRAMING_H
+#define P2PFRAMING_H
+
+using namespace std;
+
+/**
+ * Messages travel as frames: a 4-byte length in network byte order, then the payload.
+ * A frame buffer collects whatever each read returns and hands back complete frames.
+ */
+class P2PFrameBuffer
+{
+	private:
+		vector<char> data;
+		unsigned int read_offset;
+		unsigned int write_offset;
+
+	public:
+		P2PFrameBuffer();
+
+		// Make room for at least this many bytes and return where to read into
+		char * reserve(unsigned int);
+		void commit(unsigned int);
+
+		// Get the next complete frame, if there is one - valid until the next reserve()
+		bool nextFrame(char *&, unsigned int&);
+		bool isOversized();
+		void compact();
+		void clear();
+		unsigned int size();
+};
+
+class P2PFraming
+{
+	public:
+		static string frameMessage(string);
+		static void writeFrameHeader(char *, unsigned int);
+		static unsigned int readFrameHeader(const char *);
+
+		// Length prefix in front of every frame
+		static const unsigned int FRAME_HEADER_SIZE = 4;
+
+		// Anything bigger than this is treated as a protocol error
+		static const unsigned int MAX_FRAME_SIZE = 16 * 1024 * 1024;
+};
+
+#endif
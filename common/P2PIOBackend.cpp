@@ -0,0 +1,339 @@
+/**
+ * Peer-to-peer I/O backend class
+ */
+
+#include "P2PIOBackend.hpp"
+
+int P2PIOBackend::preferred_backend = P2PIOBackend::BACKEND_SYSCALL;
+
+P2PIOBackend::P2PIOBackend()
+{
+	backend = BACKEND_SYSCALL;
+	ring_descriptor = -1;
+	sq_pointer = MAP_FAILED;
+	cq_pointer = MAP_FAILED;
+	sqes = (struct io_uring_sqe *) MAP_FAILED;
+	syscall_count = 0;
+}
+
+P2PIOBackend::~P2PIOBackend()
+{
+	closeRing();
+}
+
+void P2PIOBackend::open()
+{
+	open(preferred_backend);
+}
+
+void P2PIOBackend::open(int requested_backend)
+{
+	// Only open once
+	if (ring_descriptor >= 0)
+	{
+		return;
+	}
+
+	backend = BACKEND_SYSCALL;
+
+	// Fall back to plain syscalls when the kernel lacks io_uring
+	if (requested_backend == BACKEND_URING && openRing())
+	{
+		backend = BACKEND_URING;
+	}
+}
+
+int P2PIOBackend::getBackend()
+{
+	return backend;
+}
+
+unsigned long P2PIOBackend::getSyscallCount()
+{
+	return syscall_count;
+}
+
+void P2PIOBackend::setPreferredBackend(int backend)
+{
+	preferred_backend = backend;
+}
+
+int P2PIOBackend::getPreferredBackend()
+{
+	return preferred_backend;
+}
+
+int P2PIOBackend::parseBackend(string name)
+{
+	if (name == "io_uring" || name == "uring")
+	{
+		return BACKEND_URING;
+	}
+
+	return BACKEND_SYSCALL;
+}
+
+P2PIORequest P2PIOBackend::makeRequest(int opcode, int descriptor, char * buffer, unsigned int length, off_t offset, int flags)
+{
+	P2PIORequest request;
+	request.opcode = opcode;
+	request.descriptor = descriptor;
+	request.buffer = buffer;
+	request.length = length;
+	request.offset = offset;
+	request.flags = flags;
+	request.result = 0;
+	return request;
+}
+
+bool P2PIOBackend::openRing()
+{
+	memset(&params, 0, sizeof(params));
+	ring_descriptor = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (ring_descriptor < 0)
+	{
+		return false;
+	}
+
+	// Map the submission and completion rings
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		sq_ring_size = max(sq_ring_size, cq_ring_size);
+		cq_ring_size = sq_ring_size;
+	}
+
+	sq_pointer = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_SQ_RING);
+	if (sq_pointer == MAP_FAILED)
+	{
+		closeRing();
+		return false;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		cq_pointer = sq_pointer;
+	}
+	else
+	{
+		cq_pointer = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_CQ_RING);
+		if (cq_pointer == MAP_FAILED)
+		{
+			closeRing();
+			return false;
+		}
+	}
+
+	sqes = (struct io_uring_sqe *) mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_descriptor, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		closeRing();
+		return false;
+	}
+
+	// Locate the ring fields
+	char * sq = (char *) sq_pointer;
+	char * cq = (char *) cq_pointer;
+	sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	sq_ring_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	sq_array = (unsigned *) (sq + params.sq_off.array);
+	cq_head = (unsigned *) (cq + params.cq_off.head);
+	cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	cq_ring_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	return true;
+}
+
+void P2PIOBackend::closeRing()
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+
+	if (cq_pointer != MAP_FAILED && cq_pointer != sq_pointer)
+		munmap(cq_pointer, cq_ring_size);
+
+	if (sq_pointer != MAP_FAILED)
+		munmap(sq_pointer, sq_ring_size);
+
+	if (ring_descriptor >= 0)
+		close(ring_descriptor);
+
+	sqes = (struct io_uring_sqe *) MAP_FAILED;
+	cq_pointer = MAP_FAILED;
+	sq_pointer = MAP_FAILED;
+	ring_descriptor = -1;
+}
+
+int P2PIOBackend::submit(vector<P2PIORequest> &requests)
+{
+	// Submit in batches that fit the ring - a ring that fails part way leaves the rest to plain syscalls
+	unsigned int completed = 0;
+	while (completed < requests.size())
+	{
+		if (backend == BACKEND_SYSCALL)
+		{
+			submitSyscall(requests[completed]);
+			completed++;
+			continue;
+		}
+
+		unsigned int batch = min((unsigned int)(requests.size() - completed), params.sq_entries);
+		completed += submitRing(requests, completed, batch);
+	}
+
+	return completed;
+}
+
+int P2PIOBackend::submitRing(vector<P2PIORequest> &requests, unsigned int first, unsigned int batch)
+{
+	// We're the only producer, so the tail doesn't need an atomic load
+	unsigned int tail = *sq_tail;
+	unsigned int mask = *sq_ring_mask;
+
+	for (unsigned int i = first; i < first + batch; i++)
+	{
+		P2PIORequest & request = requests[i];
+		unsigned int index = tail & mask;
+
+		struct io_uring_sqe * sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->fd = request.descriptor;
+		sqe->addr = (unsigned long) request.buffer;
+		sqe->len = request.length;
+		sqe->user_data = i;
+
+		switch (request.opcode)
+		{
+			case IO_READ:
+				sqe->opcode = IORING_OP_READ;
+				sqe->off = request.offset;
+				break;
+			case IO_WRITE:
+				sqe->opcode = IORING_OP_WRITE;
+				sqe->off = request.offset;
+				break;
+			case IO_SEND:
+				sqe->opcode = IORING_OP_SEND;
+				sqe->msg_flags = request.flags;
+				break;
+			case IO_RECV:
+				sqe->opcode = IORING_OP_RECV;
+				sqe->msg_flags = request.flags;
+				break;
+			case IO_SENDMSG:
+				sqe->opcode = IORING_OP_SENDMSG;
+				sqe->len = 1;
+				sqe->msg_flags = request.flags;
+				break;
+		}
+
+		sq_array[index] = index;
+		tail++;
+	}
+
+	// Publish the new entries to the kernel
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+	// Submit and wait for the whole batch in one call
+	unsigned int submitted = 0;
+	bool b_failed = false;
+	while (submitted < batch)
+	{
+		syscall_count++;
+		int result = syscall(__NR_io_uring_enter, ring_descriptor, batch - submitted, batch - submitted, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (result < 0 && errno != EINTR)
+		{
+			perror("Error: io_uring_enter failed, falling back to plain syscalls");
+			b_failed = true;
+			break;
+		}
+		else if (result > 0)
+		{
+			submitted += result;
+		}
+	}
+
+	// Reap the completions - even after a failure, since the kernel holds the buffers
+	// of whatever it took until they complete
+	unsigned int reaped = 0;
+	unsigned int head = *cq_head;
+	while (reaped < submitted)
+	{
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		{
+			// Interrupted before everything completed - wait for the rest
+			syscall_count++;
+			syscall(__NR_io_uring_enter, ring_descriptor, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			continue;
+		}
+
+		struct io_uring_cqe * cqe = &cqes[head & *cq_ring_mask];
+		requests[cqe->user_data].result = cqe->res;
+		head++;
+		reaped++;
+	}
+
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+	// Entries are taken in order, so the ones left over are the end of the batch - drop them with the ring
+	if (b_failed)
+	{
+		closeRing();
+		backend = BACKEND_SYSCALL;
+	}
+
+	return reaped;
+}
+
+int P2PIOBackend::sendFully(int descriptor, char * buffer, unsigned int length, int flags)
+{
+	unsigned int sent = 0;
+	vector<P2PIORequest> requests(1);
+
+	while (sent < length)
+	{
+		requests[0] = makeRequest(IO_SEND, descriptor, &buffer[sent], length - sent, 0, flags);
+		submit(requests);
+
+		if (requests[0].result == -EINTR)
+			continue;
+
+		if (requests[0].result <= 0)
+			return requests[0].result;
+
+		sent += requests[0].result;
+	}
+
+	return sent;
+}
+
+void P2PIOBackend::submitSyscall(P2PIORequest &request)
+{
+	ssize_t result = -1;
+	syscall_count++;
+
+	switch (request.opcode)
+	{
+		case IO_READ:
+			result = pread(request.descriptor, request.buffer, request.length, request.offset);
+			break;
+		case IO_WRITE:
+			result = pwrite(request.descriptor, request.buffer, request.length, request.offset);
+			break;
+		case IO_SEND:
+			result = send(request.descriptor, request.buffer, request.length, request.flags);
+			break;
+		case IO_RECV:
+			result = recv(request.descriptor, request.buffer, request.length, request.flags);
+			break;
+		case IO_SENDMSG:
+			result = sendmsg(request.descriptor, (struct msghdr *) request.buffer, request.flags);
+			break;
+	}
+
+	// Match the io_uring convention of returning -errno
+	request.result = (result < 0) ? -errno : result;
+}
@@ -0,0 +1,90 @@
+#ifndef P2PIOBACKEND_H
+#define P2PIOBACKEND_H
+
+// io_uring - driven through the raw syscalls so no extra library is needed
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+typedef struct {
+	int opcode;
+	int descriptor;
+	char * buffer;
+	unsigned int length;
+	off_t offset;
+	int flags;
+	int result;
+} P2PIORequest;
+
+class P2PIOBackend
+{
+	private:
+		int backend;
+
+		// Ring state
+		int ring_descriptor;
+		struct io_uring_params params;
+		void * sq_pointer;
+		void * cq_pointer;
+		size_t sq_ring_size;
+		size_t cq_ring_size;
+		struct io_uring_sqe * sqes;
+		struct io_uring_cqe * cqes;
+		unsigned * sq_tail;
+		unsigned * sq_ring_mask;
+		unsigned * sq_array;
+		unsigned * cq_head;
+		unsigned * cq_tail;
+		unsigned * cq_ring_mask;
+
+		// Keep track of how many system calls we make
+		unsigned long syscall_count;
+
+		bool openRing();
+		void closeRing();
+		int submitRing(vector<P2PIORequest>&, unsigned int, unsigned int);
+		void submitSyscall(P2PIORequest&);
+
+		// Backend picked at startup
+		static int preferred_backend;
+
+	public:
+		P2PIOBackend();
+		~P2PIOBackend();
+		void open(int);
+		void open();
+		int getBackend();
+		unsigned long getSyscallCount();
+
+		// Run a batch of requests, results are filled in as bytes or -errno. If the ring fails,
+		// it's closed and the rest of the requests are run as plain syscalls.
+		int submit(vector<P2PIORequest>&);
+
+		// Send a whole buffer, retrying partial sends
+		int sendFully(int, char *, unsigned int, int);
+
+		// Helpers for building requests
+		static P2PIORequest makeRequest(int, int, char *, unsigned int, off_t, int);
+
+		static void setPreferredBackend(int);
+		static int getPreferredBackend();
+		static int parseBackend(string);
+
+		// Available backends
+		static const int BACKEND_SYSCALL = 0;
+		static const int BACKEND_URING = 1;
+
+		// Available operations
+		static const int IO_READ = 0;
+		static const int IO_WRITE = 1;
+		static const int IO_SEND = 2;
+		static const int IO_RECV = 3;
+		static const int IO_SENDMSG = 4;
+
+		// Number of submission queue entries in each ring
+		static const unsigned int RING_ENTRIES = 64;
+};
+
+#endif
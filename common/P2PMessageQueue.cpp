@@ -0,0 +1,153 @@
+/**
+ * Peer-to-peer message queue class
+ */
+
+#include "P2PMessageQueue.hpp"
+
+P2PMessageQueue::P2PMessageQueue()
+{
+	cells = NULL;
+	capacity = 0;
+	mask = 0;
+	enqueue_position = 0;
+	dequeue_position = 0;
+	wakeup_descriptor = -1;
+	b_consumer_waiting = 0;
+}
+
+P2PMessageQueue::~P2PMessageQueue()
+{
+	delete[] cells;
+
+	if (wakeup_descriptor >= 0)
+		close(wakeup_descriptor);
+}
+
+void P2PMessageQueue::open(unsigned long requested_capacity)
+{
+	// Round the capacity up to a power of two so positions can be masked
+	capacity = 2;
+	while (capacity < requested_capacity)
+	{
+		capacity <<= 1;
+	}
+
+	mask = capacity - 1;
+	cells = new P2PMessageCell[capacity];
+	for (unsigned long i = 0; i < capacity; i++)
+	{
+		cells[i].sequence = i;
+	}
+
+	wakeup_descriptor = eventfd(0, EFD_CLOEXEC);
+	if (wakeup_descriptor < 0)
+	{
+		perror("Error: could not open message queue wakeup descriptor");
+		exit(1);
+	}
+}
+
+bool P2PMessageQueue::push(P2PMessage &message)
+{
+	P2PMessageCell * cell;
+	unsigned long position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+
+	while (true)
+	{
+		cell = &cells[position & mask];
+		unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		long difference = (long) sequence - (long) position;
+
+		if (difference == 0)
+		{
+			// The cell is free - try to claim it
+			if (__atomic_compare_exchange_n(&enqueue_position, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (difference < 0)
+		{
+			// The consumer hasn't caught up - the queue is full
+			return false;
+		}
+		else
+		{
+			// Another producer got here first
+			position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->message = std::move(message);
+	__atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+
+	// Only make the syscall if the consumer is asleep
+	if (__atomic_load_n(&b_consumer_waiting, __ATOMIC_SEQ_CST))
+	{
+		uint64_t value = 1;
+		if (write(wakeup_descriptor, &value, sizeof(value)) < 0)
+		{
+			perror("Error: could not wake up message consumer");
+		}
+	}
+
+	return true;
+}
+
+bool P2PMessageQueue::pop(P2PMessage &message)
+{
+	P2PMessageCell * cell = &cells[dequeue_position & mask];
+	unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+	// Not published yet
+	if ((long) sequence - (long) (dequeue_position + 1) < 0)
+	{
+		return false;
+	}
+
+	message = std::move(cell->message);
+
+	// Hand the cell back to the producers for the next lap
+	__atomic_store_n(&cell->sequence, dequeue_position + capacity, __ATOMIC_RELEASE);
+	dequeue_position++;
+
+	return true;
+}
+
+bool P2PMessageQueue::waitPop(P2PMessage &message, int timeout)
+{
+	if (pop(message))
+	{
+		return true;
+	}
+
+	// Announce that we're going to sleep, then look once more so a push can't slip past
+	__atomic_store_n(&b_consumer_waiting, 1, __ATOMIC_SEQ_CST);
+	if (pop(message))
+	{
+		__atomic_store_n(&b_consumer_waiting, 0, __ATOMIC_SEQ_CST);
+		return true;
+	}
+
+	struct pollfd descriptor;
+	descriptor.fd = wakeup_descriptor;
+	descriptor.events = POLLIN;
+	descriptor.revents = 0;
+
+	if (poll(&descriptor, 1, timeout) > 0)
+	{
+		uint64_t value;
+		if (read(wakeup_descriptor, &value, sizeof(value)) < 0)
+		{
+			perror("Error: could not read message queue wakeup");
+		}
+	}
+
+	__atomic_store_n(&b_consumer_waiting, 0, __ATOMIC_SEQ_CST);
+
+	return pop(message);
+}
+
+unsigned long P2PMessageQueue::size()
+{
+	// Approximate while producers are active
+	return __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED) - dequeue_position;
+}
@@ -0,0 +1,49 @@
+#ifndef P2PMESSAGEQUEUE_H
+#define P2PMESSAGEQUEUE_H
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+using namespace std;
+
+typedef struct {
+	unsigned long sequence;
+	P2PMessage message;
+} P2PMessageCell;
+
+/**
+ * Bounded lock-free queue with many producers and a single consumer.
+ * Each cell carries a sequence number that tells producers and the consumer
+ * whose turn it is; messages are moved in and out rather than copied.
+ * The consumer sleeps on an eventfd, which producers only poke when it's asleep.
+ */
+class P2PMessageQueue
+{
+	private:
+		P2PMessageCell * cells;
+		unsigned long capacity;
+		unsigned long mask;
+
+		// Producers claim slots here, the consumer reads from its own position
+		unsigned long enqueue_position;
+		unsigned long dequeue_position;
+
+		// Wakeup for a sleeping consumer
+		int wakeup_descriptor;
+		int b_consumer_waiting;
+
+	public:
+		P2PMessageQueue();
+		~P2PMessageQueue();
+		void open(unsigned long);
+
+		bool push(P2PMessage&);
+		bool pop(P2PMessage&);
+		bool waitPop(P2PMessage&, int);
+		unsigned long size();
+
+		// Default number of messages the queue holds, a power of two
+		static const unsigned long DEFAULT_CAPACITY = 65536;
+};
+
+#endif
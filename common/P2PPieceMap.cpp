@@ -0,0 +1,166 @@
+/**
+ * Peer-to-peer piece map class
+ */
+
+#include "P2PPieceMap.hpp"
+
+void P2PPieceMap::add(unsigned int first, unsigned int count)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	unsigned int end = first + count;
+
+	// Start from the run before, if it reaches this one
+	map<unsigned int, unsigned int>::iterator iter = runs.upper_bound(first);
+	if (iter != runs.begin())
+	{
+		map<unsigned int, unsigned int>::iterator previous = iter;
+		--previous;
+		if (previous->second >= first)
+		{
+			first = previous->first;
+			end = max(end, previous->second);
+			iter = previous;
+		}
+	}
+
+	// Swallow every run that starts inside or right after it
+	while (iter != runs.end() && iter->first <= end)
+	{
+		end = max(end, iter->second);
+		runs.erase(iter++);
+	}
+
+	runs[first] = end;
+}
+
+void P2PPieceMap::add(P2PPieceMap &other)
+{
+	map<unsigned int, unsigned int>::iterator iter;
+	for (iter = other.runs.begin(); iter != other.runs.end(); ++iter)
+	{
+		add(iter->first, iter->second - iter->first);
+	}
+}
+
+bool P2PPieceMap::contains(unsigned int piece)
+{
+	map<unsigned int, unsigned int>::iterator iter = runs.upper_bound(piece);
+	if (iter == runs.begin())
+	{
+		return false;
+	}
+
+	--iter;
+	return (piece < iter->second);
+}
+
+bool P2PPieceMap::isEmpty()
+{
+	return runs.empty();
+}
+
+bool P2PPieceMap::isComplete(unsigned int num_pieces)
+{
+	return (runs.size() == 1 && runs.begin()->first == 0 && runs.begin()->second >= num_pieces);
+}
+
+unsigned int P2PPieceMap::countPieces()
+{
+	unsigned int count = 0;
+	map<unsigned int, unsigned int>::iterator iter;
+	for (iter = runs.begin(); iter != runs.end(); ++iter)
+	{
+		count += iter->second - iter->first;
+	}
+
+	return count;
+}
+
+unsigned int P2PPieceMap::countRuns()
+{
+	return runs.size();
+}
+
+void P2PPieceMap::clear()
+{
+	runs.clear();
+}
+
+void P2PPieceMap::trim(unsigned int num_pieces)
+{
+	map<unsigned int, unsigned int>::iterator iter = runs.lower_bound(num_pieces);
+	runs.erase(iter, runs.end());
+
+	if (!runs.empty() && runs.rbegin()->second > num_pieces)
+	{
+		runs.rbegin()->second = num_pieces;
+	}
+}
+
+void P2PPieceMap::write(P2PWireWriter &writer)
+{
+	writer.putU32(runs.size());
+
+	map<unsigned int, unsigned int>::iterator iter;
+	for (iter = runs.begin(); iter != runs.end(); ++iter)
+	{
+		writer.putU32(iter->first);
+		writer.putU32(iter->second - iter->first);
+	}
+}
+
+bool P2PPieceMap::read(P2PWireReader &reader)
+{
+	unsigned int count = reader.getU32();
+	for (unsigned int i = 0; i < count && !reader.failed(); i++)
+	{
+		unsigned int first = reader.getU32();
+		unsigned int pieces = reader.getU32();
+
+		// A run that wraps around can't be in any file
+		if (!reader.failed() && pieces <= UINT_MAX - first)
+		{
+			add(first, pieces);
+		}
+	}
+
+	return !reader.failed();
+}
+
+string P2PPieceMap::toString()
+{
+	string text;
+	map<unsigned int, unsigned int>::iterator iter;
+	for (iter = runs.begin(); iter != runs.end(); ++iter)
+	{
+		text += (text.empty() ? "" : ",") + to_string(iter->first) + "-" + to_string(iter->second - 1);
+	}
+
+	return text;
+}
+
+bool P2PPieceMap::parse(string text)
+{
+	bool b_valid = true;
+	stringstream runs_text(text);
+	string run;
+	while (getline(runs_text, run, ','))
+	{
+		unsigned int first, last;
+		char dash;
+		stringstream range(run);
+		if (!(range >> first >> dash >> last) || dash != '-' || last < first || last == UINT_MAX)
+		{
+			b_valid = false;
+			continue;
+		}
+
+		add(first, last - first + 1);
+	}
+
+	return b_valid;
+}
@@ -0,0 +1,45 @@
+#ifndef P2PPIECEMAP_H
+#define P2PPIECEMAP_H
+
+using namespace std;
+
+class P2PWireWriter;
+class P2PWireReader;
+
+/**
+ * The pieces of a file a peer holds, kept as runs of pieces rather than a
+ * bit per piece. Downloads fill in more or less front to back, a few blocks
+ * at a time, so even a file of thousands of pieces is a handful of runs -
+ * and a peer with the whole file is one. Pieces are numbered from 0.
+ */
+class P2PPieceMap
+{
+	private:
+		// First piece of each run, and one past its last
+		map<unsigned int, unsigned int> runs;
+
+	public:
+		// Add a run of pieces, joining it to the runs it touches
+		void add(unsigned int, unsigned int);
+		void add(P2PPieceMap&);
+
+		bool contains(unsigned int);
+		bool isEmpty();
+		bool isComplete(unsigned int);
+		unsigned int countPieces();
+		unsigned int countRuns();
+		void clear();
+
+		// Drop anything past the end of a file of the number of pieces given
+		void trim(unsigned int);
+
+		// Runs as first piece and count - false if the runs couldn't all be read
+		void write(P2PWireWriter&);
+		bool read(P2PWireReader&);
+
+		// Runs as first-last, separated by commas, e.g. 0-15,20-31
+		string toString();
+		bool parse(string);
+};
+
+#endif
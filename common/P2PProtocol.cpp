@@ -0,0 +1,642 @@
+/**
+ * Peer-to-peer wire protocol class
+ */
+
+#include "P2PProtocol.hpp"
+
+int P2PProtocol::preferred_protocol = P2PProtocol::PROTOCOL_BINARY;
+
+/**
+ * Writer
+ */
+
+P2PWireWriter::P2PWireWriter() {}
+
+void P2PWireWriter::putU8(unsigned int value)
+{
+	data.push_back((char)(value & 0xFF));
+}
+
+void P2PWireWriter::putU16(unsigned int value)
+{
+	char bytes[2];
+	P2PProtocol::writeU16(bytes, value);
+	data.append(bytes, 2);
+}
+
+void P2PWireWriter::putU32(unsigned int value)
+{
+	char bytes[4];
+	P2PProtocol::writeU32(bytes, value);
+	data.append(bytes, 4);
+}
+
+void P2PWireWriter::putU64(unsigned long long value)
+{
+	char bytes[8];
+	P2PProtocol::writeU64(bytes, value);
+	data.append(bytes, 8);
+}
+
+void P2PWireWriter::putString(string value)
+{
+	// Strings carry a 16-bit length - paths and names are well under that
+	unsigned int length = min(value.length(), (size_t) 0xFFFF);
+	putU16(length);
+	data.append(value, 0, length);
+}
+
+void P2PWireWriter::putBytes(const char * bytes, unsigned int size)
+{
+	data.append(bytes, size);
+}
+
+string & P2PWireWriter::getData()
+{
+	return data;
+}
+
+/**
+ * Reader
+ */
+
+P2PWireReader::P2PWireReader(const char * data_value, unsigned int length_value)
+{
+	data = data_value;
+	length = length_value;
+	position = 0;
+	b_failed = false;
+}
+
+bool P2PWireReader::take(unsigned int size)
+{
+	if (b_failed || length - position < size)
+	{
+		b_failed = true;
+		return false;
+	}
+
+	return true;
+}
+
+unsigned int P2PWireReader::getU8()
+{
+	if (!take(1)) return 0;
+	return (unsigned char) data[position++];
+}
+
+unsigned int P2PWireReader::getU16()
+{
+	if (!take(2)) return 0;
+	unsigned int value = P2PProtocol::readU16(&data[position]);
+	position += 2;
+	return value;
+}
+
+unsigned int P2PWireReader::getU32()
+{
+	if (!take(4)) return 0;
+	unsigned int value = P2PProtocol::readU32(&data[position]);
+	position += 4;
+	return value;
+}
+
+unsigned long long P2PWireReader::getU64()
+{
+	if (!take(8)) return 0;
+	unsigned long long value = P2PProtocol::readU64(&data[position]);
+	position += 8;
+	return value;
+}
+
+unsigned int P2PWireReader::getFileSize()
+{
+	unsigned long long size = getU64();
+	if (size > P2PCommon::MAX_FILE_SIZE)
+	{
+		b_failed = true;
+		return 0;
+	}
+
+	return (unsigned int) size;
+}
+
+string P2PWireReader::getString()
+{
+	unsigned int size = getU16();
+	if (!take(size)) return "";
+	string value(&data[position], size);
+	position += size;
+	return value;
+}
+
+string P2PWireReader::getBytes(unsigned int size)
+{
+	if (!take(size)) return "";
+	string value(&data[position], size);
+	position += size;
+	return value;
+}
+
+bool P2PWireReader::failed()
+{
+	return b_failed;
+}
+
+unsigned int P2PWireReader::remaining()
+{
+	return b_failed ? 0 : length - position;
+}
+
+/**
+ * Protocol
+ */
+
+void P2PProtocol::setPreferredProtocol(int protocol)
+{
+	preferred_protocol = protocol;
+}
+
+int P2PProtocol::getPreferredProtocol()
+{
+	return preferred_protocol;
+}
+
+int P2PProtocol::parseProtocol(string name)
+{
+	if (name == "text")
+	{
+		return PROTOCOL_TEXT;
+	}
+
+	return PROTOCOL_BINARY;
+}
+
+bool P2PProtocol::isBinary(const char * message, unsigned int length)
+{
+	return (length >= WIRE_HEADER_SIZE && (unsigned char) message[0] == WIRE_MAGIC);
+}
+
+void P2PProtocol::writeHeader(char * buffer, unsigned int type, unsigned int file_id,
+	unsigned long long offset, unsigned int length, unsigned int checksum)
+{
+	buffer[0] = (char) WIRE_MAGIC;
+	buffer[1] = (char) WIRE_VERSION;
+	writeU16(&buffer[2], type);
+	writeU32(&buffer[4], file_id);
+	writeU64(&buffer[8], offset);
+	writeU32(&buffer[16], length);
+	writeU32(&buffer[20], checksum);
+}
+
+bool P2PProtocol::readHeader(const char * message, unsigned int length, P2PWireHeader &header)
+{
+	if (!isBinary(message, length))
+	{
+		return false;
+	}
+
+	header.version = (unsigned char) message[1];
+	header.type = readU16(&message[2]);
+	header.file_id = readU32(&message[4]);
+	header.offset = readU64(&message[8]);
+	header.length = readU32(&message[16]);
+	header.checksum = readU32(&message[20]);
+
+	// Only accept versions we understand, with the payload they claim to carry
+	return (header.version == WIRE_VERSION && header.length == length - WIRE_HEADER_SIZE);
+}
+
+string P2PProtocol::makeMessage(unsigned int type, unsigned int file_id, unsigned long long offset, string payload)
+{
+	char header[WIRE_HEADER_SIZE];
+	writeHeader(header, type, file_id, offset, payload.length(), 0);
+	return string(header, WIRE_HEADER_SIZE) + payload;
+}
+
+string P2PProtocol::encodeAddFiles(string address, int port, vector<FileItem> &files, bool b_content_hashes)
+{
+	if (preferred_protocol == PROTOCOL_TEXT)
+	{
+		// Separate each file with newlines - trackers that know content hashes take the root and piece size too
+		string message = "addFiles\r\n" + address + ":" + to_string(port) + "\r\n";
+		vector<FileItem>::iterator iter;
+		for (iter = files.begin(); iter < files.end(); iter++)
+		{
+			message += (*iter).name + '\t' + to_string((*iter).size) + '\t' + (*iter).path;
+			if (b_content_hashes)
+			{
+				message += '\t' + (*iter).hash + '\t' + to_string((*iter).piece_size);
+			}
+
+			message += "\r\n";
+		}
+
+		return message;
+	}
+
+	// The tracker takes the address from the connection, so only the port goes along
+	P2PWireWriter writer;
+	writer.putU16(port);
+	writer.putU32(files.size());
+
+	vector<FileItem>::iterator iter;
+	for (iter = files.begin(); iter < files.end(); iter++)
+	{
+		writer.putString((*iter).name);
+		writer.putU64((*iter).size);
+		writer.putString((*iter).path);
+	}
+
+	// The roots trail the list, where older trackers never look
+	for (iter = files.begin(); iter < files.end() && b_content_hashes; iter++)
+	{
+		writer.putString((*iter).hash);
+		writer.putU32((*iter).piece_size);
+	}
+
+	return makeMessage(MSG_ADD_FILES, 0, 0, writer.getData());
+}
+
+string P2PProtocol::encodeList()
+{
+	if (preferred_protocol == PROTOCOL_TEXT)
+	{
+		return "list";
+	}
+
+	return makeMessage(MSG_LIST, 0, 0, "");
+}
+
+string P2PProtocol::encodeGetFile(unsigned int file_id)
+{
+	if (preferred_protocol == PROTOCOL_TEXT)
+	{
+		return "getFile\r\n" + to_string(file_id);
+	}
+
+	return makeMessage(MSG_GET_FILE, file_id, 0, "");
+}
+
+string P2PProtocol::encodeLocate(vector<unsigned int> &file_ids, string pattern)
+{
+	if (preferred_protocol == PROTOCOL_TEXT)
+	{
+		// The pattern line may be empty - one file id per line after it
+		string message = "locate\r\n" + pattern;
+		for (unsigned int i = 0; i < file_ids.size(); i++)
+		{
+			message += "\r\n" + to_string(file_ids[i]);
+		}
+
+		return message;
+	}
+
+	P2PWireWriter writer;
+	writer.putString(pattern);
+	writer.putU32(file_ids.size());
+	for (unsigned int i = 0; i < file_ids.size(); i++)
+	{
+		writer.putU32(file_ids[i]);
+	}
+
+	return makeMessage(MSG_LOCATE, 0, 0, writer.getData());
+}
+
+string P2PProtocol::encodeFileRequest(unsigned int file_id, string name, unsigned int size, unsigned int start, unsigned int count)
+{
+	if (preferred_protocol == PROTOCOL_TEXT)
+	{
+		return "fileRequest\r\n" + to_string(file_id)
+			+ "\r\n" + name + "\r\n" + to_string(size)
+			+ "\r\n" + to_string(start) + "\r\n" + to_string(count);
+	}
+
+	P2PWireWriter writer;
+	writer.putU64(size);
+	writer.putU32(start);
+	writer.putU32(count);
+	writer.putString(name);
+
+	return makeMessage(MSG_FILE_REQUEST, file_id, 0, writer.getData());
+}
+
+string P2PProtocol::encodeBlockRequest(unsigned int request_id, unsigned int file_id, string name,
+	unsigned int size, unsigned int start, unsigned int count)
+{
+	if (preferred_protocol == PROTOCOL_TEXT)
+	{
+		return "blockRequest\r\n" + to_string(request_id) + "\r\n" + to_string(file_id)
+			+ "\r\n" + name + "\r\n" + to_string(size)
+			+ "\r\n" + to_string(start) + "\r\n" + to_string(count);
+	}
+
+	P2PWireWriter writer;
+	writer.putU32(request_id);
+	writer.putU64(size);
+	writer.putU32(start);
+	writer.putU32(count);
+	writer.putString(name);
+
+	return makeMessage(MSG_BLOCK_REQUEST, file_id, 0, writer.getData());
+}
+
+string P2PProtocol::encodeBlockCancel(unsigned int request_id, unsigned int file_id)
+{
+	if (preferred_protocol == PROTOCOL_TEXT)
+	{
+		return "blockCancel\r\n" + to_string(request_id);
+	}
+
+	P2PWireWriter writer;
+	writer.putU32(request_id);
+
+	return makeMessage(MSG_BLOCK_CANCEL, file_id, 0, writer.getData());
+}
+
+string P2PProtocol::encodePieceHashRequest(unsigned int file_id, string root)
+{
+	if (preferred_protocol == PROTOCOL_TEXT)
+	{
+		return "pieceHashRequest\r\n" + to_string(file_id) + "\r\n" + root;
+	}
+
+	P2PWireWriter writer;
+	writer.putString(root);
+
+	return makeMessage(MSG_PIECE_HASH_REQUEST, file_id, 0, writer.getData());
+}
+
+string P2PProtocol::encodeHavePieces(string address, int port, map<unsigned int, P2PPieceMap> &files)
+{
+	map<unsigned int, P2PPieceMap>::iterator iter;
+	if (preferred_protocol == PROTOCOL_TEXT)
+	{
+		// A line per file - its id, then its runs of pieces
+		string message = "havePieces\r\n" + address + ":" + to_string(port);
+		for (iter = files.begin(); iter != files.end(); ++iter)
+		{
+			message += "\r\n" + to_string(iter->first) + "\t" + iter->second.toString();
+		}
+
+		return message;
+	}
+
+	// The tracker takes the address from the connection, so only the port goes along
+	P2PWireWriter writer;
+	writer.putU16(port);
+	writer.putU32(files.size());
+	for (iter = files.begin(); iter != files.end(); ++iter)
+	{
+		writer.putU32(iter->first);
+		iter->second.write(writer);
+	}
+
+	return makeMessage(MSG_HAVE_PIECES, 0, 0, writer.getData());
+}
+
+bool P2PProtocol::splitPeerPieces(string &address, P2PPieceMap &pieces)
+{
+	size_t separator = address.find('@');
+	if (separator == string::npos)
+	{
+		return false;
+	}
+
+	pieces.parse(address.substr(separator + 1));
+	address.erase(separator);
+	return true;
+}
+
+string P2PProtocol::encodeBlockReject(int protocol, unsigned int request_id, unsigned int file_id)
+{
+	if (protocol == PROTOCOL_TEXT)
+	{
+		return "blockReject\r\n" + to_string(request_id);
+	}
+
+	P2PWireWriter writer;
+	writer.putU32(request_id);
+
+	return makeMessage(MSG_BLOCK_REJECT, file_id, 0, writer.getData());
+}
+
+string P2PProtocol::encodePieceHashes(int protocol, unsigned int file_id, string root, unsigned long long size,
+	unsigned int piece_size, vector<string> &piece_hashes)
+{
+	if (protocol == PROTOCOL_TEXT)
+	{
+		// One hash per line, in hex
+		string message = "pieceHashes\r\n" + to_string(file_id) + "\r\n" + root
+			+ "\r\n" + to_string(size) + "\r\n" + to_string(piece_size);
+		for (unsigned int i = 0; i < piece_hashes.size(); i++)
+		{
+			message += "\r\n" + P2PSha256::toHex(piece_hashes[i]);
+		}
+
+		return message;
+	}
+
+	P2PWireWriter writer;
+	writer.putString(root);
+	writer.putU64(size);
+	writer.putU32(piece_size);
+	writer.putU32(piece_hashes.size());
+	for (unsigned int i = 0; i < piece_hashes.size(); i++)
+	{
+		writer.putBytes(piece_hashes[i].data(), P2PSha256::DIGEST_SIZE);
+	}
+
+	return makeMessage(MSG_PIECE_HASHES, file_id, 0, writer.getData());
+}
+
+P2PCapabilities P2PProtocol::localCapabilities(unsigned int chunk_size)
+{
+	P2PCapabilities capabilities;
+	capabilities.version = PROTOCOL_VERSION;
+	capabilities.features = FEATURE_BINARY | FEATURE_PIPELINING | FEATURE_LARGE_BLOCKS | FEATURE_LOCATE
+		| FEATURE_CHUNK_RUNS | FEATURE_CONTENT_HASH | FEATURE_PIECE_MAP;
+	capabilities.max_frame_size = P2PFraming::MAX_FRAME_SIZE;
+	capabilities.pipeline_depth = MAX_PIPELINE_DEPTH;
+	capabilities.max_block_chunks = LARGE_BLOCK_CHUNKS;
+	capabilities.chunk_size = chunk_size;
+	capabilities.checksums = CHECKSUM_SUM32 | CHECKSUM_CRC32C | CHECKSUM_XXH3;
+	return capabilities;
+}
+
+P2PCapabilities P2PProtocol::legacyCapabilities(unsigned int chunk_size)
+{
+	// A node that never says hello takes one plain fileRequest at a time
+	P2PCapabilities capabilities;
+	capabilities.version = 1;
+	capabilities.features = 0;
+	capabilities.max_frame_size = P2PFraming::MAX_FRAME_SIZE;
+	capabilities.pipeline_depth = 1;
+	capabilities.max_block_chunks = BASE_BLOCK_CHUNKS;
+	capabilities.chunk_size = chunk_size;
+	capabilities.checksums = CHECKSUM_SUM32;
+	return capabilities;
+}
+
+P2PCapabilities P2PProtocol::negotiate(P2PCapabilities &local, P2PCapabilities &remote)
+{
+	// Only what both ends support, at the smaller of their limits. The chunk size isn't shared:
+	// each end keeps the other's, so a sender cuts chunks to the receiver's size, and a
+	// downloader skips peers whose size differs from its own
+	P2PCapabilities common;
+	common.version = min(local.version, remote.version);
+	common.features = local.features & remote.features;
+	common.max_frame_size = min(local.max_frame_size, remote.max_frame_size);
+	common.pipeline_depth = max(min(local.pipeline_depth, remote.pipeline_depth), 1u);
+	common.max_block_chunks = max(min(local.max_block_chunks, remote.max_block_chunks), 1u);
+	common.chunk_size = remote.chunk_size;
+
+	if (!(common.features & FEATURE_PIPELINING))
+	{
+		common.pipeline_depth = 1;
+	}
+
+	// Compressed chunks only exist as binary messages
+	if (!(common.features & FEATURE_BINARY))
+	{
+		common.features &= ~FEATURE_COMPRESSION;
+	}
+
+	if (!(common.features & FEATURE_LARGE_BLOCKS))
+	{
+		common.max_block_chunks = min(common.max_block_chunks, (unsigned int) BASE_BLOCK_CHUNKS);
+	}
+
+	// Pick the fastest checksum both know - every version knows the sum
+	unsigned int shared_checksums = local.checksums & remote.checksums;
+	common.checksums = CHECKSUM_SUM32;
+	for (unsigned int algorithm = CHECKSUM_SUM32; algorithm != 0 && algorithm <= shared_checksums; algorithm <<= 1)
+	{
+		if (shared_checksums & algorithm)
+			common.checksums = algorithm;
+	}
+
+	return common;
+}
+
+string P2PProtocol::encodeHello(P2PCapabilities &capabilities)
+{
+	if (preferred_protocol == PROTOCOL_TEXT)
+	{
+		return "hello\r\n" + to_string(capabilities.version) + "\r\n" + to_string(capabilities.features)
+			+ "\r\n" + to_string(capabilities.max_frame_size) + "\r\n" + to_string(capabilities.pipeline_depth)
+			+ "\r\n" + to_string(capabilities.max_block_chunks) + "\r\n" + to_string(capabilities.chunk_size)
+			+ "\r\n" + to_string(capabilities.checksums);
+	}
+
+	P2PWireWriter writer;
+	writer.putU16(capabilities.version);
+	writer.putU32(capabilities.features);
+	writer.putU32(capabilities.max_frame_size);
+	writer.putU16(capabilities.pipeline_depth);
+	writer.putU32(capabilities.max_block_chunks);
+	writer.putU32(capabilities.chunk_size);
+	writer.putU32(capabilities.checksums);
+
+	return makeMessage(MSG_HELLO, 0, 0, writer.getData());
+}
+
+bool P2PProtocol::readHello(P2PWireReader &reader, P2PCapabilities &capabilities)
+{
+	capabilities.version = reader.getU16();
+	capabilities.features = reader.getU32();
+	capabilities.max_frame_size = reader.getU32();
+	capabilities.pipeline_depth = reader.getU16();
+	capabilities.max_block_chunks = reader.getU32();
+	capabilities.chunk_size = reader.getU32();
+	capabilities.checksums = reader.getU32();
+
+	// Later versions may append fields - they're ignored
+	return !reader.failed();
+}
+
+string P2PProtocol::describeCapabilities(P2PCapabilities &capabilities)
+{
+	return "v" + to_string(capabilities.version)
+		+ ((capabilities.features & FEATURE_BINARY) ? " binary" : " text")
+		+ ((capabilities.features & FEATURE_COMPRESSION) ? ", compressed" : "")
+		+ ", " + to_string(capabilities.pipeline_depth) + " deep"
+		+ ", blocks of " + to_string(capabilities.max_block_chunks)
+		+ ", checksum " + to_string(capabilities.checksums);
+}
+
+string P2PProtocol::describeReply(string message)
+{
+	// Text replies are already readable
+	P2PWireHeader header;
+	if (!readHeader(message.data(), message.length(), header))
+	{
+		return message;
+	}
+
+	P2PWireReader reader(&message[WIRE_HEADER_SIZE], header.length);
+	if (header.type == MSG_TEXT)
+	{
+		return message.substr(WIRE_HEADER_SIZE);
+	}
+	else if (header.type == MSG_LIST_REPLY)
+	{
+		unsigned int count = reader.getU32();
+		if (count == 0)
+		{
+			return "\r\nThere are currently no files stored on the server.\r\n";
+		}
+
+		string files_message = "\r\nFile Listing:\r\n";
+		for (unsigned int i = 0; i < count && !reader.failed(); i++)
+		{
+			unsigned int file_id = reader.getU32();
+			unsigned long long size = reader.getU64();
+			string name = reader.getString();
+			files_message += "\t" + to_string(file_id) + ") " + name + " - (" + to_string(size) + " B)" "\r\n";
+		}
+
+		return files_message;
+	}
+
+	return "Unexpected reply from the server (type " + to_string(header.type) + ")";
+}
+
+void P2PProtocol::writeU16(char * buffer, unsigned int value)
+{
+	buffer[0] = (char)(value & 0xFF);
+	buffer[1] = (char)((value >> 8) & 0xFF);
+}
+
+void P2PProtocol::writeU32(char * buffer, unsigned int value)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		buffer[i] = (char)((value >> (8 * i)) & 0xFF);
+	}
+}
+
+void P2PProtocol::writeU64(char * buffer, unsigned long long value)
+{
+	for (int i = 0; i < 8; i++)
+	{
+		buffer[i] = (char)((value >> (8 * i)) & 0xFF);
+	}
+}
+
+unsigned int P2PProtocol::readU16(const char * buffer)
+{
+	const unsigned char * bytes = (const unsigned char *) buffer;
+	return bytes[0] | (bytes[1] << 8);
+}
+
+unsigned int P2PProtocol::readU32(const char * buffer)
+{
+	const unsigned char * bytes = (const unsigned char *) buffer;
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int) bytes[3] << 24);
+}
+
+unsigned long long P2PProtocol::readU64(const char * buffer)
+{
+	return (unsigned long long) readU32(buffer) | ((unsigned long long) readU32(&buffer[4]) << 32);
+}
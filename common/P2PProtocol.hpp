@@ -0,0 +1,197 @@
+#ifndef P2PPROTOCOL_H
+#define P2PPROTOCOL_H
+
+using namespace std;
+
+/**
+ * Fixed header in front of every binary message, little-endian on the wire:
+ *	magic (1) + version (1) + type (2) + file id (4) + offset (8) + length (4) + checksum (4) = 24
+ * The magic byte is never the first byte of a text message, so both protocols
+ * can share a connection.
+ */
+typedef struct {
+	unsigned int version;
+	unsigned int type;
+	unsigned int file_id;
+	unsigned long long offset;
+	unsigned int length;
+	unsigned int checksum;
+} P2PWireHeader;
+
+/**
+ * What a node can do, as sent in its hello. Once both hellos are in, each
+ * end works out the same common settings from the pair.
+ */
+typedef struct {
+	unsigned int version;
+	unsigned int features;
+	unsigned int max_frame_size;
+	unsigned int pipeline_depth;
+	unsigned int max_block_chunks;
+	unsigned int chunk_size;
+	unsigned int checksums;
+} P2PCapabilities;
+
+/**
+ * Appends little-endian fields to a message
+ */
+class P2PWireWriter
+{
+	private:
+		string data;
+
+	public:
+		P2PWireWriter();
+		void putU8(unsigned int);
+		void putU16(unsigned int);
+		void putU32(unsigned int);
+		void putU64(unsigned long long);
+		void putString(string);
+		void putBytes(const char *, unsigned int);
+		string & getData();
+};
+
+/**
+ * Reads little-endian fields out of a message in place. Reading past the
+ * end leaves the reader failed, and every later read returns zero.
+ */
+class P2PWireReader
+{
+	private:
+		const char * data;
+		unsigned int length;
+		unsigned int position;
+		bool b_failed;
+
+		bool take(unsigned int);
+
+	public:
+		P2PWireReader(const char *, unsigned int);
+		unsigned int getU8();
+		unsigned int getU16();
+		unsigned int getU32();
+		unsigned long long getU64();
+		string getString();
+
+		// A 64-bit file size - one too large to share fails the read rather than wrapping
+		unsigned int getFileSize();
+		string getBytes(unsigned int);
+		bool failed();
+
+		// Bytes left - fields added to a message later go at the end, where older readers never look
+		unsigned int remaining();
+};
+
+class P2PProtocol
+{
+	private:
+		static int preferred_protocol;
+
+	public:
+		// Wire protocol a node speaks when it starts a conversation - replies follow the request
+		static void setPreferredProtocol(int);
+		static int getPreferredProtocol();
+		static int parseProtocol(string);
+		static bool isBinary(const char *, unsigned int);
+
+		// Headers
+		static void writeHeader(char *, unsigned int, unsigned int, unsigned long long, unsigned int, unsigned int);
+		static bool readHeader(const char *, unsigned int, P2PWireHeader&);
+
+		// Build a whole binary message - header and payload
+		static string makeMessage(unsigned int, unsigned int, unsigned long long, string);
+
+		// Requests, in whichever protocol is preferred
+		static string encodeAddFiles(string, int, vector<FileItem>&, bool);
+		static string encodeList();
+		static string encodeGetFile(unsigned int);
+		static string encodeLocate(vector<unsigned int>&, string);
+		static string encodeFileRequest(unsigned int, string, unsigned int, unsigned int, unsigned int);
+		static string encodeBlockRequest(unsigned int, unsigned int, string, unsigned int, unsigned int, unsigned int);
+		static string encodeBlockCancel(unsigned int, unsigned int);
+		static string encodePieceHashRequest(unsigned int, string);
+
+		// Pieces checked since the last report, by file id - one message for every file
+		static string encodeHavePieces(string, int, map<unsigned int, P2PPieceMap>&);
+
+		// Text replies give a peer part way through a file as address:port@runs - the runs are cut off into the map
+		static bool splitPeerPieces(string&, P2PPieceMap&);
+
+		// Replies, in the protocol of the request
+		static string encodeBlockReject(int, unsigned int, unsigned int);
+		static string encodePieceHashes(int, unsigned int, string, unsigned long long, unsigned int, vector<string>&);
+
+		// Handshake - every connection opens with a hello from each end
+		static P2PCapabilities localCapabilities(unsigned int);
+		static P2PCapabilities legacyCapabilities(unsigned int);
+		static P2PCapabilities negotiate(P2PCapabilities&, P2PCapabilities&);
+		static string encodeHello(P2PCapabilities&);
+		static bool readHello(P2PWireReader&, P2PCapabilities&);
+		static string describeCapabilities(P2PCapabilities&);
+
+		// Turn a reply into something to show the user
+		static string describeReply(string);
+
+		// Little-endian helpers
+		static void writeU16(char *, unsigned int);
+		static void writeU32(char *, unsigned int);
+		static void writeU64(char *, unsigned long long);
+		static unsigned int readU16(const char *);
+		static unsigned int readU32(const char *);
+		static unsigned long long readU64(const char *);
+
+		// Protocols
+		static const int PROTOCOL_BINARY = 0;
+		static const int PROTOCOL_TEXT = 1;
+
+		// Feature level sent in the hello - 1 is a node from before the handshake
+		static const unsigned int PROTOCOL_VERSION = 2;
+
+		// Features
+		static const unsigned int FEATURE_BINARY = 1;       // Binary messages
+		static const unsigned int FEATURE_PIPELINING = 2;   // Block requests with IDs
+		static const unsigned int FEATURE_LARGE_BLOCKS = 4; // Blocks past BASE_BLOCK_CHUNKS
+		static const unsigned int FEATURE_COMPRESSION = 8;  // Compressed chunks
+		static const unsigned int FEATURE_LOCATE = 16;      // Batched tracker lookups
+		static const unsigned int FEATURE_CHUNK_RUNS = 32;  // MSG_CHUNK may carry a run of chunks
+		static const unsigned int FEATURE_CONTENT_HASH = 64; // Files are named by their content root
+		static const unsigned int FEATURE_PIECE_MAP = 128;   // The tracker knows which pieces each peer has
+
+		// Chunk checksum algorithms, fastest last
+		static const unsigned int CHECKSUM_SUM32 = 1;
+		static const unsigned int CHECKSUM_CRC32C = 2;
+		static const unsigned int CHECKSUM_XXH3 = 4;
+
+		// Limits
+		static const unsigned int BASE_BLOCK_CHUNKS = 32;
+		static const unsigned int LARGE_BLOCK_CHUNKS = 1024;
+		static const unsigned int MAX_PIPELINE_DEPTH = 64;
+		static const unsigned int MAX_LOCATE_FILES = 4096;
+
+		// Header layout
+		static const unsigned int WIRE_MAGIC = 0xB2;
+		static const unsigned int WIRE_VERSION = 1;
+		static const unsigned int WIRE_HEADER_SIZE = 24;
+
+		// Message types
+		static const unsigned int MSG_TEXT = 1;          // Human-readable reply
+		static const unsigned int MSG_ADD_FILES = 2;     // port, count, then name, size, path per file - then root, piece size per file
+		static const unsigned int MSG_LIST = 3;          // No payload
+		static const unsigned int MSG_LIST_REPLY = 4;    // count, then id, size, name per file
+		static const unsigned int MSG_GET_FILE = 5;      // File id in the header
+		static const unsigned int MSG_FILE_ADDRESS = 6;  // name, size, count, then address, port per peer - then root, piece size - then piece runs per peer
+		static const unsigned int MSG_FILE_REQUEST = 7;  // size, start chunk, chunk count, name - or root for hashed files
+		static const unsigned int MSG_CHUNK = 8;         // File data at the header's offset - a chunk, or a run of them
+		static const unsigned int MSG_BLOCK_REQUEST = 9; // request id, size, start chunk, chunk count, name or root
+		static const unsigned int MSG_BLOCK_CANCEL = 10; // request id
+		static const unsigned int MSG_BLOCK_REJECT = 11; // request id
+		static const unsigned int MSG_HELLO = 12;        // version, features, max frame, depth, block chunks, chunk size, checksums
+		static const unsigned int MSG_CHUNK_LZ = 13;     // Raw length, then a run of chunks compressed as one LZ4 block
+		static const unsigned int MSG_LOCATE = 14;       // name pattern, count, then file ids
+		static const unsigned int MSG_LOCATE_REPLY = 15; // count, then id, name, size and peers per file - then root, piece size per file - then piece runs per peer
+		static const unsigned int MSG_PIECE_HASH_REQUEST = 16; // root
+		static const unsigned int MSG_PIECE_HASHES = 17; // root, size, piece size, count, then a 32-byte SHA-256 per piece
+		static const unsigned int MSG_HAVE_PIECES = 18;  // port, count, then file id and piece runs per file
+};
+
+#endif
@@ -0,0 +1,70 @@
+/**
+ * Peer-to-peer resolver class
+ */
+
+#include "P2PResolver.hpp"
+
+P2PResolver::P2PResolver()
+{
+	pthread_mutex_init(&cache_lock, NULL);
+	ttl = DEFAULT_TTL;
+}
+
+void P2PResolver::setTTL(unsigned int seconds)
+{
+	ttl = seconds;
+}
+
+bool P2PResolver::resolve(string host, struct in_addr &address)
+{
+	// Dotted addresses need no lookup at all
+	if (inet_pton(AF_INET, host.c_str(), &address) == 1)
+	{
+		return true;
+	}
+
+	// Check the cache
+	time_t now = time(NULL);
+	pthread_mutex_lock(&cache_lock);
+	map<string, P2PResolverEntry>::iterator iter = cache.find(host);
+	if (iter != cache.end() && iter->second.expires > now)
+	{
+		address = iter->second.address;
+		pthread_mutex_unlock(&cache_lock);
+		return true;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	// Look the name up - getaddrinfo is safe to call from any thread
+	struct addrinfo hints;
+	struct addrinfo * results;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host.c_str(), NULL, &hints, &results) != 0 || results == NULL)
+	{
+		return false;
+	}
+
+	address = ((struct sockaddr_in *) results->ai_addr)->sin_addr;
+	freeaddrinfo(results);
+
+	// Remember it for next time
+	P2PResolverEntry entry;
+	entry.address = address;
+	entry.expires = now + ttl;
+
+	pthread_mutex_lock(&cache_lock);
+	cache[host] = entry;
+	pthread_mutex_unlock(&cache_lock);
+
+	return true;
+}
+
+void P2PResolver::clear()
+{
+	pthread_mutex_lock(&cache_lock);
+	cache.clear();
+	pthread_mutex_unlock(&cache_lock);
+}
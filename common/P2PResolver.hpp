@@ -0,0 +1,33 @@
+#ifndef P2PRESOLVER_H
+#define P2PRESOLVER_H
+
+using namespace std;
+
+typedef struct {
+	struct in_addr address;
+	time_t expires;
+} P2PResolverEntry;
+
+/**
+ * Thread-safe host name lookups. Dotted addresses - which is what the
+ * tracker hands out - never leave the caller; names are looked up once
+ * and kept for a while.
+ */
+class P2PResolver
+{
+	private:
+		map<string, P2PResolverEntry> cache;
+		pthread_mutex_t cache_lock;
+		unsigned int ttl;
+
+	public:
+		P2PResolver();
+		void setTTL(unsigned int);
+		bool resolve(string, struct in_addr &);
+		void clear();
+
+		// How long (in seconds) a looked-up name is trusted
+		static const unsigned int DEFAULT_TTL = 300;
+};
+
+#endif
@@ -0,0 +1,287 @@
+/**
+ * Peer-to-peer SHA-256 class
+ */
+
+#include "P2PSha256.hpp"
+
+static const unsigned int SHA256_ROUND_CONSTANTS[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline unsigned int rotateRight32(unsigned int value, int bits)
+{
+	return (value >> bits) | (value << (32 - bits));
+}
+
+P2PSha256Compress P2PSha256::compress_function = P2PSha256::selectCompress();
+
+P2PSha256::P2PSha256()
+{
+	reset();
+}
+
+void P2PSha256::reset()
+{
+	state[0] = 0x6a09e667;
+	state[1] = 0xbb67ae85;
+	state[2] = 0x3c6ef372;
+	state[3] = 0xa54ff53a;
+	state[4] = 0x510e527f;
+	state[5] = 0x9b05688c;
+	state[6] = 0x1f83d9ab;
+	state[7] = 0x5be0cd19;
+	block_length = 0;
+	total_length = 0;
+}
+
+void P2PSha256::compressPortable(unsigned int * state, const unsigned char * data, size_t blocks)
+{
+	for (; blocks > 0; blocks--, data += 64)
+	{
+		// Message schedule - the block is big-endian words
+		unsigned int w[64];
+		for (int i = 0; i < 16; i++)
+		{
+			w[i] = ((unsigned int) data[4 * i] << 24) | ((unsigned int) data[4 * i + 1] << 16)
+				| ((unsigned int) data[4 * i + 2] << 8) | (unsigned int) data[4 * i + 3];
+		}
+
+		for (int i = 16; i < 64; i++)
+		{
+			unsigned int s0 = rotateRight32(w[i - 15], 7) ^ rotateRight32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			unsigned int s1 = rotateRight32(w[i - 2], 17) ^ rotateRight32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		unsigned int a = state[0], b = state[1], c = state[2], d = state[3];
+		unsigned int e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (int i = 0; i < 64; i++)
+		{
+			unsigned int s1 = rotateRight32(e, 6) ^ rotateRight32(e, 11) ^ rotateRight32(e, 25);
+			unsigned int choose = (e & f) ^ (~e & g);
+			unsigned int t1 = h + s1 + choose + SHA256_ROUND_CONSTANTS[i] + w[i];
+			unsigned int s0 = rotateRight32(a, 2) ^ rotateRight32(a, 13) ^ rotateRight32(a, 22);
+			unsigned int majority = (a & b) ^ (a & c) ^ (b & c);
+			unsigned int t2 = s0 + majority;
+
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
+}
+
+void P2PSha256::update(const char * data, size_t size)
+{
+	const unsigned char * bytes = (const unsigned char *) data;
+	total_length += size;
+
+	// Top up a partial block first
+	if (block_length > 0)
+	{
+		size_t take = min(size, (size_t)(64 - block_length));
+		memcpy(&block[block_length], bytes, take);
+		block_length += take;
+		bytes += take;
+		size -= take;
+
+		if (block_length < 64)
+		{
+			return;
+		}
+
+		compress_function(state, block, 1);
+		block_length = 0;
+	}
+
+	// Whole blocks straight from the data
+	if (size >= 64)
+	{
+		compress_function(state, bytes, size / 64);
+		bytes += size & ~(size_t) 63;
+		size &= 63;
+	}
+
+	memcpy(block, bytes, size);
+	block_length = size;
+}
+
+string P2PSha256::finish()
+{
+	// Pad with a one bit, zeros, and the length in bits
+	unsigned long long bit_length = total_length * 8;
+	block[block_length++] = 0x80;
+	if (block_length > 56)
+	{
+		memset(&block[block_length], 0, 64 - block_length);
+		compress_function(state, block, 1);
+		block_length = 0;
+	}
+
+	memset(&block[block_length], 0, 56 - block_length);
+	for (int i = 0; i < 8; i++)
+	{
+		block[56 + i] = (unsigned char)(bit_length >> (56 - 8 * i));
+	}
+	compress_function(state, block, 1);
+
+	char digest[DIGEST_SIZE];
+	for (int i = 0; i < 8; i++)
+	{
+		digest[4 * i] = (char)(state[i] >> 24);
+		digest[4 * i + 1] = (char)(state[i] >> 16);
+		digest[4 * i + 2] = (char)(state[i] >> 8);
+		digest[4 * i + 3] = (char) state[i];
+	}
+
+	reset();
+	return string(digest, DIGEST_SIZE);
+}
+
+string P2PSha256::digest(const char * data, size_t size)
+{
+	P2PSha256 sha;
+	sha.update(data, size);
+	return sha.finish();
+}
+
+string P2PSha256::toHex(const string &digest)
+{
+	static const char HEX_DIGITS[] = "0123456789abcdef";
+
+	string text(digest.length() * 2, '0');
+	for (unsigned int i = 0; i < digest.length(); i++)
+	{
+		text[2 * i] = HEX_DIGITS[(unsigned char) digest[i] >> 4];
+		text[2 * i + 1] = HEX_DIGITS[(unsigned char) digest[i] & 0xF];
+	}
+
+	return text;
+}
+
+bool P2PSha256::fromHex(const string &text, string &digest)
+{
+	if (text.length() != 2 * DIGEST_SIZE)
+	{
+		return false;
+	}
+
+	digest.assign(DIGEST_SIZE, '\0');
+	for (unsigned int i = 0; i < text.length(); i++)
+	{
+		char c = text[i];
+		int nibble;
+		if (c >= '0' && c <= '9')
+			nibble = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			nibble = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			nibble = c - 'A' + 10;
+		else
+			return false;
+
+		digest[i / 2] = (char)((digest[i / 2] << 4) | nibble);
+	}
+
+	return true;
+}
+
+bool P2PSha256::isAccelerated()
+{
+	return (compress_function != &P2PSha256::compressPortable);
+}
+
+P2PSha256Compress P2PSha256::selectCompress()
+{
+#ifdef P2P_SHA256_X86
+	// The SHA extensions are CPUID leaf 7, EBX bit 29 - the rounds also need SSE4.1 and SSSE3
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29))
+		&& __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3"))
+	{
+		return &P2PSha256::compressSHANI;
+	}
+#endif
+
+	return &P2PSha256::compressPortable;
+}
+
+#ifdef P2P_SHA256_X86
+__attribute__((target("sha,sse4.1,ssse3")))
+void P2PSha256::compressSHANI(unsigned int * state, const unsigned char * data, size_t blocks)
+{
+	const __m128i BYTE_SWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	// The instructions want the state as ABEF and CDGH
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	for (; blocks > 0; blocks--, data += 64)
+	{
+		__m128i saved0 = state0;
+		__m128i saved1 = state1;
+		__m128i message[4];
+		for (int i = 0; i < 4; i++)
+		{
+			message[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) &data[16 * i]), BYTE_SWAP);
+		}
+
+		// Sixteen groups of four rounds, extending the schedule as it goes
+		for (int group = 0; group < 16; group++)
+		{
+			__m128i & current = message[group & 3];
+			__m128i rounds = _mm_add_epi32(current,
+				_mm_loadu_si128((const __m128i *) &SHA256_ROUND_CONSTANTS[4 * group]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, rounds);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(rounds, 0x0E));
+
+			if (group >= 3 && group < 15)
+			{
+				// Finish the words four groups ahead
+				__m128i & next = message[(group + 1) & 3];
+				next = _mm_add_epi32(next, _mm_alignr_epi8(current, message[(group + 3) & 3], 4));
+				next = _mm_sha256msg2_epu32(next, current);
+			}
+
+			if (group >= 1 && group < 13)
+			{
+				// Start the words for three groups ahead
+				message[(group + 3) & 3] = _mm_sha256msg1_epu32(message[(group + 3) & 3], current);
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, saved0);
+		state1 = _mm_add_epi32(state1, saved1);
+	}
+
+	// Back to ABCD and EFGH
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	_mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+	_mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
@@ -0,0 +1,57 @@
+#ifndef P2PSHA256_H
+#define P2PSHA256_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define P2P_SHA256_X86 1
+#endif
+
+using namespace std;
+
+// Compresses a run of whole 64-byte blocks into the state
+typedef void (*P2PSha256Compress)(unsigned int *, const unsigned char *, size_t);
+
+/**
+ * SHA-256, fed in pieces of any size. Used for content hashes, where the
+ * chunk checksums aren't strong enough to say two files are the same.
+ * Blocks go through the SHA extensions where the CPU has them.
+ */
+class P2PSha256
+{
+	private:
+		unsigned int state[8];
+		unsigned char block[64];
+		unsigned int block_length;
+		unsigned long long total_length;
+
+		// Runs of whole blocks - the best version is picked at startup
+		static P2PSha256Compress compress_function;
+		static P2PSha256Compress selectCompress();
+		static void compressPortable(unsigned int *, const unsigned char *, size_t);
+#ifdef P2P_SHA256_X86
+		static void compressSHANI(unsigned int *, const unsigned char *, size_t);
+#endif
+
+	public:
+		P2PSha256();
+		void reset();
+		void update(const char *, size_t);
+
+		// The 32-byte digest - the hash starts over afterwards
+		string finish();
+
+		// Digest of one buffer
+		static string digest(const char *, size_t);
+
+		// Digests as text, and back - false if the text isn't a whole digest
+		static string toHex(const string&);
+		static bool fromHex(const string&, string&);
+
+		// Whether the SHA extensions are in use
+		static bool isAccelerated();
+
+		static const unsigned int DIGEST_SIZE = 32;
+};
+
+#endif
@@ -0,0 +1,180 @@
+/**
+ * Peer-to-peer worker thread pool class
+ */
+
+#include "P2PThreadPool.hpp"
+
+__thread P2PThreadPool * P2PThreadPool::current_pool = NULL;
+__thread int P2PThreadPool::current_worker = -1;
+
+P2PThreadPool::P2PThreadPool()
+{
+	num_threads = 0;
+	queue_locks = NULL;
+	pending = 0;
+	active = 0;
+	next_queue = 0;
+	submitted = 0;
+	completed = 0;
+	stolen = 0;
+	pthread_mutex_init(&idle_lock, NULL);
+	pthread_cond_init(&work_available, NULL);
+}
+
+void P2PThreadPool::start(string pool_name, unsigned int threads)
+{
+	name = pool_name;
+	num_threads = max(threads, 1u);
+
+	// Everything is sized up front, so the workers never see a vector move
+	queues.resize(num_threads);
+	queue_locks = new pthread_mutex_t[num_threads];
+	workers.resize(num_threads);
+
+	for (unsigned int i = 0; i < num_threads; i++)
+	{
+		pthread_mutex_init(&queue_locks[i], NULL);
+		workers[i].pool = this;
+		workers[i].index = i;
+	}
+
+	for (unsigned int i = 0; i < num_threads; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, &P2PThreadPool::startWorkerThread, (void *)&workers[i]) != 0)
+		{
+			perror("Error: could not spawn worker thread");
+			exit(1);
+		}
+
+		pthread_detach(thread);
+	}
+}
+
+void P2PThreadPool::submit(void (*run)(void *), void * arg)
+{
+	P2PTask task;
+	task.run = run;
+	task.arg = arg;
+
+	// Workers queue onto their own deque, everyone else spreads tasks round-robin
+	unsigned int index;
+	if (current_pool == this && current_worker >= 0)
+		index = current_worker;
+	else
+		index = __sync_fetch_and_add(&next_queue, 1) % num_threads;
+
+	// Counted under the queue's lock, so no worker can take the task and count it off first
+	pthread_mutex_lock(&queue_locks[index]);
+	__sync_fetch_and_add(&submitted, 1);
+	__sync_fetch_and_add(&pending, 1);
+	queues[index].push_back(task);
+	pthread_mutex_unlock(&queue_locks[index]);
+
+	// Wake a sleeping worker
+	pthread_mutex_lock(&idle_lock);
+	pthread_cond_signal(&work_available);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+bool P2PThreadPool::takeLocal(unsigned int index, P2PTask &task)
+{
+	bool b_found = false;
+
+	// Newest first - its data is most likely still in cache
+	pthread_mutex_lock(&queue_locks[index]);
+	if (!queues[index].empty())
+	{
+		task = queues[index].back();
+		queues[index].pop_back();
+		b_found = true;
+	}
+	pthread_mutex_unlock(&queue_locks[index]);
+
+	return b_found;
+}
+
+bool P2PThreadPool::steal(unsigned int index, P2PTask &task)
+{
+	// Oldest first, from the other end of everyone else's deque
+	for (unsigned int offset = 1; offset < num_threads; offset++)
+	{
+		unsigned int victim = (index + offset) % num_threads;
+		bool b_found = false;
+
+		pthread_mutex_lock(&queue_locks[victim]);
+		if (!queues[victim].empty())
+		{
+			task = queues[victim].front();
+			queues[victim].pop_front();
+			b_found = true;
+		}
+		pthread_mutex_unlock(&queue_locks[victim]);
+
+		if (b_found)
+		{
+			__sync_fetch_and_add(&stolen, 1);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void P2PThreadPool::runWorker(unsigned int index)
+{
+	current_pool = this;
+	current_worker = index;
+
+	P2PTask task;
+	while (true)
+	{
+		if (takeLocal(index, task) || steal(index, task))
+		{
+			__sync_fetch_and_sub(&pending, 1);
+			__sync_fetch_and_add(&active, 1);
+
+			task.run(task.arg);
+
+			__sync_fetch_and_sub(&active, 1);
+			__sync_fetch_and_add(&completed, 1);
+			continue;
+		}
+
+		// Nothing to do - sleep until a task is submitted
+		pthread_mutex_lock(&idle_lock);
+		while (__sync_fetch_and_add(&pending, 0) == 0)
+		{
+			pthread_cond_wait(&work_available, &idle_lock);
+		}
+		pthread_mutex_unlock(&idle_lock);
+	}
+}
+
+void * P2PThreadPool::startWorkerThread(void * arg)
+{
+	P2PWorkerInfo * worker = (P2PWorkerInfo *) arg;
+	worker->pool->runWorker(worker->index);
+	pthread_exit(NULL);
+}
+
+P2PThreadPoolStats P2PThreadPool::getStats()
+{
+	P2PThreadPoolStats stats;
+	stats.threads = num_threads;
+	stats.submitted = __sync_fetch_and_add(&submitted, 0);
+	stats.completed = __sync_fetch_and_add(&completed, 0);
+	stats.stolen = __sync_fetch_and_add(&stolen, 0);
+	stats.queued = __sync_fetch_and_add(&pending, 0);
+	stats.active = __sync_fetch_and_add(&active, 0);
+	return stats;
+}
+
+string P2PThreadPool::describe()
+{
+	P2PThreadPoolStats stats = getStats();
+	return name + ": " + to_string(stats.threads) + " threads, "
+		+ to_string(stats.active) + " active, " + to_string(stats.queued) + " queued, "
+		+ to_string(stats.completed) + " of " + to_string(stats.submitted) + " tasks done, "
+		+ to_string(stats.stolen) + " stolen";
+}
@@ -0,0 +1,72 @@
+#ifndef P2PTHREADPOOL_H
+#define P2PTHREADPOOL_H
+
+using namespace std;
+
+// A task owns its argument - the function is responsible for freeing it
+typedef struct {
+	void (*run)(void *);
+	void * arg;
+} P2PTask;
+
+typedef struct {
+	unsigned int threads;
+	unsigned long submitted;
+	unsigned long completed;
+	unsigned long stolen;
+	unsigned int queued;
+	unsigned int active;
+} P2PThreadPoolStats;
+
+class P2PThreadPool;
+
+typedef struct {
+	P2PThreadPool * pool;
+	unsigned int index;
+} P2PWorkerInfo;
+
+/**
+ * Fixed-size pool of worker threads. Each worker has its own deque: it takes
+ * its newest task first, and steals the oldest task from other workers when idle.
+ */
+class P2PThreadPool
+{
+	private:
+		string name;
+		unsigned int num_threads;
+
+		// One deque and lock per worker
+		vector< deque<P2PTask> > queues;
+		pthread_mutex_t * queue_locks;
+		vector<P2PWorkerInfo> workers;
+
+		// Idle workers sleep here until something is submitted
+		pthread_mutex_t idle_lock;
+		pthread_cond_t work_available;
+
+		// Counters, updated atomically
+		unsigned int pending;
+		unsigned int active;
+		unsigned int next_queue;
+		unsigned long submitted;
+		unsigned long completed;
+		unsigned long stolen;
+
+		bool takeLocal(unsigned int, P2PTask&);
+		bool steal(unsigned int, P2PTask&);
+		void runWorker(unsigned int);
+		static void * startWorkerThread(void *);
+
+		// Index of the pool worker running on this thread, if any
+		static __thread P2PThreadPool * current_pool;
+		static __thread int current_worker;
+
+	public:
+		P2PThreadPool();
+		void start(string, unsigned int);
+		void submit(void (*)(void *), void *);
+		P2PThreadPoolStats getStats();
+		string describe();
+};
+
+#endif
@@ -0,0 +1,242 @@
+/**
+ * Peer-to-peer tokenizer classes
+ */
+
+#include "P2PTokenizer.hpp"
+
+/**
+ * String view
+ */
+
+P2PStringView::P2PStringView()
+{
+	data = "";
+	length = 0;
+}
+
+P2PStringView::P2PStringView(const char * data_value, unsigned int length_value)
+{
+	data = data_value;
+	length = length_value;
+}
+
+P2PStringView::P2PStringView(const string &value)
+{
+	data = value.data();
+	length = value.length();
+}
+
+string P2PStringView::toString() const
+{
+	return string(data, length);
+}
+
+bool P2PStringView::equals(const char * value) const
+{
+	unsigned int value_length = strlen(value);
+	return (value_length == length && memcmp(data, value, length) == 0);
+}
+
+bool P2PStringView::empty() const
+{
+	return (length == 0);
+}
+
+P2PStringView P2PStringView::trim() const
+{
+	// Same whitespace as P2PCommon::trimWhitespace
+	unsigned int first = 0;
+	unsigned int last = length;
+	while (first < last && (data[first] == ' ' || data[first] == '\n' || data[first] == '\r' || data[first] == '\t'))
+		first++;
+	while (last > first && (data[last-1] == ' ' || data[last-1] == '\n' || data[last-1] == '\r' || data[last-1] == '\t'))
+		last--;
+
+	return P2PStringView(data + first, last - first);
+}
+
+bool P2PStringView::toUnsigned(unsigned long long &value) const
+{
+	if (length == 0 || length > 20)
+	{
+		return false;
+	}
+
+	value = 0;
+	for (unsigned int i = 0; i < length; i++)
+	{
+		if (data[i] < '0' || data[i] > '9')
+			return false;
+
+		value = value * 10 + (data[i] - '0');
+	}
+
+	return true;
+}
+
+bool P2PStringView::toInt(int &value) const
+{
+	// Allow a sign, like stoi
+	bool b_negative = (length > 0 && data[0] == '-');
+	unsigned int skip = (length > 0 && (data[0] == '-' || data[0] == '+')) ? 1 : 0;
+
+	unsigned long long magnitude;
+	if (!P2PStringView(data + skip, length - skip).toUnsigned(magnitude) || magnitude > 0x7FFFFFFFULL)
+	{
+		return false;
+	}
+
+	value = b_negative ? -(int) magnitude : (int) magnitude;
+	return true;
+}
+
+/**
+ * Tokenizer
+ */
+
+int P2PTokenizer::scanner = P2PTokenizer::detectScanner();
+const char * (*P2PTokenizer::find_function)(const char *, const char *, char) = NULL;
+
+int P2PTokenizer::detectScanner()
+{
+#ifdef P2P_TOKENIZER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SCANNER_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return SCANNER_SSE2;
+#endif
+
+	return SCANNER_SCALAR;
+}
+
+void P2PTokenizer::setScanner(int requested_scanner)
+{
+	// Never pick something the CPU can't run
+	scanner = min(requested_scanner, detectScanner());
+	find_function = NULL;
+}
+
+int P2PTokenizer::getScanner()
+{
+	return scanner;
+}
+
+string P2PTokenizer::describeScanner(int scanner_value)
+{
+	if (scanner_value == SCANNER_AVX2)
+		return "AVX2";
+	if (scanner_value == SCANNER_SSE2)
+		return "SSE2";
+
+	return "scalar";
+}
+
+const char * P2PTokenizer::findByte(const char * begin, const char * end, char delimiter)
+{
+	if (find_function == NULL)
+	{
+#ifdef P2P_TOKENIZER_X86
+		if (scanner == SCANNER_AVX2)
+			find_function = &P2PTokenizer::findAVX2;
+		else if (scanner == SCANNER_SSE2)
+			find_function = &P2PTokenizer::findSSE2;
+		else
+#endif
+			find_function = &P2PTokenizer::findScalar;
+	}
+
+	return find_function(begin, end, delimiter);
+}
+
+const char * P2PTokenizer::findScalar(const char * begin, const char * end, char delimiter)
+{
+	while (begin < end && *begin != delimiter)
+		begin++;
+
+	return begin;
+}
+
+#ifdef P2P_TOKENIZER_X86
+__attribute__((target("sse2")))
+const char * P2PTokenizer::findSSE2(const char * begin, const char * end, char delimiter)
+{
+	// Compare 16 bytes at a time, then finish off the tail
+	const __m128i pattern = _mm_set1_epi8(delimiter);
+	while (end - begin >= 16)
+	{
+		__m128i block = _mm_loadu_si128((const __m128i *) begin);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern));
+		if (mask != 0)
+			return begin + __builtin_ctz(mask);
+
+		begin += 16;
+	}
+
+	return findScalar(begin, end, delimiter);
+}
+
+__attribute__((target("avx2")))
+const char * P2PTokenizer::findAVX2(const char * begin, const char * end, char delimiter)
+{
+	// Compare 32 bytes at a time, then finish off the tail
+	const __m256i pattern = _mm256_set1_epi8(delimiter);
+	while (end - begin >= 32)
+	{
+		__m256i block = _mm256_loadu_si256((const __m256i *) begin);
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, pattern));
+		if (mask != 0)
+			return begin + __builtin_ctz(mask);
+
+		begin += 32;
+	}
+
+	return findSSE2(begin, end, delimiter);
+}
+#endif
+
+unsigned int P2PTokenizer::split(P2PStringView text, char delimiter, P2PStringView * fields, unsigned int max_fields)
+{
+	const char * position = text.data;
+	const char * end = text.data + text.length;
+	unsigned int count = 0;
+
+	while (position < end && count < max_fields)
+	{
+		const char * next = findByte(position, end, delimiter);
+		fields[count++] = P2PStringView(position, next - position);
+		position = next + 1;
+	}
+
+	return count;
+}
+
+unsigned int P2PTokenizer::split(P2PStringView text, char delimiter, vector<P2PStringView> &fields)
+{
+	const char * position = text.data;
+	const char * end = text.data + text.length;
+	fields.clear();
+
+	while (position < end)
+	{
+		const char * next = findByte(position, end, delimiter);
+		fields.push_back(P2PStringView(position, next - position));
+		position = next + 1;
+	}
+
+	return fields.size();
+}
+
+unsigned int P2PTokenizer::splitLines(P2PStringView text, vector<P2PStringView> &lines)
+{
+	split(text, '\n', lines);
+
+	// Drop the \r left over from each \r\n
+	for (unsigned int i = 0; i < lines.size(); i++)
+	{
+		if (lines[i].length > 0 && lines[i].data[lines[i].length - 1] == '\r')
+			lines[i].length--;
+	}
+
+	return lines.size();
+}
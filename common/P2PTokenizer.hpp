@@ -0,0 +1,74 @@
+#ifndef P2PTOKENIZER_H
+#define P2PTOKENIZER_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define P2P_TOKENIZER_X86 1
+#endif
+
+using namespace std;
+
+/**
+ * A view of characters that live somewhere else - usually the receive buffer.
+ * Nothing is copied until toString() is asked for.
+ */
+class P2PStringView
+{
+	public:
+		const char * data;
+		unsigned int length;
+
+		P2PStringView();
+		P2PStringView(const char *, unsigned int);
+		P2PStringView(const string &);
+
+		string toString() const;
+		bool equals(const char *) const;
+		bool empty() const;
+		P2PStringView trim() const;
+
+		// False unless the whole view is a number
+		bool toUnsigned(unsigned long long &) const;
+		bool toInt(int &) const;
+};
+
+/**
+ * Splits messages into fields without allocating. Delimiters are found with
+ * SSE2 or AVX2 compares where the CPU has them.
+ */
+class P2PTokenizer
+{
+	private:
+		static int scanner;
+		static const char * (*find_function)(const char *, const char *, char);
+
+		static const char * findScalar(const char *, const char *, char);
+#ifdef P2P_TOKENIZER_X86
+		static const char * findSSE2(const char *, const char *, char);
+		static const char * findAVX2(const char *, const char *, char);
+#endif
+
+	public:
+		// First occurrence of the byte, or the end
+		static const char * findByte(const char *, const char *, char);
+
+		// Fields between delimiters, like getline - a trailing empty field is dropped.
+		// The array version stops at the given count; the vector keeps its capacity between calls.
+		static unsigned int split(P2PStringView, char, P2PStringView *, unsigned int);
+		static unsigned int split(P2PStringView, char, vector<P2PStringView>&);
+
+		// Lines split on \n, with the \r of each \r\n trimmed off
+		static unsigned int splitLines(P2PStringView, vector<P2PStringView>&);
+
+		// Scanner selection - the best one the CPU supports is picked at startup
+		static void setScanner(int);
+		static int getScanner();
+		static int detectScanner();
+		static string describeScanner(int);
+
+		static const int SCANNER_SCALAR = 0;
+		static const int SCANNER_SSE2 = 1;
+		static const int SCANNER_AVX2 = 2;
+};
+
+#endif
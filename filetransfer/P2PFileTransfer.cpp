@@ -8,8 +8,31 @@
  * Public Methods
  */
 const string P2PFileTransfer::DATA_FOLDER = "P2PSharedFile";
-
-P2PFileTransfer::P2PFileTransfer() {}
+unsigned int P2PFileTransfer::fixed_piece_size = 0;
+map<unsigned int, P2PDownloadFile> P2PFileTransfer::downloads;
+pthread_mutex_t P2PFileTransfer::downloads_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t P2PFileTransfer::checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+map<int, unsigned int> P2PFileTransfer::closing_descriptors;
+pthread_key_t P2PFileTransfer::backend_key;
+pthread_once_t P2PFileTransfer::backend_key_once = PTHREAD_ONCE_INIT;
+
+P2PFileTransfer::P2PFileTransfer()
+{
+	outbound = NULL;
+	rate_limiter = NULL;
+	protocol = P2PProtocol::PROTOCOL_BINARY;
+	request_id = 0;
+	uploads = NULL;
+	b_compress = false;
+	b_sampled = false;
+	compression_misses = 0;
+	b_chunk_runs = false;
+	chunk_size = CHUNK_SIZE;
+	checksum_algorithm = P2PChecksum::ALGORITHM_SUM32;
+	piece_chunks = 0;
+	result = TRANSFER_SENT;
+	throttle_delay = 0;
+}
 
 void P2PFileTransfer::setBounds(unsigned int start, unsigned int count)
 {
@@ -17,7 +40,129 @@ void P2PFileTransfer::setBounds(unsigned int start, unsigned int count)
 	this->count = count;
 }
 
-void P2PFileTransfer::startTransferFile(FileItem file_item, int socket_id)
+P2PIOBackend & P2PFileTransfer::threadBackend()
+{
+	// Pool workers are long-lived, so each keeps one backend (and ring) for its lifetime
+	pthread_once(&backend_key_once, &P2PFileTransfer::createBackendKey);
+	P2PIOBackend * backend = (P2PIOBackend *) pthread_getspecific(backend_key);
+	if (backend == NULL)
+	{
+		backend = new P2PIOBackend;
+		backend->open();
+		pthread_setspecific(backend_key, backend);
+	}
+
+	return *backend;
+}
+
+void P2PFileTransfer::createBackendKey()
+{
+	pthread_key_create(&backend_key, &P2PFileTransfer::releaseBackend);
+}
+
+void P2PFileTransfer::releaseBackend(void * backend)
+{
+	// Closes the ring and unmaps its queues
+	delete (P2PIOBackend *) backend;
+}
+
+void P2PFileTransfer::setOutbound(P2POutbound * outbound_value)
+{
+	outbound = outbound_value;
+}
+
+void P2PFileTransfer::setProtocol(int protocol_value)
+{
+	protocol = protocol_value;
+}
+
+void P2PFileTransfer::setUpload(unsigned int request_id_value, P2PUploadRegistry * uploads_value)
+{
+	request_id = request_id_value;
+	uploads = uploads_value;
+}
+
+void P2PFileTransfer::setCompression(bool b_compress_value)
+{
+	b_compress = b_compress_value;
+}
+
+void P2PFileTransfer::setChunkRuns(bool b_chunk_runs_value)
+{
+	b_chunk_runs = b_chunk_runs_value;
+}
+
+void P2PFileTransfer::setChunkSize(unsigned int chunk_size_value)
+{
+	chunk_size = (chunk_size_value > 0 && chunk_size_value <= MAX_CHUNK_SIZE) ? chunk_size_value : CHUNK_SIZE;
+}
+
+void P2PFileTransfer::setChecksum(unsigned int algorithm)
+{
+	checksum_algorithm = algorithm;
+}
+
+void P2PFileTransfer::setRateLimiter(P2PRateLimiter * rate_limiter_value)
+{
+	rate_limiter = rate_limiter_value;
+}
+
+unsigned int P2PFileTransfer::getStart()
+{
+	return start;
+}
+
+unsigned int P2PFileTransfer::getCount()
+{
+	return count;
+}
+
+long P2PFileTransfer::getThrottleDelay()
+{
+	return throttle_delay;
+}
+
+bool P2PFileTransfer::isCompressing()
+{
+	return b_compress;
+}
+
+bool P2PFileTransfer::isSendingChunkRuns()
+{
+	return b_chunk_runs;
+}
+
+bool P2PFileTransfer::canSend(int socket_id, int file_id, unsigned int &room)
+{
+	// Nothing goes out while the upload limits are in debt - there's no debt while the node is under them
+	throttle_delay = (rate_limiter != NULL) ? rate_limiter->getDelay(P2PRateLimiter::DIRECTION_UPLOAD, socket_id, file_id) : 0;
+	if (throttle_delay > 0)
+	{
+		result = TRANSFER_THROTTLED;
+		return false;
+	}
+
+	// Or while the peer's queue is full
+	room = outbound->getRoom(socket_id);
+	if (room == 0)
+	{
+		result = TRANSFER_QUEUE_FULL;
+		return false;
+	}
+
+	return true;
+}
+
+void P2PFileTransfer::charge(int socket_id, int file_id, unsigned int bytes)
+{
+	// The frame has gone, so its debt is paid off before the next one
+	if (rate_limiter != NULL)
+	{
+		rate_limiter->reserve(P2PRateLimiter::DIRECTION_UPLOAD, socket_id, file_id, bytes);
+	}
+}
+
+int P2PFileTransfer::startTransferFile(FileItem file_item, int socket_id)
 {
 	// Get the file ID and path
 	int file_id = file_item.file_id;
@@ -36,45 +181,76 @@ void P2PFileTransfer::startTransferFile(FileItem file_item, int socket_id)
 		filename = filename.substr(0, P2PCommon::MAX_FILENAME_LENGTH - 1 - filename_ext.length()) + '.' + filename_ext;
 	}
 
-	// Load in the file bit by bit
-	ifstream input_stream(path, ios::binary);
-	if (input_stream)
+	// Open the file for positional reads
+	int input_descriptor = open(path.c_str(), O_RDONLY);
+	struct stat s;
+	if (input_descriptor >= 0 && fstat(input_descriptor, &s) == 0)
 	{
 		// Get length of file
-		input_stream.seekg(0, input_stream.end);
-		unsigned int length = input_stream.tellg();
+		unsigned int length = s.st_size;
 
 		// Determine number of file chunks
 		unsigned int num_chunks;
-		if (length % FILE_CHUNK_SIZE == 0)
-			num_chunks = length/FILE_CHUNK_SIZE;
+		if (length % chunk_size == 0)
+			num_chunks = length/chunk_size;
 		else
-			num_chunks = length/FILE_CHUNK_SIZE + 1;
+			num_chunks = length/chunk_size + 1;
+
+		// Runs stop at the end of a piece, when the file's pieces are made of whole chunks
+		piece_chunks = 0;
+		if (file_item.piece_size >= chunk_size && file_item.piece_size % chunk_size == 0)
+		{
+			piece_chunks = file_item.piece_size / chunk_size;
+		}
 
-		// Start back at beginning
-		input_stream.seekg(0, input_stream.beg);
+		// Each chunk is read straight into a whole frame, which the outbound queue takes over
+		const bool b_binary = (protocol == P2PProtocol::PROTOCOL_BINARY);
+		const unsigned int MESSAGE_HEADER_SIZE = b_binary ? P2PProtocol::WIRE_HEADER_SIZE : HEADER_SIZE;
+		const unsigned int PAYLOAD_OFFSET = P2PFraming::FRAME_HEADER_SIZE + MESSAGE_HEADER_SIZE;
+		vector<char *> buffers(max((unsigned int) READ_BATCH_CHUNKS, (unsigned int) RUN_CHUNKS));
+		bool b_socket_open = true;
 
-		// Allocate memory for sending data in chunks
-		char * buffer = new char[FILE_CHUNK_SIZE + HEADER_SIZE];
+		// Compressed runs are binary messages
+		if (!b_binary)
+		{
+			b_compress = false;
+		}
 
-		// Read data as blocks
-		unsigned int i = 0;
+		// Read data as blocks - chunks are numbered from 1
+		unsigned int i = 1;
 		unsigned int total = num_chunks;
 
 		if (start > 0 && start <= num_chunks)
 			i = start;
 
-		if (count > 0 && (count+i) <= num_chunks)
-			total = (count+i);
+		if (count > 0 && (i+count-1) <= num_chunks)
+			total = (i+count-1);
 
-		// Start at the proper location
-		if (i > 0)
-			input_stream.seekg((i-1) * FILE_CHUNK_SIZE);
-	
-		while (i <= total)
+		vector<P2PIORequest> requests;
+		result = TRANSFER_SENT;
+		while (i <= total && b_socket_open && result == TRANSFER_SENT)
 		{
-			// Clear out the buffer
-			memset(buffer, 0, FILE_CHUNK_SIZE + HEADER_SIZE);
+			// Stop early if the downloader gave up on this block
+			if (uploads != NULL && uploads->isCancelled(socket_id, request_id))
+			{
+				break;
+			}
+
+			// Once nothing is being compressed, the rest goes out in runs straight from the page cache
+			if (b_binary && b_chunk_runs && !b_compress)
+			{
+				if (sendChunkRuns(input_descriptor, length, i, total, file_id, socket_id, b_socket_open))
+					break;
+
+				b_chunk_runs = false;
+			}
+
+			// Stop where we are when the peer can't take any more yet - the caller picks it up from there
+			unsigned int room;
+			if (!canSend(socket_id, file_id, room))
+			{
+				break;
+			}
 
 			/*
 				Header:
@@ -88,297 +264,687 @@ void P2PFileTransfer::startTransferFile(FileItem file_item, int socket_id)
 			// 8      + 10      + 5       + 12   + 10 + 10 + 8        = 63
 			*/
 
-			// Read in the data to send
-			input_stream.read(&buffer[HEADER_SIZE], FILE_CHUNK_SIZE);
-			int bytes_read = input_stream.gcount();
-
-			// Compute the checksum
-			string checksum = computeChecksum(&buffer[HEADER_SIZE], bytes_read);
-
-			// Prepend the header
-			char header[HEADER_SIZE+1]; // +1 = null terminator
-			sprintf(header, "%12s\r\n%10d\t%5d\t%10d\t%10d\t%8s\r\n", 
-				"fileTransfer", file_id, bytes_read, num_chunks, i, checksum.c_str());
+			// Read in a batch of chunks with a single submission, no more than the queue has room for
+			unsigned int batch = b_compress ? countRunChunks(i, total)
+				: min(min((unsigned int) READ_BATCH_CHUNKS, total - i + 1), room / (PAYLOAD_OFFSET + chunk_size) + 1);
+			requests.clear();
+			for (unsigned int b = 0; b < batch; b++)
+			{
+				buffers[b] = new char[PAYLOAD_OFFSET + chunk_size];
+				requests.push_back(P2PIOBackend::makeRequest(P2PIOBackend::IO_READ, input_descriptor,
+					&buffers[b][PAYLOAD_OFFSET], chunk_size, (off_t)(i + b - 1) * chunk_size, 0));
+			}
 
-			// Copy the header to the buffer
-			memcpy(&buffer[0], header, HEADER_SIZE);
+			threadBackend().submit(requests);
 
-			// Send the data across the wire
-			int bytes_written = write(socket_id, buffer, HEADER_SIZE + bytes_read);
-			if (bytes_written == -1)
+			// The whole batch can go out as one compressed run - one the queue turned away is read again
+			if (b_compress && sendCompressedBatch(buffers, requests, batch, i, file_id, socket_id, b_socket_open))
 			{
-				perror("Error: could not write to socket");
+				if (result == TRANSFER_SENT)
+					i += batch;
+
+				continue;
 			}
 
-			if (bytes_written < HEADER_SIZE + bytes_read)
+			for (unsigned int b = 0; b < batch; b++)
 			{
-				// TO BE HANDLED - when write could not deliver the full payload
+				char * buffer = buffers[b];
+				int bytes_read = max(requests[b].result, 0);
+
+				// Once a frame is turned away the rest of the batch is dropped, and read again next time
+				if (!b_socket_open || result != TRANSFER_SENT)
+				{
+					delete[] buffer;
+					continue;
+				}
+
+				// Prepend the headers
+				P2PFraming::writeFrameHeader(&buffer[0], MESSAGE_HEADER_SIZE + bytes_read);
+				if (b_binary)
+				{
+					P2PProtocol::writeHeader(&buffer[P2PFraming::FRAME_HEADER_SIZE], P2PProtocol::MSG_CHUNK, file_id,
+						(unsigned long long)(i - 1) * chunk_size, bytes_read,
+						P2PChecksum::compute(checksum_algorithm, &buffer[PAYLOAD_OFFSET], bytes_read));
+				}
+				else
+				{
+					// Text headers carry the checksum in hex
+					unsigned int checksum = P2PChecksum::compute(checksum_algorithm, &buffer[PAYLOAD_OFFSET], bytes_read);
+
+					// A field too wide for its column would shift the payload - stop rather than send it
+					char header[HEADER_SIZE+1]; // +1 = null terminator
+					int header_length = snprintf(header, sizeof(header), "%12s\r\n%10d\t%5d\t%10d\t%10d\t%8x\r\n",
+						"fileTransfer", file_id, bytes_read, num_chunks, i, checksum);
+					if (header_length != (int) HEADER_SIZE)
+					{
+						cout << "Error: file transfer header doesn't fit, stopping the transfer" << endl;
+						delete[] buffer;
+						result = TRANSFER_FAILED;
+						continue;
+					}
+					memcpy(&buffer[P2PFraming::FRAME_HEADER_SIZE], header, HEADER_SIZE);
+				}
+
+				// Queue the frame - it's only paid for once it's in
+				int sent = outbound->tryEnqueue(socket_id, buffer, PAYLOAD_OFFSET + bytes_read);
+				if (sent == P2POutbound::SEND_QUEUED)
+				{
+					charge(socket_id, file_id, PAYLOAD_OFFSET + bytes_read);
+					i++;
+				}
+				else if (sent == P2POutbound::SEND_FULL)
+				{
+					delete[] buffer;
+					result = TRANSFER_QUEUE_FULL;
+				}
+				else
+				{
+					cout << "Error: connection closed during file transfer" << endl;
+					b_socket_open = false;
+				}
 			}
+		}
+
+		// Whatever is left is picked up from here
+		start = i;
+		count = (i <= total) ? total - i + 1 : 0;
+
+		// Close the file - the queued frames belong to the outbound queue now
+		close(input_descriptor);
+		return (b_socket_open && i <= total) ? result : TRANSFER_SENT;
+	}
+
+	perror("Error: could not initiate file transfer");
+
+	if (input_descriptor >= 0)
+		close(input_descriptor);
+
+	return TRANSFER_FAILED;
+}
 
-			// If we write too fast, then the messages are sent in one packet
-			usleep(5000);
+bool P2PFileTransfer::sendCompressedBatch(vector<char *> &buffers, vector<P2PIORequest> &requests, unsigned int batch,
+	unsigned int first_chunk, int file_id, int socket_id, bool &b_socket_open)
+{
+	const unsigned int PAYLOAD_OFFSET = P2PFraming::FRAME_HEADER_SIZE + P2PProtocol::WIRE_HEADER_SIZE;
+
+	// Gather the chunks into one run - only the file's last chunk may be short
+	compression_buffer.resize(RUN_CHUNKS * chunk_size);
+	int raw_size = 0;
+	for (unsigned int b = 0; b < batch; b++)
+	{
+		int bytes_read = requests[b].result;
+		if (bytes_read < 0 || (b + 1 < batch && bytes_read != (int) chunk_size))
+		{
+			return false;
+		}
+
+		memcpy(&compression_buffer[raw_size], &buffers[b][PAYLOAD_OFFSET], bytes_read);
+		raw_size += bytes_read;
+	}
+
+	// Judge the transfer by a sample of its first run - already-compressed data is sent as is
+	if (!b_sampled)
+	{
+		b_sampled = true;
+		if (!P2PCompression::isCompressible(&compression_buffer[0], raw_size))
+		{
+			b_compress = false;
+			return false;
+		}
+	}
 
-			// Move to the next chunk
-			input_stream.seekg((i++) * FILE_CHUNK_SIZE);
+	// The run is prefixed with its raw length
+	int bound = P2PCompression::compressBound(raw_size);
+	char * frame = new char[PAYLOAD_OFFSET + 4 + bound];
+	int compressed_size = P2PCompression::compress(&compression_buffer[0], &frame[PAYLOAD_OFFSET + 4], raw_size, bound);
+	if (compressed_size <= 0 || (compressed_size + 4) * 100 > raw_size * (100 - P2PCompression::MIN_SAVINGS_PERCENT))
+	{
+		// Not worth it - send the chunks as they are, and give up after a few misses in a row
+		delete[] frame;
+		if (++compression_misses >= MAX_COMPRESSION_MISSES)
+		{
+			b_compress = false;
 		}
 
-		// Close and deallocate
-		input_stream.close();
-		delete[] buffer;
+		return false;
+	}
+
+	compression_misses = 0;
+	P2PProtocol::writeU32(&frame[PAYLOAD_OFFSET], raw_size);
+	P2PFraming::writeFrameHeader(&frame[0], P2PProtocol::WIRE_HEADER_SIZE + 4 + compressed_size);
+	P2PProtocol::writeHeader(&frame[P2PFraming::FRAME_HEADER_SIZE], P2PProtocol::MSG_CHUNK_LZ, file_id,
+		(unsigned long long)(first_chunk - 1) * chunk_size, 4 + compressed_size,
+		P2PChecksum::compute(checksum_algorithm, &compression_buffer[0], raw_size));
+
+	// The chunk frames aren't needed any more
+	for (unsigned int b = 0; b < batch; b++)
+	{
+		delete[] buffers[b];
+	}
+
+	int sent = outbound->tryEnqueue(socket_id, frame, PAYLOAD_OFFSET + 4 + compressed_size);
+	if (sent == P2POutbound::SEND_QUEUED)
+	{
+		charge(socket_id, file_id, PAYLOAD_OFFSET + 4 + compressed_size);
+	}
+	else if (sent == P2POutbound::SEND_FULL)
+	{
+		delete[] frame;
+		result = TRANSFER_QUEUE_FULL;
 	}
 	else
 	{
-		perror("Error: could not initiate file transfer");
+		cout << "Error: connection closed during file transfer" << endl;
+		b_socket_open = false;
 	}
+
+	return true;
+}
+
+bool P2PFileTransfer::sendChunkRuns(int input_descriptor, unsigned int length, unsigned int &i, unsigned int total,
+	int file_id, int socket_id, bool &b_socket_open)
+{
+	const unsigned int HEADER_LENGTH = P2PFraming::FRAME_HEADER_SIZE + P2PProtocol::WIRE_HEADER_SIZE;
+
+	// The mapping is only read for checksums (and MSG_ZEROCOPY) - sendfile() reads the file itself
+	P2PMappedFile * file = new P2PMappedFile(input_descriptor, length);
+	if (!file->isMapped())
+	{
+		file->release();
+		return false;
+	}
+
+	while (i <= total && b_socket_open)
+	{
+		// Stop early if the downloader gave up on this block
+		if (uploads != NULL && uploads->isCancelled(socket_id, request_id))
+		{
+			break;
+		}
+
+		// Or for now, when the peer can't take any more yet
+		unsigned int room;
+		if (!canSend(socket_id, file_id, room))
+		{
+			break;
+		}
+
+		unsigned int batch = countRunChunks(i, total);
+		off_t offset = (off_t)(i - 1) * chunk_size;
+		unsigned int run_length = min(batch * chunk_size, (unsigned int)(length - offset));
+
+		// Only the headers are written here
+		char * header = new char[HEADER_LENGTH];
+		P2PFraming::writeFrameHeader(&header[0], P2PProtocol::WIRE_HEADER_SIZE + run_length);
+		P2PProtocol::writeHeader(&header[P2PFraming::FRAME_HEADER_SIZE], P2PProtocol::MSG_CHUNK, file_id,
+			offset, run_length, P2PChecksum::compute(checksum_algorithm, &file->getData()[offset], run_length));
+
+		int sent = outbound->tryEnqueueFile(socket_id, header, HEADER_LENGTH, file, offset, run_length);
+		if (sent == P2POutbound::SEND_QUEUED)
+		{
+			charge(socket_id, file_id, HEADER_LENGTH + run_length);
+			i += batch;
+		}
+		else if (sent == P2POutbound::SEND_FULL)
+		{
+			delete[] header;
+			result = TRANSFER_QUEUE_FULL;
+			break;
+		}
+		else
+		{
+			cout << "Error: connection closed during file transfer" << endl;
+			b_socket_open = false;
+		}
+	}
+
+	// Queued regions hold their own references
+	file->release();
+	return true;
 }
 
-void P2PFileTransfer::handleIncomingFileTransfer(FileDataPacket packet)
+unsigned int P2PFileTransfer::countRunChunks(unsigned int i, unsigned int total)
+{
+	// A run never spans two pieces, so the downloader can credit it to a single piece
+	unsigned int batch = min((unsigned int) RUN_CHUNKS, total - i + 1);
+	if (piece_chunks > 0)
+	{
+		batch = min(batch, piece_chunks - (i - 1) % piece_chunks);
+	}
+
+	return batch;
+}
+
+unsigned int P2PFileTransfer::handleIncomingFileTransfer(FileDataPacket packet, unsigned int &first_part)
 {
 	// Get the raw message and file information from the packet
 	FileItem file_item = packet.file_item;
 	char * raw_message = packet.packet;
+	unsigned int checksum_algorithm = packet.checksum;
 
-	// Parse the request
-	vector<string> request = P2PCommon::parseRequest(raw_message);
-	vector<string> header_info = P2PCommon::splitString(request[1], '\t');
+	unsigned long long offset;
+	char * payload;
+	int payload_size;
+	bool b_checksum_matches;
 
-	// Direct the data stream into the correct file
-	string file_id = P2PCommon::trimWhitespace(header_info[0]);
-	int payload_size = stoi(P2PCommon::trimWhitespace(header_info[1]));
-	string total_file_parts = P2PCommon::trimWhitespace(header_info[2]);
-	string file_part = P2PCommon::trimWhitespace(header_info[3]);
-	string checksum = P2PCommon::trimWhitespace(header_info[4]);
+	// Holds a decompressed run until it's written out
+	vector<char> raw_run;
 
-	// Validate the checksum before we do anything
-	string computed_checksum = computeChecksum(&raw_message[HEADER_SIZE], payload_size);
-
-	if (checksum.compare(computed_checksum) != 0)
+	// Only files we're downloading have anywhere to go
+	if (file_item.size == 0)
 	{
-		perror("Error: calculated checksums do not match.");
-		return;
+		cout << "Error: received a chunk for a file we aren't downloading" << endl;
+		return 0;
 	}
 
-	// Ensure we have the data storage folder to work with
-	struct stat s;
-	int file_status = stat(P2PFileTransfer::DATA_FOLDER.c_str(), &s);
-	if (!(file_status == 0 && (s.st_mode & S_IFDIR)))
+	P2PWireHeader header;
+	if (P2PProtocol::readHeader(raw_message, packet.length, header))
 	{
-		if (mkdir(P2PFileTransfer::DATA_FOLDER.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0)
+		// Binary chunks say where they go
+		offset = header.offset;
+		payload = &raw_message[P2PProtocol::WIRE_HEADER_SIZE];
+		payload_size = header.length;
+
+		// A compressed run unpacks into consecutive chunks
+		if (header.type == P2PProtocol::MSG_CHUNK_LZ)
 		{
-			string message = "Error: could not create folder to save data. Create folder called " + P2PFileTransfer::DATA_FOLDER;
-			perror(message.c_str());
-			return;
+			unsigned int raw_size = (payload_size >= 4) ? P2PProtocol::readU32(payload) : 0;
+			if (raw_size == 0 || raw_size > RUN_CHUNKS * CHUNK_SIZE)
+			{
+				cout << "Error: malformed compressed chunk run, dropping it" << endl;
+				return 0;
+			}
+
+			raw_run.resize(raw_size);
+			if (P2PCompression::decompress(&payload[4], &raw_run[0], payload_size - 4, raw_size) != (int) raw_size)
+			{
+				cout << "Error: could not decompress chunk run, dropping it" << endl;
+				return 0;
+			}
+
+			payload = &raw_run[0];
+			payload_size = raw_size;
+		}
+
+		b_checksum_matches = (P2PChecksum::compute(checksum_algorithm, payload, payload_size) == header.checksum);
+	}
+	else
+	{
+		// Parse the header - only the second line is needed, the payload is never scanned
+		P2PStringView request[2];
+		P2PStringView header_info[5];
+		int part_number;
+		if (P2PTokenizer::split(P2PStringView(raw_message, min(packet.length, (unsigned int) HEADER_SIZE)), '\n', request, 2) < 2
+			|| P2PTokenizer::split(request[1], '\t', header_info, 5) < 5
+			|| !header_info[1].trim().toInt(payload_size)
+			|| !header_info[3].trim().toInt(part_number)
+			|| payload_size < 0 || part_number < 1 || HEADER_SIZE + payload_size > packet.length)
+		{
+			cout << "Error: malformed file transfer header, dropping it" << endl;
+			return 0;
 		}
+
+		// Chunks are numbered from 1
+		offset = (unsigned long long)(part_number - 1) * CHUNK_SIZE;
+
+		// The checksum is in hex - compared as a number
+		string checksum_text = header_info[4].trim().toString();
+		char * checksum_end = NULL;
+		unsigned long checksum = strtoul(checksum_text.c_str(), &checksum_end, 16);
+
+		payload = &raw_message[HEADER_SIZE];
+		b_checksum_matches = (checksum_text.length() > 0 && *checksum_end == '\0'
+			&& checksum == P2PChecksum::compute(checksum_algorithm, payload, payload_size));
 	}
 
-	// Construct the download filename
-	string filename = file_id + ".pt." + file_part + ".of." + total_file_parts + ".p2pft";
+	// A message carries a chunk, or a run of them from a peer that agreed to runs, starting on a chunk
+	if (payload_size > (int)(RUN_CHUNKS * CHUNK_SIZE) || offset % CHUNK_SIZE != 0 || offset + payload_size > file_item.size)
+	{
+		cout << "Error: chunk out of bounds, dropping it" << endl;
+		return 0;
+	}
 
-	// Save the piece to this folder
-	string data_filename = P2PFileTransfer::DATA_FOLDER + "/" + filename;
-	std::ofstream outfile(data_filename.c_str(), ios::binary);
-	if (outfile)
+	// Validate the checksum before we do anything
+	if (!b_checksum_matches)
 	{
-		// Write and close
-		outfile.write(&raw_message[HEADER_SIZE], payload_size);
-		outfile.flush();
-		outfile.close();
+		perror("Error: calculated checksums do not match.");
+		return 0;
 	}
-	else
+
+	// Write the chunks straight into place in the download
+	int output_descriptor = acquireDownload(file_item.file_id);
+	if (output_descriptor < 0)
 	{
-		perror("Error: could not open file to write");
+		cout << "Error: received a chunk for a file we aren't downloading" << endl;
+		return 0;
+	}
+
+	vector<P2PIORequest> requests;
+	requests.push_back(P2PIOBackend::makeRequest(P2PIOBackend::IO_WRITE, output_descriptor,
+		payload, payload_size, offset, 0));
+	threadBackend().submit(requests);
+	releaseDownload(file_item.file_id, output_descriptor);
+
+	// Report the run of chunks that was saved
+	unsigned int bytes_written = max(requests[0].result, 0);
+	if (requests[0].result != payload_size)
+	{
+		perror("Error: could not write file chunk");
+	}
+
+	// Only the file's last chunk is short
+	first_part = offset / CHUNK_SIZE + 1;
+	if (bytes_written == (unsigned int) payload_size)
+	{
+		return max(1u, (bytes_written + CHUNK_SIZE - 1) / CHUNK_SIZE);
 	}
+
+	return bytes_written / CHUNK_SIZE;
 }
 
-bool P2PFileTransfer::compileFileParts(FileItem & file_item)
+bool P2PFileTransfer::completeDownload(FileItem & file_item)
 {
-	// Keep track of whether the file is completed
-	bool b_file_completed = false;
-
-	// Compute the total number of parts from the file size
-	unsigned int length = file_item.size;
-	unsigned int num_chunks;
-	if (length % FILE_CHUNK_SIZE == 0)
-		num_chunks = length/FILE_CHUNK_SIZE;
-	else
-		num_chunks = length/FILE_CHUNK_SIZE + 1;
+	// Pieces still missing are listed in ranges - only a file with none is finished
+	if (file_item.missing_pieces.size() > 0)
+	{
+		return false;
+	}
 
-	// Once we've saved the data, analyze to see if we have a full file
-	// Add all files in the directory
-	DIR *directory;
-	struct dirent *ep;
+	// Files shared with their path are saved under the last part of it
+	string filename = file_item.name.substr(file_item.name.find_last_of('/') + 1);
+	string final_filename = P2PFileTransfer::DATA_FOLDER + '/' 
+		+ P2PCommon::renameDuplicateFile(filename, P2PFileTransfer::DATA_FOLDER);
 
-	// Open the directory
-	directory = opendir(P2PFileTransfer::DATA_FOLDER.c_str());
-	if (directory == NULL)
+	// Every chunk is already in place, so the file only has to be moved under its name
+	closeDownload(file_item.file_id);
+	if (rename(downloadPath(file_item.file_id).c_str(), final_filename.c_str()) != 0)
 	{
+		perror("Error: could not move finished download into place");
 		return false;
 	}
 
-	// Get the file information
-	string file_id = to_string(file_item.file_id);
-	string filename = file_item.name;
+	// Notify the user
+	cout << "Your download of \"" << filename << "\" is completed." << endl;
+	file_item.path = final_filename;
+
+	return true;
+}
+
+bool P2PFileTransfer::openDownload(FileItem & file_item, vector<bool> &chunks_received)
+{
+	pthread_mutex_lock(&downloads_lock);
 
-	// Prepare the array 
-	bool pieces_found[num_chunks];
-	for (unsigned int i = 1; i <= num_chunks; i++)
+	// Asking the tracker again for the same file keeps the download going
+	if (downloads.find(file_item.file_id) != downloads.end())
 	{
-		pieces_found[i] = false;
+		pthread_mutex_unlock(&downloads_lock);
+		return true;
 	}
 
-	// See how many parts we have available
-	unsigned int i = 0;
-	while ((ep = readdir(directory)) != NULL && num_chunks >= i)
+	// Ensure we have the data storage folder to work with
+	if (!createDataFolder())
 	{
-		string this_filename = string(ep->d_name);
+		pthread_mutex_unlock(&downloads_lock);
+		return false;
+	}
 
-		// Validate the filename length
-		if (this_filename.length() < 8)
+	string path = downloadPath(file_item.file_id);
+	string journal_path = path + ".resume";
+	P2PResumeJournal * journal = new P2PResumeJournal;
+
+	// A journal from an earlier run carries on where it stopped, as long as the data it vouches for is still there
+	struct stat data_status;
+	if (journal->load(journal_path, file_item, CHUNK_SIZE, chunks_received)
+		&& stat(path.c_str(), &data_status) == 0 && (unsigned long long) data_status.st_size == file_item.size)
+	{
+		int descriptor = open(path.c_str(), O_RDWR);
+		if (descriptor >= 0)
 		{
-			continue;
+			unsigned int chunks_done = std::count(chunks_received.begin(), chunks_received.end(), true);
+			cout << "Resuming the download of \"" << file_item.name << "\" with " << chunks_done
+				<< " of " << chunks_received.size() << " chunks already saved." << endl;
+
+			addDownloadLocked(file_item.file_id, descriptor, path, journal);
+			pthread_mutex_unlock(&downloads_lock);
+			return true;
 		}
+	}
 
-		// Evaluate that each part is there
-		if (this_filename.compare(0, file_id.length() + 1, (file_id + ".").c_str()) == 0
-			&& this_filename.compare(this_filename.length() - 6, 6, ".p2pft") == 0)
-		{
-			// Get the piece number
-			vector<string> pieces = P2PCommon::splitString(this_filename, '.');
+	// Otherwise start over - the empty journal goes in first, so a crash never pairs an old journal with new data
+	chunks_received.clear();
+	if (!journal->create(journal_path, file_item, CHUNK_SIZE))
+	{
+		delete journal;
+		pthread_mutex_unlock(&downloads_lock);
+		return false;
+	}
 
-			// Keep track of found pieces so we can request the missing ones
-			pieces_found[stoi(pieces[2])] = true;
+	int descriptor = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (descriptor < 0)
+	{
+		perror("Error: could not open file to write");
+		delete journal;
+		remove(journal_path.c_str());
+		pthread_mutex_unlock(&downloads_lock);
+		return false;
+	}
 
-			i++;
+	// Reserve the whole file now, so chunks landing anywhere don't fragment it or run out of space half way -
+	// filesystems without fallocate get a sparse file of the right size instead
+	if (file_item.size > 0 && fallocate(descriptor, 0, 0, file_item.size) != 0)
+	{
+		if ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(descriptor, file_item.size) != 0)
+		{
+			perror("Error: could not make room for the download");
+			close(descriptor);
+			delete journal;
+			remove(path.c_str());
+			remove(journal_path.c_str());
+			pthread_mutex_unlock(&downloads_lock);
+			return false;
 		}
 	}
 
-	// If we have all the parts, combine them
-	if (i == num_chunks)
-	{
-		string final_filename = P2PFileTransfer::DATA_FOLDER + '/' 
-			+ P2PCommon::renameDuplicateFile(filename, P2PFileTransfer::DATA_FOLDER);
+	addDownloadLocked(file_item.file_id, descriptor, path, journal);
+	pthread_mutex_unlock(&downloads_lock);
+	return true;
+}
 
-		std::ofstream outfile(final_filename.c_str(), ios::binary);
+void P2PFileTransfer::checkpointDownload(unsigned int file_id, vector<bool> &chunks_received)
+{
+	// One checkpoint at a time, and never while the journal is being closed
+	pthread_mutex_lock(&checkpoint_lock);
+
+	pthread_mutex_lock(&downloads_lock);
+	int descriptor = -1;
+	P2PResumeJournal * journal = NULL;
+	map<unsigned int, P2PDownloadFile>::iterator iter = downloads.find(file_id);
+	if (iter != downloads.end())
+	{
+		iter->second.writers++;
+		descriptor = iter->second.descriptor;
+		journal = iter->second.journal;
+	}
+	pthread_mutex_unlock(&downloads_lock);
 
-		if (outfile)
+	// The chunks were written before they were counted, so once the data is synced the journal can say so
+	if (descriptor >= 0)
+	{
+		if (fdatasync(descriptor) != 0 || !journal->store(chunks_received))
 		{
-			for (i = 1; i <= num_chunks; i++)
-			{
-				// Get the current file to read
-				string this_filename = P2PFileTransfer::DATA_FOLDER + '/' + file_id 
-					+ ".pt." + to_string(i) + ".of." + to_string(num_chunks) + ".p2pft";
+			perror("Error: could not save download progress");
+		}
 
-				// Open the file to read in
-				ifstream input_stream(this_filename, ios::binary);
-				if (input_stream)
-				{
-					// Get length of file
-					input_stream.seekg(0, input_stream.end);
-					unsigned int length = input_stream.tellg();
-					input_stream.seekg(0, input_stream.beg);
-
-					// Allocate memory for transferring data
-					char * buffer = new char[length];
-					input_stream.read(buffer, length);
-
-					// Read the contents of this file into the general file
-					outfile.write(buffer, length);
-					outfile.flush();
-				}
+		releaseDownload(file_id, descriptor);
+	}
 
-				// Delete the unneeded chunk
-				if (remove(this_filename.c_str()) != 0)
-				{
-					perror("Error: Could not remove outdated file chunk");
-				}
-			}
+	pthread_mutex_unlock(&checkpoint_lock);
+}
 
-			// Notify the user
-			cout << "Your download of \"" << filename << "\" is completed." << endl;
-			b_file_completed = true;
-			file_item.path = final_filename;
+void P2PFileTransfer::checkpointTransfers(vector<FileItem> &download_file_list, P2PRequestWindow &request_window)
+{
+	vector<bool> chunks_received;
+	vector<FileItem>::iterator iter;
+	for (iter = download_file_list.begin(); iter < download_file_list.end(); iter++)
+	{
+		if (!(*iter).completed && request_window.getReceivedChunks((*iter).file_id, chunks_received))
+		{
+			checkpointDownload((*iter).file_id, chunks_received);
+		}
+	}
+}
 
-			// Close the output file
-			outfile.close();
+void P2PFileTransfer::closeDownload(unsigned int file_id)
+{
+	pthread_mutex_lock(&checkpoint_lock);
+	pthread_mutex_lock(&downloads_lock);
+
+	map<unsigned int, P2PDownloadFile>::iterator iter = downloads.find(file_id);
+	if (iter != downloads.end())
+	{
+		// The download is finished, so its journal goes
+		delete iter->second.journal;
+		remove((iter->second.path + ".resume").c_str());
+
+		// Chunks still being written close it when they finish
+		if (iter->second.writers > 0)
+		{
+			closing_descriptors[iter->second.descriptor] = iter->second.writers;
 		}
 		else
 		{
-			perror("Error: could not open file to write");
+			close(iter->second.descriptor);
 		}
+
+		downloads.erase(iter);
 	}
-	else
+
+	pthread_mutex_unlock(&downloads_lock);
+	pthread_mutex_unlock(&checkpoint_lock);
+}
+
+bool P2PFileTransfer::createDataFolder()
+{
+	struct stat s;
+	int file_status = stat(P2PFileTransfer::DATA_FOLDER.c_str(), &s);
+	if (!(file_status == 0 && (s.st_mode & S_IFDIR)))
 	{
-		// If we're missing pieces, determine which ones we're missing
-		int start = 0; int count = 0;
-		for (int i = 1; i <= num_chunks; i++)
+		if (mkdir(P2PFileTransfer::DATA_FOLDER.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0)
 		{
-			if (!pieces_found[i] && start < 1)
-			{
-				start = i;
-				count = 1;
-			}
-			else if (!pieces_found[i] && start >= 1)
-			{
-				count++;
-			}
+			string message = "Error: could not create folder to save data. Create folder called " + P2PFileTransfer::DATA_FOLDER;
+			perror(message.c_str());
+			return false;
+		}
+	}
 
-			if ((pieces_found[i] && start >= 1) || (i == num_chunks && start >= 1))
-			{
-				// We have a range - save it so that the peernode can restart the transfer
-				file_item.missing_pieces.push_back(start);
-				file_item.missing_pieces.push_back(count);
-				start = 0;
-				count = 0;
+	return true;
+}
 
-			}
-		}
+string P2PFileTransfer::downloadPath(unsigned int file_id)
+{
+	return P2PFileTransfer::DATA_FOLDER + "/" + to_string(file_id) + ".p2pft";
+}
+
+bool P2PFileTransfer::readDownload(unsigned int file_id, unsigned long long offset, char * buffer, unsigned int length)
+{
+	int descriptor = acquireDownload(file_id);
+	if (descriptor < 0)
+	{
+		return false;
 	}
 
-	// Close the directory
-	closedir(directory);
+	vector<P2PIORequest> requests;
+	requests.push_back(P2PIOBackend::makeRequest(P2PIOBackend::IO_READ, descriptor, buffer, length, offset, 0));
+	threadBackend().submit(requests);
+	releaseDownload(file_id, descriptor);
+
+	return (requests[0].result == (int) length);
+}
 
-	return b_file_completed;
+void P2PFileTransfer::addDownloadLocked(unsigned int file_id, int descriptor, string path, P2PResumeJournal * journal)
+{
+	P2PDownloadFile & download = downloads[file_id];
+	download.descriptor = descriptor;
+	download.path = path;
+	download.writers = 0;
+	download.journal = journal;
 }
 
-string P2PFileTransfer::computeChecksum(char * data, int size)
+int P2PFileTransfer::acquireDownload(unsigned int file_id)
 {
-	unsigned int checksum = 0;
-	unsigned int value = 0;
-	int i = 0;
-	while (i < size)
+	pthread_mutex_lock(&downloads_lock);
+
+	// Late chunks for a finished download have nowhere to go
+	int descriptor = -1;
+	map<unsigned int, P2PDownloadFile>::iterator iter = downloads.find(file_id);
+	if (iter != downloads.end())
 	{
-		// Add on the next value
-		value <<= 8;
-		value |= data[i];
+		iter->second.writers++;
+		descriptor = iter->second.descriptor;
+	}
 
-		// If we have a full value, add it to the checksum
-		if ((i+1)%4 == 0)
-		{
-			checksum += value;
-			checksum += (checksum <= value) ? 1 : 0; // Overflow -> Wraparound, add 1 bit
-			value = 0;
-		}
+	pthread_mutex_unlock(&downloads_lock);
+	return descriptor;
+}
+
+void P2PFileTransfer::releaseDownload(unsigned int file_id, int descriptor)
+{
+	pthread_mutex_lock(&downloads_lock);
+
+	map<unsigned int, P2PDownloadFile>::iterator iter = downloads.find(file_id);
+	if (iter != downloads.end() && iter->second.descriptor == descriptor)
+	{
+		iter->second.writers--;
+	}
+	else if (--closing_descriptors[descriptor] == 0)
+	{
+		// The last writer of a closed download
+		close(descriptor);
+		closing_descriptors.erase(descriptor);
+	}
+
+	pthread_mutex_unlock(&downloads_lock);
+}
 
-		// Move to the next iteration
-		i++;
+unsigned int P2PFileTransfer::choosePieceSize(unsigned int file_size)
+{
+	if (fixed_piece_size > 0)
+	{
+		return fixed_piece_size;
+	}
+
+	// The smallest power of two that keeps the file near TARGET_PIECES
+	unsigned int piece_size = MIN_PIECE_SIZE;
+	while (piece_size < MAX_PIECE_SIZE && file_size / piece_size > TARGET_PIECES)
+	{
+		piece_size <<= 1;
 	}
 
-	// Handle leftover values
-	if (value > 0)
+	return piece_size;
+}
+
+void P2PFileTransfer::setPieceSize(unsigned int piece_size)
+{
+	// Rounded up to a power of two in range, so a piece is always whole chunks - 0 picks by file size
+	fixed_piece_size = 0;
+	if (piece_size > 0)
 	{
-		checksum += value;
-		checksum += (checksum <= value) ? 1 : 0; 
+		fixed_piece_size = MIN_PIECE_SIZE;
+		while (fixed_piece_size < MAX_PIECE_SIZE && fixed_piece_size < piece_size)
+		{
+			fixed_piece_size <<= 1;
+		}
 	}
+}
 
-	// Convert the checksum to hex and return as a string
-	stringstream sstream;
-	sstream << hex << checksum;
-	return sstream.str();
+unsigned int P2PFileTransfer::countPieces(FileItem & file_item)
+{
+	unsigned int piece_size = (file_item.piece_size > 0) ? file_item.piece_size : choosePieceSize(file_item.size);
+	return max(1u, (unsigned int)(((unsigned long long) file_item.size + piece_size - 1) / piece_size));
 }
 
-void P2PFileTransfer::reviewTransfers(vector<FileItem> &download_file_list)
+void P2PFileTransfer::reviewTransfers(vector<FileItem> &download_file_list, P2PRequestWindow &request_window)
 {
-	bool b_file_completed = false;
 	vector<FileItem>::iterator iter;
 	for (iter = download_file_list.begin(); iter < download_file_list.end(); iter++)
 	{
@@ -388,7 +954,13 @@ void P2PFileTransfer::reviewTransfers(vector<FileItem> &download_file_list)
 			continue;
 		}
 
-		// Compile the file's parts
-		(*iter).completed = compileFileParts(*iter);
+		// The request window knows which pieces are in - the file is done once they all are
+		if (request_window.getMissingPieces((*iter).file_id, (*iter).missing_pieces))
+		{
+			(*iter).completed = completeDownload(*iter);
+		}
 	}
+
+	// Record what the rest have so far, in case we're stopped before they finish
+	checkpointTransfers(download_file_list, request_window);
 }
@@ -3,6 +3,14 @@
 
 using namespace std;
 
+// A download in progress - one preallocated file that every chunk is written into, and its journal
+typedef struct {
+	int descriptor;
+	string path;
+	unsigned int writers;
+	P2PResumeJournal * journal;
+} P2PDownloadFile;
+
 class P2PFileTransfer
 {
 	private:
@@ -10,20 +18,140 @@ class P2PFileTransfer
 		unsigned int start;
 		unsigned int count;
 
+		// Chunk reads and writes go through this thread's backend, released when the thread exits
+		static P2PIOBackend & threadBackend();
+		static void createBackendKey();
+		static void releaseBackend(void *);
+		static pthread_key_t backend_key;
+		static pthread_once_t backend_key_once;
+
+		// Size of the chunks this session sends - whatever the peer cuts files into
+		unsigned int chunk_size;
+
+		// Checksum algorithm agreed with the peer in the hello
+		unsigned int checksum_algorithm;
+
+		// Piece size to use for every file instead of picking one from its size, or 0
+		static unsigned int fixed_piece_size;
+
+		// Open downloads by file id, shared by every chunk worker
+		static map<unsigned int, P2PDownloadFile> downloads;
+		static pthread_mutex_t downloads_lock;
+
+		// A writer holds the descriptor open until it's done with it, even once the download is closed
+		static map<int, unsigned int> closing_descriptors;
+		static int acquireDownload(unsigned int);
+		static void releaseDownload(unsigned int, int);
+		static void addDownloadLocked(unsigned int, int, string, P2PResumeJournal *);
+
+		// Held while the journals are written out, so none is closed under a checkpoint
+		static pthread_mutex_t checkpoint_lock;
+
+		// Frames are sent through the node's outbound queues, as fast as the upload limits allow.
+		// Nothing waits for either - the transfer stops where it is, and says why.
+		P2POutbound * outbound;
+		P2PRateLimiter * rate_limiter;
+		int result;
+		long throttle_delay;
+
+		bool canSend(int, int, unsigned int&);
+		void charge(int, int, unsigned int);
+
+		// Protocol the chunks are sent in - whatever the request came in
+		int protocol;
+
+		// Block request being served, so the downloader can cancel it
+		unsigned int request_id;
+		P2PUploadRegistry * uploads;
+
+		// Chunk runs are compressed until they stop paying off
+		bool b_compress;
+		bool b_sampled;
+		unsigned int compression_misses;
+		vector<char> compression_buffer;
+
+		bool sendCompressedBatch(vector<char *>&, vector<P2PIORequest>&, unsigned int, unsigned int, int, int, bool&);
+
+		// The peer takes runs of chunks in one message, which are sent from the page cache
+		bool b_chunk_runs;
+
+		bool sendChunkRuns(int, unsigned int, unsigned int&, unsigned int, int, int, bool&);
+
+		// Chunks in the file's pieces, when they're made of whole chunks, or 0
+		unsigned int piece_chunks;
+
+		unsigned int countRunChunks(unsigned int, unsigned int);
+
 	public:
 		P2PFileTransfer();
 
 		void setBounds(unsigned int, unsigned int);
-		void startTransferFile(FileItem, int);
-		void handleIncomingFileTransfer(FileDataPacket);
-		string computeChecksum(char *, int);
-		void reviewTransfers(vector<FileItem>&);
-		bool compileFileParts(FileItem&);
-
-		// File transfer
-		static const unsigned int FILE_CHUNK_SIZE = 449;
+		void setOutbound(P2POutbound *);
+		void setProtocol(int);
+		void setUpload(unsigned int, P2PUploadRegistry *);
+		void setCompression(bool);
+		void setChunkRuns(bool);
+		void setChunkSize(unsigned int);
+		void setChecksum(unsigned int);
+		void setRateLimiter(P2PRateLimiter *);
+		int startTransferFile(FileItem, int);
+
+		// Where a transfer that stopped early picks up again, and what it was sending with
+		unsigned int getStart();
+		unsigned int getCount();
+		long getThrottleDelay();
+		bool isCompressing();
+		bool isSendingChunkRuns();
+		unsigned int handleIncomingFileTransfer(FileDataPacket, unsigned int&);
+		void reviewTransfers(vector<FileItem>&, P2PRequestWindow&);
+		bool completeDownload(FileItem&);
+		void checkpointTransfers(vector<FileItem>&, P2PRequestWindow&);
+
+		// Downloads - created at full size up front, or picked up from their journal, and renamed into place when done
+		static bool openDownload(FileItem&, vector<bool>&);
+		static void checkpointDownload(unsigned int, vector<bool>&);
+		static void closeDownload(unsigned int);
+		static string downloadPath(unsigned int);
+
+		// Make the data folder if it isn't there yet
+		static bool createDataFolder();
+
+		// Read back part of a download, e.g. a whole piece to check it against its hash
+		static bool readDownload(unsigned int, unsigned long long, char *, unsigned int);
+
+		// Pieces - the unit a download is tracked and stored in
+		static unsigned int choosePieceSize(unsigned int);
+		static void setPieceSize(unsigned int);
+		static unsigned int countPieces(FileItem&);
+
+		// How a transfer ended - the last two stopped early, and can be started again from getStart()
+		static const int TRANSFER_SENT = 0;
+		static const int TRANSFER_FAILED = 1;
+		static const int TRANSFER_QUEUE_FULL = 2;
+		static const int TRANSFER_THROTTLED = 3;
+
+		// File transfer - pieces are sent as chunks of CHUNK_SIZE
+		static const unsigned int CHUNK_SIZE = 16 * 1024;
 		static const unsigned int HEADER_SIZE = 63;
 
+		// Chunk size of nodes from before pieces, which still get served in it, and the largest served
+		static const unsigned int LEGACY_CHUNK_SIZE = 449;
+		static const unsigned int MAX_CHUNK_SIZE = 64 * 1024;
+
+		// Pieces are a power of two in this range, picked so a file has about TARGET_PIECES
+		static const unsigned int MIN_PIECE_SIZE = 256 * 1024;
+		static const unsigned int MAX_PIECE_SIZE = 16 * 1024 * 1024;
+		static const unsigned int TARGET_PIECES = 1024;
+
+		// Number of chunks read from disk in a single submission
+		static const unsigned int READ_BATCH_CHUNKS = 16;
+
+		// Chunks sent together as one run, compressed or straight from the page cache
+		static const unsigned int RUN_CHUNKS = 16;
+
+		// Compressed runs in a row that may fail to shrink before we stop trying
+		static const unsigned int MAX_COMPRESSION_MISSES = 4;
+
 		// Data folder
 		static const string DATA_FOLDER;
 };
@@ -0,0 +1,184 @@
+/**
+ * Peer-to-peer hash cache class
+ */
+
+#include "P2PHashCache.hpp"
+
+static const char HASH_CACHE_MAGIC[8] = { 'P', '2', 'P', 'H', 'A', 'S', 'H', '\0' };
+
+P2PHashCache::P2PHashCache()
+{
+	b_modified = false;
+	pthread_mutex_init(&cache_lock, NULL);
+}
+
+string P2PHashCache::makeKey(struct stat &status)
+{
+	// A file rewritten in place gets a new modification time, down to the nanosecond
+	P2PWireWriter writer;
+	writer.putU64(status.st_dev);
+	writer.putU64(status.st_ino);
+	writer.putU64(status.st_size);
+	writer.putU64(status.st_mtim.tv_sec);
+	writer.putU32(status.st_mtim.tv_nsec);
+	return writer.getData();
+}
+
+void P2PHashCache::load(string path_value)
+{
+	path = path_value;
+	entries.clear();
+	b_modified = false;
+
+	ifstream input(path.c_str(), ios::in | ios::binary);
+	if (!input)
+	{
+		return;
+	}
+
+	stringstream contents;
+	contents << input.rdbuf();
+	string data = contents.str();
+
+	// The magic and version, the number of entries, then each key with its piece size and hashes
+	if (data.length() < sizeof(HASH_CACHE_MAGIC) || memcmp(data.data(), HASH_CACHE_MAGIC, sizeof(HASH_CACHE_MAGIC)) != 0)
+	{
+		cout << "Error: " << path << " isn't a hash cache, starting a new one" << endl;
+		return;
+	}
+
+	P2PWireReader reader(&data[sizeof(HASH_CACHE_MAGIC)], data.length() - sizeof(HASH_CACHE_MAGIC));
+	if (reader.getU32() != VERSION)
+	{
+		return;
+	}
+
+	unsigned int count = reader.getU32();
+	for (unsigned int i = 0; i < count && !reader.failed(); i++)
+	{
+		string key = reader.getString();
+		P2PHashCacheEntry entry;
+		entry.piece_size = reader.getU32();
+
+		unsigned int leaf_count = reader.getU32();
+		for (unsigned int l = 0; l < leaf_count && !reader.failed(); l++)
+		{
+			entry.leaves.push_back(reader.getBytes(P2PSha256::DIGEST_SIZE));
+		}
+
+		if (!reader.failed())
+		{
+			entries[key] = entry;
+		}
+	}
+}
+
+bool P2PHashCache::save()
+{
+	pthread_mutex_lock(&cache_lock);
+
+	if (!b_modified || path.length() == 0)
+	{
+		pthread_mutex_unlock(&cache_lock);
+		return true;
+	}
+
+	P2PWireWriter writer;
+	writer.putBytes(HASH_CACHE_MAGIC, sizeof(HASH_CACHE_MAGIC));
+	writer.putU32(VERSION);
+	writer.putU32(entries.size());
+
+	map<string, P2PHashCacheEntry>::iterator iter;
+	for (iter = entries.begin(); iter != entries.end(); ++iter)
+	{
+		writer.putString(iter->first);
+		writer.putU32(iter->second.piece_size);
+		writer.putU32(iter->second.leaves.size());
+		for (unsigned int l = 0; l < iter->second.leaves.size(); l++)
+		{
+			writer.putBytes(iter->second.leaves[l].data(), P2PSha256::DIGEST_SIZE);
+		}
+	}
+
+	// Write it all out beside the old cache, then swap it in
+	string temporary_path = path + ".tmp";
+	string & data = writer.getData();
+	int descriptor = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	bool b_saved = (descriptor >= 0);
+
+	size_t done = 0;
+	while (b_saved && done < data.length())
+	{
+		ssize_t bytes_written = write(descriptor, &data[done], data.length() - done);
+		if (bytes_written < 0 && errno == EINTR)
+			continue;
+
+		b_saved = (bytes_written > 0);
+		done += max(bytes_written, (ssize_t) 0);
+	}
+
+	if (descriptor >= 0)
+	{
+		b_saved = (fsync(descriptor) == 0 && b_saved);
+		::close(descriptor);
+	}
+
+	if (!b_saved || rename(temporary_path.c_str(), path.c_str()) != 0)
+	{
+		perror("Error: could not save the hash cache");
+		unlink(temporary_path.c_str());
+		pthread_mutex_unlock(&cache_lock);
+		return false;
+	}
+
+	b_modified = false;
+	pthread_mutex_unlock(&cache_lock);
+	return true;
+}
+
+bool P2PHashCache::lookup(struct stat &status, unsigned int piece_size, vector<string> &leaves)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	// Hashes of the same file cut another way are no use
+	map<string, P2PHashCacheEntry>::iterator iter = entries.find(makeKey(status));
+	bool b_found = (iter != entries.end() && iter->second.piece_size == piece_size);
+	if (b_found)
+	{
+		leaves = iter->second.leaves;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+	return b_found;
+}
+
+void P2PHashCache::store(struct stat &status, unsigned int piece_size, vector<string> &leaves)
+{
+	P2PHashCacheEntry entry;
+	entry.piece_size = piece_size;
+	entry.leaves = leaves;
+
+	// A file that changed since it was last hashed replaces its old entry, so the cache doesn't grow with every edit
+	string key = makeKey(status);
+	string file_key = key.substr(0, FILE_KEY_LENGTH);
+
+	pthread_mutex_lock(&cache_lock);
+	map<string, P2PHashCacheEntry>::iterator iter = entries.lower_bound(file_key);
+	while (iter != entries.end() && iter->first.compare(0, FILE_KEY_LENGTH, file_key) == 0)
+	{
+		entries.erase(iter++);
+	}
+
+	entries[key] = entry;
+	b_modified = true;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+unsigned int P2PHashCache::countEntries()
+{
+	pthread_mutex_lock(&cache_lock);
+	unsigned int count = entries.size();
+	pthread_mutex_unlock(&cache_lock);
+
+	return count;
+}
@@ -0,0 +1,51 @@
+#ifndef P2PHASHCACHE_H
+#define P2PHASHCACHE_H
+
+using namespace std;
+
+// Piece hashes of a file as it was when it was hashed
+typedef struct {
+	unsigned int piece_size;
+	vector<string> leaves;
+} P2PHashCacheEntry;
+
+/**
+ * Piece hashes of files shared before, kept on disk between runs. Entries
+ * are keyed by the file's device, inode, size and modification time, so a
+ * file that hasn't changed is never read again, and one that has is simply
+ * missed. Each file keeps only its latest entry. The cache is written to a new file that's renamed over the old
+ * one, so a crash leaves one or the other and never half of each.
+ */
+class P2PHashCache
+{
+	private:
+		string path;
+		map<string, P2PHashCacheEntry> entries;
+		pthread_mutex_t cache_lock;
+		bool b_modified;
+
+		static string makeKey(struct stat&);
+
+		// Keys start with the device and inode, so every entry of one file sits together
+		static const unsigned int FILE_KEY_LENGTH = 16;
+
+	public:
+		P2PHashCache();
+
+		// Read the cache at the path given - a missing or unreadable one starts empty
+		void load(string);
+
+		// Write it back, if anything was added since it was loaded
+		bool save();
+
+		// The piece hashes of an unchanged file, cut into pieces of the size given - false if it isn't cached
+		bool lookup(struct stat&, unsigned int, vector<string>&);
+		void store(struct stat&, unsigned int, vector<string>&);
+
+		unsigned int countEntries();
+
+		// Layout
+		static const unsigned int VERSION = 1;
+};
+
+#endif
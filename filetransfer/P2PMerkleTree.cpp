@@ -0,0 +1,108 @@
+/**
+ * Peer-to-peer Merkle tree class
+ */
+
+#include "P2PMerkleTree.hpp"
+
+P2PMerkleTree::P2PMerkleTree()
+{
+	size = 0;
+	piece_size = 0;
+}
+
+bool P2PMerkleTree::setLeaves(unsigned long long size_value, unsigned int piece_size_value, vector<string> &piece_hashes)
+{
+	// The root comes from the hashes, so they can't fail to add up to it
+	return setLeaves(size_value, piece_size_value, piece_hashes, P2PSha256::toHex(computeRoot(piece_hashes)));
+}
+
+bool P2PMerkleTree::setLeaves(unsigned long long size_value, unsigned int piece_size_value, vector<string> &piece_hashes, string root_value)
+{
+	size = size_value;
+	piece_size = piece_size_value;
+	if (piece_size == 0 || piece_hashes.size() != countPieces())
+	{
+		return false;
+	}
+
+	for (unsigned int i = 0; i < piece_hashes.size(); i++)
+	{
+		if (piece_hashes[i].length() != P2PSha256::DIGEST_SIZE)
+			return false;
+	}
+
+	if (P2PSha256::toHex(computeRoot(piece_hashes)) != root_value)
+	{
+		return false;
+	}
+
+	leaves = piece_hashes;
+	root = root_value;
+	return true;
+}
+
+bool P2PMerkleTree::verifyPiece(unsigned int piece, const char * data, size_t length)
+{
+	return (piece < leaves.size() && P2PSha256::digest(data, length) == leaves[piece]);
+}
+
+string P2PMerkleTree::getRoot()
+{
+	return root;
+}
+
+vector<string> & P2PMerkleTree::getLeaves()
+{
+	return leaves;
+}
+
+unsigned long long P2PMerkleTree::getSize()
+{
+	return size;
+}
+
+unsigned int P2PMerkleTree::getPieceSize()
+{
+	return piece_size;
+}
+
+unsigned int P2PMerkleTree::countPieces()
+{
+	// Even an empty file has a piece, so it has a hash
+	return max(1ULL, (size + piece_size - 1) / piece_size);
+}
+
+string P2PMerkleTree::computeRoot(vector<string> &piece_hashes)
+{
+	if (piece_hashes.size() == 0)
+	{
+		return string(P2PSha256::DIGEST_SIZE, '\0');
+	}
+
+	// Pad to a power of two, then hash each pair until one is left
+	unsigned int width = 1;
+	while (width < piece_hashes.size())
+	{
+		width <<= 1;
+	}
+
+	vector<string> level = piece_hashes;
+	level.resize(width, string(P2PSha256::DIGEST_SIZE, '\0'));
+	while (level.size() > 1)
+	{
+		for (unsigned int i = 0; i < level.size() / 2; i++)
+		{
+			level[i] = P2PSha256::digest((level[2 * i] + level[2 * i + 1]).data(), 2 * P2PSha256::DIGEST_SIZE);
+		}
+
+		level.resize(level.size() / 2);
+	}
+
+	return level[0];
+}
+
+unsigned int P2PMerkleTree::defaultThreads()
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cores > 0) ? cores : 1;
+}
@@ -0,0 +1,46 @@
+#ifndef P2PMERKLETREE_H
+#define P2PMERKLETREE_H
+
+using namespace std;
+
+/**
+ * Content hash of a file: the SHA-256 of each piece, paired up into a tree
+ * whose root names the file. The leaves are padded with zero hashes to a
+ * power of two, and a file of one piece has that piece's hash as its root.
+ * A downloader gets the piece hashes from a peer, checks that they add up
+ * to the root the tracker gave, and then checks every piece against them.
+ */
+class P2PMerkleTree
+{
+	private:
+		unsigned long long size;
+		unsigned int piece_size;
+		vector<string> leaves;
+		string root;
+
+	public:
+		P2PMerkleTree();
+
+		// Take piece hashes worked out here, from the file itself - false unless there's one per piece
+		bool setLeaves(unsigned long long, unsigned int, vector<string>&);
+
+		// Take piece hashes sent by a peer - false unless they add up to the root, in hex
+		bool setLeaves(unsigned long long, unsigned int, vector<string>&, string);
+
+		// Whether a piece's data matches its hash
+		bool verifyPiece(unsigned int, const char *, size_t);
+
+		string getRoot();
+		vector<string> & getLeaves();
+		unsigned long long getSize();
+		unsigned int getPieceSize();
+		unsigned int countPieces();
+
+		// Root of a list of piece hashes
+		static string computeRoot(vector<string>&);
+
+		// Threads to hash with - one per core
+		static unsigned int defaultThreads();
+};
+
+#endif
@@ -0,0 +1,162 @@
+/**
+ * Peer-to-peer resume journal class
+ */
+
+#include "P2PResumeJournal.hpp"
+
+static const char RESUME_MAGIC[8] = { 'P', '2', 'P', 'R', 'S', 'U', 'M', '\0' };
+
+P2PResumeJournal::P2PResumeJournal()
+{
+	descriptor = -1;
+	mapping = NULL;
+	mapping_size = 0;
+	num_chunks = 0;
+}
+
+P2PResumeJournal::~P2PResumeJournal()
+{
+	close();
+}
+
+bool P2PResumeJournal::load(string path, FileItem & file_item, unsigned int chunk_size, vector<bool> &chunks_received)
+{
+	close();
+
+	int journal_descriptor = open(path.c_str(), O_RDWR);
+	if (journal_descriptor < 0)
+	{
+		return false;
+	}
+
+	struct stat s;
+	if (fstat(journal_descriptor, &s) != 0 || s.st_size < (off_t) BITFIELD_OFFSET
+		|| !mapFile(journal_descriptor, s.st_size))
+	{
+		::close(journal_descriptor);
+		return false;
+	}
+
+	// Only a complete journal of this very file is any use
+	if (!matches(file_item, chunk_size) || mapping_size != BITFIELD_OFFSET + (num_chunks + 7) / 8)
+	{
+		close();
+		return false;
+	}
+
+	char * bits = &mapping[BITFIELD_OFFSET];
+	chunks_received.assign(num_chunks, false);
+	for (unsigned int i = 0; i < num_chunks; i++)
+	{
+		chunks_received[i] = (bits[i / 8] >> (i % 8)) & 1;
+	}
+
+	return true;
+}
+
+bool P2PResumeJournal::create(string path, FileItem & file_item, unsigned int chunk_size)
+{
+	close();
+
+	unsigned int chunks = max(1u, (unsigned int)(((unsigned long long) file_item.size + chunk_size - 1) / chunk_size));
+	size_t size = BITFIELD_OFFSET + (chunks + 7) / 8;
+
+	// Starts out as zeros - no magic, and no chunks
+	int journal_descriptor = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (journal_descriptor < 0 || ftruncate(journal_descriptor, size) != 0 || !mapFile(journal_descriptor, size))
+	{
+		perror("Error: could not create resume journal");
+		if (journal_descriptor >= 0)
+			::close(journal_descriptor);
+		return false;
+	}
+
+	P2PResumeHeader * header = (P2PResumeHeader *) mapping;
+	header->version = VERSION;
+	header->file_id = file_item.file_id;
+	header->size = file_item.size;
+	header->chunk_size = chunk_size;
+	header->piece_size = file_item.piece_size;
+	header->num_chunks = chunks;
+	header->name_length = min((unsigned int) file_item.name.length(), (unsigned int) sizeof(header->name));
+	memcpy(header->name, file_item.name.data(), header->name_length);
+	num_chunks = chunks;
+
+	// The rest has to be on disk before the magic says the journal is good
+	msync(mapping, mapping_size, MS_SYNC);
+	memcpy(header->magic, RESUME_MAGIC, sizeof(RESUME_MAGIC));
+	msync(mapping, mapping_size, MS_SYNC);
+
+	return true;
+}
+
+bool P2PResumeJournal::store(vector<bool> &chunks_received)
+{
+	if (mapping == NULL || chunks_received.size() != num_chunks)
+	{
+		return false;
+	}
+
+	// Bits are only added - a write torn by a crash still leaves chunks that are on disk
+	char * bits = &mapping[BITFIELD_OFFSET];
+	for (unsigned int i = 0; i < num_chunks; i++)
+	{
+		if (chunks_received[i])
+			bits[i / 8] |= (char)(1 << (i % 8));
+	}
+
+	return msync(mapping, mapping_size, MS_SYNC) == 0;
+}
+
+void P2PResumeJournal::close()
+{
+	if (mapping != NULL)
+	{
+		munmap(mapping, mapping_size);
+		mapping = NULL;
+		mapping_size = 0;
+	}
+
+	if (descriptor >= 0)
+	{
+		::close(descriptor);
+		descriptor = -1;
+	}
+
+	num_chunks = 0;
+}
+
+bool P2PResumeJournal::mapFile(int journal_descriptor, size_t size)
+{
+	void * pointer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, journal_descriptor, 0);
+	if (pointer == MAP_FAILED)
+	{
+		return false;
+	}
+
+	descriptor = journal_descriptor;
+	mapping = (char *) pointer;
+	mapping_size = size;
+	return true;
+}
+
+bool P2PResumeJournal::matches(FileItem & file_item, unsigned int chunk_size)
+{
+	P2PResumeHeader * header = (P2PResumeHeader *) mapping;
+	if (memcmp(header->magic, RESUME_MAGIC, sizeof(RESUME_MAGIC)) != 0 || header->version != VERSION)
+	{
+		return false;
+	}
+
+	unsigned int chunks = max(1u, (unsigned int)(((unsigned long long) file_item.size + chunk_size - 1) / chunk_size));
+	unsigned int name_length = min((unsigned int) file_item.name.length(), (unsigned int) sizeof(header->name));
+	if (header->file_id != file_item.file_id || header->size != file_item.size || header->chunk_size != chunk_size
+		|| header->piece_size != file_item.piece_size || header->num_chunks != chunks
+		|| header->name_length != name_length || memcmp(header->name, file_item.name.data(), name_length) != 0)
+	{
+		return false;
+	}
+
+	num_chunks = chunks;
+	return true;
+}
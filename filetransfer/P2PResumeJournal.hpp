@@ -0,0 +1,60 @@
+#ifndef P2PRESUMEJOURNAL_H
+#define P2PRESUMEJOURNAL_H
+
+using namespace std;
+
+/**
+ * Start of a resume journal. The magic goes in last when one is made, so a
+ * journal cut short by a crash is never taken for a valid one.
+ */
+typedef struct {
+	char magic[8];
+	unsigned int version;
+	unsigned int file_id;
+	unsigned long long size;
+	unsigned int chunk_size;
+	unsigned int piece_size;
+	unsigned int num_chunks;
+	unsigned int name_length;
+	char name[256];
+} P2PResumeHeader;
+
+/**
+ * Which chunks of a download are safely on disk, kept in a small file next
+ * to it and mapped into memory: a header, then a bit per chunk. Bits are
+ * only ever set, and only once the download's data has been synced, so
+ * whatever state a crash leaves the journal in, every chunk it has is real.
+ * Downloading the same file again picks up from it.
+ */
+class P2PResumeJournal
+{
+	private:
+		int descriptor;
+		char * mapping;
+		size_t mapping_size;
+		unsigned int num_chunks;
+
+		bool mapFile(int, size_t);
+		bool matches(FileItem&, unsigned int);
+
+	public:
+		P2PResumeJournal();
+		~P2PResumeJournal();
+
+		// Open a journal left by an earlier run, filling in the chunks it has - false if there's none for this file
+		bool load(string, FileItem&, unsigned int, vector<bool>&);
+
+		// Start a new, empty journal, replacing any old one
+		bool create(string, FileItem&, unsigned int);
+
+		// Record the chunks received, once they're on disk
+		bool store(vector<bool>&);
+
+		void close();
+
+		// Layout
+		static const unsigned int VERSION = 1;
+		static const unsigned int BITFIELD_OFFSET = 512;
+};
+
+#endif
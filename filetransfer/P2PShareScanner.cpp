@@ -0,0 +1,416 @@
+/**
+ * Peer-to-peer share scanner class
+ */
+
+#include "P2PShareScanner.hpp"
+
+unsigned int P2PShareScanner::read_threads = P2PShareScanner::DEFAULT_READ_THREADS;
+unsigned int P2PShareScanner::hash_threads = 0;
+const string P2PShareScanner::DEFAULT_CACHE_FILE = "hashes.p2pcache";
+string P2PShareScanner::cache_path = P2PFileTransfer::DATA_FOLDER + "/" + P2PShareScanner::DEFAULT_CACHE_FILE;
+
+P2PShareScanner::P2PShareScanner()
+{
+	busy_walkers = 0;
+	next_file = 0;
+	queued_bytes = 0;
+	active_readers = 0;
+	cached_files = 0;
+	hashed_files = 0;
+	bytes_read = 0;
+	seconds = 0;
+
+	pthread_mutex_init(&walk_lock, NULL);
+	pthread_cond_init(&walk_ready, NULL);
+	pthread_mutex_init(&piece_lock, NULL);
+	pthread_cond_init(&piece_ready, NULL);
+	pthread_cond_init(&piece_space, NULL);
+}
+
+void P2PShareScanner::setThreads(unsigned int readers, unsigned int hashers)
+{
+	read_threads = (readers > 0) ? readers : (unsigned int) DEFAULT_READ_THREADS;
+	hash_threads = hashers;
+}
+
+void P2PShareScanner::setCachePath(string path)
+{
+	cache_path = path;
+}
+
+vector<FileItem> P2PShareScanner::scan(vector<string> &paths, vector<P2PMerkleTree *> &trees)
+{
+	timeval start, end;
+	gettimeofday(&start, NULL);
+
+	unsigned int hashers = (hash_threads > 0) ? hash_threads : P2PMerkleTree::defaultThreads();
+	if (cache_path.length() > 0)
+	{
+		cache.load(cache_path);
+	}
+
+	// Files named directly are added as they are, folders are walked
+	struct stat s;
+	for (unsigned int i = 0; i < paths.size(); i++)
+	{
+		if (stat(paths[i].c_str(), &s) != 0)
+		{
+			cout << "Could not find file or folder: " << paths[i] << endl;
+			continue;
+		}
+
+		char * real_path = realpath(paths[i].c_str(), NULL);
+		if (real_path == NULL)
+		{
+			continue;
+		}
+
+		if (S_ISDIR(s.st_mode))
+			directories.push_back(real_path);
+		else if (S_ISREG(s.st_mode))
+			addFile(paths[i], real_path, s);
+
+		free(real_path);
+	}
+
+	// Walk the folders with every thread the scan has - it's all waiting on the disk
+	vector<pthread_t> threads;
+	startThreads(&P2PShareScanner::startWalkThread, read_threads + hashers, threads);
+	for (unsigned int i = 0; i < threads.size(); i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	// The walkers finish in any order
+	sort(files.begin(), files.end(), &P2PShareScanner::comparePaths);
+
+	// Files the cache knows are done - the rest are read and hashed
+	for (unsigned int i = 0; i < files.size(); i++)
+	{
+		P2PScanFile & file = files[i];
+		if (cache.lookup(file.status, file.file_item.piece_size, file.leaves))
+		{
+			file.b_cached = true;
+			cached_files++;
+		}
+		else
+		{
+			file.leaves.assign(P2PFileTransfer::countPieces(file.file_item), string());
+			files_to_hash.push_back(i);
+		}
+	}
+
+	// Readers and hashers run side by side
+	active_readers = min(read_threads, (unsigned int) files_to_hash.size());
+	threads.clear();
+	startThreads(&P2PShareScanner::startReadThread, active_readers, threads);
+	startThreads(&P2PShareScanner::startHashThread, (active_readers > 0) ? hashers : 0, threads);
+	for (unsigned int i = 0; i < threads.size(); i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	// Every file that could be read gets its tree
+	vector<FileItem> file_items;
+	for (unsigned int i = 0; i < files.size(); i++)
+	{
+		P2PScanFile & file = files[i];
+		P2PMerkleTree * tree = new P2PMerkleTree;
+		if (file.b_failed || !tree->setLeaves(file.file_item.size, file.file_item.piece_size, file.leaves))
+		{
+			cout << "Error: could not hash \"" << file.file_item.path << "\" - sharing it by name" << endl;
+			delete tree;
+		}
+		else
+		{
+			file.file_item.hash = tree->getRoot();
+			trees.push_back(tree);
+
+			if (!file.b_cached)
+			{
+				cache.store(file.status, file.file_item.piece_size, file.leaves);
+				hashed_files++;
+			}
+		}
+
+		file_items.push_back(file.file_item);
+	}
+
+	// The cache goes beside the downloads
+	if (cache_path.length() > 0)
+	{
+		P2PFileTransfer::createDataFolder();
+		cache.save();
+	}
+
+	gettimeofday(&end, NULL);
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+	return file_items;
+}
+
+string P2PShareScanner::describe()
+{
+	ostringstream description;
+	description << "Scanned " << files.size() << " files in " << seconds << "s: " << cached_files << " from the hash cache, "
+		<< hashed_files << " hashed (" << (bytes_read / (1024 * 1024)) << " MB read)";
+	return description.str();
+}
+
+void P2PShareScanner::addFile(string name, string path, struct stat &status)
+{
+	// Sizes past this would wrap wherever they're passed on
+	if ((unsigned long long) status.st_size > P2PCommon::MAX_FILE_SIZE)
+	{
+		cout << "Error: \"" << path << "\" is too large to share" << endl;
+		return;
+	}
+
+	P2PScanFile file;
+	file.file_item.name = name;
+	file.file_item.size = status.st_size;
+	file.file_item.piece_size = P2PFileTransfer::choosePieceSize(status.st_size);
+	file.file_item.path = path;
+	file.file_item.file_id = 0;
+	file.file_item.completed = false;
+	file.status = status;
+	file.b_cached = false;
+	file.b_failed = false;
+
+	pthread_mutex_lock(&walk_lock);
+	files.push_back(file);
+	pthread_mutex_unlock(&walk_lock);
+}
+
+void P2PShareScanner::walkDirectory(string path)
+{
+	DIR * directory = opendir(path.c_str());
+	if (directory == NULL)
+	{
+		cout << "Could not open folder: " << path << endl;
+		return;
+	}
+
+	struct dirent * ep;
+	while ((ep = readdir(directory)) != NULL)
+	{
+		string name = ep->d_name;
+		if (name == "." || name == "..")
+		{
+			continue;
+		}
+
+		// Links are followed to files, but never into folders, so the walk can't go round in circles
+		struct stat s;
+		if (fstatat(dirfd(directory), ep->d_name, &s, AT_SYMLINK_NOFOLLOW) != 0)
+		{
+			continue;
+		}
+
+		string entry_path = path + "/" + name;
+		if (S_ISLNK(s.st_mode))
+		{
+			char * real_path = NULL;
+			if (fstatat(dirfd(directory), ep->d_name, &s, 0) == 0 && S_ISREG(s.st_mode))
+			{
+				real_path = realpath(entry_path.c_str(), NULL);
+			}
+
+			if (real_path != NULL)
+			{
+				addFile(name, real_path, s);
+				free(real_path);
+			}
+		}
+		else if (S_ISREG(s.st_mode))
+		{
+			addFile(name, entry_path, s);
+		}
+		else if (S_ISDIR(s.st_mode))
+		{
+			pthread_mutex_lock(&walk_lock);
+			directories.push_back(entry_path);
+			pthread_cond_signal(&walk_ready);
+			pthread_mutex_unlock(&walk_lock);
+		}
+	}
+
+	closedir(directory);
+}
+
+bool P2PShareScanner::readFile(P2PScanFile &file, unsigned int file_index)
+{
+	int descriptor = open(file.file_item.path.c_str(), O_RDONLY);
+	if (descriptor < 0)
+	{
+		return false;
+	}
+
+	// Each file is read once, front to back
+	posix_fadvise(descriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	unsigned long long size = file.file_item.size;
+	unsigned int piece_size = file.file_item.piece_size;
+	bool b_read = true;
+	for (unsigned int piece = 0; piece < file.leaves.size() && b_read; piece++)
+	{
+		P2PScanPiece scan_piece;
+		scan_piece.file_index = file_index;
+		scan_piece.piece = piece;
+		scan_piece.length = min((unsigned long long) piece_size, size - (unsigned long long) piece * piece_size);
+		scan_piece.data = new char[max(scan_piece.length, 1u)];
+
+		// The file may come back short if it changed since it was found
+		unsigned int done = 0;
+		while (done < scan_piece.length)
+		{
+			ssize_t bytes = pread(descriptor, &scan_piece.data[done], scan_piece.length - done, (off_t) piece * piece_size + done);
+			if (bytes < 0 && errno == EINTR)
+				continue;
+
+			if (bytes <= 0)
+				break;
+
+			done += bytes;
+		}
+
+		if (done < scan_piece.length)
+		{
+			delete[] scan_piece.data;
+			b_read = false;
+			break;
+		}
+
+		__sync_fetch_and_add(&bytes_read, (unsigned long long) scan_piece.length);
+		queuePiece(scan_piece);
+	}
+
+	close(descriptor);
+	return b_read;
+}
+
+void P2PShareScanner::queuePiece(P2PScanPiece &piece)
+{
+	pthread_mutex_lock(&piece_lock);
+
+	// Wait for the hashers to catch up - a piece bigger than the whole limit still goes once the queue is empty
+	while (queued_bytes > 0 && queued_bytes + piece.length > MAX_QUEUED_BYTES)
+	{
+		pthread_cond_wait(&piece_space, &piece_lock);
+	}
+
+	pieces.push_back(piece);
+	queued_bytes += piece.length;
+	pthread_cond_signal(&piece_ready);
+
+	pthread_mutex_unlock(&piece_lock);
+}
+
+bool P2PShareScanner::comparePaths(const P2PScanFile &first, const P2PScanFile &second)
+{
+	return first.file_item.path < second.file_item.path;
+}
+
+void P2PShareScanner::startThreads(void * (*run)(void *), unsigned int count, vector<pthread_t> &threads)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, run, (void *) this) == 0)
+		{
+			threads.push_back(thread);
+		}
+	}
+}
+
+void * P2PShareScanner::startWalkThread(void * arg)
+{
+	P2PShareScanner * scanner = (P2PShareScanner *) arg;
+
+	pthread_mutex_lock(&scanner->walk_lock);
+	while (true)
+	{
+		// The walk is over once there's nothing queued and nobody left to find more
+		while (scanner->directories.empty() && scanner->busy_walkers > 0)
+		{
+			pthread_cond_wait(&scanner->walk_ready, &scanner->walk_lock);
+		}
+
+		if (scanner->directories.empty())
+		{
+			break;
+		}
+
+		string path = scanner->directories.front();
+		scanner->directories.pop_front();
+		scanner->busy_walkers++;
+		pthread_mutex_unlock(&scanner->walk_lock);
+
+		scanner->walkDirectory(path);
+
+		pthread_mutex_lock(&scanner->walk_lock);
+		if (--scanner->busy_walkers == 0 && scanner->directories.empty())
+		{
+			pthread_cond_broadcast(&scanner->walk_ready);
+		}
+	}
+	pthread_mutex_unlock(&scanner->walk_lock);
+
+	return NULL;
+}
+
+void * P2PShareScanner::startReadThread(void * arg)
+{
+	P2PShareScanner * scanner = (P2PShareScanner *) arg;
+
+	// Each reader takes the next file nobody has yet
+	unsigned int next;
+	while ((next = __sync_fetch_and_add(&scanner->next_file, 1)) < scanner->files_to_hash.size())
+	{
+		unsigned int file_index = scanner->files_to_hash[next];
+		if (!scanner->readFile(scanner->files[file_index], file_index))
+		{
+			scanner->files[file_index].b_failed = true;
+		}
+	}
+
+	// The hashers stop once the last reader is done and the queue is empty
+	pthread_mutex_lock(&scanner->piece_lock);
+	scanner->active_readers--;
+	pthread_cond_broadcast(&scanner->piece_ready);
+	pthread_mutex_unlock(&scanner->piece_lock);
+
+	return NULL;
+}
+
+void * P2PShareScanner::startHashThread(void * arg)
+{
+	P2PShareScanner * scanner = (P2PShareScanner *) arg;
+
+	while (true)
+	{
+		pthread_mutex_lock(&scanner->piece_lock);
+		while (scanner->pieces.empty() && scanner->active_readers > 0)
+		{
+			pthread_cond_wait(&scanner->piece_ready, &scanner->piece_lock);
+		}
+
+		if (scanner->pieces.empty())
+		{
+			pthread_mutex_unlock(&scanner->piece_lock);
+			break;
+		}
+
+		P2PScanPiece piece = scanner->pieces.front();
+		scanner->pieces.pop_front();
+		scanner->queued_bytes -= piece.length;
+		pthread_cond_broadcast(&scanner->piece_space);
+		pthread_mutex_unlock(&scanner->piece_lock);
+
+		// Every piece has its own slot, so the hashers never touch the same one
+		scanner->files[piece.file_index].leaves[piece.piece] = P2PSha256::digest(piece.data, piece.length);
+		delete[] piece.data;
+	}
+
+	return NULL;
+}
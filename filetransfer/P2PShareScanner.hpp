@@ -0,0 +1,102 @@
+#ifndef P2PSHARESCANNER_H
+#define P2PSHARESCANNER_H
+
+using namespace std;
+
+// A file the scan found, with the status the hash cache knows it by
+typedef struct {
+	FileItem file_item;
+	struct stat status;
+	vector<string> leaves;
+	bool b_cached;
+	bool b_failed;
+} P2PScanFile;
+
+// A piece read from disk, waiting for a hasher
+typedef struct {
+	unsigned int file_index;
+	unsigned int piece;
+	char * data;
+	unsigned int length;
+} P2PScanPiece;
+
+/**
+ * Finds the files under the paths being shared and works out their content
+ * hashes. Folders are walked all the way down by several threads at once.
+ * Files the hash cache knows are done there and then; the rest go through
+ * a pipeline of reader threads, which read them a piece at a time, and
+ * hasher threads, which hash the pieces. The pieces waiting between the two
+ * are bounded, so a slow disk or a slow CPU holds the other side back
+ * instead of filling memory.
+ */
+class P2PShareScanner
+{
+	private:
+		// Folders still to walk, and the walkers busy with one
+		deque<string> directories;
+		unsigned int busy_walkers;
+		pthread_mutex_t walk_lock;
+		pthread_cond_t walk_ready;
+
+		// Everything found so far
+		vector<P2PScanFile> files;
+
+		// Files to read, and the pieces read but not yet hashed
+		vector<unsigned int> files_to_hash;
+		unsigned int next_file;
+		deque<P2PScanPiece> pieces;
+		unsigned long long queued_bytes;
+		unsigned int active_readers;
+		pthread_mutex_t piece_lock;
+		pthread_cond_t piece_ready;
+		pthread_cond_t piece_space;
+
+		// Hashes of files from earlier scans
+		P2PHashCache cache;
+
+		// Counters for describe()
+		unsigned int cached_files;
+		unsigned int hashed_files;
+		unsigned long long bytes_read;
+		double seconds;
+
+		void addFile(string, string, struct stat&);
+		void walkDirectory(string);
+		bool readFile(P2PScanFile&, unsigned int);
+		void queuePiece(P2PScanPiece&);
+		void startThreads(void * (*)(void *), unsigned int, vector<pthread_t>&);
+		static bool comparePaths(const P2PScanFile&, const P2PScanFile&);
+
+		static void * startWalkThread(void *);
+		static void * startReadThread(void *);
+		static void * startHashThread(void *);
+
+		// Settings shared by every scan
+		static unsigned int read_threads;
+		static unsigned int hash_threads;
+		static string cache_path;
+
+	public:
+		P2PShareScanner();
+
+		// Find every file under the paths given and hash it - each file's tree is handed back with it
+		vector<FileItem> scan(vector<string>&, vector<P2PMerkleTree *>&);
+
+		// How the last scan went
+		string describe();
+
+		// Threads reading files and hashing pieces - 0 keeps the default
+		static void setThreads(unsigned int, unsigned int);
+
+		// Where the hash cache is kept - an empty path turns it off
+		static void setCachePath(string);
+
+		// Defaults
+		static const unsigned int DEFAULT_READ_THREADS = 2;
+		static const string DEFAULT_CACHE_FILE;
+
+		// Bytes of pieces that may wait for a hasher
+		static const unsigned long long MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+};
+
+#endif
@@ -0,0 +1,188 @@
+/**
+ * Peer-to-peer connection pool class
+ */
+
+#include "P2PConnectionPool.hpp"
+
+P2PConnectionPool::P2PConnectionPool()
+{
+	pthread_mutex_init(&pool_lock, NULL);
+	max_per_peer = DEFAULT_MAX_PER_PEER;
+	sessions_per_connection = DEFAULT_SESSIONS_PER_CONNECTION;
+	idle_timeout = DEFAULT_IDLE_TIMEOUT;
+}
+
+void P2PConnectionPool::setMaxPerPeer(unsigned int max_connections)
+{
+	max_per_peer = (max_connections > 0) ? max_connections : 1;
+}
+
+void P2PConnectionPool::setSessionsPerConnection(unsigned int max_sessions)
+{
+	sessions_per_connection = (max_sessions > 0) ? max_sessions : 1;
+}
+
+void P2PConnectionPool::setIdleTimeout(unsigned int seconds)
+{
+	idle_timeout = seconds;
+}
+
+string P2PConnectionPool::makeKey(string address, int port)
+{
+	return address + ":" + to_string(port);
+}
+
+int P2PConnectionPool::acquire(string peer, int file_id)
+{
+	pthread_mutex_lock(&pool_lock);
+
+	int socket_id = -1;
+	map<string, vector<int> >::iterator peer_iter = peers.find(peer);
+	if (peer_iter != peers.end() && peer_iter->second.size() > 0)
+	{
+		vector<int> & peer_sockets = peer_iter->second;
+
+		// A session asking again (e.g. for missing pieces) keeps its connection
+		socket_id = findSession(peer_sockets, file_id);
+		if (socket_id < 0)
+		{
+			// Otherwise share the least busy connection, unless they're all
+			// full and the peer still has room for another
+			socket_id = findLeastLoaded(peer_sockets);
+			if (connections[socket_id].sessions.size() >= sessions_per_connection
+				&& peer_sockets.size() < max_per_peer)
+			{
+				socket_id = -1;
+			}
+		}
+
+		if (socket_id >= 0)
+		{
+			P2PPooledConnection & connection = connections[socket_id];
+			connection.sessions.insert(file_id);
+			gettimeofday(&connection.last_used, NULL);
+		}
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+	return socket_id;
+}
+
+void P2PConnectionPool::add(string peer, int socket_id, int file_id)
+{
+	pthread_mutex_lock(&pool_lock);
+
+	P2PPooledConnection connection;
+	connection.socket_id = socket_id;
+	connection.peer = peer;
+	connection.sessions.insert(file_id);
+	gettimeofday(&connection.last_used, NULL);
+
+	connections[socket_id] = connection;
+	peers[peer].push_back(socket_id);
+
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void P2PConnectionPool::release(int file_id)
+{
+	pthread_mutex_lock(&pool_lock);
+
+	// The idle clock starts once the last session leaves
+	map<int, P2PPooledConnection>::iterator iter;
+	for (iter = connections.begin(); iter != connections.end(); ++iter)
+	{
+		if (iter->second.sessions.erase(file_id) > 0)
+		{
+			gettimeofday(&iter->second.last_used, NULL);
+		}
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void P2PConnectionPool::removeSocket(int socket_id)
+{
+	pthread_mutex_lock(&pool_lock);
+
+	map<int, P2PPooledConnection>::iterator iter = connections.find(socket_id);
+	if (iter != connections.end())
+	{
+		vector<int> & peer_sockets = peers[iter->second.peer];
+		peer_sockets.erase(remove(peer_sockets.begin(), peer_sockets.end(), socket_id), peer_sockets.end());
+		if (peer_sockets.size() == 0)
+		{
+			peers.erase(iter->second.peer);
+		}
+
+		connections.erase(iter);
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+}
+
+vector<int> P2PConnectionPool::collectIdle()
+{
+	vector<int> idle_sockets;
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	pthread_mutex_lock(&pool_lock);
+
+	map<int, P2PPooledConnection>::iterator iter;
+	for (iter = connections.begin(); iter != connections.end(); ++iter)
+	{
+		if (iter->second.sessions.size() == 0
+			&& (unsigned long)(now.tv_sec - iter->second.last_used.tv_sec) >= idle_timeout)
+		{
+			idle_sockets.push_back(iter->first);
+		}
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+
+	// The caller closes them, which removes them from the pool
+	return idle_sockets;
+}
+
+string P2PConnectionPool::describe()
+{
+	pthread_mutex_lock(&pool_lock);
+
+	unsigned int idle = 0;
+	map<int, P2PPooledConnection>::iterator iter;
+	for (iter = connections.begin(); iter != connections.end(); ++iter)
+	{
+		if (iter->second.sessions.size() == 0)
+			idle++;
+	}
+
+	string description = "Peer connections: " + to_string(connections.size()) + " open to "
+		+ to_string(peers.size()) + " peers, " + to_string(idle) + " idle";
+
+	pthread_mutex_unlock(&pool_lock);
+	return description;
+}
+
+int P2PConnectionPool::findSession(vector<int> &peer_sockets, int file_id)
+{
+	for (unsigned int i = 0; i < peer_sockets.size(); i++)
+	{
+		if (connections[peer_sockets[i]].sessions.count(file_id) > 0)
+			return peer_sockets[i];
+	}
+
+	return -1;
+}
+
+int P2PConnectionPool::findLeastLoaded(vector<int> &peer_sockets)
+{
+	int best_socket = peer_sockets[0];
+	for (unsigned int i = 1; i < peer_sockets.size(); i++)
+	{
+		if (connections[peer_sockets[i]].sessions.size() < connections[best_socket].sessions.size())
+			best_socket = peer_sockets[i];
+	}
+
+	return best_socket;
+}
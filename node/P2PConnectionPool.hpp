@@ -0,0 +1,62 @@
+#ifndef P2PCONNECTIONPOOL_H
+#define P2PCONNECTIONPOOL_H
+
+using namespace std;
+
+typedef struct {
+	int socket_id;
+	string peer;
+	set<int> sessions;
+	timeval last_used;
+} P2PPooledConnection;
+
+/**
+ * Connections to other peers, keyed by address:port. File sessions share
+ * them instead of dialing each peer once per file; connections nobody is
+ * using are handed back for closing after an idle timeout.
+ */
+class P2PConnectionPool
+{
+	private:
+		map<int, P2PPooledConnection> connections;
+		map<string, vector<int> > peers;
+		pthread_mutex_t pool_lock;
+		unsigned int max_per_peer;
+		unsigned int sessions_per_connection;
+		unsigned int idle_timeout;
+
+		int findSession(vector<int>&, int);
+		int findLeastLoaded(vector<int>&);
+
+	public:
+		P2PConnectionPool();
+		void setMaxPerPeer(unsigned int);
+		void setSessionsPerConnection(unsigned int);
+		void setIdleTimeout(unsigned int);
+
+		static string makeKey(string, int);
+
+		// Find a connection to the peer for the file session, -1 if a new one should be dialed
+		int acquire(string, int);
+
+		// Register a freshly dialed connection, already holding the file session
+		void add(string, int, int);
+
+		// End a file session on every connection it used
+		void release(int);
+
+		// Forget a connection that was closed
+		void removeSocket(int);
+
+		// Connections that have sat unused past the idle timeout
+		vector<int> collectIdle();
+
+		string describe();
+
+		// Defaults
+		static const unsigned int DEFAULT_MAX_PER_PEER = 2;
+		static const unsigned int DEFAULT_SESSIONS_PER_CONNECTION = 8;
+		static const unsigned int DEFAULT_IDLE_TIMEOUT = 30; // seconds
+};
+
+#endif
@@ -0,0 +1,223 @@
+/**
+ * Peer-to-peer connection table class
+ */
+
+#include "P2PConnectionTable.hpp"
+
+P2PConnectionTable::P2PConnectionTable()
+{
+	free_head = -1;
+	used_slots = 0;
+	pthread_rwlock_init(&table_lock, NULL);
+}
+
+void P2PConnectionTable::open(unsigned int slot_count)
+{
+	pthread_rwlock_wrlock(&table_lock);
+
+	// The slab never grows, so pointers into it stay put
+	slots.clear();
+	slots.resize(slot_count);
+	descriptor_index.clear();
+	descriptor_index.reserve(slot_count);
+	name_index.clear();
+	used_slots = 0;
+
+	// Chain every slot into the free list
+	for (unsigned int i = 0; i < slot_count; i++)
+	{
+		slots[i].b_in_use = false;
+		slots[i].next_free = (i + 1 < slot_count) ? (int)(i + 1) : -1;
+	}
+	free_head = (slot_count > 0) ? 0 : -1;
+
+	pthread_rwlock_unlock(&table_lock);
+}
+
+bool P2PConnectionTable::add(int socket_id, string type, string name)
+{
+	pthread_rwlock_wrlock(&table_lock);
+
+	if (free_head < 0 || descriptor_index.count(socket_id) > 0)
+	{
+		pthread_rwlock_unlock(&table_lock);
+		return false;
+	}
+
+	// Take the first free slot
+	int slot_id = free_head;
+	P2PConnectionSlot & slot = slots[slot_id];
+	free_head = slot.next_free;
+
+	slot.socket.socket_id = socket_id;
+	slot.socket.type = type;
+	slot.socket.name = name;
+	slot.frame_buffer.clear();
+	slot.b_in_use = true;
+	slot.next_free = -1;
+	slot.b_negotiated = false;
+	gettimeofday(&slot.opened, NULL);
+	used_slots++;
+
+	descriptor_index[socket_id] = slot_id;
+	if (name.length() > 0)
+	{
+		name_index.insert(make_pair(name, slot_id));
+	}
+
+	pthread_rwlock_unlock(&table_lock);
+	return true;
+}
+
+bool P2PConnectionTable::remove(int socket_id)
+{
+	pthread_rwlock_wrlock(&table_lock);
+
+	int slot_id = findSlot(socket_id);
+	if (slot_id < 0)
+	{
+		pthread_rwlock_unlock(&table_lock);
+		return false;
+	}
+
+	P2PConnectionSlot & slot = slots[slot_id];
+
+	// Drop the indexes
+	descriptor_index.erase(socket_id);
+	pair<unordered_multimap<string, int>::iterator, unordered_multimap<string, int>::iterator> range;
+	range = name_index.equal_range(slot.socket.name);
+	for (unordered_multimap<string, int>::iterator iter = range.first; iter != range.second; ++iter)
+	{
+		if (iter->second == slot_id)
+		{
+			name_index.erase(iter);
+			break;
+		}
+	}
+
+	// Hand the slot back
+	slot.frame_buffer.clear();
+	slot.b_in_use = false;
+	slot.next_free = free_head;
+	free_head = slot_id;
+	used_slots--;
+
+	pthread_rwlock_unlock(&table_lock);
+	return true;
+}
+
+P2PSocket * P2PConnectionTable::find(int socket_id)
+{
+	pthread_rwlock_rdlock(&table_lock);
+	int slot_id = findSlot(socket_id);
+	P2PSocket * socket = (slot_id >= 0) ? &slots[slot_id].socket : NULL;
+	pthread_rwlock_unlock(&table_lock);
+
+	return socket;
+}
+
+P2PFrameBuffer * P2PConnectionTable::getFrameBuffer(int socket_id)
+{
+	pthread_rwlock_rdlock(&table_lock);
+	int slot_id = findSlot(socket_id);
+	P2PFrameBuffer * frame_buffer = (slot_id >= 0) ? &slots[slot_id].frame_buffer : NULL;
+	pthread_rwlock_unlock(&table_lock);
+
+	return frame_buffer;
+}
+
+void P2PConnectionTable::setCapabilities(int socket_id, P2PCapabilities &capabilities)
+{
+	pthread_rwlock_wrlock(&table_lock);
+
+	int slot_id = findSlot(socket_id);
+	if (slot_id >= 0)
+	{
+		slots[slot_id].capabilities = capabilities;
+		slots[slot_id].b_negotiated = true;
+	}
+
+	pthread_rwlock_unlock(&table_lock);
+}
+
+bool P2PConnectionTable::getCapabilities(int socket_id, P2PCapabilities &capabilities)
+{
+	pthread_rwlock_rdlock(&table_lock);
+
+	int slot_id = findSlot(socket_id);
+	bool b_negotiated = (slot_id >= 0 && slots[slot_id].b_negotiated);
+	if (b_negotiated)
+	{
+		capabilities = slots[slot_id].capabilities;
+	}
+
+	pthread_rwlock_unlock(&table_lock);
+	return b_negotiated;
+}
+
+vector<int> P2PConnectionTable::collectUnnegotiated(int timeout)
+{
+	vector<int> silent_sockets;
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	pthread_rwlock_rdlock(&table_lock);
+	for (unsigned int i = 0; i < slots.size(); i++)
+	{
+		P2PConnectionSlot & slot = slots[i];
+		long elapsed = (now.tv_sec - slot.opened.tv_sec) * 1000 + (now.tv_usec - slot.opened.tv_usec) / 1000;
+		if (slot.b_in_use && !slot.b_negotiated && elapsed >= timeout)
+			silent_sockets.push_back(slot.socket.socket_id);
+	}
+	pthread_rwlock_unlock(&table_lock);
+
+	return silent_sockets;
+}
+
+bool P2PConnectionTable::findByName(string name, P2PSocket &socket)
+{
+	pthread_rwlock_rdlock(&table_lock);
+
+	bool b_found = false;
+	unordered_multimap<string, int>::iterator iter = name_index.find(name);
+	if (iter != name_index.end())
+	{
+		socket = slots[iter->second].socket;
+		b_found = true;
+	}
+
+	pthread_rwlock_unlock(&table_lock);
+	return b_found;
+}
+
+vector<P2PSocket> P2PConnectionTable::list()
+{
+	vector<P2PSocket> sockets;
+
+	pthread_rwlock_rdlock(&table_lock);
+	sockets.reserve(used_slots);
+	for (unsigned int i = 0; i < slots.size(); i++)
+	{
+		if (slots[i].b_in_use)
+			sockets.push_back(slots[i].socket);
+	}
+	pthread_rwlock_unlock(&table_lock);
+
+	return sockets;
+}
+
+unsigned int P2PConnectionTable::size()
+{
+	return __atomic_load_n(&used_slots, __ATOMIC_RELAXED);
+}
+
+unsigned int P2PConnectionTable::capacity()
+{
+	return slots.size();
+}
+
+int P2PConnectionTable::findSlot(int socket_id)
+{
+	unordered_map<int, int>::iterator iter = descriptor_index.find(socket_id);
+	return (iter != descriptor_index.end()) ? iter->second : -1;
+}
@@ -0,0 +1,62 @@
+#ifndef P2PCONNECTIONTABLE_H
+#define P2PCONNECTIONTABLE_H
+
+#include <unordered_map>
+
+using namespace std;
+
+typedef struct {
+	P2PSocket socket;
+	P2PFrameBuffer frame_buffer;
+	bool b_in_use;
+	int next_free;
+
+	// Settings agreed in the hello exchange, and when the connection opened
+	P2PCapabilities capabilities;
+	bool b_negotiated;
+	timeval opened;
+} P2PConnectionSlot;
+
+/**
+ * Every socket a node has open, in a fixed slab of slots. Free slots are
+ * chained into a list, and sockets are indexed by descriptor and by name,
+ * so adding, finding and removing one never walks the table.
+ */
+class P2PConnectionTable
+{
+	private:
+		vector<P2PConnectionSlot> slots;
+		int free_head;
+		unsigned int used_slots;
+		unordered_map<int, int> descriptor_index;
+		unordered_multimap<string, int> name_index;
+		pthread_rwlock_t table_lock;
+
+		int findSlot(int);
+
+	public:
+		P2PConnectionTable();
+		void open(unsigned int);
+
+		// False when every slot is taken
+		bool add(int, string, string);
+		bool remove(int);
+
+		// Pointers stay valid until the socket is removed - only the reactor removes sockets
+		P2PSocket * find(int);
+		P2PFrameBuffer * getFrameBuffer(int);
+
+		// Handshake results - false until the peer's hello is in
+		void setCapabilities(int, P2PCapabilities&);
+		bool getCapabilities(int, P2PCapabilities&);
+
+		// Sockets that have waited longer than the timeout (in ms) without a hello
+		vector<int> collectUnnegotiated(int);
+
+		bool findByName(string, P2PSocket&);
+		vector<P2PSocket> list();
+		unsigned int size();
+		unsigned int capacity();
+};
+
+#endif
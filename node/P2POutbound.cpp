@@ -0,0 +1,548 @@
+/**
+ * Peer-to-peer outbound queue classes
+ */
+
+#include "P2POutbound.hpp"
+
+bool P2POutbound::b_zerocopy_enabled = false;
+
+/**
+ * Mapped file
+ */
+
+P2PMappedFile::P2PMappedFile(int descriptor_value, size_t length_value)
+{
+	// Our own descriptor, so the file outlives the upload that queued it
+	descriptor = dup(descriptor_value);
+	length = length_value;
+	references = 1;
+
+	data = NULL;
+	if (descriptor >= 0 && length > 0)
+	{
+		void * mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, descriptor, 0);
+		if (mapping != MAP_FAILED)
+		{
+			data = (char *) mapping;
+			madvise(data, length, MADV_SEQUENTIAL);
+		}
+	}
+}
+
+bool P2PMappedFile::isMapped()
+{
+	return (data != NULL);
+}
+
+int P2PMappedFile::getDescriptor()
+{
+	return descriptor;
+}
+
+char * P2PMappedFile::getData()
+{
+	return data;
+}
+
+void P2PMappedFile::retain()
+{
+	__sync_fetch_and_add(&references, 1);
+}
+
+void P2PMappedFile::release()
+{
+	if (__sync_sub_and_fetch(&references, 1) > 0)
+	{
+		return;
+	}
+
+	// Pages pinned by MSG_ZEROCOPY stay valid in the kernel after this
+	if (data != NULL)
+		munmap(data, length);
+
+	if (descriptor >= 0)
+		close(descriptor);
+
+	delete this;
+}
+
+/**
+ * Outbound queue
+ */
+
+P2POutboundQueue::P2POutboundQueue()
+{
+	queued_bytes = 0;
+	b_zerocopy = false;
+	zerocopy_pending = 0;
+}
+
+void P2POutboundQueue::push(P2POutboundEntry &entry)
+{
+	entries.push_back(entry);
+
+	queued_bytes += entry.length + entry.file_length;
+}
+
+bool P2POutboundQueue::sendsFromMapping(P2POutboundEntry &entry)
+{
+	// Large regions are pinned and sent from the mapping when the socket takes MSG_ZEROCOPY
+	return (b_zerocopy && entry.file_length >= P2POutbound::ZEROCOPY_MIN_BYTES && entry.file->isMapped());
+}
+
+int P2POutboundQueue::flush(int socket)
+{
+	struct iovec iov[P2POutbound::MAX_FLUSH_ENTRIES];
+	struct msghdr message;
+
+	while (entries.size() > 0)
+	{
+		P2POutboundEntry & front = entries.front();
+		ssize_t sent;
+		int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+
+		if (front.file != NULL && front.offset >= front.length && !sendsFromMapping(front))
+		{
+			// The header is out - the payload goes straight from the page cache
+			off_t position = front.file_offset + (front.offset - front.length);
+			sent = sendfile(socket, front.file->getDescriptor(), &position, front.length + front.file_length - front.offset);
+
+			// The file got shorter under us - the peer can't get the bytes it was promised
+			if (sent == 0)
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			// Gather as many frames as we can into one call, up to a payload sendfile() has to send
+			int iovcnt = 0;
+			deque<P2POutboundEntry>::iterator iter;
+			for (iter = entries.begin(); iter != entries.end() && iovcnt + 2 <= P2POutbound::MAX_FLUSH_ENTRIES; ++iter)
+			{
+				unsigned int position = iter->offset;
+				if (position < iter->length)
+				{
+					iov[iovcnt].iov_base = iter->data + position;
+					iov[iovcnt].iov_len = iter->length - position;
+					iovcnt++;
+					position = iter->length;
+				}
+
+				if (iter->file == NULL)
+				{
+					continue;
+				}
+
+				if (!sendsFromMapping(*iter))
+				{
+					// Hold the header back until the payload follows it
+					flags |= MSG_MORE;
+					break;
+				}
+
+				iov[iovcnt].iov_base = iter->file->getData() + iter->file_offset + (position - iter->length);
+				iov[iovcnt].iov_len = iter->length + iter->file_length - position;
+				iovcnt++;
+				flags |= MSG_ZEROCOPY;
+			}
+
+			memset(&message, 0, sizeof(message));
+			message.msg_iov = iov;
+			message.msg_iovlen = iovcnt;
+
+			sent = sendmsg(socket, &message, flags);
+			if (sent >= 0 && (flags & MSG_ZEROCOPY))
+			{
+				zerocopy_pending++;
+			}
+		}
+
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			// The socket is full - the reactor picks up the rest once it's writable
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			// Out of memory for pinning pages - copy from now on
+			if (errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+			{
+				b_zerocopy = false;
+				continue;
+			}
+
+			return -1;
+		}
+
+		release(sent);
+	}
+
+	// Notifications pile up on the error queue until they're read
+	if (zerocopy_pending > 0)
+	{
+		reapCompletions(socket);
+	}
+
+	return 0;
+}
+
+void P2POutboundQueue::release(size_t sent)
+{
+	// Release whatever was fully sent
+	queued_bytes -= sent;
+	while (sent > 0)
+	{
+		P2POutboundEntry & entry = entries.front();
+		unsigned int remaining = entry.length + entry.file_length - entry.offset;
+		if (sent < remaining)
+		{
+			entry.offset += sent;
+			break;
+		}
+
+		sent -= remaining;
+		delete[] entry.data;
+		if (entry.file != NULL)
+			entry.file->release();
+		entries.pop_front();
+	}
+}
+
+void P2POutboundQueue::reapCompletions(int socket)
+{
+	// Each notification covers a range of sends - the pages were released when they were
+	// sent, as the mapping is never written to, so all that's left is counting them off
+	char control[128];
+	struct msghdr message;
+	while (zerocopy_pending > 0)
+	{
+		memset(&message, 0, sizeof(message));
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		if (recvmsg(socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+		{
+			break;
+		}
+
+		struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+		if (header != NULL && header->cmsg_len >= CMSG_LEN(sizeof(struct sock_extended_err)))
+		{
+			struct sock_extended_err * error = (struct sock_extended_err *) CMSG_DATA(header);
+			if (error->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+			{
+				unsigned int completed = error->ee_data - error->ee_info + 1;
+				zerocopy_pending -= min(completed, zerocopy_pending);
+			}
+		}
+	}
+}
+
+void P2POutboundQueue::clear()
+{
+	while (entries.size() > 0)
+	{
+		delete[] entries.front().data;
+		if (entries.front().file != NULL)
+			entries.front().file->release();
+		entries.pop_front();
+	}
+
+	queued_bytes = 0;
+	zerocopy_pending = 0;
+}
+
+bool P2POutboundQueue::empty()
+{
+	return entries.empty();
+}
+
+unsigned int P2POutboundQueue::size()
+{
+	return queued_bytes;
+}
+
+P2POutbound::P2POutbound()
+{
+	reactor = NULL;
+	max_queue_bytes = DEFAULT_MAX_QUEUE_BYTES;
+	pthread_mutex_init(&queues_lock, NULL);
+}
+
+void P2POutbound::setReactor(P2PReactor * reactor_value)
+{
+	reactor = reactor_value;
+}
+
+void P2POutbound::setMaxQueueBytes(unsigned int max_bytes)
+{
+	max_queue_bytes = max_bytes;
+}
+
+void P2POutbound::setZeroCopy(bool b_enabled)
+{
+	b_zerocopy_enabled = b_enabled;
+}
+
+bool P2POutbound::isZeroCopy()
+{
+	return b_zerocopy_enabled;
+}
+
+void P2POutbound::addSocket(int socket)
+{
+	// Kernels without MSG_ZEROCOPY refuse the option, and the socket just copies
+	bool b_zerocopy = false;
+	if (b_zerocopy_enabled)
+	{
+		int enable = 1;
+		b_zerocopy = (setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0);
+	}
+
+	pthread_mutex_lock(&queues_lock);
+	P2POutboundQueue & queue = queues[socket];
+	queue.clear();
+	queue.b_zerocopy = b_zerocopy;
+	generations[socket]++;
+	pthread_mutex_unlock(&queues_lock);
+}
+
+void P2POutbound::removeSocket(int socket)
+{
+	pthread_mutex_lock(&queues_lock);
+
+	map<int, P2POutboundQueue>::iterator iter = queues.find(socket);
+	if (iter != queues.end())
+	{
+		iter->second.clear();
+		queues.erase(iter);
+	}
+
+	// Anyone waiting on this socket needs to find out it's gone
+	vector<P2PTask> waiters;
+	takeWaitersLocked(socket, waiters);
+	pthread_mutex_unlock(&queues_lock);
+
+	runWaiters(waiters);
+}
+
+unsigned int P2POutbound::getGeneration(int socket)
+{
+	pthread_mutex_lock(&queues_lock);
+	unsigned int generation = generations[socket];
+	pthread_mutex_unlock(&queues_lock);
+
+	return generation;
+}
+
+void P2POutbound::takeWaitersLocked(int socket, vector<P2PTask> &waiters)
+{
+	map<int, vector<P2PTask> >::iterator iter = space_waiters.find(socket);
+	if (iter != space_waiters.end())
+	{
+		waiters.swap(iter->second);
+		space_waiters.erase(iter);
+	}
+}
+
+void P2POutbound::runWaiters(vector<P2PTask> &waiters)
+{
+	// Outside the lock, so they can queue again straight away
+	for (unsigned int i = 0; i < waiters.size(); i++)
+	{
+		waiters[i].run(waiters[i].arg);
+	}
+}
+
+int P2POutbound::enqueueLocked(int socket, P2POutboundEntry &entry)
+{
+	map<int, P2POutboundQueue>::iterator iter = queues.find(socket);
+	if (iter == queues.end())
+	{
+		delete[] entry.data;
+		if (entry.file != NULL)
+			entry.file->release();
+		return SEND_CLOSED;
+	}
+
+	// A frame is accepted as long as the queue is under its bound, so any single frame fits
+	P2POutboundQueue & queue = iter->second;
+	if (queue.size() >= max_queue_bytes)
+	{
+		return SEND_FULL;
+	}
+
+	bool b_was_empty = queue.empty();
+	queue.push(entry);
+
+	// Nothing else is in flight, so try to send it right away
+	if (b_was_empty && queue.flush(socket) < 0)
+	{
+		// Leave the error for the reactor to notice when it reads
+		queue.clear();
+	}
+
+	// The select() fallback needs to be told to watch for writability
+	if (reactor != NULL && !queue.empty())
+	{
+		reactor->setWriteInterest(socket, true);
+	}
+
+	return SEND_QUEUED;
+}
+
+int P2POutbound::enqueue(int socket, char * data, unsigned int length)
+{
+	P2POutboundEntry entry = { data, length, 0, NULL, 0, 0 };
+
+	pthread_mutex_lock(&queues_lock);
+	int result = enqueueLocked(socket, entry);
+	pthread_mutex_unlock(&queues_lock);
+
+	if (result == SEND_FULL)
+	{
+		delete[] data;
+	}
+
+	return result;
+}
+
+int P2POutbound::enqueueMessage(int socket, string message)
+{
+	// Copy the framed message into a buffer the queue can own
+	char * data = new char[P2PFraming::FRAME_HEADER_SIZE + message.length()];
+	P2PFraming::writeFrameHeader(data, message.length());
+	memcpy(&data[P2PFraming::FRAME_HEADER_SIZE], message.data(), message.length());
+
+	return enqueue(socket, data, P2PFraming::FRAME_HEADER_SIZE + message.length());
+}
+
+int P2POutbound::tryEnqueue(int socket, char * data, unsigned int length)
+{
+	P2POutboundEntry entry = { data, length, 0, NULL, 0, 0 };
+
+	pthread_mutex_lock(&queues_lock);
+	int result = enqueueLocked(socket, entry);
+	pthread_mutex_unlock(&queues_lock);
+
+	return result;
+}
+
+int P2POutbound::tryEnqueueFile(int socket, char * header, unsigned int header_length,
+	P2PMappedFile * file, off_t file_offset, unsigned int file_length)
+{
+	// The queued region keeps the file open
+	file->retain();
+	P2POutboundEntry entry = { header, header_length, 0, file, file_offset, file_length };
+
+	pthread_mutex_lock(&queues_lock);
+	int result = enqueueLocked(socket, entry);
+	pthread_mutex_unlock(&queues_lock);
+
+	// A region that wasn't queued gives its reference back
+	if (result == SEND_FULL)
+	{
+		file->release();
+	}
+
+	return result;
+}
+
+unsigned int P2POutbound::getRoom(int socket)
+{
+	pthread_mutex_lock(&queues_lock);
+
+	unsigned int room = max_queue_bytes;
+	map<int, P2POutboundQueue>::iterator iter = queues.find(socket);
+	if (iter != queues.end())
+	{
+		room = (iter->second.size() < max_queue_bytes) ? max_queue_bytes - iter->second.size() : 0;
+	}
+
+	pthread_mutex_unlock(&queues_lock);
+	return room;
+}
+
+bool P2POutbound::notifyWhenSpace(int socket, void (*run)(void *), void * arg)
+{
+	pthread_mutex_lock(&queues_lock);
+
+	// Only a queue that's still full is worth waiting on
+	map<int, P2POutboundQueue>::iterator iter = queues.find(socket);
+	bool b_waiting = (iter != queues.end() && iter->second.size() >= max_queue_bytes);
+	if (b_waiting)
+	{
+		P2PTask waiter = { run, arg };
+		space_waiters[socket].push_back(waiter);
+	}
+
+	pthread_mutex_unlock(&queues_lock);
+	return b_waiting;
+}
+
+void P2POutbound::reapCompletions(int socket)
+{
+	pthread_mutex_lock(&queues_lock);
+
+	map<int, P2POutboundQueue>::iterator iter = queues.find(socket);
+	if (iter != queues.end() && iter->second.zerocopy_pending > 0)
+	{
+		iter->second.reapCompletions(socket);
+	}
+
+	pthread_mutex_unlock(&queues_lock);
+}
+
+int P2POutbound::flush(int socket)
+{
+	pthread_mutex_lock(&queues_lock);
+
+	int result = 0;
+	vector<P2PTask> waiters;
+	map<int, P2POutboundQueue>::iterator iter = queues.find(socket);
+	if (iter != queues.end())
+	{
+		result = iter->second.flush(socket);
+
+		// The connection is broken - drop what's queued, the reactor closes it when it reads
+		if (result < 0)
+		{
+			iter->second.clear();
+		}
+
+		if (reactor != NULL && iter->second.empty())
+		{
+			reactor->setWriteInterest(socket, false);
+		}
+
+		// Wake up producers waiting for room, once there's enough of it to be worth their while
+		if (iter->second.size() <= max_queue_bytes / WAKE_DIVISOR)
+		{
+			takeWaitersLocked(socket, waiters);
+		}
+	}
+
+	pthread_mutex_unlock(&queues_lock);
+
+	runWaiters(waiters);
+	return result;
+}
+
+bool P2POutbound::hasPending(int socket)
+{
+	pthread_mutex_lock(&queues_lock);
+
+	bool b_pending = false;
+	map<int, P2POutboundQueue>::iterator iter = queues.find(socket);
+	if (iter != queues.end())
+	{
+		b_pending = !iter->second.empty();
+	}
+
+	pthread_mutex_unlock(&queues_lock);
+
+	return b_pending;
+}
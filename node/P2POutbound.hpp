@@ -0,0 +1,163 @@
+#ifndef P2POUTBOUND_H
+#define P2POUTBOUND_H
+
+// Sending straight from the page cache
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <linux/errqueue.h>
+
+// MSG_ZEROCOPY, for headers that predate it
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+using namespace std;
+
+/**
+ * A file mapped for sending straight from the page cache. Queued regions
+ * hold references to it; the last one to let go unmaps and closes it.
+ */
+class P2PMappedFile
+{
+	private:
+		int descriptor;
+		char * data;
+		size_t length;
+		int references;
+
+	public:
+		P2PMappedFile(int, size_t);
+		bool isMapped();
+		int getDescriptor();
+		char * getData();
+		void retain();
+		void release();
+};
+
+/**
+ * Bytes in memory, optionally followed by a region of a mapped file. The
+ * offset counts through both.
+ */
+typedef struct {
+	char * data;
+	unsigned int length;
+	unsigned int offset;
+	P2PMappedFile * file;
+	off_t file_offset;
+	unsigned int file_length;
+} P2POutboundEntry;
+
+/**
+ * Bytes waiting to go out on one socket
+ */
+class P2POutboundQueue
+{
+	private:
+		deque<P2POutboundEntry> entries;
+		unsigned int queued_bytes;
+
+		bool sendsFromMapping(P2POutboundEntry&);
+		void release(size_t);
+
+	public:
+		P2POutboundQueue();
+		void push(P2POutboundEntry&);
+		int flush(int);
+		void reapCompletions(int);
+		void clear();
+		bool empty();
+		unsigned int size();
+
+		// MSG_ZEROCOPY was turned on for the socket, and sends still to be confirmed
+		bool b_zerocopy;
+		unsigned int zerocopy_pending;
+};
+
+/**
+ * Outbound queues for every socket of a node. Producers on any thread queue
+ * frames; the reactor flushes whatever is left when a socket becomes writable.
+ */
+class P2POutbound
+{
+	private:
+		map<int, P2POutboundQueue> queues;
+		pthread_mutex_t queues_lock;
+		P2PReactor * reactor;
+		unsigned int max_queue_bytes;
+
+		// Bumped every time a socket number is handed out again
+		map<int, unsigned int> generations;
+
+		// Producers to call back once a full queue has drained, or its socket is gone
+		map<int, vector<P2PTask> > space_waiters;
+
+		int enqueueLocked(int, P2POutboundEntry&);
+		void takeWaitersLocked(int, vector<P2PTask>&);
+		static void runWaiters(vector<P2PTask>&);
+
+		static bool b_zerocopy_enabled;
+
+	public:
+		P2POutbound();
+		void setReactor(P2PReactor *);
+		void setMaxQueueBytes(unsigned int);
+
+		void addSocket(int);
+		void removeSocket(int);
+
+		// Which connection on the socket number this is, so work queued for an old one can tell
+		unsigned int getGeneration(int);
+
+		// Queue a frame - ownership of the buffer passes to the queue
+		int enqueue(int, char *, unsigned int);
+		int enqueueMessage(int, string);
+
+		// Queue a frame without waiting - if the queue is full, the buffer stays with the caller
+		int tryEnqueue(int, char *, unsigned int);
+
+		// Same, for a header followed by a region of a mapped file, which is sent with sendfile()
+		int tryEnqueueFile(int, char *, unsigned int, P2PMappedFile *, off_t, unsigned int);
+
+		// Bytes the queue takes before it's full - a closed socket has no bound, so queueing finds out
+		unsigned int getRoom(int);
+
+		// Call the function once the queue has drained, or the socket is gone - false if it has room now.
+		// It's called on the reactor thread, so it should only hand the work back to a pool.
+		bool notifyWhenSpace(int, void (*)(void *), void *);
+
+		// Large file regions go out with MSG_ZEROCOPY on sockets opened after this is turned on
+		static void setZeroCopy(bool);
+		static bool isZeroCopy();
+
+		// Clear MSG_ZEROCOPY notifications off the socket's error queue
+		void reapCompletions(int);
+
+		// Write as much as the socket will take
+		int flush(int);
+		bool hasPending(int);
+
+		// Results of queueing
+		static const int SEND_QUEUED = 0;
+		static const int SEND_FULL = 1;
+		static const int SEND_CLOSED = 2;
+
+		// Bound on the bytes waiting on any one socket
+		static const unsigned int DEFAULT_MAX_QUEUE_BYTES = 1024 * 1024;
+
+		// Waiting producers are called back once the queue is down to this fraction of the bound
+		static const unsigned int WAKE_DIVISOR = 2;
+
+		// Frames gathered into a single sendmsg
+		static const int MAX_FLUSH_ENTRIES = 64;
+
+		// Smallest region worth pinning for MSG_ZEROCOPY - below this, copying is cheaper
+		static const unsigned int ZEROCOPY_MIN_BYTES = 16 * 1024;
+};
+
+#endif
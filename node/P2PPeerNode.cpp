@@ -25,18 +25,31 @@ void P2PPeerNode::construct(int port, int max_connections_value)
 
 	// Define server limits
 	MAX_CONNECTIONS = max_connections_value;
-	BUFFER_SIZE = 513; // Size given in bytes
-	INCOMING_MESSAGE_SIZE = BUFFER_SIZE - 1;
-
-	// Keep track of the client sockets
-	sockets = new int[MAX_CONNECTIONS];
-
-	// Handle the buffer
-	buffer = new char[BUFFER_SIZE];
+	BUFFER_SIZE = 65536; // Size of each read, given in bytes
 
 	// Default bind offset
 	number_bind_tries = 1;
 
+	// Default worker pool sizes
+	chunk_pool_size = 4;
+	upload_pool_size = 8;
+	b_reuse_port = false;
+	connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+	pthread_mutex_init(&content_lock, NULL);
+	pthread_mutex_init(&deferred_lock, NULL);
+	pthread_mutex_init(&close_lock, NULL);
+	pthread_mutex_init(&file_lists_lock, NULL);
+
+	// Default to epoll - the reactor falls back to select() if it's unavailable
+	reactor_backend = P2PReactor::BACKEND_EPOLL;
+
+	// Advertise everything this build supports
+	local_capabilities = P2PProtocol::localCapabilities(P2PFileTransfer::CHUNK_SIZE);
+	if (P2PCompression::isEnabled())
+	{
+		local_capabilities.features |= P2PProtocol::FEATURE_COMPRESSION;
+	}
+
 	// Keep track of the last update to the sockets
 	gettimeofday(&sockets_last_modified, NULL);
 }
@@ -46,6 +59,21 @@ void P2PPeerNode::setBindMaxOffset(unsigned int max_offset)
 	number_bind_tries = max_offset;
 }
 
+void P2PPeerNode::setReusePort(bool reuse_port)
+{
+	b_reuse_port = reuse_port;
+}
+
+void P2PPeerNode::setReactorBackend(int backend)
+{
+	reactor_backend = backend;
+}
+
+void P2PPeerNode::setConnectTimeout(int timeout)
+{
+	connect_timeout = timeout;
+}
+
 //void P2PPeerNode::setBindPort(string address) {}
 //void P2PPeerNode::setMaxClients(string address) {}
 
@@ -54,6 +82,20 @@ void P2PPeerNode::start()
 	// Open the socket and listen for connections
 	this->initialize();
 	this->openPrimarySocket();
+
+	// Open the queue that hands messages to the application
+	message_queue.open(P2PMessageQueue::DEFAULT_CAPACITY);
+
+	// Start the worker pools
+	chunk_pool.start("chunk workers", chunk_pool_size);
+	upload_pool.start("upload workers", upload_pool_size);
+
+	// Open the I/O backend picked at startup
+	io_backend.open();
+	if (io_backend.getBackend() == P2PIOBackend::BACKEND_URING)
+	{
+		cout << "Using io_uring I/O backend" << endl;
+	}
 }
 
 
@@ -62,11 +104,8 @@ void P2PPeerNode::start()
  */
 void P2PPeerNode::initialize()
 {
-	// Ensure that all sockets are invalid to boot
-	for (int i = 0; i < MAX_CONNECTIONS; i++)
-	{
-		sockets[i] = 0;
-	}
+	// One slot for every connection, plus the primary socket
+	connection_table.open(MAX_CONNECTIONS + 1);
 }
 
 /**
@@ -92,6 +131,13 @@ void P2PPeerNode::openPrimarySocket()
         exit(1);
     }
 
+	// Let several reactors listen on the same port, the kernel balances new connections across them
+	if (b_reuse_port && setsockopt(primary_socket, SOL_SOCKET, SO_REUSEPORT, (char *)&opt, sizeof(opt)) < 0)
+	{
+		perror("Error: could not use setsockopt to set 'SO_REUSEPORT'");
+		exit(1);
+	}
+
 	// Bind the socket
 	port_offset = 0;
 	int socket_status = -1;
@@ -118,10 +164,16 @@ void P2PPeerNode::openPrimarySocket()
 	// Set the public-facing port
 	public_port = PORT_NUMBER + port_offset;
 
-	P2PSocket a_socket;
-	a_socket.socket_id = primary_socket;
-	a_socket.type = "primary";
-	socket_vector.push_back(a_socket);
+	// Accept connections without blocking, so the reactor can drain the backlog on each wakeup
+	P2PReactor::setNonBlocking(primary_socket);
+
+	// Register the primary socket with the reactor
+	reactor.open(reactor_backend);
+	reactor.addSocket(primary_socket);
+	outbound.setReactor(&reactor);
+
+	connection_table.add(primary_socket, "primary", "");
+	connection_table.setCapabilities(primary_socket, local_capabilities);
 
 	// Keep track of the last update to the sockets
 	gettimeofday(&sockets_last_modified, NULL);
@@ -149,70 +201,122 @@ int P2PPeerNode::bindPrimarySocket(int socket, int offset)
  * Make a connection
  */
 int P2PPeerNode::makeConnection(string name, string host, int port)
+{
+	// Wait for the connect - for callers that need the answer before going on
+	return openConnection(name, host, port, true);
+}
+
+int P2PPeerNode::dialConnection(string name, string host, int port)
+{
+	// Start the connect and let the reactor finish it - only call this from the reactor
+	return openConnection(name, host, port, false);
+}
+
+int P2PPeerNode::openConnection(string name, string host, int port, bool b_wait)
 {
 	struct sockaddr_in server_address;
-	struct hostent * server;
 
-	// Create the socket - use SOCK_STREAM for TCP, SOCK_DGRAM for UDP
-	int new_socket = socket(AF_INET, SOCK_STREAM, 0);
-	if (new_socket < 0)
-	{
-		cout << "Error: could not open socket" << endl;
-		return -1;
-	}
+	// Clear out the server_address memory space
+	memset((char *) &server_address, 0, sizeof(server_address));
 
 	// Find the server host
-	server = gethostbyname(host.c_str());
-	if (server == NULL)
+	if (!resolver.resolve(host, server_address.sin_addr))
 	{
 		cout << "Error: could not find the host" << endl;
 		return -1;
 	}
 
-	// Clear out the server_address memory space
-	memset((char *) &server_address, 0, sizeof(server_address));
-
 	// Configure the socket information
 	server_address.sin_family = AF_INET;
-	memcpy(server->h_addr, &server_address.sin_addr.s_addr, server->h_length);
 	server_address.sin_port = htons(port);
 
-	// Connect to the server
-	if (connect(new_socket, (struct sockaddr *) &server_address, sizeof(server_address)) < 0) 
+	// Create the socket - use SOCK_STREAM for TCP, SOCK_DGRAM for UDP
+	int new_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (new_socket < 0)
 	{
-		perror("Error: could not connect to host");
+		cout << "Error: could not open socket" << endl;
 		return -1;
 	}
 
-	// Add socket to open slot
-	for (int i = 0; i <= MAX_CONNECTIONS; i++) 
+	// Everything from here on goes through the reactor, including the connect
+	P2PReactor::setNonBlocking(new_socket);
+
+	// Connect to the server
+	bool b_pending = false;
+	if (connect(new_socket, (struct sockaddr *) &server_address, sizeof(server_address)) < 0)
 	{
-		// If we reach the maximum number of clients, we've gone too far
-		// Can't make a new connection!
-		if (i == MAX_CONNECTIONS)
+		if (errno != EINPROGRESS)
 		{
-			// Report connection denied
-			cout << "Reached maximum number of connections, can't add new one" << endl;
+			perror("Error: could not connect to host");
 			close(new_socket);
 			return -1;
 		}
 
-		// Skip all valid client sockets
-		if (sockets[i] != 0) continue;
+		b_pending = true;
+	}
+
+	// Wait it out here if the caller can't go on without the connection
+	if (b_pending && b_wait)
+	{
+		struct pollfd poll_descriptor;
+		poll_descriptor.fd = new_socket;
+		poll_descriptor.events = POLLOUT;
+
+		int error = 0;
+		socklen_t error_length = sizeof(error);
+		int ready = poll(&poll_descriptor, 1, connect_timeout);
+		if (ready > 0)
+		{
+			getsockopt(new_socket, SOL_SOCKET, SO_ERROR, &error, &error_length);
+		}
 
-		// Add new socket
-		sockets[i] = new_socket;
+		if (ready <= 0 || error != 0)
+		{
+			if (ready == 0)
+				errno = ETIMEDOUT;
+			else if (ready > 0)
+				errno = error;
 
-		P2PSocket a_socket;
-		a_socket.socket_id = new_socket;
-		a_socket.type = "server";
-		a_socket.name = name;
-		socket_vector.push_back(a_socket);
+			perror("Error: could not connect to host");
+			close(new_socket);
+			return -1;
+		}
 
-		// Keep track of the last update to the sockets
-		gettimeofday(&sockets_last_modified, NULL);
+		b_pending = false;
+	}
+
+	// Add socket to an open slot - if there are none, we've gone too far
+	if (!connection_table.add(new_socket, "server", name))
+	{
+		// Report connection denied
+		cout << "Reached maximum number of connections, can't add new one" << endl;
+		close(new_socket);
+		return -1;
+	}
+
+	outbound.addSocket(new_socket);
+	reactor.addSocket(new_socket);
+	sendHello(new_socket);
+
+	// Keep track of the last update to the sockets
+	gettimeofday(&sockets_last_modified, NULL);
+
+	// The reactor finishes the connect once the socket turns writable - anything
+	// sent in the meantime waits in the outbound queue
+	if (b_pending)
+	{
+		timeval deadline;
+		gettimeofday(&deadline, NULL);
+		deadline.tv_sec += connect_timeout / 1000;
+		deadline.tv_usec += (connect_timeout % 1000) * 1000;
+		if (deadline.tv_usec >= 1000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_usec -= 1000000;
+		}
 
-		break;
+		pending_connects[new_socket] = deadline;
+		reactor.setWriteInterest(new_socket, true);
 	}
 
 	cout << "Find IP of peers containing the target file ---"<< host << ':' << port << endl;
@@ -220,6 +324,103 @@ int P2PPeerNode::makeConnection(string name, string host, int port)
 	return new_socket;
 }
 
+bool P2PPeerNode::finishConnect(int socket)
+{
+	map<int, timeval>::iterator iter = pending_connects.find(socket);
+	if (iter == pending_connects.end())
+	{
+		return true;
+	}
+
+	// See how the connect went
+	int error = 0;
+	socklen_t error_length = sizeof(error);
+	if (getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0)
+	{
+		error = errno;
+	}
+
+	if (error != 0)
+	{
+		cout << "Error: could not connect to peer: " << strerror(error) << endl;
+		closeSocket(socket);
+		return false;
+	}
+
+	// No error yet - only done once the peer is actually there
+	struct sockaddr_in peer_address;
+	socklen_t peer_address_length = sizeof(peer_address);
+	if (getpeername(socket, (struct sockaddr *) &peer_address, &peer_address_length) == 0)
+	{
+		pending_connects.erase(iter);
+	}
+
+	return true;
+}
+
+void P2PPeerNode::completeConnects(vector<int> &ready_sockets, vector<int> &writable_sockets)
+{
+	if (pending_connects.size() == 0)
+	{
+		return;
+	}
+
+	// Any activity on a connecting socket means the connect finished, one way or another
+	vector<int> failed_sockets;
+	for (unsigned int i = 0; i < writable_sockets.size(); i++)
+	{
+		if (!finishConnect(writable_sockets[i]))
+			failed_sockets.push_back(writable_sockets[i]);
+	}
+
+	for (unsigned int i = 0; i < ready_sockets.size(); i++)
+	{
+		if (!finishConnect(ready_sockets[i]))
+			failed_sockets.push_back(ready_sockets[i]);
+	}
+
+	// Failed sockets are already closed, keep them away from the handlers
+	for (unsigned int i = 0; i < failed_sockets.size(); i++)
+	{
+		ready_sockets.erase(remove(ready_sockets.begin(), ready_sockets.end(), failed_sockets[i]), ready_sockets.end());
+		writable_sockets.erase(remove(writable_sockets.begin(), writable_sockets.end(), failed_sockets[i]), writable_sockets.end());
+	}
+}
+
+int P2PPeerNode::expireConnects()
+{
+	if (pending_connects.size() == 0)
+	{
+		return -1;
+	}
+
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	// Give up on connects past their deadline, and find the next deadline
+	long next_timeout = -1;
+	vector<int> expired_sockets;
+	map<int, timeval>::iterator iter;
+	for (iter = pending_connects.begin(); iter != pending_connects.end(); ++iter)
+	{
+		long remaining = (iter->second.tv_sec - now.tv_sec) * 1000
+			+ (iter->second.tv_usec - now.tv_usec) / 1000;
+
+		if (remaining <= 0)
+			expired_sockets.push_back(iter->first);
+		else if (next_timeout < 0 || remaining < next_timeout)
+			next_timeout = remaining;
+	}
+
+	for (unsigned int i = 0; i < expired_sockets.size(); i++)
+	{
+		cout << "Error: timed out connecting to peer" << endl;
+		closeSocket(expired_sockets[i]);
+	}
+
+	return (int) next_timeout;
+}
+
 /*
 bool P2PPeerNode::isConnection(string address, int port)
 {
@@ -237,106 +438,79 @@ bool P2PPeerNode::isConnection(string address, int port)
 
 void P2PPeerNode::queueSocketToClose(int socket_id)
 {
+	pthread_mutex_lock(&close_lock);
 	sockets_to_close.push_back(socket_id);
+	pthread_mutex_unlock(&close_lock);
+
+	reactor.wakeup();
 }
 
 void P2PPeerNode::queueSocketToCloseByName(string socket_name)
 {
-	P2PSocket socket = getSocketByName(socket_name);
-	sockets_to_close.push_back(socket.socket_id);
+	P2PSocket socket;
+	if (connection_table.findByName(socket_name, socket))
+	{
+		pthread_mutex_lock(&close_lock);
+		sockets_to_close.push_back(socket.socket_id);
+		pthread_mutex_unlock(&close_lock);
+
+		reactor.wakeup();
+	}
 }
 
 void P2PPeerNode::closeSocketByName(string socket_name)
 {
-	// Remove the socket from the vector
-	vector<P2PSocket>::iterator iter;
-	for (iter = socket_vector.begin(); iter != socket_vector.end(); )
+	// Close every socket going by this name
+	P2PSocket socket;
+	while (connection_table.findByName(socket_name, socket))
 	{
-		if (iter->name.compare(socket_name) == 0)
-		{
-			// Remove from the int array
-			for (int i = 0; i < MAX_CONNECTIONS; i++)
-			{
-				if (iter->socket_id == sockets[i])
-				{
-					sockets[i] = 0;
-					break;
-				}
-			}
-
-			iter = socket_vector.erase(iter);
-
-			// Close and free the socket
-			close(iter->socket_id);
-		}
-		else
-			++iter;
+		closeSocket(socket.socket_id);
 	}
-
-	// Keep track of the last update to the sockets
-	gettimeofday(&sockets_last_modified, NULL);
 }
 
 void P2PPeerNode::closeSocket(int socket)
 {
-	// Remove the socket from the vector
-	vector<P2PSocket>::iterator iter;
-	for (iter = socket_vector.begin(); iter != socket_vector.end(); )
+	// Free the slot - a socket that isn't in the table was already closed
+	if (!connection_table.remove(socket))
 	{
-		if (iter->socket_id == socket)
-			iter = socket_vector.erase(iter);
-		else
-			++iter;
+		return;
 	}
 
 	// Keep track of the last update to the sockets
 	gettimeofday(&sockets_last_modified, NULL);
 
-	// Remove from the int array
-	for (int i = 0; i < MAX_CONNECTIONS; i++)
-	{
-		if (socket == sockets[i])
-		{
-			sockets[i] = 0;
-			break;
-		}
-	}
-
 	// Close and free the socket
+	pending_connects.erase(socket);
+	connection_pool.removeSocket(socket);
+	reactor.removeSocket(socket);
+	outbound.removeSocket(socket);
 	close(socket);
+
+	// Stop serving the peer, and hand whatever it owed us to the file's other peers
+	upload_registry.removeSocket(socket);
+	rate_limiter.removePeer(socket);
+	vector<unsigned int> file_ids = request_window.removeSocket(socket);
+	for (unsigned int i = 0; i < file_ids.size(); i++)
+	{
+		fillRequests(file_ids[i]);
+	}
 }
 
 /**
  * Handle Connection Activity
  */
 
-void P2PPeerNode::resetSocketDescriptors()
+void P2PPeerNode::closeQueuedSockets()
 {
-	// Determine if we have any sockets to close
-	while (sockets_to_close.size() > 0)
-	{
-		closeSocket(sockets_to_close.front());
-		sockets_to_close.erase(sockets_to_close.begin());
-	}
-
-	// Reset the current socket descriptors
-	FD_ZERO(&socket_descriptors);
-	FD_SET(primary_socket, &socket_descriptors);
+	// Take the sockets queued from other threads, then close them outside the lock
+	vector<int> sockets;
+	pthread_mutex_lock(&close_lock);
+	sockets.swap(sockets_to_close);
+	pthread_mutex_unlock(&close_lock);
 
-	// Keep track of the maximum socket descriptor for select()
-	max_connection = primary_socket;
-
-	// Add remaining sockets
-	for (int i = 0; i < MAX_CONNECTIONS; i++)
+	for (unsigned int i = 0; i < sockets.size(); i++)
 	{
-		// Validate the socket
-		if (sockets[i] <= 0) continue;
-
-		// Add socket to set
-		FD_SET(sockets[i], &socket_descriptors);
-
-		// Update the maximum socket descriptor
-		max_connection = max(max_connection, sockets[i]);
+		closeSocket(sockets[i]);
 	}
 }
 
@@ -346,220 +520,686 @@ void P2PPeerNode::handleNewConnectionRequest()
 	struct sockaddr_in client_address;
 	socklen_t client_address_length = sizeof(client_address);
 
-	// Accept a new socket
-	int new_socket = accept(primary_socket, (struct sockaddr *)&client_address, &client_address_length);
-
-	// Validate the new socket
-	if (new_socket < 0)
+	// The primary socket is edge-triggered, so accept until the backlog is empty
+	while (true)
 	{
-		perror("Error: failure to accept new socket");
-		exit(1);
-	}
+		// Accept a new socket
+		client_address_length = sizeof(client_address);
+		int new_socket = accept(primary_socket, (struct sockaddr *)&client_address, &client_address_length);
 
-	// Report new connection
-	//cout << "New Connection Request: " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
+		// Validate the new socket
+		if (new_socket < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
 
-	// Add socket to open slot
-	for (int i = 0; i <= MAX_CONNECTIONS; i++)
-	{
-		// If we reach the maximum number of clients, we've gone too far
+			perror("Error: failure to accept new socket");
+			exit(1);
+		}
+
+		// Report new connection
+		//cout << "New Connection Request: " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
+
+		// Add socket to an open slot - if there are none, we've gone too far
 		// Can't accept a new connection!
-		if (i == MAX_CONNECTIONS)
+		if (!connection_table.add(new_socket, "client", ""))
 		{
 			// Report connection denied
 			cout << "Reached maximum number of clients, denied connection request" << endl;
 
 			// Send refusal message to socket
-			string message = "Server is too busy, please try again later\r\n";
+			string message = P2PFraming::frameMessage("Server is too busy, please try again later\r\n");
 			write(new_socket, message.c_str(), message.length());
 
 			close(new_socket);
-			break;
+			continue;
 		}
 
-		// Skip all valid client sockets
-		if (sockets[i] != 0) continue;
-
-		// Add new socket
-		sockets[i] = new_socket;
-
-		P2PSocket a_socket;
-		a_socket.socket_id = new_socket;
-		a_socket.type = "client";
-		a_socket.name = "";
-		socket_vector.push_back(a_socket);
+		P2PReactor::setNonBlocking(new_socket);
+		outbound.addSocket(new_socket);
+		reactor.addSocket(new_socket);
+		sendHello(new_socket);
 
 		// Keep track of the last update to the sockets
 		gettimeofday(&sockets_last_modified, NULL);
-
-		break;
 	}
 }
 
-void P2PPeerNode::handleExistingConnections()
+void P2PPeerNode::handleExistingConnections(vector<int> &ready_sockets)
 {
 	// Prepare the client address
 	struct sockaddr_in client_address;
 	socklen_t client_address_length = sizeof(client_address);
 
-	// Iterate over all clients
-	for (int i = 0; i < MAX_CONNECTIONS; i++) 
-	{
-		if (!FD_ISSET(sockets[i], &socket_descriptors)) continue;
-
-		// Clear out the buffer
-		memset(&buffer[0], 0, BUFFER_SIZE);
+	// Sockets are edge-triggered, so read until there is nothing left on each
+	vector<int> pending_sockets = ready_sockets;
+	vector<int> still_pending;
+	vector<P2PIORequest> requests;
 
-		// Read the incoming message into the buffer
-		int message_size = read(sockets[i], buffer, INCOMING_MESSAGE_SIZE);
-
-		// Handle a closed connection
-		if (message_size == 0)
+	while (pending_sockets.size() > 0)
+	{
+		// Read from every pending socket in one batch, straight into its frame buffer
+		requests.clear();
+		for (unsigned int i = 0; i < pending_sockets.size(); i++)
 		{
-			// Report the disconnection
-			getpeername(sockets[i], (struct sockaddr*)&client_address, &client_address_length);
-			//cout << "Connection closed: " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
+			P2PFrameBuffer * frame_buffer = connection_table.getFrameBuffer(pending_sockets[i]);
+			if (frame_buffer == NULL) continue;
 
-			// Close and free the socket
-			//queueSocketToClose(sockets[i]);
-			closeSocket(sockets[i]);
+			char * destination = frame_buffer->reserve(BUFFER_SIZE);
+			requests.push_back(P2PIOBackend::makeRequest(P2PIOBackend::IO_RECV, pending_sockets[i], 
+				destination, BUFFER_SIZE, 0, MSG_DONTWAIT));
 		}
-		else
+
+		io_backend.submit(requests);
+
+		still_pending.clear();
+		for (unsigned int i = 0; i < requests.size(); i++)
 		{
-			// Make a copy of the vector to avoid concurrency issues
-			vector<P2PSocket> socket_vector_copy;
-			socket_vector_copy = socket_vector;
+			int socket_id = requests[i].descriptor;
+			int message_size = requests[i].result;
 
-			// Remove the socket from the vector
-			vector<P2PSocket>::iterator iter;
-			for (iter = socket_vector_copy.begin(); iter != socket_vector_copy.end(); ++iter)
+			// Nothing more to read for now
+			if (message_size == -EAGAIN || message_size == -EWOULDBLOCK)
 			{
-				if (iter->socket_id == sockets[i])
+				// Zero-copy notifications keep the socket flagged until they're read
+				if (P2POutbound::isZeroCopy())
 				{
-					// Parse the request
-					vector<string> request_parsed = P2PCommon::parseRequest(buffer);
+					outbound.reapCompletions(socket_id);
+				}
 
-					// Trim whitespace from the command
-					request_parsed[0] = P2PCommon::trimWhitespace(request_parsed[0]);
+				continue;
+			}
+			else if (message_size == -EINTR)
+			{
+				still_pending.push_back(socket_id);
+				continue;
+			}
 
-					if (request_parsed[0].compare("fileTransfer") == 0)
-					{
-						// Get the File ID
-						vector<string> file_id_info = P2PCommon::splitString(request_parsed[1], ':');
-						vector<string> header_info = P2PCommon::splitString(request_parsed[1], '\t');
-						int file_id = stoi(P2PCommon::trimWhitespace(header_info[0]));
-
-						// Make a copy of the data
-						char * buffer_copy = new char[BUFFER_SIZE];
-						memcpy(buffer_copy, buffer, BUFFER_SIZE);
-
-						// Pack the data neatly for travel
-						FileDataPacket packet;
-						packet.file_item = getDownloadFileItem(file_id);
-						packet.packet = buffer_copy;
-
-						// Perform this as a separate thread
-						pthread_t thread;
-						if (pthread_create(&thread, NULL, &P2PPeerNode::handleFileTransfer, (void *)&packet) != 0)
-						{
-							perror("Error: could not spawn thread");
-							//exit(1);
-						}
-					}
-					//else if (request_parsed[0].compare("initiateFileTransfer") == 0)
-					else if (request_parsed[0].compare("fileRequest") == 0)
-					{
-						// Get the File ID
-						int file_id = stoi(P2PCommon::trimWhitespace(request_parsed[1]));
-						string name = P2PCommon::trimWhitespace(request_parsed[2]);
-						int size = stoi(P2PCommon::trimWhitespace(request_parsed[3]));
-						unsigned int start = stoi(P2PCommon::trimWhitespace(request_parsed[4]));
-						unsigned int count = stoi(P2PCommon::trimWhitespace(request_parsed[5]));
-
-						// Prepare the request
-						FileDataRequest request;
-						request.socket_id = iter->socket_id;
-						request.start = start;
-						request.count = count;
-						request.file_item = getLocalFileItem(name, size);
-
-						// Set the file ID
-						request.file_item.file_id = file_id;
-
-						// Perform this as a separate thread
-						pthread_t thread;
-						if (pthread_create(&thread, NULL, &P2PPeerNode::initiateFileTransfer, (void *)&request) != 0)
-						{
-							perror("Error: could not spawn thread");
-							//exit(1);
-						}
-
-						// Wait for the thread to obtain access to the data without freeing the memory
-						sleep(1);
-					}
-					else if (request_parsed[0].compare("fileAddress") == 0)
-					{
-						prepareFileTransferRequest(request_parsed);
-					}
-					else if (iter->type.compare("server") == 0)
-					{
-						this->enqueueMessage(sockets[i], buffer);
-					}
-					else if (iter->type.compare("client") == 0)
-					{
-						this->enqueueMessage(sockets[i], buffer);
-					}
-				}
+			// Handle a closed connection
+			if (message_size <= 0)
+			{
+				// Report the disconnection
+				getpeername(socket_id, (struct sockaddr*)&client_address, &client_address_length);
+				//cout << "Connection closed: " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
+
+				// Close and free the socket
+				//queueSocketToClose(socket_id);
+				closeSocket(socket_id);
+				continue;
 			}
+
+			// Hand over every complete frame - partial frames wait for the next read
+			P2PFrameBuffer & frame_buffer = *connection_table.getFrameBuffer(socket_id);
+			frame_buffer.commit(message_size);
+
+			char * frame;
+			unsigned int frame_length;
+			while (frame_buffer.nextFrame(frame, frame_length))
+			{
+				handleSocketMessage(socket_id, frame, frame_length);
+			}
+
+			// A peer announcing an absurd frame is broken, drop it
+			if (frame_buffer.isOversized())
+			{
+				cout << "Error: frame too large, closing connection" << endl;
+				closeSocket(socket_id);
+				continue;
+			}
+
+			still_pending.push_back(socket_id);
 		}
+
+		pending_sockets.swap(still_pending);
 	}
 }
 
-void P2PPeerNode::listenForActivity()
+void P2PPeerNode::handleSocketMessage(int socket_id, char * buffer, unsigned int length)
 {
-	while (true) 
+	// Find who sent it
+	P2PSocket * socket = connection_table.find(socket_id);
+	if (socket == NULL)
 	{
-		// Ready the socket descriptors
-		this->resetSocketDescriptors();
-  
-		// Wait for activity
-		int activity = select(max_connection + 1, &socket_descriptors, NULL, NULL, NULL);
+		return;
+	}
 
-		// Validate the activity
-		if ((activity < 0) && (errno!=EINTR))
+	// Binary messages are decoded straight from the frame
+	if (P2PProtocol::isBinary(buffer, length))
+	{
+		handleBinaryMessage(socket, buffer, length);
+		return;
+	}
+
+	// Parse the request - the lines point into the frame, nothing is copied
+	vector<P2PStringView> & request_parsed = request_lines;
+	if (P2PTokenizer::splitLines(P2PStringView(buffer, length), request_parsed) == 0)
+	{
+		return;
+	}
+
+	// Trim whitespace from the command
+	P2PStringView command = request_parsed[0].trim();
+
+	if (command.equals("fileTransfer") && request_parsed.size() >= 2)
+	{
+		// Get the File ID
+		P2PStringView header_info[1];
+		int file_id = 0;
+		if (P2PTokenizer::split(request_parsed[1], '\t', header_info, 1) < 1 || !header_info[0].trim().toInt(file_id))
 		{
-			perror("Error: select failed");
-			exit(1);
+			cout << "Error: malformed file transfer header, dropping it" << endl;
+			return;
 		}
 
-		// Anything on the primary socket is a new connection
-		if (FD_ISSET(primary_socket, &socket_descriptors))
+		// Make a terminated copy of the data
+		char * buffer_copy = new char[length + 1];
+		memcpy(buffer_copy, buffer, length);
+		buffer_copy[length] = 0;
+
+		// Pack the data neatly for travel - the task owns the packet,
+		// since the reactor moves straight on to the next read
+		FileDataPacket * packet = new FileDataPacket;
+		packet->file_item = getDownloadFileItem(file_id);
+		packet->file_item.file_id = file_id;
+		packet->packet = buffer_copy;
+		packet->length = length;
+		packet->checksum = getChecksum(socket_id);
+		packet->node = this;
+
+		// Verify and write the chunk on the chunk pool
+		chunk_pool.submit(&P2PPeerNode::handleFileTransfer, (void *)packet);
+	}
+	//else if (command.equals("initiateFileTransfer"))
+	else if (command.equals("fileRequest") && request_parsed.size() >= 6)
+	{
+		// Get the File ID
+		int file_id, size, start, count;
+		string name = request_parsed[2].trim().toString();
+		if (!request_parsed[1].trim().toInt(file_id) || !request_parsed[3].trim().toInt(size)
+			|| !request_parsed[4].trim().toInt(start) || !request_parsed[5].trim().toInt(count))
 		{
-			this->handleNewConnectionRequest();
+			cout << "Error: malformed file request, dropping it" << endl;
+			return;
 		}
 
-		// Perform any open activities on all other clients
-		this->handleExistingConnections();
+		submitUpload(socket->socket_id, 0, file_id, name, size, start, count, P2PProtocol::PROTOCOL_TEXT);
 	}
-}
+	else if (command.equals("hello") && request_parsed.size() >= 8)
+	{
+		// One number per line, in the order of the binary hello
+		unsigned long long fields[7];
+		for (unsigned int i = 0; i < 7; i++)
+		{
+			if (!request_parsed[i + 1].trim().toUnsigned(fields[i]))
+			{
+				cout << "Error: malformed hello, dropping it" << endl;
+				return;
+			}
+		}
 
-void P2PPeerNode::monitorTransfers()
-{
-	P2PFileTransfer file_transfer;
-	map<int, int> file_to_missing_piece;
+		P2PCapabilities remote;
+		remote.version = fields[0];
+		remote.features = fields[1];
+		remote.max_frame_size = fields[2];
+		remote.pipeline_depth = fields[3];
+		remote.max_block_chunks = fields[4];
+		remote.chunk_size = fields[5];
+		remote.checksums = fields[6];
 
-	while (true)
+		applyCapabilities(socket->socket_id, remote);
+	}
+	else if (command.equals("blockRequest") && request_parsed.size() >= 7)
 	{
-		// Give it a rest
-		sleep(3);
+		// Same as a file request, tagged with the downloader's request ID
+		int request_id, file_id, size, start, count;
+		string name = request_parsed[3].trim().toString();
+		if (!request_parsed[1].trim().toInt(request_id) || !request_parsed[2].trim().toInt(file_id)
+			|| !request_parsed[4].trim().toInt(size) || !request_parsed[5].trim().toInt(start)
+			|| !request_parsed[6].trim().toInt(count))
+		{
+			cout << "Error: malformed block request, dropping it" << endl;
+			return;
+		}
 
-		// Check to see how file transfers are doing.
-		// If any get stuck, make a request to download more parts.	
-		file_transfer.reviewTransfers(download_file_list);
+		submitUpload(socket->socket_id, request_id, file_id, name, size, start, count, P2PProtocol::PROTOCOL_TEXT);
+	}
+	else if (command.equals("blockCancel") && request_parsed.size() >= 2)
+	{
+		int request_id;
+		if (request_parsed[1].trim().toInt(request_id))
+		{
+			upload_registry.cancel(socket->socket_id, request_id);
+		}
+	}
+	else if (command.equals("blockReject") && request_parsed.size() >= 2)
+	{
+		// Send the block somewhere else
+		int request_id;
+		unsigned int file_id;
+		if (request_parsed[1].trim().toInt(request_id) && request_window.reject(socket->socket_id, request_id, file_id))
+		{
+			fillRequests(file_id);
+		}
+	}
+	else if (command.equals("pieceHashRequest") && request_parsed.size() >= 3)
+	{
+		int file_id;
+		if (request_parsed[1].trim().toInt(file_id))
+		{
+			sendPieceHashes(socket->socket_id, file_id, request_parsed[2].trim().toString(), P2PProtocol::PROTOCOL_TEXT);
+		}
+	}
+	else if (command.equals("pieceHashes") && request_parsed.size() >= 5)
+	{
+		// The root, size and piece size, then one hash per line in hex
+		int file_id;
+		unsigned long long size, piece_size;
+		if (!request_parsed[1].trim().toInt(file_id) || !request_parsed[3].trim().toUnsigned(size)
+			|| !request_parsed[4].trim().toUnsigned(piece_size))
+		{
+			cout << "Error: malformed piece hashes, dropping them" << endl;
+			return;
+		}
 
-		// If any are newly completed, remove them from the list
-		vector<FileItem>::iterator iter;
-		for (iter = download_file_list.begin(); iter < download_file_list.end(); )
+		vector<string> piece_hashes(request_parsed.size() - 5);
+		for (unsigned int i = 5; i < request_parsed.size(); i++)
+		{
+			if (!P2PSha256::fromHex(request_parsed[i].trim().toString(), piece_hashes[i - 5]))
+			{
+				cout << "Error: malformed piece hashes, dropping them" << endl;
+				return;
+			}
+		}
+
+		receivePieceHashes(file_id, request_parsed[2].trim().toString(), size, piece_size, piece_hashes);
+	}
+	else if (command.equals("fileAddress"))
+	{
+		prepareFileTransferRequest(request_parsed);
+	}
+	else if (command.equals("fileAddresses"))
+	{
+		prepareLocatedFiles(request_parsed);
+	}
+	else if (socket->type.compare("server") == 0)
+	{
+		this->enqueueMessage(socket_id, buffer, length);
+	}
+	else if (socket->type.compare("client") == 0)
+	{
+		this->enqueueMessage(socket_id, buffer, length);
+	}
+}
+
+void P2PPeerNode::handleBinaryMessage(P2PSocket * socket, char * buffer, unsigned int length)
+{
+	// Decode the header in place
+	P2PWireHeader header;
+	if (!P2PProtocol::readHeader(buffer, length, header))
+	{
+		cout << "Error: malformed message, dropping it" << endl;
+		return;
+	}
+
+	P2PWireReader reader(&buffer[P2PProtocol::WIRE_HEADER_SIZE], header.length);
+
+	if (header.type == P2PProtocol::MSG_CHUNK || header.type == P2PProtocol::MSG_CHUNK_LZ)
+	{
+		// Make a copy of the data - the frame buffer is reused by the next read
+		char * buffer_copy = new char[length];
+		memcpy(buffer_copy, buffer, length);
+
+		// The task owns the packet
+		FileDataPacket * packet = new FileDataPacket;
+		packet->file_item = getDownloadFileItem(header.file_id);
+		packet->file_item.file_id = header.file_id;
+		packet->packet = buffer_copy;
+		packet->length = length;
+		packet->checksum = getChecksum(socket->socket_id);
+		packet->node = this;
+
+		// Verify and write the chunk on the chunk pool
+		chunk_pool.submit(&P2PPeerNode::handleFileTransfer, (void *)packet);
+	}
+	else if (header.type == P2PProtocol::MSG_FILE_REQUEST)
+	{
+		unsigned int size = reader.getFileSize();
+		unsigned int start = reader.getU32();
+		unsigned int count = reader.getU32();
+		string name = reader.getString();
+
+		if (reader.failed())
+		{
+			cout << "Error: malformed file request, dropping it" << endl;
+			return;
+		}
+
+		submitUpload(socket->socket_id, 0, header.file_id, name, size, start, count, P2PProtocol::PROTOCOL_BINARY);
+	}
+	else if (header.type == P2PProtocol::MSG_HELLO)
+	{
+		P2PCapabilities remote;
+		if (!P2PProtocol::readHello(reader, remote))
+		{
+			cout << "Error: malformed hello, dropping it" << endl;
+			return;
+		}
+
+		applyCapabilities(socket->socket_id, remote);
+	}
+	else if (header.type == P2PProtocol::MSG_BLOCK_REQUEST)
+	{
+		unsigned int request_id = reader.getU32();
+		unsigned int size = reader.getFileSize();
+		unsigned int start = reader.getU32();
+		unsigned int count = reader.getU32();
+		string name = reader.getString();
+
+		if (reader.failed())
+		{
+			cout << "Error: malformed block request, dropping it" << endl;
+			return;
+		}
+
+		submitUpload(socket->socket_id, request_id, header.file_id, name, size, start, count, P2PProtocol::PROTOCOL_BINARY);
+	}
+	else if (header.type == P2PProtocol::MSG_BLOCK_CANCEL)
+	{
+		unsigned int request_id = reader.getU32();
+		if (!reader.failed())
+		{
+			upload_registry.cancel(socket->socket_id, request_id);
+		}
+	}
+	else if (header.type == P2PProtocol::MSG_BLOCK_REJECT)
+	{
+		// Send the block somewhere else
+		unsigned int request_id = reader.getU32();
+		unsigned int file_id;
+		if (!reader.failed() && request_window.reject(socket->socket_id, request_id, file_id))
+		{
+			fillRequests(file_id);
+		}
+	}
+	else if (header.type == P2PProtocol::MSG_PIECE_HASH_REQUEST)
+	{
+		string root = reader.getString();
+		if (!reader.failed())
+		{
+			sendPieceHashes(socket->socket_id, header.file_id, root, P2PProtocol::PROTOCOL_BINARY);
+		}
+	}
+	else if (header.type == P2PProtocol::MSG_PIECE_HASHES)
+	{
+		string root = reader.getString();
+		unsigned long long size = reader.getU64();
+		unsigned int piece_size = reader.getU32();
+		unsigned int hash_count = reader.getU32();
+
+		vector<string> piece_hashes;
+		for (unsigned int i = 0; i < hash_count && !reader.failed(); i++)
+		{
+			piece_hashes.push_back(reader.getBytes(P2PSha256::DIGEST_SIZE));
+		}
+
+		if (reader.failed())
+		{
+			cout << "Error: malformed piece hashes, dropping them" << endl;
+			return;
+		}
+
+		receivePieceHashes(header.file_id, root, size, piece_size, piece_hashes);
+	}
+	else if (header.type == P2PProtocol::MSG_FILE_ADDRESS)
+	{
+		// A file id of zero means the tracker doesn't know the file
+		if (header.file_id == 0)
+		{
+			return;
+		}
+
+		string name = reader.getString();
+		unsigned int size = reader.getFileSize();
+		unsigned int address_count = reader.getU32();
+
+		vector<string> addresses;
+		for (unsigned int i = 0; i < address_count && !reader.failed(); i++)
+		{
+			string address = reader.getString();
+			unsigned int port = reader.getU16();
+			addresses.push_back(address + ":" + to_string(port));
+		}
+
+		// Trackers that know content hashes send the root and piece size after the peers
+		string hash;
+		unsigned int piece_size = 0;
+		if (reader.remaining() > 0)
+		{
+			hash = reader.getString();
+			piece_size = reader.getU32();
+		}
+
+		// Then, if they know piece maps, the pieces each peer has
+		vector<P2PPieceMap> piece_maps;
+		if (reader.remaining() > 0)
+		{
+			piece_maps.resize(addresses.size());
+			for (unsigned int i = 0; i < piece_maps.size() && !reader.failed(); i++)
+			{
+				piece_maps[i].read(reader);
+			}
+		}
+
+		if (reader.failed())
+		{
+			cout << "Error: malformed file address list, dropping it" << endl;
+			return;
+		}
+
+		prepareFileTransferRequest(header.file_id, name, size, hash, piece_size, addresses, piece_maps);
+	}
+	else if (header.type == P2PProtocol::MSG_LOCATE_REPLY)
+	{
+		// Every file the tracker found, each with its peers
+		unsigned int file_count = reader.getU32();
+		cout << "Tracker located " << file_count << " files." << endl;
+
+		vector<FileItem> files;
+		vector<vector<string> > file_addresses;
+		for (unsigned int f = 0; f < file_count && !reader.failed(); f++)
+		{
+			FileItem file_item;
+			file_item.file_id = reader.getU32();
+			file_item.name = reader.getString();
+			file_item.size = reader.getFileSize();
+			file_item.piece_size = 0;
+			unsigned int address_count = reader.getU32();
+
+			vector<string> addresses;
+			for (unsigned int i = 0; i < address_count && !reader.failed(); i++)
+			{
+				string address = reader.getString();
+				unsigned int port = reader.getU16();
+				addresses.push_back(address + ":" + to_string(port));
+			}
+
+			if (reader.failed())
+			{
+				cout << "Error: malformed located file list, dropping the rest" << endl;
+				break;
+			}
+
+			files.push_back(file_item);
+			file_addresses.push_back(addresses);
+		}
+
+		// Trackers that know content hashes send each root and piece size after the list
+		for (unsigned int f = 0; f < files.size() && reader.remaining() > 0; f++)
+		{
+			files[f].hash = reader.getString();
+			files[f].piece_size = reader.getU32();
+		}
+
+		// Then, if they know piece maps, the pieces each file's peers have
+		vector<vector<P2PPieceMap> > file_piece_maps(files.size());
+		for (unsigned int f = 0; f < files.size() && reader.remaining() > 0; f++)
+		{
+			file_piece_maps[f].resize(file_addresses[f].size());
+			for (unsigned int i = 0; i < file_piece_maps[f].size() && !reader.failed(); i++)
+			{
+				file_piece_maps[f][i].read(reader);
+			}
+		}
+
+		if (reader.failed())
+		{
+			for (unsigned int f = 0; f < files.size(); f++)
+			{
+				files[f].hash = "";
+				file_piece_maps[f].clear();
+			}
+		}
+
+		for (unsigned int f = 0; f < files.size(); f++)
+		{
+			prepareFileTransferRequest(files[f].file_id, files[f].name, files[f].size,
+				files[f].hash, files[f].piece_size, file_addresses[f], file_piece_maps[f]);
+		}
+	}
+	else if (socket->type.compare("server") == 0 || socket->type.compare("client") == 0)
+	{
+		// Everything else is for the application
+		this->enqueueMessage(socket->socket_id, buffer, length);
+	}
+}
+
+void P2PPeerNode::listenForActivity()
+{
+	vector<int> ready_sockets;
+	vector<int> writable_sockets;
+
+	while (true) 
+	{
+		// Close anything that was queued up since the last pass
+		this->closeQueuedSockets();
+
+		// Wait for activity, waking up in time to abandon slow connects and send held-back requests
+		int timeout = this->expireConnects();
+		int scheduled_timeout = this->sendScheduledRequests();
+		if (scheduled_timeout >= 0 && (timeout < 0 || scheduled_timeout < timeout))
+		{
+			timeout = scheduled_timeout;
+		}
+
+		int deferred_timeout = this->resumeDeferredUploads(false);
+		if (deferred_timeout >= 0 && (timeout < 0 || deferred_timeout < timeout))
+		{
+			timeout = deferred_timeout;
+		}
+
+		int activity = reactor.wait(ready_sockets, writable_sockets, timeout);
+
+		// Validate the activity
+		if (activity < 0)
+		{
+			perror("Error: reactor wait failed");
+			exit(1);
+		}
+
+		// Finish connects that have been answered
+		this->completeConnects(ready_sockets, writable_sockets);
+
+		// Send whatever is queued on sockets that drained - a broken
+		// connection is closed once the read side sees it
+		vector<int>::iterator write_iter;
+		for (write_iter = writable_sockets.begin(); write_iter != writable_sockets.end(); ++write_iter)
+		{
+			outbound.flush(*write_iter);
+		}
+
+		// Anything on the primary socket is a new connection
+		vector<int>::iterator iter = find(ready_sockets.begin(), ready_sockets.end(), primary_socket);
+		if (iter != ready_sockets.end())
+		{
+			ready_sockets.erase(iter);
+			this->handleNewConnectionRequest();
+		}
+
+		// Perform any open activities on the clients that are ready
+		this->handleExistingConnections(ready_sockets);
+	}
+}
+
+void P2PPeerNode::monitorTransfers()
+{
+	P2PFileTransfer file_transfer;
+	map<int, bool> files_without_peers;
+	unsigned int hash_request_turn = 0;
+
+	while (true)
+	{
+		// Give it a rest
+		sleep(3);
+
+		// Hang up on peers we haven't needed for a while
+		vector<int> idle_sockets = connection_pool.collectIdle();
+		for (unsigned int i = 0; i < idle_sockets.size(); i++)
+		{
+			queueSocketToClose(idle_sockets[i]);
+		}
+
+		// Peers that never said hello predate the handshake - talk to them the old way
+		vector<int> silent_sockets = connection_table.collectUnnegotiated(HELLO_TIMEOUT);
+		for (unsigned int i = 0; i < silent_sockets.size(); i++)
+		{
+			applyCapabilities(silent_sockets[i], P2PProtocol::legacyCapabilities(P2PFileTransfer::LEGACY_CHUNK_SIZE));
+		}
+
+		// Cancel block requests that have gone quiet, and send what they were missing elsewhere
+		vector<P2PBlockRequest> expired = request_window.expire();
+		set<unsigned int> expired_files;
+		for (unsigned int i = 0; i < expired.size(); i++)
+		{
+			sendMessageToSocket(P2PProtocol::encodeBlockCancel(expired[i].request_id, expired[i].file_id), expired[i].socket_id);
+			expired_files.insert(expired[i].file_id);
+		}
+
+		set<unsigned int>::iterator file_iter;
+		for (file_iter = expired_files.begin(); file_iter != expired_files.end(); ++file_iter)
+		{
+			fillRequests(*file_iter);
+		}
+
+		// Work on a copy, so finished files are synced and renamed without holding up the workers
+		pthread_mutex_lock(&file_lists_lock);
+		vector<FileItem> downloads = download_file_list;
+		pthread_mutex_unlock(&file_lists_lock);
+
+		// Check to see how file transfers are doing.
+		// If any get stuck, make a request to download more parts.	
+		file_transfer.reviewTransfers(downloads, request_window);
+
+		// Tell the tracker which pieces came in since last time
+		reportPieces();
+
+		// Downloads still without piece hashes ask the next of their peers in turn
+		for (unsigned int i = 0; i < downloads.size(); i++)
+		{
+			FileItem & file_item = downloads[i];
+			if (!file_item.completed && !file_item.hash.empty() && findContentTree(file_item.hash) == NULL)
+			{
+				vector<int> peers = request_window.getPeers(file_item.file_id);
+				if (peers.size() > 0)
+				{
+					requestPieceHashes(file_item.file_id, peers[hash_request_turn++ % peers.size()]);
+				}
+			}
+		}
+
+		// If any are newly completed, remove them from the list
+		vector<unsigned int> stalled_files;
+		vector<FileItem>::iterator iter;
+		for (iter = downloads.begin(); iter < downloads.end(); )
 		{
 			// Make sure to register newly finished files with the server
 			// Also remove from the downloads list, add to the local list
@@ -569,404 +1209,1122 @@ void P2PPeerNode::monitorTransfers()
 				copy_file_item.file_id = (*iter).file_id;
 				copy_file_item.name = (*iter).name;
 				copy_file_item.size = (*iter).size;
+				copy_file_item.piece_size = (*iter).piece_size;
+				copy_file_item.hash = (*iter).hash;
 				copy_file_item.path = (*iter).path; // This was updated when the pieces were put together
 
-				local_file_list.push_back(copy_file_item);
-				addFileToServer(*iter);
-				iter = download_file_list.erase(iter);
+				pthread_mutex_lock(&file_lists_lock);
+				for (unsigned int i = 0; i < download_file_list.size(); i++)
+				{
+					if (download_file_list[i].file_id == copy_file_item.file_id)
+					{
+						download_file_list.erase(download_file_list.begin() + i);
+						break;
+					}
+				}
+				local_file_list.push_back(copy_file_item);
+				pthread_mutex_unlock(&file_lists_lock);
+
+				addFileToServer(*iter);
+				iter = downloads.erase(iter);
+
+				// Leave the connections open for the next file from the same peers
+				request_window.removeFile(copy_file_item.file_id);
+				rate_limiter.removeFile(copy_file_item.file_id);
+				connection_pool.release(copy_file_item.file_id);
+			}
+
+			else if (!request_window.hasPeers((*iter).file_id) && !files_without_peers[(*iter).file_id])
+			{
+				// Every peer has dropped out, but this is the first time we've noticed it
+				// So, keep track of the file, and check again the next go-around
+				files_without_peers[(*iter).file_id] = true;
+				iter++;
+			}
+			else if (!request_window.hasPeers((*iter).file_id))
+			{
+				// Still nobody to ask - time to get fresh peers from the tracker
+				stalled_files.push_back((*iter).file_id);
+
+				files_without_peers[(*iter).file_id] = false;
+				iter++;
+			}
+			else
+			{
+				// Peers part way through may have more of it by now
+				if (request_window.isStarved((*iter).file_id))
+				{
+					stalled_files.push_back((*iter).file_id);
+				}
+
+				files_without_peers[(*iter).file_id] = false;
+				iter++;
+			}
+		}
+
+		// One lookup for every stalled file
+		if (stalled_files.size() > 0)
+		{
+			locateFiles(stalled_files, "");
+		}
+	}
+}
+
+
+void P2PPeerNode::addFileToServer(FileItem file_item)
+{
+	// Prepare the primary address
+	struct sockaddr_in primary_address;
+	socklen_t primary_address_length = sizeof(primary_address);
+
+	// Get the public-facing port and IP address
+	primary_address = getPrimaryAddress();
+	string address = inet_ntoa(primary_address.sin_addr);
+
+	// The root goes along to trackers that key files by it
+	vector<FileItem> files(1, file_item);
+	P2PSocket server_socket = getSocketByName("central_server");
+	sendMessageToSocket(P2PProtocol::encodeAddFiles(address, getPublicPort(), files,
+		hasContentHashes(server_socket.socket_id)), server_socket.socket_id);
+}
+
+/**
+ * Program Logic
+ */
+
+bool P2PPeerNode::sendMessageToSocket(string request, int socket)
+{
+	// Respect the largest frame the peer said it would take
+	P2PCapabilities capabilities;
+	if (connection_table.getCapabilities(socket, capabilities) && request.length() > capabilities.max_frame_size)
+	{
+		cout << "Error: message is larger than the peer accepts, not sent" << endl;
+		return false;
+	}
+
+	// Queue the message - the socket never blocks, so a full queue is reported back instead
+	int result = outbound.enqueueMessage(socket, request);
+	if (result == P2POutbound::SEND_FULL)
+	{
+		cout << "Error: outbound queue is full, message not sent" << endl;
+	}
+
+	return (result == P2POutbound::SEND_QUEUED);
+}
+
+void P2PPeerNode::enqueueMessage(int client_socket, char* buffer, unsigned int length)
+{
+	P2PMessage message;
+	message.socket_id = client_socket;
+	message.message = string(buffer, length);
+
+	// Push to the queue - the reactor never waits on the application
+	if (!message_queue.push(message))
+	{
+		cout << "Error: message queue is full, dropping message" << endl;
+	}
+}
+
+int P2PPeerNode::countSockets()
+{
+	return connection_table.size();
+}
+
+timeval P2PPeerNode::getSocketsLastModified()
+{
+	return sockets_last_modified;
+}
+
+vector<P2PSocket> P2PPeerNode::getSockets()
+{
+	return connection_table.list();
+}
+
+struct sockaddr_in P2PPeerNode::getClientAddressFromSocket(int socket_id)
+{
+	// Prepare the client address
+	struct sockaddr_in client_address;
+	socklen_t client_address_length = sizeof(client_address);
+
+	// Get the peer name
+	getpeername(socket_id, (struct sockaddr*)&client_address, &client_address_length);
+
+	return client_address;
+}
+
+struct sockaddr_in P2PPeerNode::getPrimaryAddress()
+{
+	return getClientAddressFromSocket(primary_socket);
+}
+
+int P2PPeerNode::getPublicPort()
+{
+	return public_port;
+}
+
+int P2PPeerNode::countQueueMessages()
+{
+	return message_queue.size();
+}
+
+bool P2PPeerNode::tryPopQueueMessage(P2PMessage &message)
+{
+	// False when nothing has been published yet - a producer may still be filling its slot
+	return message_queue.pop(message);
+}
+
+bool P2PPeerNode::waitQueueMessage(P2PMessage &message, int timeout)
+{
+	// Sleep until a message arrives or the timeout (in ms) passes
+	return message_queue.waitPop(message, timeout);
+}
+
+string P2PPeerNode::getFileProgress()
+{
+	string progress;
+
+	pthread_mutex_lock(&file_lists_lock);
+	vector<FileItem> downloads = download_file_list;
+	pthread_mutex_unlock(&file_lists_lock);
+
+	// Iterate through all files in the local file list
+	vector<FileItem>::iterator iter;
+	for (iter = downloads.begin(); iter != downloads.end(); ++iter)
+	{
+		// RBH need to get actual progress
+		progress += "\t" + (*iter).name + "\t" + analyzeFileProgress((*iter)) + "\r\n";
+	}
+
+	if (progress.length() == 0)
+	{
+		progress = "You have no active file transfers.";
+	}
+
+	return progress;
+}
+
+string P2PPeerNode::analyzeFileProgress(FileItem file_item)
+{
+	// The request window counts what has been written, piece by piece
+	unsigned int pieces_done, num_pieces;
+	unsigned long long bytes_done;
+	if (request_window.getProgress(file_item.file_id, pieces_done, num_pieces, bytes_done))
+	{
+		return to_string(bytes_done) + " of " + to_string(file_item.size) + " bytes, "
+			+ to_string(pieces_done) + " of " + to_string(num_pieces) + " pieces of "
+			+ to_string(file_item.piece_size / 1024) + " KB";
+	}
+
+	return "Waiting for seeders...";
+}
+
+bool P2PPeerNode::hasSocketByName(string name)
+{
+	P2PSocket socket;
+	return connection_table.findByName(name, socket);
+}
+
+P2PSocket P2PPeerNode::getSocketByName(string name)
+{
+	P2PSocket socket;
+	connection_table.findByName(name, socket);
+	return socket;
+}
+
+bool P2PPeerNode::sendMessageToSocketName(string socket_name, string message)
+{
+	// Get a socket by name
+	P2PSocket socket;
+	if (!connection_table.findByName(socket_name, socket))
+	{
+		return false;
+	}
+
+	return sendMessageToSocket(message, socket.socket_id);
+}
+
+void P2PPeerNode::prepareFileTransferRequest(vector<P2PStringView> &request)
+{
+	// If the data came back invalid (possible race condition), just bail - trackers
+	// that know content hashes put the root and piece size after the size
+	int file_id, size;
+	P2PStringView size_info[3];
+	unsigned int size_fields = (request.size() >= 4) ? P2PTokenizer::split(request[3], '\t', size_info, 3) : 0;
+	if (size_fields < 1 || !request[1].trim().toInt(file_id) || !size_info[0].trim().toInt(size))
+	{
+		return;
+	}
+
+	string hash;
+	int piece_size = 0;
+	if (size_fields >= 3 && size_info[2].trim().toInt(piece_size))
+	{
+		hash = size_info[1].trim().toString();
+	}
+
+	// Convert the remaining data
+	string name = request[2].trim().toString();
+
+	// Peers part way through the file have their pieces after the address
+	vector<string> addresses;
+	vector<P2PPieceMap> piece_maps;
+	for (unsigned int i = 4; i < request.size(); i++)
+	{
+		string address = request[i].trim().toString();
+		piece_maps.push_back(P2PPieceMap());
+		P2PProtocol::splitPeerPieces(address, piece_maps.back());
+		addresses.push_back(address);
+	}
+
+	prepareFileTransferRequest(file_id, name, size, hash, piece_size, addresses, piece_maps);
+}
+
+void P2PPeerNode::prepareLocatedFiles(vector<P2PStringView> &request)
+{
+	// The count, then a line per file - id, name, size and its peers, tab separated.
+	// Trackers that know content hashes put the root and piece size before the peers.
+	cout << "Tracker located " << ((request.size() > 1) ? request[1].trim().toString() : "0") << " files." << endl;
+
+	vector<P2PStringView> fields;
+	for (unsigned int i = 2; i < request.size(); i++)
+	{
+		int file_id, size;
+		if (P2PTokenizer::split(request[i], '\t', fields) < 3 || !fields[0].trim().toInt(file_id) || !fields[2].trim().toInt(size))
+		{
+			continue;
+		}
+
+		// Addresses always have a port, the root never does
+		string hash;
+		int piece_size = 0;
+		unsigned int first_address = 3;
+		if (fields.size() >= 5 && fields[3].toString().find(':') == string::npos && fields[4].trim().toInt(piece_size))
+		{
+			hash = fields[3].trim().toString();
+			first_address = 5;
+		}
+
+		vector<string> addresses;
+		vector<P2PPieceMap> piece_maps;
+		for (unsigned int a = first_address; a < fields.size(); a++)
+		{
+			string address = fields[a].trim().toString();
+			piece_maps.push_back(P2PPieceMap());
+			P2PProtocol::splitPeerPieces(address, piece_maps.back());
+			addresses.push_back(address);
+		}
+
+		prepareFileTransferRequest(file_id, fields[1].toString(), size, hash, piece_size, addresses, piece_maps);
+	}
+}
+
+bool P2PPeerNode::locateFiles(vector<unsigned int> file_ids, string pattern)
+{
+	// Trackers that know locate take the whole batch in one request
+	P2PCapabilities capabilities;
+	P2PSocket server_socket = getSocketByName("central_server");
+	if (connection_table.getCapabilities(server_socket.socket_id, capabilities)
+		&& (capabilities.features & P2PProtocol::FEATURE_LOCATE))
+	{
+		// The pattern goes along with the first batch of ids
+		unsigned int i = 0;
+		do
+		{
+			vector<unsigned int> batch(file_ids.begin() + i,
+				file_ids.begin() + min((unsigned int) file_ids.size(), i + P2PProtocol::MAX_LOCATE_FILES));
+			sendMessageToSocket(P2PProtocol::encodeLocate(batch, (i == 0) ? pattern : ""), server_socket.socket_id);
+			i += P2PProtocol::MAX_LOCATE_FILES;
+		} while (i < file_ids.size());
+
+		return true;
+	}
+
+	// Older trackers are asked one file at a time, and can't match names
+	for (unsigned int i = 0; i < file_ids.size(); i++)
+	{
+		sendMessageToSocket(P2PProtocol::encodeGetFile(file_ids[i]), server_socket.socket_id);
+	}
+
+	return (pattern.length() == 0);
+}
+
+void P2PPeerNode::prepareFileTransferRequest(int file_id, string name, int size, string hash,
+	unsigned int piece_size, vector<string> addresses, vector<P2PPieceMap> piece_maps)
+{
+	// Files with a content root are known by it - the rest by name and size
+	string key = hash.empty() ? name : hash;
+
+	// Push to our local cache, only if it's not already there
+	FileItem file_item;
+	pthread_mutex_lock(&file_lists_lock);
+	if (hasFileItem(download_file_list, key, size))
+	{
+		file_item = getFileItem(download_file_list, key, size);
+	}
+	else
+	{
+		// Keep a record of this file - a hashed file's pieces are the ones its hashes cover,
+		// otherwise the piece size is picked from its size
+		file_item.name = name;
+		file_item.size = size;
+		file_item.hash = hash;
+		file_item.piece_size = (!hash.empty() && piece_size > 0) ? piece_size : P2PFileTransfer::choosePieceSize(size);
+		file_item.file_id = file_id;
+		file_item.completed = false;
+
+		download_file_list.push_back(file_item);
+	}
+	pthread_mutex_unlock(&file_lists_lock);
+
+	// Chunks are written straight into a file made at full size up front, or
+	// one an earlier run left behind along with the journal of what it holds
+	vector<bool> chunks_received;
+	if (!P2PFileTransfer::openDownload(file_item, chunks_received))
+	{
+		cout << "Error: could not start the download of \"" << name << "\"" << endl;
+		return;
+	}
+
+	// The window remembers which chunks are still missing when the tracker is asked again.
+	// Pieces of a hashed file only count once they've matched their hash.
+	request_window.addFile(file_id, getFileKey(file_item), size, P2PFileTransfer::CHUNK_SIZE,
+		file_item.piece_size, chunks_received, !file_item.hash.empty());
+
+	int num_addresses = addresses.size();
+	cout << "Found " << num_addresses << " peers holding this file." << endl;
+
+	for (int i = 0; i < num_addresses; i++)
+	{
+		// Parse the address
+		vector<string> address = P2PCommon::parseAddress(addresses[i]);
+		if (address.size() < 2)
+		{
+			continue;
+		}
+
+		// Reuse a connection to the peer, or make one
+		int peer_socket = connectToPeer(address[0], atoi(address[1].c_str()), file_id);
+		if (peer_socket >= 0)
+		{
+			request_window.addPeer(file_id, peer_socket);
+
+			// No pieces listed means the peer has the whole file
+			if (i < (int) piece_maps.size() && !piece_maps[i].isEmpty() && !file_item.hash.empty())
+			{
+				request_window.setPeerPieces(file_id, peer_socket, piece_maps[i]);
+			}
+		}
+	}
+
+	// Dole out blocks to the peers
+	fillRequests(file_id);
+}
+
+int P2PPeerNode::connectToPeer(string address, int port, int file_id)
+{
+	// Share an open connection to the peer when there is one
+	string peer = P2PConnectionPool::makeKey(address, port);
+	int peer_socket = connection_pool.acquire(peer, file_id);
+	if (peer_socket >= 0)
+	{
+		return peer_socket;
+	}
+
+	// Otherwise dial - the socket is named after the peer it reaches, and
+	// requests queue up on it until the connect finishes
+	peer_socket = dialConnection(peer, address, port);
+	if (peer_socket >= 0)
+	{
+		connection_pool.add(peer, peer_socket, file_id);
+	}
+
+	return peer_socket;
+}
+
+void P2PPeerNode::sendHello(int socket)
+{
+	sendMessageToSocket(P2PProtocol::encodeHello(local_capabilities), socket);
+}
 
-				// Also disconnect when we're done
-				queueSocketToCloseByName(to_string(copy_file_item.file_id));
-			}
-			else if ((*iter).missing_pieces.size() > 0 && !file_to_missing_piece[(*iter).file_id])
-			{
-				// We have missing pieces, but this is the first time we've noticed it
-				// So, keep track of the file with missing pieces, and compare the next go-around
-				file_to_missing_piece[(*iter).file_id] = (*iter).missing_pieces[0];
-				iter++;
-			}
-			else if ((*iter).missing_pieces.size() > 0 
-				&& file_to_missing_piece[(*iter).file_id] == (*iter).missing_pieces[0])
-			{
-				// We have missing pieces that have persisted - time to send a new request
-				//queueSocketToCloseByName(to_string((*iter).file_id));
-				sendMessageToSocketName("central_server", "getFile\r\n" + to_string((*iter).file_id));
+void P2PPeerNode::applyCapabilities(int socket, P2PCapabilities remote)
+{
+	// Both ends work out the same settings from the two hellos
+	P2PCapabilities common = P2PProtocol::negotiate(local_capabilities, remote);
+	connection_table.setCapabilities(socket, common);
 
-				file_to_missing_piece[(*iter).file_id] = 0;
-				//iter = download_file_list.erase(iter);
-				iter++;
+	// Chunk numbers only line up between nodes that cut files the same way
+	if (remote.chunk_size != local_capabilities.chunk_size)
+	{
+		cout << "Error: peer uses " << remote.chunk_size << "-byte chunks, we use "
+			<< local_capabilities.chunk_size << " - not downloading from it" << endl;
+		return;
+	}
+
+	// The peer can take block requests now
+	vector<unsigned int> file_ids = request_window.setPeerLimits(socket, common.pipeline_depth, common.max_block_chunks);
+	for (unsigned int i = 0; i < file_ids.size(); i++)
+	{
+		fillRequests(file_ids[i]);
+
+		// The first peer that can send a file's piece hashes is asked for them
+		FileItem file_item = getDownloadFileItem(file_ids[i]);
+		if (!file_item.hash.empty() && (common.features & P2PProtocol::FEATURE_CONTENT_HASH))
+		{
+			pthread_mutex_lock(&content_lock);
+			bool b_requested = !piece_hash_requests.insert(file_ids[i]).second;
+			pthread_mutex_unlock(&content_lock);
+
+			if (!b_requested)
+			{
+				requestPieceHashes(file_ids[i], socket);
 			}
 		}
 	}
 }
 
-
-void P2PPeerNode::addFileToServer(FileItem file_item)
+unsigned int P2PPeerNode::getChecksum(int socket)
 {
-	// Prepare the primary address
-	struct sockaddr_in primary_address;
-	socklen_t primary_address_length = sizeof(primary_address);
+	// Chunks are checked with the sum until the hellos settle on something faster
+	P2PCapabilities capabilities;
+	if (connection_table.getCapabilities(socket, capabilities))
+	{
+		return capabilities.checksums;
+	}
 
-	// Get the public-facing port and IP address
-	primary_address = getPrimaryAddress();
-	string address = inet_ntoa(primary_address.sin_addr);
+	return P2PProtocol::CHECKSUM_SUM32;
+}
 
-	string add_files_message = "addFiles\r\n" + address + ":" + to_string(getPublicPort()) + "\r\n";
-	add_files_message += file_item.name + '\t' + to_string(file_item.size) + '\t' + file_item.path + "\r\n";
+void P2PPeerNode::fillRequests(unsigned int file_id)
+{
+	// Top up every peer's window with blocks that still need asking for
+	vector<P2PBlockRequest> requests = request_window.fill(file_id);
+	bool b_scheduled = false;
+	for (unsigned int i = 0; i < requests.size(); i++)
+	{
+		P2PBlockRequest & request = requests[i];
 
-	sendMessageToSocketName("central_server", add_files_message);
-}
+		// The block's bytes are booked against the download limits - over them, the request waits its turn
+		long delay = rate_limiter.reserve(P2PRateLimiter::DIRECTION_DOWNLOAD, request.socket_id, request.file_id, request.bytes);
+		if (delay > 0)
+		{
+			request_window.schedule(request.request_id, delay);
+			b_scheduled = true;
+			continue;
+		}
 
-/**
- * Program Logic
- */
+		sendBlockRequest(request);
+	}
 
-void P2PPeerNode::sendMessageToSocket(string request, int socket)
-{
-	// Write the message to the server socket
-	if (write(socket, request.c_str(), request.length()) < 0)
+	// Have the reactor wake up in time to send them
+	if (b_scheduled)
 	{
-		perror("Error: could not send message to server");
-		exit(1);
+		reactor.wakeup();
 	}
 }
 
-void P2PPeerNode::enqueueMessage(int client_socket, char* buffer)
+void P2PPeerNode::sendBlockRequest(P2PBlockRequest &request)
 {
-	P2PMessage message;
-	message.socket_id = client_socket;
-	message.message = string(buffer);
+	// Peers that don't know content hashes look a hashed file up by its name
+	P2PCapabilities capabilities;
+	bool b_negotiated = connection_table.getCapabilities(request.socket_id, capabilities);
+	string name = request.name;
+	if (b_negotiated && !(capabilities.features & P2PProtocol::FEATURE_CONTENT_HASH))
+	{
+		name = getDownloadFileItem(request.file_id).name;
+	}
+
+	// Nodes from before pipelining only know the plain range request
+	if (b_negotiated && !(capabilities.features & P2PProtocol::FEATURE_PIPELINING))
+	{
+		sendMessageToSocket(P2PProtocol::encodeFileRequest(request.file_id, name,
+			request.size, request.start, request.count), request.socket_id);
+		return;
+	}
 
-	// Push to the queue
-	message_queue.push_back(message);
+	sendMessageToSocket(P2PProtocol::encodeBlockRequest(request.request_id, request.file_id,
+		name, request.size, request.start, request.count), request.socket_id);
 }
 
-int P2PPeerNode::countSockets()
+int P2PPeerNode::sendScheduledRequests()
 {
-	return socket_vector.size();
+	// Send the held-back requests whose turn has come
+	int next_timeout;
+	vector<P2PBlockRequest> due = request_window.collectDue(next_timeout);
+	for (unsigned int i = 0; i < due.size(); i++)
+	{
+		sendBlockRequest(due[i]);
+	}
+
+	return next_timeout;
 }
 
-timeval P2PPeerNode::getSocketsLastModified()
+void P2PPeerNode::completeChunk(unsigned int file_id, unsigned int part)
 {
-	return sockets_last_modified;
+	// A finished request frees a slot in the peer's window
+	vector<unsigned int> file_ids = request_window.completeChunk(file_id, part);
+	for (unsigned int i = 0; i < file_ids.size(); i++)
+	{
+		fillRequests(file_ids[i]);
+	}
 }
 
-vector<P2PSocket> P2PPeerNode::getSockets()
+void P2PPeerNode::submitUpload(int socket_id, unsigned int request_id, unsigned int file_id, string name,
+	unsigned int size, unsigned int start, unsigned int count, int protocol)
 {
-	return socket_vector;
+	// Prepare the request - the task owns it
+	FileDataRequest * request = new FileDataRequest;
+	request->socket_id = socket_id;
+	request->start = start;
+	request->count = count;
+	request->file_item = getLocalFileItem(name, size);
+	request->file_item.file_id = file_id;
+	request->protocol = protocol;
+	request->outbound = &outbound;
+	request->request_id = request_id;
+	request->uploads = &upload_registry;
+
+	// Compress, or send runs of chunks, only for peers that agreed to it in their hello
+	P2PCapabilities capabilities;
+	bool b_negotiated = (protocol == P2PProtocol::PROTOCOL_BINARY && connection_table.getCapabilities(socket_id, capabilities));
+	request->b_compress = (b_negotiated && (capabilities.features & P2PProtocol::FEATURE_COMPRESSION));
+	request->b_chunk_runs = (b_negotiated && (capabilities.features & P2PProtocol::FEATURE_CHUNK_RUNS));
+
+	// Chunks are cut to the size the peer said it uses - a peer that never said hello predates pieces
+	request->chunk_size = P2PFileTransfer::LEGACY_CHUNK_SIZE;
+	request->checksum = getChecksum(socket_id);
+	request->rate_limiter = &rate_limiter;
+	request->node = this;
+	request->generation = outbound.getGeneration(socket_id);
+	if (connection_table.getCapabilities(socket_id, capabilities))
+	{
+		request->chunk_size = capabilities.chunk_size;
+	}
+
+	// A file we're still downloading is served from its download, once every piece asked for has matched its hash
+	if (!hasLocalFileItem(name, size) && hasDownloadFileItem(name, size) && start > 0 && count > 0)
+	{
+		FileItem download = getDownloadFileItem(name, size);
+		unsigned long long offset = (unsigned long long)(start - 1) * request->chunk_size;
+		unsigned long long length = (offset < download.size)
+			? min((unsigned long long) count * request->chunk_size, download.size - offset) : 0;
+
+		if (!download.hash.empty() && request_window.hasCheckedPieces(download.file_id, offset, length))
+		{
+			request->file_item = download;
+			request->file_item.file_id = file_id;
+			request->file_item.path = P2PFileTransfer::downloadPath(download.file_id);
+		}
+	}
+
+	// Block requests can be cancelled until they're done
+	if (request_id > 0)
+	{
+		upload_registry.begin(socket_id, request_id);
+	}
+
+	// Run the upload session on the upload pool - sessions finish in whatever order they run
+	upload_pool.submit(&P2PPeerNode::initiateFileTransfer, (void *)request);
 }
 
-struct sockaddr_in P2PPeerNode::getClientAddressFromSocket(int socket_id)
+P2PMerkleTree * P2PPeerNode::findContentTree(string root)
 {
-	// Prepare the client address
-	struct sockaddr_in client_address;
-	socklen_t client_address_length = sizeof(client_address);
+	P2PMerkleTree * tree = NULL;
 
-	// Get the peer name
-	getpeername(socket_id, (struct sockaddr*)&client_address, &client_address_length);
+	pthread_mutex_lock(&content_lock);
+	map<string, P2PMerkleTree *>::iterator iter = content_trees.find(root);
+	if (iter != content_trees.end())
+	{
+		tree = iter->second;
+	}
+	pthread_mutex_unlock(&content_lock);
 
-	return client_address;
+	return tree;
 }
 
-struct sockaddr_in P2PPeerNode::getPrimaryAddress()
+void P2PPeerNode::requestPieceHashes(unsigned int file_id, int socket)
 {
-	return getClientAddressFromSocket(primary_socket);
+	FileItem file_item = getDownloadFileItem(file_id);
+	if (!file_item.hash.empty() && hasContentHashes(socket))
+	{
+		sendMessageToSocket(P2PProtocol::encodePieceHashRequest(file_id, file_item.hash), socket);
+	}
 }
 
-int P2PPeerNode::getPublicPort()
+void P2PPeerNode::sendPieceHashes(int socket, unsigned int file_id, string root, int protocol)
 {
-	return public_port;
+	// Trees are never dropped once they're in, so the leaves can be read without the lock
+	P2PMerkleTree * tree = findContentTree(root);
+	if (tree == NULL)
+	{
+		return;
+	}
+
+	sendMessageToSocket(P2PProtocol::encodePieceHashes(protocol, file_id, root, tree->getSize(),
+		tree->getPieceSize(), tree->getLeaves()), socket);
 }
 
-int P2PPeerNode::countQueueMessages()
+void P2PPeerNode::receivePieceHashes(unsigned int file_id, string root, unsigned long long size,
+	unsigned int piece_size, vector<string> &piece_hashes)
 {
-	return message_queue.size();
+	// Only take hashes for the download they were asked for, and only once
+	FileItem file_item = getDownloadFileItem(file_id);
+	if (file_item.hash.empty() || file_item.hash != root || findContentTree(root) != NULL)
+	{
+		return;
+	}
+
+	// They have to cover the file the way we cut it, and add up to the root the tracker gave
+	P2PMerkleTree * tree = new P2PMerkleTree;
+	if (size != file_item.size || piece_size != file_item.piece_size || !tree->setLeaves(size, piece_size, piece_hashes, root))
+	{
+		cout << "Error: piece hashes for \"" << file_item.name << "\" don't match its content root, dropping them" << endl;
+		delete tree;
+		return;
+	}
+
+	pthread_mutex_lock(&content_lock);
+	if (!content_trees.insert(make_pair(root, tree)).second)
+	{
+		delete tree;
+	}
+	pthread_mutex_unlock(&content_lock);
+
+	// Check the pieces that came in while we waited
+	verifyPieces(file_id, root);
 }
 
-P2PMessage P2PPeerNode::popQueueMessage()
+void P2PPeerNode::verifyPieces(unsigned int file_id, string root)
 {
-	// Validation
-	if (message_queue.size() <= 0)
+	// Pieces wait until the hashes are in
+	P2PMerkleTree * tree = findContentTree(root);
+	if (tree == NULL)
 	{
-		perror("Error: can't pop a message from an empty queue");
-		exit(1);
+		return;
 	}
 
-	// Return a message
-	P2PMessage message = message_queue[0];
-	message_queue.erase(message_queue.begin());
-	return message;
+	// Each piece is read back and hashed on the chunk pool - the task owns its argument
+	vector<unsigned int> pieces = request_window.takeUncheckedPieces(file_id);
+	for (unsigned int i = 0; i < pieces.size(); i++)
+	{
+		P2PPieceCheck * check = new P2PPieceCheck;
+		check->file_id = file_id;
+		check->piece = pieces[i];
+		check->offset = (unsigned long long) pieces[i] * tree->getPieceSize();
+		check->length = min((unsigned long long) tree->getPieceSize(), tree->getSize() - check->offset);
+		check->tree = tree;
+		check->node = this;
+
+		chunk_pool.submit(&P2PPeerNode::verifyDownloadPiece, (void *)check);
+	}
 }
 
-string P2PPeerNode::getFileProgress()
+void P2PPeerNode::finishPieceCheck(unsigned int file_id, unsigned int piece, bool b_matched)
 {
-	string progress;
-
-	// Iterate through all files in the local file list
-	vector<FileItem>::iterator iter;
-	for (iter = download_file_list.begin(); iter != download_file_list.end(); ++iter)
+	// A piece that doesn't match goes back out, ahead of the rest
+	if (request_window.finishPieceCheck(file_id, piece, b_matched))
 	{
-		// RBH need to get actual progress
-		progress += "\t" + (*iter).name + "\t" + analyzeFileProgress((*iter)) + "\r\n";
+		cout << "Error: piece " << piece << " of file " << file_id << " doesn't match its hash, downloading it again" << endl;
+		fillRequests(file_id);
+	}
+	else if (b_matched)
+	{
+		// One that does can be passed on, once the tracker hears of it
+		pthread_mutex_lock(&content_lock);
+		pieces_to_report[file_id].add(piece, 1);
+		pthread_mutex_unlock(&content_lock);
 	}
+}
 
-	if (progress.length() == 0)
+void P2PPeerNode::reportPieces()
+{
+	map<unsigned int, P2PPieceMap> pieces;
+	pthread_mutex_lock(&content_lock);
+	pieces.swap(pieces_to_report);
+	pthread_mutex_unlock(&content_lock);
+
+	// Trackers from before piece maps only hear about whole files
+	P2PSocket server_socket = getSocketByName("central_server");
+	if (pieces.size() == 0 || !hasPieceMaps(server_socket.socket_id))
 	{
-		progress = "You have no active file transfers.";
+		return;
 	}
 
-	return progress;
+	// Every file's new pieces go in one message
+	struct sockaddr_in primary_address = getPrimaryAddress();
+	string address = inet_ntoa(primary_address.sin_addr);
+	sendMessageToSocket(P2PProtocol::encodeHavePieces(address, getPublicPort(), pieces), server_socket.socket_id);
 }
 
-string P2PPeerNode::analyzeFileProgress(FileItem file_item)
+void P2PPeerNode::initiateFileTransfer(void * arg)
 {
-	// First, check to see if the file is finished downloading
-	DIR *directory;
-	struct dirent *ep;
+	// Revive the packet
+	FileDataRequest * request = static_cast<FileDataRequest *>(arg);
+
+	// The connection went away while it was waiting, and the socket may be someone else's now
+	if (request->outbound->getGeneration(request->socket_id) != request->generation)
+	{
+		if (request->request_id > 0)
+		{
+			request->uploads->finish(request->socket_id, request->request_id);
+		}
+
+		delete request;
+		return;
+	}
 
-	// Open the directory
-	directory = opendir(P2PFileTransfer::DATA_FOLDER.c_str());
-	if (directory != NULL)
+	P2PFileTransfer file_transfer;
+	file_transfer.setBounds(request->start, request->count);
+	file_transfer.setOutbound(request->outbound);
+	file_transfer.setProtocol(request->protocol);
+	file_transfer.setUpload(request->request_id, request->uploads);
+	file_transfer.setCompression(request->b_compress);
+	file_transfer.setChunkRuns(request->b_chunk_runs);
+	file_transfer.setChunkSize(request->chunk_size);
+	file_transfer.setChecksum(request->checksum);
+	file_transfer.setRateLimiter(request->rate_limiter);
+	int result = file_transfer.startTransferFile(request->file_item, request->socket_id);
+
+	// Rather than hold the worker while the peer catches up, stop here and come back for the rest
+	if (result == P2PFileTransfer::TRANSFER_QUEUE_FULL || result == P2PFileTransfer::TRANSFER_THROTTLED)
 	{
-		// Get the expected number of parts
-		unsigned int size_downloaded = 0;
+		request->start = file_transfer.getStart();
+		request->count = file_transfer.getCount();
+		request->b_compress = file_transfer.isCompressing();
+		request->b_chunk_runs = file_transfer.isSendingChunkRuns();
+
+		if (result == P2PFileTransfer::TRANSFER_THROTTLED)
+		{
+			request->node->deferUpload(request, file_transfer.getThrottleDelay());
+		}
+		else if (!request->outbound->notifyWhenSpace(request->socket_id, &P2PPeerNode::resumeUpload, request))
+		{
+			// It drained in the meantime
+			resumeUpload(request);
+		}
 
-		string filename = to_string(file_item.file_id) + ".pt.";
+		return;
+	}
 
-		// See how many parts we have available
-		while ((ep = readdir(directory)) != NULL)
+	if (request->request_id > 0)
+	{
+		// Tell the downloader to look elsewhere if we couldn't serve the block
+		if (result == P2PFileTransfer::TRANSFER_FAILED)
 		{
-			// Evaluate that each part is there
-			string this_filename = string(ep->d_name);
-			if (this_filename.compare(0, filename.length(), filename) == 0
-				&& this_filename.compare(this_filename.length() - 6, 6, ".p2pft") == 0)
-			{				
-				struct stat s;
-				string path = (P2PFileTransfer::DATA_FOLDER + '/' + this_filename);
-				if (stat(path.c_str(), &s) == 0 && (s.st_mode & S_IFREG))
-				{
-					size_downloaded += s.st_size;
-				}
-			}
+			request->outbound->enqueueMessage(request->socket_id,
+				P2PProtocol::encodeBlockReject(request->protocol, request->request_id, request->file_item.file_id));
 		}
 
-		return to_string(size_downloaded) + " of " + to_string(file_item.size) + " bytes";
+		request->uploads->finish(request->socket_id, request->request_id);
 	}
 
-	return "Waiting for seeders...";
+	// Finished - release the request
+	delete request;
 }
 
-bool P2PPeerNode::hasSocketByName(string name)
+void P2PPeerNode::resumeUpload(void * arg)
 {
-	vector<P2PSocket>::iterator iter;
-	for (iter = socket_vector.begin(); iter != socket_vector.end(); ++iter)
+	// Back on the upload pool, behind whatever else came in
+	FileDataRequest * request = static_cast<FileDataRequest *>(arg);
+	request->node->upload_pool.submit(&P2PPeerNode::initiateFileTransfer, (void *) request);
+}
+
+void P2PPeerNode::deferUpload(FileDataRequest * request, long delay)
+{
+	timeval due;
+	gettimeofday(&due, NULL);
+	due.tv_sec += delay / 1000;
+	due.tv_usec += (delay % 1000) * 1000;
+	if (due.tv_usec >= 1000000)
 	{
-		if ((*iter).name == name)
-		{
-			return true;
-		}
+		due.tv_sec++;
+		due.tv_usec -= 1000000;
 	}
 
-	return false;
+	pthread_mutex_lock(&deferred_lock);
+	deferred_uploads.push_back(make_pair(due, request));
+	pthread_mutex_unlock(&deferred_lock);
+
+	// The reactor works out its next wakeup again
+	reactor.wakeup();
 }
 
-P2PSocket P2PPeerNode::getSocketByName(string name)
+int P2PPeerNode::resumeDeferredUploads(bool b_all)
 {
-	P2PSocket socket;
-	vector<P2PSocket>::iterator iter;
-	for (iter = socket_vector.begin(); iter != socket_vector.end(); ++iter)
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	// Hand back the uploads that are due, and find when the next one is
+	long next_timeout = -1;
+	vector<FileDataRequest *> due;
+	pthread_mutex_lock(&deferred_lock);
+	for (unsigned int i = 0; i < deferred_uploads.size(); )
 	{
-		if ((*iter).name == name)
+		long remaining = (deferred_uploads[i].first.tv_sec - now.tv_sec) * 1000
+			+ (deferred_uploads[i].first.tv_usec - now.tv_usec) / 1000;
+
+		if (b_all || remaining <= 0)
 		{
-			socket = (*iter);
+			due.push_back(deferred_uploads[i].second);
+			deferred_uploads[i] = deferred_uploads.back();
+			deferred_uploads.pop_back();
+			continue;
 		}
+
+		if (next_timeout < 0 || remaining < next_timeout)
+			next_timeout = remaining;
+
+		i++;
 	}
+	pthread_mutex_unlock(&deferred_lock);
 
-	return socket;
+	for (unsigned int i = 0; i < due.size(); i++)
+	{
+		resumeUpload(due[i]);
+	}
+
+	return (int) next_timeout;
 }
 
-void P2PPeerNode::sendMessageToSocketName(string socket_name, string message)
+void P2PPeerNode::handleFileTransfer(void * arg)
 {
-	// Validate
-	if (!hasSocketByName(socket_name))
+	// Revive the packet
+	FileDataPacket * packet;
+	packet = (FileDataPacket *) arg;
+
+	P2PFileTransfer file_transfer;
+	unsigned int first_part = 0;
+	unsigned int parts = file_transfer.handleIncomingFileTransfer(*packet, first_part);
+
+	// Credit the block requests the chunks belong to - a compressed run carries several
+	for (unsigned int i = 0; i < parts; i++)
 	{
-		return;
+		packet->node->completeChunk(packet->file_item.file_id, first_part + i);
 	}
 
-	// Get a socket by name
-	P2PSocket socket = getSocketByName(socket_name);
-	if (write(socket.socket_id, message.c_str(), message.length()) < 0)
+	// Check any pieces those chunks finished
+	if (parts > 0 && !packet->file_item.hash.empty())
 	{
-		perror("Error: could not send message to server");
-		exit(1);
+		packet->node->verifyPieces(packet->file_item.file_id, packet->file_item.hash);
 	}
+
+	delete[] (*packet).packet;
+	delete packet;
 }
 
-void P2PPeerNode::prepareFileTransferRequest(vector<string> request)
+void P2PPeerNode::verifyDownloadPiece(void * arg)
 {
-	prepareFileTransferRequest(request, 0, 0);
+	// Revive the check
+	P2PPieceCheck * check = static_cast<P2PPieceCheck *>(arg);
+
+	char * buffer = new char[max(check->length, 1u)];
+	bool b_matched = P2PFileTransfer::readDownload(check->file_id, check->offset, buffer, check->length)
+		&& check->tree->verifyPiece(check->piece, buffer, check->length);
+	check->node->finishPieceCheck(check->file_id, check->piece, b_matched);
+
+	delete[] buffer;
+	delete check;
 }
 
-void P2PPeerNode::prepareFileTransferRequest(vector<string> request, int start, int count)
+void P2PPeerNode::setWorkerThreads(unsigned int chunk_threads, unsigned int upload_threads)
 {
-	// Trim any whitespace
-	string file_id = P2PCommon::trimWhitespace(request[1]);
+	chunk_pool_size = chunk_threads;
+	upload_pool_size = upload_threads;
+}
 
-	// If the data came back invalid (possible race condition), just bail
-	if (file_id == "NULL")
-	{
-		return;
-	}
+string P2PPeerNode::getWorkerStats()
+{
+	return chunk_pool.describe() + "\r\n" + upload_pool.describe();
+}
 
-	// Convert the remaining data
-	string name = P2PCommon::trimWhitespace(request[2]);
-	int size = stoi(P2PCommon::trimWhitespace(request[3]));
-	string address_pair = P2PCommon::trimWhitespace(request[4]);
+void P2PPeerNode::setPeerConnectionLimits(unsigned int max_per_peer, unsigned int idle_timeout)
+{
+	connection_pool.setMaxPerPeer(max_per_peer);
+	connection_pool.setIdleTimeout(idle_timeout);
+}
 
-	// Push to our local cache, only if it's not already there
-	if (!hasDownloadFileItem(name, size))
-	{
-		// Keep a record of this file
-		FileItem file_item;
-		file_item.name = name;
-		file_item.size = size;
-		file_item.file_id = stoi(file_id);
+string P2PPeerNode::getConnectionStats()
+{
+	return connection_pool.describe();
+}
 
-		download_file_list.push_back(file_item);
-	}
-	else
+void P2PPeerNode::setRequestWindow(unsigned int window_size, unsigned int block_chunks, unsigned int timeout)
+{
+	request_window.setWindowSize(window_size);
+	request_window.setBlockChunks(block_chunks);
+	request_window.setRequestTimeout(timeout);
+}
+
+string P2PPeerNode::getRequestStats()
+{
+	return request_window.describe();
+}
+
+bool P2PPeerNode::setRateLimit(string limit)
+{
+	int direction, scope, key;
+	unsigned int rate;
+	if (!P2PRateLimiter::parseLimit(limit, direction, scope, rate, key))
 	{
-		// Get the start and count from the missing pieces
-		FileItem file_item = getDownloadFileItem(name, size);
-		start = file_item.missing_pieces.front();
-		file_item.missing_pieces.erase(file_item.missing_pieces.begin());
-		count = file_item.missing_pieces.front();
-		file_item.missing_pieces.erase(file_item.missing_pieces.begin());
+		return false;
 	}
 
-	// Estimate the number of chunks that will be needed
-	unsigned int num_chunks;
-	if (size % P2PFileTransfer::FILE_CHUNK_SIZE == 0)
-		num_chunks = size/P2PFileTransfer::FILE_CHUNK_SIZE;
+	if (key >= 0)
+		rate_limiter.setLimit(direction, scope, key, rate);
 	else
-		num_chunks = size/P2PFileTransfer::FILE_CHUNK_SIZE + 1;
+		rate_limiter.setLimit(direction, scope, rate);
 
-	// Dole out the requests to each available address
-	int num_addresses = request.size() - 4;
-	int i = 0;
-
-	cout << "Found " << num_addresses << " peers holding this file." << endl;
-	// Ensure that start is 1, minimum
-	if (start <= 0)
+	// Held-back requests were timed for the old limits - book them again under the new ones
+	if (direction == P2PRateLimiter::DIRECTION_DOWNLOAD)
 	{
-		start = 1;
-	}
+		rate_limiter.clearDebt(direction);
+		vector<P2PBlockRequest> scheduled = request_window.takeScheduled();
+		for (unsigned int i = 0; i < scheduled.size(); i++)
+		{
+			P2PBlockRequest & request = scheduled[i];
+			long delay = rate_limiter.reserve(direction, request.socket_id, request.file_id, request.bytes);
+			if (delay > 0)
+				request_window.schedule(request.request_id, delay);
+			else
+				sendBlockRequest(request);
+		}
 
-	// Ensure that count has a valid value, and divide the count among the available peers
-	if (count <= 0)
-	{
-		count = num_chunks / num_addresses;
+		if (scheduled.size() > 0)
+		{
+			reactor.wakeup();
+		}
 	}
-	else if (count > 0)
+	else
 	{
-		count /= num_addresses;
+		// Uploads waiting on the old limits try again under the new ones
+		rate_limiter.clearDebt(direction);
+		resumeDeferredUploads(true);
 	}
 
-	while (i < num_addresses)
-	{
-		// Get the address pair
-		address_pair = P2PCommon::trimWhitespace(request[4+i]);
-
-		// Parse the address
-		vector<string> address = P2PCommon::parseAddress(address_pair);
-
-		// Make the connection
-		makeConnection(file_id, address[0], stoi(address[1]));
-
-		// Determine where we start and how many we dole out
-		start += i * count;
-
-		// Send the file request
-		requestFileTransfer(file_id, stoi(file_id), name, size, start, count);
-	
-		// Move to the next address
-		i++;
-	}
+	return true;
 }
 
-void P2PPeerNode::requestFileTransfer(string socket_name, int file_id, string name, int size, unsigned int start, unsigned int count)
+string P2PPeerNode::getRateStats()
 {
-	// Compose the file transfer request
-	string file_transfer_request = "fileRequest\r\n" + to_string(file_id)
-		+ "\r\n" + name + "\r\n" + to_string(size)
-		+ "\r\n" + to_string(start) + "\r\n" + to_string(count);
-	sendMessageToSocketName(socket_name, file_transfer_request);
+	return rate_limiter.describe();
 }
 
-void * P2PPeerNode::initiateFileTransfer(void * arg)
+void P2PPeerNode::saveDownloads()
 {
-	// Revive the packet
-	FileDataRequest * request = static_cast<FileDataRequest *>(arg);
+	pthread_mutex_lock(&file_lists_lock);
+	vector<FileItem> downloads = download_file_list;
+	pthread_mutex_unlock(&file_lists_lock);
 
 	P2PFileTransfer file_transfer;
-	file_transfer.setBounds(request->start, request->count);
-	file_transfer.startTransferFile(request->file_item, request->socket_id);
+	file_transfer.checkpointTransfers(downloads, request_window);
+}
+
+vector<FileItem> P2PPeerNode::scanFiles(vector<string> paths)
+{
+	// Folders are walked and files hashed on threads of the scanner's own
+	P2PShareScanner scanner;
+	vector<P2PMerkleTree *> trees;
+	vector<FileItem> files = scanner.scan(paths, trees);
+	scan_stats = scanner.describe();
+
+	// The same content shared twice keeps its first tree
+	pthread_mutex_lock(&content_lock);
+	for (unsigned int i = 0; i < trees.size(); i++)
+	{
+		if (!content_trees.insert(make_pair(trees[i]->getRoot(), trees[i])).second)
+		{
+			delete trees[i];
+		}
+	}
+	pthread_mutex_unlock(&content_lock);
 
-	// Finished - close the thread
-	pthread_exit(NULL);
+	return files;
 }
 
-void * P2PPeerNode::handleFileTransfer(void * arg)
+string P2PPeerNode::getScanStats()
 {
-	// Revive the packet
-	FileDataPacket * packet;
-	packet = (FileDataPacket *) arg;
+	return scan_stats;
+}
 
-	P2PFileTransfer file_transfer;
-	file_transfer.handleIncomingFileTransfer(*packet);
+bool P2PPeerNode::hasContentHashes(int socket)
+{
+	P2PCapabilities capabilities;
+	return (connection_table.getCapabilities(socket, capabilities)
+		&& (capabilities.features & P2PProtocol::FEATURE_CONTENT_HASH));
+}
 
-	//delete[] (*packet).packet;
-	pthread_exit(NULL);
+bool P2PPeerNode::hasPieceMaps(int socket)
+{
+	P2PCapabilities capabilities;
+	return (connection_table.getCapabilities(socket, capabilities)
+		&& (capabilities.features & P2PProtocol::FEATURE_PIECE_MAP));
 }
 
 void P2PPeerNode::addDownloadFileItems(vector<FileItem> files)
 {
+	pthread_mutex_lock(&file_lists_lock);
 	addFileItems(download_file_list, files);
+	pthread_mutex_unlock(&file_lists_lock);
 }
 
-bool P2PPeerNode::hasDownloadFileItem(string name, int size)
+bool P2PPeerNode::hasDownloadFileItem(string name, unsigned int size)
 {
-	return hasFileItem(download_file_list, name, size);
+	pthread_mutex_lock(&file_lists_lock);
+	bool found = hasFileItem(download_file_list, name, size);
+	pthread_mutex_unlock(&file_lists_lock);
+
+	return found;
 }
 
-FileItem P2PPeerNode::getDownloadFileItem(string name, int size)
+FileItem P2PPeerNode::getDownloadFileItem(string name, unsigned int size)
 {
-	return getFileItem(download_file_list, name, size);
+	pthread_mutex_lock(&file_lists_lock);
+	FileItem file_item = getFileItem(download_file_list, name, size);
+	pthread_mutex_unlock(&file_lists_lock);
+
+	return file_item;
 }
 
 FileItem P2PPeerNode::getDownloadFileItem(int file_id)
 {
-	return getFileItem(download_file_list, file_id);
+	pthread_mutex_lock(&file_lists_lock);
+	FileItem file_item = getFileItem(download_file_list, file_id);
+	pthread_mutex_unlock(&file_lists_lock);
+
+	return file_item;
 }
 
 void P2PPeerNode::addLocalFileItems(vector<FileItem> files)
 {
+	pthread_mutex_lock(&file_lists_lock);
 	addFileItems(local_file_list, files);
+	pthread_mutex_unlock(&file_lists_lock);
 }
 
-bool P2PPeerNode::hasLocalFileItem(string name, int size)
+bool P2PPeerNode::hasLocalFileItem(string name, unsigned int size)
 {
-	return hasFileItem(local_file_list, name, size);
+	pthread_mutex_lock(&file_lists_lock);
+	bool found = hasFileItem(local_file_list, name, size);
+	pthread_mutex_unlock(&file_lists_lock);
+
+	return found;
 }
 
-FileItem P2PPeerNode::getLocalFileItem(string name, int size)
+FileItem P2PPeerNode::getLocalFileItem(string name, unsigned int size)
 {
-	return getFileItem(local_file_list, name, size);
+	pthread_mutex_lock(&file_lists_lock);
+	FileItem file_item = getFileItem(local_file_list, name, size);
+	pthread_mutex_unlock(&file_lists_lock);
+
+	return file_item;
 }
 
 FileItem P2PPeerNode::getLocalFileItem(int file_id)
 {
-	return getFileItem(local_file_list, file_id);
+	pthread_mutex_lock(&file_lists_lock);
+	FileItem file_item = getFileItem(local_file_list, file_id);
+	pthread_mutex_unlock(&file_lists_lock);
+
+	return file_item;
 }
 
 void P2PPeerNode::addFileItems(vector<FileItem> &existing_files, vector<FileItem> files_to_add)
@@ -974,20 +2332,27 @@ void P2PPeerNode::addFileItems(vector<FileItem> &existing_files, vector<FileItem
 	vector<FileItem>::iterator iter;
 	for (iter = files_to_add.begin(); iter < files_to_add.end(); iter++)
 	{
-		if (!hasFileItem(existing_files, (*iter).name, (*iter).size))
+		if (!hasFileItem(existing_files, getFileKey(*iter), (*iter).size))
 		{
 			existing_files.push_back((*iter));
 		}
 	}
 }
 
-bool P2PPeerNode::hasFileItem(vector<FileItem> &existing_files, string name, int size)
+string P2PPeerNode::getFileKey(FileItem &file_item)
+{
+	// Files are known by their content root, or by name when they have none
+	return file_item.hash.empty() ? file_item.name : file_item.hash;
+}
+
+bool P2PPeerNode::hasFileItem(vector<FileItem> &existing_files, string key, unsigned int size)
 {
 	// A map would be a better way to store and retrieve this information..
+	// The key is a content root, or a name from a peer that doesn't know the root
 	vector<FileItem>::iterator iter;
 	for (iter = existing_files.begin(); iter < existing_files.end(); iter++)
 	{
-		if ((*iter).name == name && (*iter).size == size)
+		if (((*iter).name == key || (*iter).hash == key) && (*iter).size == size)
 		{
 			return true;
 		}
@@ -996,14 +2361,14 @@ bool P2PPeerNode::hasFileItem(vector<FileItem> &existing_files, string name, int
 	return false;
 }
 
-FileItem P2PPeerNode::getFileItem(vector<FileItem> &existing_files, string name, int size)
+FileItem P2PPeerNode::getFileItem(vector<FileItem> &existing_files, string key, unsigned int size)
 {
 	// A map would be a better way to store and retrieve this information..
-	FileItem file_item;
+	FileItem file_item = FileItem();
 	vector<FileItem>::iterator iter;
 	for (iter = existing_files.begin(); iter < existing_files.end(); iter++)
 	{
-		if ((*iter).name == name && (*iter).size == size)
+		if (((*iter).name == key || (*iter).hash == key) && (*iter).size == size)
 		{
 			file_item = (*iter);
 			break;
@@ -1016,7 +2381,7 @@ FileItem P2PPeerNode::getFileItem(vector<FileItem> &existing_files, string name,
 FileItem P2PPeerNode::getFileItem(vector<FileItem> &existing_files, int file_id)
 {
 	// A map would be a better way to store and retrieve this information..
-	FileItem file_item;
+	FileItem file_item = FileItem();
 	vector<FileItem>::iterator iter;
 	for (iter = existing_files.begin(); iter < existing_files.end(); iter++)
 	{
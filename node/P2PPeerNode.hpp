@@ -2,37 +2,106 @@
 #define P2PPEERNODE_H
 
 #include "../common/P2PCommon.cpp"
+#include "../common/P2PChecksum.cpp"
+#include "../common/P2PSha256.cpp"
+#include "../common/P2PResolver.cpp"
+#include "../common/P2PIOBackend.cpp"
+#include "../common/P2PFraming.cpp"
+#include "../common/P2PProtocol.cpp"
+#include "../common/P2PPieceMap.cpp"
+#include "../common/P2PTokenizer.cpp"
+#include "../common/P2PCompression.cpp"
+#include "../common/P2PThreadPool.cpp"
+#include "../common/P2PMessageQueue.cpp"
+#include "P2PReactor.cpp"
+#include "P2POutbound.cpp"
+#include "P2PConnectionPool.cpp"
+#include "P2PConnectionTable.cpp"
+#include "P2PRequestWindow.cpp"
+#include "P2PRateLimiter.cpp"
+#include "../filetransfer/P2PResumeJournal.cpp"
+#include "../filetransfer/P2PMerkleTree.cpp"
 #include "../filetransfer/P2PFileTransfer.cpp"
+#include "../filetransfer/P2PHashCache.cpp"
+#include "../filetransfer/P2PShareScanner.cpp"
 
 using namespace std;
 
+// A piece of a download to check against its hash
+typedef struct {
+	unsigned int file_id;
+	unsigned int piece;
+	unsigned long long offset;
+	unsigned int length;
+	P2PMerkleTree * tree;
+	P2PPeerNode * node;
+} P2PPieceCheck;
+
 class P2PPeerNode
 {
 	private:
 		void construct(int, int);
 		void initialize();
-		void resetSocketDescriptors();
+		void closeQueuedSockets();
+		int openConnection(string, string, int, bool);
+		bool finishConnect(int);
+		void completeConnects(vector<int>&, vector<int>&);
+		int expireConnects();
 		void handleNewConnectionRequest();
-		void handleExistingConnections();
+		void handleExistingConnections(vector<int>&);
+		void handleSocketMessage(int, char*, unsigned int);
+		void handleBinaryMessage(P2PSocket *, char*, unsigned int);
 		void handleRequest(int, char*);
-		void enqueueMessage(int, char*);
+		void enqueueMessage(int, char*, unsigned int);
 
 		// Get File for transfer
-		void prepareFileTransferRequest(vector<string>);
-		void prepareFileTransferRequest(vector<string>, int, int);
+		void prepareFileTransferRequest(vector<P2PStringView>&);
+		void prepareFileTransferRequest(int, string, int, string, unsigned int, vector<string>, vector<P2PPieceMap>);
+		void prepareLocatedFiles(vector<P2PStringView>&);
+		int connectToPeer(string, int, int);
+
+		// Handshake - settings are agreed per connection from both hellos
+		void sendHello(int);
+		void applyCapabilities(int, P2PCapabilities);
+		unsigned int getChecksum(int);
+
+		// Block requests - downloading keeps each peer's window full, uploading answers them
+		void fillRequests(unsigned int);
+		void sendBlockRequest(P2PBlockRequest&);
+		int sendScheduledRequests();
+		void completeChunk(unsigned int, unsigned int);
+		void submitUpload(int, unsigned int, unsigned int, string, unsigned int, unsigned int, unsigned int, int);
+
+		// Uploads waiting on the upload limits give their worker back, and are handed to the pool again when due
+		void deferUpload(FileDataRequest *, long);
+		int resumeDeferredUploads(bool);
 
-		// Stub functions
+		// Content hashes - piece hashes are fetched from a peer, then every piece is checked once it's in
+		P2PMerkleTree * findContentTree(string);
+		void requestPieceHashes(unsigned int, int);
+		void sendPieceHashes(int, unsigned int, string, int);
+		void receivePieceHashes(unsigned int, string, unsigned long long, unsigned int, vector<string>&);
+		void verifyPieces(unsigned int, string);
+		void finishPieceCheck(unsigned int, unsigned int, bool);
+
+		// Pieces that passed their check are batched up and reported to the tracker, so other peers can ask us for them
+		void reportPieces();
+
+		// Stub functions - the caller holds the file lists lock
 		FileItem getFileItem(vector<FileItem>&, int);
 		void addFileItems(vector<FileItem>&, vector<FileItem>);
-		bool hasFileItem(vector<FileItem>&, string, int);
-		FileItem getFileItem(vector<FileItem>&, string, int);
+		bool hasFileItem(vector<FileItem>&, string, unsigned int);
+		FileItem getFileItem(vector<FileItem>&, string, unsigned int);
+		static string getFileKey(FileItem&);
 
 		FileItem getLocalFileItem(int);
 		FileItem getDownloadFileItem(int);
 
-		// Worker threads
-		static void * initiateFileTransfer(void *);
-		static void * handleFileTransfer(void *);
+		// Worker tasks - each owns and frees its argument
+		static void initiateFileTransfer(void *);
+		static void resumeUpload(void *);
+		static void handleFileTransfer(void *);
+		static void verifyDownloadPiece(void *);
 
 		// Own socket
 		void openPrimarySocket();
@@ -45,35 +114,89 @@ class P2PPeerNode
 		int PORT_NUMBER;
 		int MAX_CONNECTIONS;
 		int BUFFER_SIZE;
-		int INCOMING_MESSAGE_SIZE;
 
-		// Buffer
-		char * buffer;
+		// How long (in ms) a connect may take before it's abandoned
+		static const int DEFAULT_CONNECT_TIMEOUT = 5000;
+
+		// How long (in ms) to wait for a hello before treating the peer as a legacy node
+		static const int HELLO_TIMEOUT = 2000;
 
-		// Message queue and file list
-		vector<P2PMessage> message_queue;
+		// What this node advertises in its hello
+		P2PCapabilities local_capabilities;
+
+		// Message queue and file lists - the lists are shared by the reactor, the monitor and chunk workers
+		P2PMessageQueue message_queue;
 		vector<FileItem> local_file_list;
 		vector<FileItem> download_file_list;
+		pthread_mutex_t file_lists_lock;
 
 		// Sockets
 		int primary_socket;
-		int * sockets;
-		int max_connection;
 
 		// Managing Sockets
 		timeval sockets_last_modified;
 
-		// Available sockets
-		vector<P2PSocket> socket_vector;
+		// Lines of the text message being handled - reused so parsing doesn't allocate
+		vector<P2PStringView> request_lines;
+
+		// Open sockets, each with the buffer that reassembles its incoming frames
+		P2PConnectionTable connection_table;
+
+		// Sockets other threads want closed - the reactor closes them on its next pass
 		vector<int> sockets_to_close;
+		pthread_mutex_t close_lock;
 
 		// Settings
 		int port_offset;
 		int public_port;
 		unsigned int number_bind_tries;
+		bool b_reuse_port;
+
+		// Event loop used to watch the sockets
+		P2PReactor reactor;
+		int reactor_backend;
+
+		// Socket reads are batched through the reactor thread's I/O backend
+		P2PIOBackend io_backend;
+
+		// Bounded per-socket send queues, flushed by the reactor
+		P2POutbound outbound;
+
+		// Connections to other peers, shared between file sessions
+		P2PConnectionPool connection_pool;
 
-		// Socket descriptors used for select()
-		fd_set socket_descriptors;
+		// Block requests out to other peers, and the ones we're serving
+		P2PRequestWindow request_window;
+		P2PUploadRegistry upload_registry;
+
+		// Upload and download bandwidth - uploads and block requests are held back until their tokens are due
+		P2PRateLimiter rate_limiter;
+		vector<pair<timeval, FileDataRequest *> > deferred_uploads;
+		pthread_mutex_t deferred_lock;
+
+		// Host lookups, and connects still in flight with their deadlines
+		P2PResolver resolver;
+		map<int, timeval> pending_connects;
+		int connect_timeout;
+
+		// Content trees of the files we share or are downloading, by root
+		map<string, P2PMerkleTree *> content_trees;
+		pthread_mutex_t content_lock;
+
+		// Downloads whose piece hashes have been asked for since they started
+		set<unsigned int> piece_hash_requests;
+
+		// Pieces checked since the tracker was last told, by file id - under the content lock too
+		map<unsigned int, P2PPieceMap> pieces_to_report;
+
+		// How the last share scan went
+		string scan_stats;
+
+		// Worker pools - chunk verification and writes, and upload sessions
+		P2PThreadPool chunk_pool;
+		P2PThreadPool upload_pool;
+		unsigned int chunk_pool_size;
+		unsigned int upload_pool_size;
 
 	public:
 		P2PPeerNode();
@@ -82,9 +205,37 @@ class P2PPeerNode
 		void listenForActivity();
 		void monitorTransfers();
 		void setBindMaxOffset(unsigned int);
+		void setReactorBackend(int);
+		void setReusePort(bool);
+		void setWorkerThreads(unsigned int, unsigned int);
+		string getWorkerStats();
+		void setPeerConnectionLimits(unsigned int, unsigned int);
+		string getConnectionStats();
+		void setRequestWindow(unsigned int, unsigned int, unsigned int);
+		string getRequestStats();
+
+		// Change a rate limit while running - "up|down global|peer|file <KB/s> [file id]"
+		bool setRateLimit(string);
+		string getRateStats();
+
+		// Write every download's progress to its journal, e.g. before quitting
+		void saveDownloads();
+
+		// Find the files under the paths given and hash them, ready to share - a file
+		// that can't be read keeps an empty hash and is shared by name
+		vector<FileItem> scanFiles(vector<string>);
+		string getScanStats();
+
+		// Whether the peer names files by their content root
+		bool hasContentHashes(int);
+
+		// Whether the tracker keeps which pieces each peer has
+		bool hasPieceMaps(int);
 
 		// Add and remove new connections
 		int makeConnection(string, string, int);
+		int dialConnection(string, string, int);
+		void setConnectTimeout(int);
 		void closeSocket(int);
 		void closeSocketByName(string);
 		void queueSocketToClose(int);
@@ -99,29 +250,32 @@ class P2PPeerNode
 
 		bool hasSocketByName(string);
 		P2PSocket getSocketByName(string);
-		void sendMessageToSocketName(string, string);
+		bool sendMessageToSocketName(string, string);
+
+		// Ask the tracker for the peers of many files at once - false if it can't match names
+		bool locateFiles(vector<unsigned int>, string);
 
 		// Progress
 		string getFileProgress();
 		string analyzeFileProgress(FileItem);
 
 		// Send message to socket
-		void sendMessageToSocket(string, int);
-		void requestFileTransfer(string, int, string, int, unsigned int, unsigned int);
+		bool sendMessageToSocket(string, int);
 
-		// Interact with message queue
-		P2PMessage popQueueMessage();
+		// Interact with message queue - the count includes messages still being pushed, so pop with tryPop
+		bool tryPopQueueMessage(P2PMessage&);
+		bool waitQueueMessage(P2PMessage&, int);
 		int countQueueMessages();
 
 		// Handle download files
 		void addDownloadFileItems(vector<FileItem>);
-		bool hasDownloadFileItem(string, int);
-		FileItem getDownloadFileItem(string, int);
+		bool hasDownloadFileItem(string, unsigned int);
+		FileItem getDownloadFileItem(string, unsigned int);
 
 		// Handle local files
 		void addLocalFileItems(vector<FileItem>);
-		bool hasLocalFileItem(string, int);
-		FileItem getLocalFileItem(string, int);
+		bool hasLocalFileItem(string, unsigned int);
+		FileItem getLocalFileItem(string, unsigned int);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,255 @@
+/**
+ * Peer-to-peer rate limiter class
+ */
+
+#include "P2PRateLimiter.hpp"
+
+P2PRateLimiter::P2PRateLimiter()
+{
+	pthread_mutex_init(&limiter_lock, NULL);
+
+	for (int direction = 0; direction < 2; direction++)
+	{
+		for (int scope = 0; scope < 3; scope++)
+		{
+			default_rates[direction][scope] = 0;
+		}
+	}
+}
+
+void P2PRateLimiter::setLimit(int direction, int scope, unsigned int rate)
+{
+	pthread_mutex_lock(&limiter_lock);
+	default_rates[direction][scope] = rate;
+	pthread_mutex_unlock(&limiter_lock);
+}
+
+void P2PRateLimiter::setLimit(int direction, int scope, int key, unsigned int rate)
+{
+	pthread_mutex_lock(&limiter_lock);
+	if (scope == SCOPE_GLOBAL)
+	{
+		default_rates[direction][scope] = rate;
+	}
+	else
+	{
+		key_rates[direction][scope][key] = rate;
+	}
+
+	pthread_mutex_unlock(&limiter_lock);
+}
+
+unsigned int P2PRateLimiter::getLimit(int direction, int scope)
+{
+	pthread_mutex_lock(&limiter_lock);
+	unsigned int rate = default_rates[direction][scope];
+	pthread_mutex_unlock(&limiter_lock);
+	return rate;
+}
+
+long P2PRateLimiter::getDelay(int direction, int socket_id, unsigned int file_id)
+{
+	pthread_mutex_lock(&limiter_lock);
+
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	P2PTokenBucket * levels[3];
+	levels[SCOPE_GLOBAL] = bucketLocked(direction, SCOPE_GLOBAL, 0, now);
+	levels[SCOPE_PEER] = bucketLocked(direction, SCOPE_PEER, socket_id, now);
+	levels[SCOPE_FILE] = bucketLocked(direction, SCOPE_FILE, file_id, now);
+
+	// The slowest bucket to pay off its debt decides the wait
+	double wait = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		if (levels[i] != NULL && levels[i]->tokens < 0)
+			wait = max(wait, -levels[i]->tokens / levels[i]->rate);
+	}
+
+	pthread_mutex_unlock(&limiter_lock);
+	return (long)(wait * 1000 + 0.999);
+}
+
+long P2PRateLimiter::reserve(int direction, int socket_id, unsigned int file_id, unsigned int bytes)
+{
+	pthread_mutex_lock(&limiter_lock);
+
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	P2PTokenBucket * levels[3];
+	levels[SCOPE_GLOBAL] = bucketLocked(direction, SCOPE_GLOBAL, 0, now);
+	levels[SCOPE_PEER] = bucketLocked(direction, SCOPE_PEER, socket_id, now);
+	levels[SCOPE_FILE] = bucketLocked(direction, SCOPE_FILE, file_id, now);
+
+	// Later reservations queue up behind this one's debt
+	double wait = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		if (levels[i] == NULL)
+			continue;
+
+		levels[i]->tokens -= bytes;
+		if (levels[i]->tokens < 0)
+			wait = max(wait, -levels[i]->tokens / levels[i]->rate);
+	}
+
+	pthread_mutex_unlock(&limiter_lock);
+	return (long)(wait * 1000 + 0.999);
+}
+
+void P2PRateLimiter::clearDebt(int direction)
+{
+	pthread_mutex_lock(&limiter_lock);
+
+	for (int scope = 0; scope < 3; scope++)
+	{
+		map<int, P2PTokenBucket>::iterator iter;
+		for (iter = buckets[direction][scope].begin(); iter != buckets[direction][scope].end(); ++iter)
+		{
+			iter->second.tokens = max(iter->second.tokens, 0.0);
+		}
+	}
+
+	pthread_mutex_unlock(&limiter_lock);
+}
+
+void P2PRateLimiter::removePeer(int socket_id)
+{
+	pthread_mutex_lock(&limiter_lock);
+	for (int direction = 0; direction < 2; direction++)
+	{
+		buckets[direction][SCOPE_PEER].erase(socket_id);
+		key_rates[direction][SCOPE_PEER].erase(socket_id);
+	}
+	pthread_mutex_unlock(&limiter_lock);
+}
+
+void P2PRateLimiter::removeFile(unsigned int file_id)
+{
+	pthread_mutex_lock(&limiter_lock);
+	for (int direction = 0; direction < 2; direction++)
+	{
+		buckets[direction][SCOPE_FILE].erase(file_id);
+	}
+	pthread_mutex_unlock(&limiter_lock);
+}
+
+bool P2PRateLimiter::parseLimit(string limit, int &direction, int &scope, unsigned int &rate, int &key)
+{
+	stringstream fields(limit);
+	string direction_name, scope_name;
+	long long kilobytes;
+	if (!(fields >> direction_name >> scope_name >> kilobytes) || kilobytes < 0)
+	{
+		return false;
+	}
+
+	if (direction_name == "up" || direction_name == "upload")
+		direction = DIRECTION_UPLOAD;
+	else if (direction_name == "down" || direction_name == "download")
+		direction = DIRECTION_DOWNLOAD;
+	else
+		return false;
+
+	if (scope_name == "global" || scope_name == "all")
+		scope = SCOPE_GLOBAL;
+	else if (scope_name == "peer")
+		scope = SCOPE_PEER;
+	else if (scope_name == "file")
+		scope = SCOPE_FILE;
+	else
+		return false;
+
+	// A file id after a file limit sets it for that file alone
+	key = -1;
+	if (scope == SCOPE_FILE && !(fields >> key))
+	{
+		key = -1;
+	}
+
+	rate = (unsigned int) min(kilobytes * 1024, 0xFFFFFFFFLL);
+	return true;
+}
+
+string P2PRateLimiter::describe()
+{
+	const char * directions[] = { "upload", "download" };
+	const char * scopes[] = { " total", " per peer", " per file" };
+
+	pthread_mutex_lock(&limiter_lock);
+
+	string description = "Rate limits:";
+	for (int direction = 0; direction < 2; direction++)
+	{
+		string limits;
+		for (int scope = 0; scope < 3; scope++)
+		{
+			if (default_rates[direction][scope] > 0)
+			{
+				limits += string(limits.length() > 0 ? ", " : " ") + to_string(default_rates[direction][scope] / 1024)
+					+ " KB/s" + scopes[scope];
+			}
+		}
+
+		if (key_rates[direction][SCOPE_FILE].size() > 0)
+		{
+			limits += string(limits.length() > 0 ? ", " : " ") + to_string(key_rates[direction][SCOPE_FILE].size())
+				+ " files set apart";
+		}
+
+		description += string(direction > 0 ? ";" : "") + " " + directions[direction]
+			+ (limits.length() > 0 ? limits : " unlimited");
+	}
+
+	pthread_mutex_unlock(&limiter_lock);
+	return description;
+}
+
+unsigned int P2PRateLimiter::rateLocked(int direction, int scope, int key)
+{
+	if (scope != SCOPE_GLOBAL)
+	{
+		map<int, unsigned int>::iterator iter = key_rates[direction][scope].find(key);
+		if (iter != key_rates[direction][scope].end())
+			return iter->second;
+	}
+
+	return default_rates[direction][scope];
+}
+
+P2PTokenBucket * P2PRateLimiter::bucketLocked(int direction, int scope, int key, timeval &now)
+{
+	// Unlimited scopes have no bucket
+	unsigned int rate = rateLocked(direction, scope, key);
+	if (rate == 0)
+	{
+		buckets[direction][scope].erase(key);
+		return NULL;
+	}
+
+	// A new bucket starts full
+	map<int, P2PTokenBucket>::iterator iter = buckets[direction][scope].find(key);
+	if (iter == buckets[direction][scope].end())
+	{
+		P2PTokenBucket & bucket = buckets[direction][scope][key];
+		bucket.rate = rate;
+		bucket.tokens = capacity(rate);
+		bucket.refilled = now;
+		return &bucket;
+	}
+
+	// Top it up for the time that has passed, at the rate in force now
+	P2PTokenBucket & bucket = iter->second;
+	double elapsed = (now.tv_sec - bucket.refilled.tv_sec) + (now.tv_usec - bucket.refilled.tv_usec) / 1000000.0;
+	bucket.rate = rate;
+	bucket.tokens = min(capacity(rate), bucket.tokens + max(elapsed, 0.0) * rate);
+	bucket.refilled = now;
+	return &bucket;
+}
+
+double P2PRateLimiter::capacity(unsigned int rate)
+{
+	return max((double) rate * BURST_MS / 1000, (double) MIN_BURST);
+}
@@ -0,0 +1,72 @@
+#ifndef P2PRATELIMITER_H
+#define P2PRATELIMITER_H
+
+using namespace std;
+
+typedef struct {
+	double tokens;
+	unsigned int rate;
+	timeval refilled;
+} P2PTokenBucket;
+
+/**
+ * Token buckets for upload and download bandwidth. Each direction has a
+ * global bucket, one per peer and one per file, and every byte has to get
+ * through all three. Limits are in bytes per second, 0 is unlimited, and
+ * can change at any time. Buckets hold a quarter second of their rate, so
+ * an idle node can use the whole link straight away.
+ */
+class P2PRateLimiter
+{
+	private:
+		// Rate for every peer or file of a scope, and the ones set for a single key
+		unsigned int default_rates[2][3];
+		map<int, unsigned int> key_rates[2][3];
+		map<int, P2PTokenBucket> buckets[2][3];
+		pthread_mutex_t limiter_lock;
+
+		unsigned int rateLocked(int, int, int);
+		P2PTokenBucket * bucketLocked(int, int, int, timeval&);
+		double capacity(unsigned int);
+
+	public:
+		P2PRateLimiter();
+
+		// Limit a whole scope, or one peer or file in it, in bytes per second
+		void setLimit(int, int, unsigned int);
+		void setLimit(int, int, int, unsigned int);
+		unsigned int getLimit(int, int);
+
+		// The ms until all three buckets are out of debt - 0 when something can go now
+		long getDelay(int, int, unsigned int);
+
+		// Takes tokens for the bytes now, going into debt - returns the ms until it's paid off
+		long reserve(int, int, unsigned int, unsigned int);
+
+		// Forget the debt of one direction, so what it was for can be reserved again
+		void clearDebt(int);
+
+		// Drop the buckets of peers and files that are gone
+		void removePeer(int);
+		void removeFile(unsigned int);
+
+		// Parse "up|down global|peer|file <KB/s> [file id]"
+		static bool parseLimit(string, int&, int&, unsigned int&, int&);
+
+		string describe();
+
+		// Directions
+		static const int DIRECTION_UPLOAD = 0;
+		static const int DIRECTION_DOWNLOAD = 1;
+
+		// Scopes, from widest to narrowest
+		static const int SCOPE_GLOBAL = 0;
+		static const int SCOPE_PEER = 1;
+		static const int SCOPE_FILE = 2;
+
+		// How much of its rate a bucket holds, and the least it holds
+		static const unsigned int BURST_MS = 250;
+		static const unsigned int MIN_BURST = 64 * 1024;
+};
+
+#endif
@@ -0,0 +1,242 @@
+/**
+ * Peer-to-peer reactor class
+ */
+
+#include "P2PReactor.hpp"
+
+P2PReactor::P2PReactor()
+{
+	backend = BACKEND_SELECT;
+	epoll_descriptor = -1;
+	wakeup_descriptor = -1;
+	events = NULL;
+	pthread_mutex_init(&watched_sockets_lock, NULL);
+}
+
+P2PReactor::~P2PReactor()
+{
+	if (epoll_descriptor >= 0)
+		close(epoll_descriptor);
+
+	if (wakeup_descriptor >= 0)
+		close(wakeup_descriptor);
+
+	delete[] events;
+}
+
+void P2PReactor::open(int requested_backend)
+{
+	backend = requested_backend;
+
+	// The wakeup descriptor is watched by both backends
+	wakeup_descriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_descriptor < 0)
+	{
+		perror("Error: could not open reactor wakeup descriptor");
+		exit(1);
+	}
+
+	if (backend == BACKEND_EPOLL)
+	{
+		epoll_descriptor = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_descriptor < 0)
+		{
+			// Fall back to select() if the kernel won't give us an epoll instance
+			perror("Error: could not open epoll instance, falling back to select");
+			backend = BACKEND_SELECT;
+		}
+		else
+		{
+			events = new struct epoll_event[MAX_EVENTS];
+		}
+	}
+
+	addSocket(wakeup_descriptor);
+}
+
+int P2PReactor::getBackend()
+{
+	return backend;
+}
+
+void P2PReactor::addSocket(int socket)
+{
+	if (backend == BACKEND_EPOLL)
+	{
+		// Edge-triggered - the caller must drain the socket on every wakeup.
+		// Writability is always watched, it only fires when a full socket drains
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.fd = socket;
+
+		if (epoll_ctl(epoll_descriptor, EPOLL_CTL_ADD, socket, &event) < 0)
+		{
+			perror("Error: could not register socket with epoll");
+		}
+	}
+	else
+	{
+		if (socket >= FD_SETSIZE)
+		{
+			cout << "Error: socket " << socket << " is beyond FD_SETSIZE and can't be watched by select" << endl;
+			return;
+		}
+
+		pthread_mutex_lock(&watched_sockets_lock);
+		watched_sockets.push_back(socket);
+		pthread_mutex_unlock(&watched_sockets_lock);
+
+		// Make sure a select() in progress picks up the new socket
+		if (socket != wakeup_descriptor)
+			wakeup();
+	}
+}
+
+void P2PReactor::removeSocket(int socket)
+{
+	if (backend == BACKEND_EPOLL)
+	{
+		// Closing the socket would deregister it too, but only once every duplicate is closed
+		epoll_ctl(epoll_descriptor, EPOLL_CTL_DEL, socket, NULL);
+	}
+	else
+	{
+		pthread_mutex_lock(&watched_sockets_lock);
+		watched_sockets.erase(remove(watched_sockets.begin(), watched_sockets.end(), socket), watched_sockets.end());
+		write_sockets.erase(remove(write_sockets.begin(), write_sockets.end(), socket), write_sockets.end());
+		pthread_mutex_unlock(&watched_sockets_lock);
+	}
+}
+
+void P2PReactor::setWriteInterest(int socket, bool b_interested)
+{
+	// epoll always watches for writability
+	if (backend == BACKEND_EPOLL || socket >= FD_SETSIZE)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&watched_sockets_lock);
+	bool b_watched = (find(write_sockets.begin(), write_sockets.end(), socket) != write_sockets.end());
+	if (b_interested && !b_watched)
+		write_sockets.push_back(socket);
+	else if (!b_interested && b_watched)
+		write_sockets.erase(remove(write_sockets.begin(), write_sockets.end(), socket), write_sockets.end());
+	pthread_mutex_unlock(&watched_sockets_lock);
+
+	if (b_interested && !b_watched)
+		wakeup();
+}
+
+int P2PReactor::wait(vector<int> &ready_sockets, vector<int> &writable_sockets, int timeout)
+{
+	ready_sockets.clear();
+	writable_sockets.clear();
+
+	if (backend == BACKEND_EPOLL)
+	{
+		int num_events = epoll_wait(epoll_descriptor, events, MAX_EVENTS, timeout);
+		if (num_events < 0)
+		{
+			return (errno == EINTR) ? 0 : -1;
+		}
+
+		// Only the sockets that are ready are reported
+		for (int i = 0; i < num_events; i++)
+		{
+			if (events[i].data.fd == wakeup_descriptor)
+			{
+				drainWakeup();
+				continue;
+			}
+
+			if (events[i].events & EPOLLOUT)
+				writable_sockets.push_back(events[i].data.fd);
+
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				ready_sockets.push_back(events[i].data.fd);
+		}
+
+		return ready_sockets.size() + writable_sockets.size();
+	}
+
+	// Build the descriptor set from the watched sockets
+	fd_set socket_descriptors;
+	fd_set write_descriptors;
+	FD_ZERO(&socket_descriptors);
+	FD_ZERO(&write_descriptors);
+	int max_connection = 0;
+
+	pthread_mutex_lock(&watched_sockets_lock);
+	vector<int> sockets_copy = watched_sockets;
+	vector<int> write_copy = write_sockets;
+	pthread_mutex_unlock(&watched_sockets_lock);
+
+	vector<int>::iterator iter;
+	for (iter = sockets_copy.begin(); iter != sockets_copy.end(); ++iter)
+	{
+		FD_SET(*iter, &socket_descriptors);
+		max_connection = max(max_connection, *iter);
+	}
+
+	for (iter = write_copy.begin(); iter != write_copy.end(); ++iter)
+	{
+		FD_SET(*iter, &write_descriptors);
+		max_connection = max(max_connection, *iter);
+	}
+
+	// Wait for activity
+	struct timeval tv;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	int activity = select(max_connection + 1, &socket_descriptors, &write_descriptors, NULL, (timeout < 0) ? NULL : &tv);
+	if (activity < 0)
+	{
+		return (errno == EINTR) ? 0 : -1;
+	}
+
+	for (iter = sockets_copy.begin(); iter != sockets_copy.end(); ++iter)
+	{
+		if (!FD_ISSET(*iter, &socket_descriptors)) continue;
+
+		if (*iter == wakeup_descriptor)
+			drainWakeup();
+		else
+			ready_sockets.push_back(*iter);
+	}
+
+	for (iter = write_copy.begin(); iter != write_copy.end(); ++iter)
+	{
+		if (FD_ISSET(*iter, &write_descriptors))
+			writable_sockets.push_back(*iter);
+	}
+
+	return ready_sockets.size() + writable_sockets.size();
+}
+
+void P2PReactor::wakeup()
+{
+	uint64_t value = 1;
+	if (write(wakeup_descriptor, &value, sizeof(value)) < 0 && errno != EAGAIN)
+	{
+		perror("Error: could not wake up reactor");
+	}
+}
+
+void P2PReactor::drainWakeup()
+{
+	uint64_t value;
+	while (read(wakeup_descriptor, &value, sizeof(value)) > 0);
+}
+
+bool P2PReactor::setNonBlocking(int socket)
+{
+	int flags = fcntl(socket, F_GETFL, 0);
+	if (flags < 0)
+	{
+		return false;
+	}
+
+	return (fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0);
+}
@@ -0,0 +1,55 @@
+#ifndef P2PREACTOR_H
+#define P2PREACTOR_H
+
+// Event notification
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+
+using namespace std;
+
+class P2PReactor
+{
+	private:
+		int backend;
+
+		// epoll backend
+		int epoll_descriptor;
+		struct epoll_event * events;
+
+		// select() fallback - sockets are watched level-triggered
+		vector<int> watched_sockets;
+		vector<int> write_sockets;
+		pthread_mutex_t watched_sockets_lock;
+
+		// Used to interrupt a blocking wait from another thread
+		int wakeup_descriptor;
+
+		void drainWakeup();
+
+	public:
+		P2PReactor();
+		~P2PReactor();
+		void open(int);
+		int getBackend();
+
+		// Register and deregister sockets
+		void addSocket(int);
+		void removeSocket(int);
+		void setWriteInterest(int, bool);
+
+		// Wait for activity, filling in the sockets that are readable and writable
+		int wait(vector<int>&, vector<int>&, int);
+		void wakeup();
+
+		static bool setNonBlocking(int);
+
+		// Available backends
+		static const int BACKEND_SELECT = 0;
+		static const int BACKEND_EPOLL = 1;
+
+		// Maximum number of events reported by a single wait
+		static const int MAX_EVENTS = 1024;
+};
+
+#endif
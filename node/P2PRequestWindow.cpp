@@ -0,0 +1,923 @@
+/**
+ * Peer-to-peer request window class
+ */
+
+#include "P2PRequestWindow.hpp"
+
+P2PRequestWindow::P2PRequestWindow()
+{
+	pthread_mutex_init(&window_lock, NULL);
+	next_request_id = 1;
+	window_size = DEFAULT_WINDOW_SIZE;
+	block_chunks = DEFAULT_BLOCK_CHUNKS;
+	request_timeout = DEFAULT_REQUEST_TIMEOUT;
+	completed_requests = 0;
+	retried_requests = 0;
+	scheduled_requests = 0;
+}
+
+void P2PRequestWindow::setWindowSize(unsigned int requests)
+{
+	window_size = (requests > 0) ? requests : 1;
+}
+
+void P2PRequestWindow::setBlockChunks(unsigned int chunks)
+{
+	block_chunks = (chunks > 0) ? chunks : 1;
+}
+
+void P2PRequestWindow::setRequestTimeout(unsigned int timeout)
+{
+	request_timeout = timeout;
+}
+
+bool P2PRequestWindow::addFile(unsigned int file_id, string name, unsigned int size, unsigned int chunk_size, unsigned int piece_size,
+	vector<bool> &chunks_received, bool b_check_pieces)
+{
+	pthread_mutex_lock(&window_lock);
+
+	bool b_added = false;
+	if (downloads.find(file_id) == downloads.end())
+	{
+		unsigned int num_chunks = max(1u, (unsigned int)(((unsigned long long) size + chunk_size - 1) / chunk_size));
+		unsigned int piece_chunks = max(1u, piece_size / chunk_size);
+		unsigned int num_pieces = (num_chunks + piece_chunks - 1) / piece_chunks;
+
+		P2PDownloadState & state = downloads[file_id];
+		state.name = name;
+		state.size = size;
+		state.chunk_size = chunk_size;
+		state.chunks_received.assign(num_chunks, false);
+		state.chunks_missing = num_chunks;
+		state.piece_chunks = piece_chunks;
+		state.piece_chunks_missing.assign(num_pieces, piece_chunks);
+		state.piece_chunks_missing[num_pieces - 1] = num_chunks - (num_pieces - 1) * piece_chunks;
+		state.pieces_missing = num_pieces;
+		state.b_check_pieces = b_check_pieces;
+
+		// Chunks saved before a restart are already in - whole pieces of them may still need checking
+		if (chunks_received.size() == num_chunks)
+		{
+			state.chunks_received = chunks_received;
+			for (unsigned int i = 0; i < num_chunks; i++)
+			{
+				if (chunks_received[i])
+				{
+					state.chunks_missing--;
+					if (--state.piece_chunks_missing[i / piece_chunks] == 0)
+						pieceFilledLocked(state, i / piece_chunks);
+				}
+			}
+		}
+
+		for (unsigned int piece = 0; piece < num_pieces; piece++)
+		{
+			queuePieceLocked(state, piece, false);
+		}
+
+		b_added = true;
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return b_added;
+}
+
+void P2PRequestWindow::removeFile(unsigned int file_id)
+{
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PBlockRequest>::iterator iter;
+	for (iter = requests.begin(); iter != requests.end(); )
+	{
+		if (iter->second.file_id == file_id)
+		{
+			finishLocked(iter++);
+		}
+		else
+		{
+			++iter;
+		}
+	}
+
+	downloads.erase(file_id);
+
+	pthread_mutex_unlock(&window_lock);
+}
+
+bool P2PRequestWindow::hasFile(unsigned int file_id)
+{
+	pthread_mutex_lock(&window_lock);
+	bool b_found = (downloads.find(file_id) != downloads.end());
+	pthread_mutex_unlock(&window_lock);
+	return b_found;
+}
+
+void P2PRequestWindow::addPeer(unsigned int file_id, int socket_id)
+{
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator iter = downloads.find(file_id);
+	if (iter != downloads.end())
+	{
+		// A peer offered again by the tracker gets a fresh start - with the whole file, until told otherwise
+		iter->second.peer_failures[socket_id] = 0;
+		iter->second.peer_pieces.erase(socket_id);
+	}
+
+	pthread_mutex_unlock(&window_lock);
+}
+
+void P2PRequestWindow::setPeerPieces(unsigned int file_id, int socket_id, P2PPieceMap &pieces)
+{
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator iter = downloads.find(file_id);
+	if (iter != downloads.end() && iter->second.peer_failures.count(socket_id) > 0)
+	{
+		// What the tracker said last replaces what it said before
+		if (pieces.isComplete(iter->second.piece_chunks_missing.size()))
+			iter->second.peer_pieces.erase(socket_id);
+		else
+			iter->second.peer_pieces[socket_id] = pieces;
+	}
+
+	pthread_mutex_unlock(&window_lock);
+}
+
+bool P2PRequestWindow::isStarved(unsigned int file_id)
+{
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator iter = downloads.find(file_id);
+	bool b_starved = (iter != downloads.end() && iter->second.pending_blocks.size() > 0
+		&& iter->second.peer_failures.size() > 0);
+
+	// Only peers part way through, and none of them has been given anything
+	if (b_starved)
+	{
+		map<int, unsigned int>::iterator peer_iter;
+		for (peer_iter = iter->second.peer_failures.begin(); peer_iter != iter->second.peer_failures.end() && b_starved; ++peer_iter)
+		{
+			b_starved = (iter->second.peer_pieces.count(peer_iter->first) > 0);
+		}
+
+		map<unsigned int, P2PBlockRequest>::iterator request_iter;
+		for (request_iter = requests.begin(); request_iter != requests.end() && b_starved; ++request_iter)
+		{
+			b_starved = (request_iter->second.file_id != file_id);
+		}
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return b_starved;
+}
+
+bool P2PRequestWindow::hasCheckedPieces(unsigned int file_id, unsigned long long offset, unsigned long long length)
+{
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator iter = downloads.find(file_id);
+	if (iter == downloads.end() || length == 0 || offset + length > iter->second.size)
+	{
+		pthread_mutex_unlock(&window_lock);
+		return false;
+	}
+
+	P2PDownloadState & state = iter->second;
+	unsigned long long piece_bytes = (unsigned long long) state.piece_chunks * state.chunk_size;
+	bool b_checked = true;
+	for (unsigned int piece = offset / piece_bytes; piece <= (offset + length - 1) / piece_bytes && b_checked; piece++)
+	{
+		b_checked = isPieceCheckedLocked(state, piece);
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return b_checked;
+}
+
+bool P2PRequestWindow::hasPeers(unsigned int file_id)
+{
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator iter = downloads.find(file_id);
+	bool b_has_peers = (iter != downloads.end() && iter->second.peer_failures.size() > 0);
+
+	pthread_mutex_unlock(&window_lock);
+	return b_has_peers;
+}
+
+vector<unsigned int> P2PRequestWindow::setPeerLimits(int socket_id, unsigned int depth, unsigned int max_block_chunks)
+{
+	vector<unsigned int> file_ids;
+
+	pthread_mutex_lock(&window_lock);
+
+	P2PPeerLimits & limits = peer_limits[socket_id];
+	limits.depth = min(window_size, max(depth, 1u));
+	limits.block_chunks = max(max_block_chunks, 1u);
+	file_ids = peerFilesLocked(socket_id);
+
+	pthread_mutex_unlock(&window_lock);
+	return file_ids;
+}
+
+vector<P2PBlockRequest> P2PRequestWindow::fill(unsigned int file_id)
+{
+	vector<P2PBlockRequest> new_requests;
+
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator download_iter = downloads.find(file_id);
+	if (download_iter == downloads.end())
+	{
+		pthread_mutex_unlock(&window_lock);
+		return new_requests;
+	}
+
+	P2PDownloadState & state = download_iter->second;
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	// Hand out one block per peer per round, so the file is spread across its peers
+	bool b_assigned = true;
+	while (b_assigned && state.pending_blocks.size() > 0)
+	{
+		b_assigned = false;
+
+		map<int, unsigned int>::iterator peer_iter;
+		for (peer_iter = state.peer_failures.begin(); peer_iter != state.peer_failures.end() && state.pending_blocks.size() > 0; ++peer_iter)
+		{
+			// Peers that haven't finished the handshake wait
+			map<int, P2PPeerLimits>::iterator limits_iter = peer_limits.find(peer_iter->first);
+			if (limits_iter == peer_limits.end() || outstanding[peer_iter->first] >= limits_iter->second.depth)
+			{
+				continue;
+			}
+
+			// Peers part way through the file may have nothing that's left to ask for
+			pair<unsigned int, unsigned int> block;
+			if (!takeBlockLocked(state, peer_iter->first, block))
+			{
+				continue;
+			}
+
+			// Cut the block down to what the peer takes, leaving the rest for the next request
+			if (block.second > limits_iter->second.block_chunks)
+			{
+				state.pending_blocks.push_front(make_pair(block.first + limits_iter->second.block_chunks,
+					block.second - limits_iter->second.block_chunks));
+				block.second = limits_iter->second.block_chunks;
+			}
+
+			// Chunks can land after a request was given up on - skip blocks that already arrived
+			unsigned int remaining = 0;
+			for (unsigned int chunk = block.first; chunk < block.first + block.second; chunk++)
+			{
+				if (!state.chunks_received[chunk - 1])
+					remaining++;
+			}
+
+			if (remaining == 0)
+			{
+				b_assigned = true;
+				continue;
+			}
+
+			P2PBlockRequest request;
+			request.request_id = next_request_id++;
+			request.file_id = file_id;
+			request.name = state.name;
+			request.size = state.size;
+			request.socket_id = peer_iter->first;
+			request.start = block.first;
+			request.count = block.second;
+			request.remaining = remaining;
+			request.bytes = min((unsigned long long) block.second * state.chunk_size,
+				state.size - (unsigned long long)(block.first - 1) * state.chunk_size);
+			request.sent = now;
+			request.b_sent = true;
+
+			requests[request.request_id] = request;
+			outstanding[request.socket_id]++;
+			new_requests.push_back(request);
+			b_assigned = true;
+		}
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return new_requests;
+}
+
+void P2PRequestWindow::schedule(unsigned int request_id, long delay)
+{
+	pthread_mutex_lock(&window_lock);
+
+	// The send time is in the future, so the request can't time out before it goes
+	map<unsigned int, P2PBlockRequest>::iterator iter = requests.find(request_id);
+	if (iter != requests.end() && iter->second.b_sent)
+	{
+		gettimeofday(&iter->second.sent, NULL);
+		long long send_time = (long long) iter->second.sent.tv_sec * 1000000 + iter->second.sent.tv_usec + (long long) delay * 1000;
+		iter->second.sent.tv_sec = send_time / 1000000;
+		iter->second.sent.tv_usec = send_time % 1000000;
+		iter->second.b_sent = false;
+		scheduled_requests++;
+	}
+
+	pthread_mutex_unlock(&window_lock);
+}
+
+vector<P2PBlockRequest> P2PRequestWindow::collectDue(int &next_timeout)
+{
+	vector<P2PBlockRequest> due;
+	next_timeout = -1;
+
+	pthread_mutex_lock(&window_lock);
+
+	if (scheduled_requests > 0)
+	{
+		timeval now;
+		gettimeofday(&now, NULL);
+
+		map<unsigned int, P2PBlockRequest>::iterator iter;
+		for (iter = requests.begin(); iter != requests.end(); ++iter)
+		{
+			P2PBlockRequest & request = iter->second;
+			if (request.b_sent)
+				continue;
+
+			long remaining = (request.sent.tv_sec - now.tv_sec) * 1000 + (request.sent.tv_usec - now.tv_usec) / 1000;
+			if (remaining <= 0)
+			{
+				request.b_sent = true;
+				scheduled_requests--;
+				due.push_back(request);
+			}
+			else if (next_timeout < 0 || remaining < next_timeout)
+			{
+				next_timeout = remaining;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return due;
+}
+
+vector<P2PBlockRequest> P2PRequestWindow::takeScheduled()
+{
+	vector<P2PBlockRequest> scheduled;
+
+	pthread_mutex_lock(&window_lock);
+
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	map<unsigned int, P2PBlockRequest>::iterator iter;
+	for (iter = requests.begin(); iter != requests.end() && scheduled_requests > 0; ++iter)
+	{
+		if (!iter->second.b_sent)
+		{
+			iter->second.b_sent = true;
+			iter->second.sent = now;
+			scheduled_requests--;
+			scheduled.push_back(iter->second);
+		}
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return scheduled;
+}
+
+vector<unsigned int> P2PRequestWindow::completeChunk(unsigned int file_id, unsigned int chunk)
+{
+	vector<unsigned int> file_ids;
+
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator download_iter = downloads.find(file_id);
+	if (download_iter == downloads.end() || chunk == 0 || chunk > download_iter->second.chunks_received.size()
+		|| download_iter->second.chunks_received[chunk - 1])
+	{
+		pthread_mutex_unlock(&window_lock);
+		return file_ids;
+	}
+
+	P2PDownloadState & state = download_iter->second;
+	state.chunks_received[chunk - 1] = true;
+	state.chunks_missing--;
+
+	if (--state.piece_chunks_missing[(chunk - 1) / state.piece_chunks] == 0)
+	{
+		pieceFilledLocked(state, (chunk - 1) / state.piece_chunks);
+	}
+
+	// Credit the request the chunk belongs to
+	map<unsigned int, P2PBlockRequest>::iterator iter;
+	for (iter = requests.begin(); iter != requests.end(); ++iter)
+	{
+		P2PBlockRequest & request = iter->second;
+		if (request.file_id == file_id && chunk >= request.start && chunk < request.start + request.count)
+		{
+			// Remember who sent the piece, in case it doesn't match its hash
+			if (state.b_check_pieces)
+			{
+				state.piece_peers[(chunk - 1) / state.piece_chunks].insert(request.socket_id);
+			}
+
+			if (--request.remaining == 0)
+			{
+				// The peer delivered - forget its earlier failures
+				state.peer_failures[request.socket_id] = 0;
+
+				// Files downloading together share the peer's window
+				int socket_id = request.socket_id;
+				finishLocked(iter);
+				completed_requests++;
+
+				file_ids.push_back(file_id);
+				vector<unsigned int> peer_files = peerFilesLocked(socket_id);
+				for (unsigned int i = 0; i < peer_files.size(); i++)
+				{
+					if (peer_files[i] != file_id)
+						file_ids.push_back(peer_files[i]);
+				}
+			}
+
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return file_ids;
+}
+
+vector<unsigned int> P2PRequestWindow::takeUncheckedPieces(unsigned int file_id)
+{
+	vector<unsigned int> pieces;
+
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator iter = downloads.find(file_id);
+	if (iter != downloads.end())
+	{
+		P2PDownloadState & state = iter->second;
+		pieces.assign(state.unchecked_pieces.begin(), state.unchecked_pieces.end());
+		state.checking_pieces.insert(state.unchecked_pieces.begin(), state.unchecked_pieces.end());
+		state.unchecked_pieces.clear();
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return pieces;
+}
+
+bool P2PRequestWindow::finishPieceCheck(unsigned int file_id, unsigned int piece, bool b_matched)
+{
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator iter = downloads.find(file_id);
+	if (iter == downloads.end() || iter->second.checking_pieces.erase(piece) == 0)
+	{
+		pthread_mutex_unlock(&window_lock);
+		return false;
+	}
+
+	P2PDownloadState & state = iter->second;
+	set<int> peers = state.piece_peers[piece];
+	state.piece_peers.erase(piece);
+	if (b_matched)
+	{
+		state.pieces_missing--;
+		pthread_mutex_unlock(&window_lock);
+		return false;
+	}
+
+	// Delivering other blocks doesn't make up for bad data, so these are counted on their own
+	set<int>::iterator peer_iter;
+	for (peer_iter = peers.begin(); peer_iter != peers.end(); ++peer_iter)
+	{
+		if (++state.peer_bad_pieces[*peer_iter] >= MAX_PEER_FAILURES)
+		{
+			state.peer_failures.erase(*peer_iter);
+		}
+	}
+
+	// Every chunk of a bad piece is suspect, so the whole piece goes back out, ahead of the rest
+	unsigned int first_chunk = piece * state.piece_chunks;
+	unsigned int end_chunk = min(first_chunk + state.piece_chunks, (unsigned int) state.chunks_received.size());
+	for (unsigned int i = first_chunk; i < end_chunk; i++)
+	{
+		state.chunks_received[i] = false;
+	}
+
+	state.chunks_missing += end_chunk - first_chunk;
+	state.piece_chunks_missing[piece] = end_chunk - first_chunk;
+	queuePieceLocked(state, piece, true);
+	retried_requests++;
+
+	pthread_mutex_unlock(&window_lock);
+	return true;
+}
+
+bool P2PRequestWindow::reject(int socket_id, unsigned int request_id, unsigned int &file_id)
+{
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PBlockRequest>::iterator iter = requests.find(request_id);
+	if (iter == requests.end() || iter->second.socket_id != socket_id)
+	{
+		pthread_mutex_unlock(&window_lock);
+		return false;
+	}
+
+	// The peer doesn't have the file, so there's no point asking it again
+	file_id = iter->second.file_id;
+	requeueLocked(iter->second);
+	downloads[file_id].peer_failures.erase(socket_id);
+	finishLocked(iter);
+	retried_requests++;
+
+	pthread_mutex_unlock(&window_lock);
+	return true;
+}
+
+vector<P2PBlockRequest> P2PRequestWindow::expire()
+{
+	vector<P2PBlockRequest> expired;
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PBlockRequest>::iterator iter;
+	for (iter = requests.begin(); iter != requests.end(); )
+	{
+		P2PBlockRequest & request = iter->second;
+		long elapsed = (now.tv_sec - request.sent.tv_sec) * 1000 + (now.tv_usec - request.sent.tv_usec) / 1000;
+		if (elapsed < (long) request_timeout)
+		{
+			++iter;
+			continue;
+		}
+
+		expired.push_back(request);
+		requeueLocked(request);
+		retried_requests++;
+
+		// Stop asking a peer that keeps timing out
+		map<int, unsigned int> & peer_failures = downloads[request.file_id].peer_failures;
+		map<int, unsigned int>::iterator peer_iter = peer_failures.find(request.socket_id);
+		if (peer_iter != peer_failures.end() && ++peer_iter->second >= MAX_PEER_FAILURES)
+		{
+			peer_failures.erase(peer_iter);
+		}
+
+		finishLocked(iter++);
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return expired;
+}
+
+vector<unsigned int> P2PRequestWindow::removeSocket(int socket_id)
+{
+	vector<unsigned int> file_ids;
+
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PBlockRequest>::iterator iter;
+	for (iter = requests.begin(); iter != requests.end(); )
+	{
+		if (iter->second.socket_id == socket_id)
+		{
+			if (find(file_ids.begin(), file_ids.end(), iter->second.file_id) == file_ids.end())
+				file_ids.push_back(iter->second.file_id);
+
+			requeueLocked(iter->second);
+			retried_requests++;
+			finishLocked(iter++);
+		}
+		else
+		{
+			++iter;
+		}
+	}
+
+	map<unsigned int, P2PDownloadState>::iterator download_iter;
+	for (download_iter = downloads.begin(); download_iter != downloads.end(); ++download_iter)
+	{
+		download_iter->second.peer_failures.erase(socket_id);
+		download_iter->second.peer_bad_pieces.erase(socket_id);
+		download_iter->second.peer_pieces.erase(socket_id);
+	}
+
+	outstanding.erase(socket_id);
+	peer_limits.erase(socket_id);
+
+	pthread_mutex_unlock(&window_lock);
+	return file_ids;
+}
+
+bool P2PRequestWindow::getMissingPieces(unsigned int file_id, vector<unsigned int> &missing_pieces)
+{
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator iter = downloads.find(file_id);
+	if (iter == downloads.end())
+	{
+		pthread_mutex_unlock(&window_lock);
+		return false;
+	}
+
+	// Pieces are numbered from 1 - one that hasn't passed its check yet is still missing
+	missing_pieces.clear();
+	P2PDownloadState & state = iter->second;
+	for (unsigned int piece = 0; piece < state.piece_chunks_missing.size(); piece++)
+	{
+		if (isPieceCheckedLocked(state, piece))
+			continue;
+
+		if (missing_pieces.size() > 0 && missing_pieces[missing_pieces.size() - 2] + missing_pieces.back() == piece + 1)
+		{
+			missing_pieces.back()++;
+		}
+		else
+		{
+			missing_pieces.push_back(piece + 1);
+			missing_pieces.push_back(1);
+		}
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return true;
+}
+
+bool P2PRequestWindow::getProgress(unsigned int file_id, unsigned int &pieces_done, unsigned int &num_pieces,
+	unsigned long long &bytes_done)
+{
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator iter = downloads.find(file_id);
+	if (iter == downloads.end())
+	{
+		pthread_mutex_unlock(&window_lock);
+		return false;
+	}
+
+	// Every chunk is whole except the file's last
+	P2PDownloadState & state = iter->second;
+	num_pieces = state.piece_chunks_missing.size();
+	pieces_done = num_pieces - state.pieces_missing;
+	bytes_done = (unsigned long long)(state.chunks_received.size() - state.chunks_missing) * state.chunk_size;
+	if (state.chunks_received.back())
+	{
+		bytes_done -= (unsigned long long) state.chunks_received.size() * state.chunk_size - state.size;
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return true;
+}
+
+bool P2PRequestWindow::getReceivedChunks(unsigned int file_id, vector<bool> &chunks_received)
+{
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator iter = downloads.find(file_id);
+	bool b_found = (iter != downloads.end());
+	if (b_found)
+	{
+		chunks_received = iter->second.chunks_received;
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return b_found;
+}
+
+vector<int> P2PRequestWindow::getPeers(unsigned int file_id)
+{
+	vector<int> peers;
+
+	pthread_mutex_lock(&window_lock);
+
+	map<unsigned int, P2PDownloadState>::iterator iter = downloads.find(file_id);
+	if (iter != downloads.end())
+	{
+		map<int, unsigned int>::iterator peer_iter;
+		for (peer_iter = iter->second.peer_failures.begin(); peer_iter != iter->second.peer_failures.end(); ++peer_iter)
+		{
+			peers.push_back(peer_iter->first);
+		}
+	}
+
+	pthread_mutex_unlock(&window_lock);
+	return peers;
+}
+
+string P2PRequestWindow::describe()
+{
+	pthread_mutex_lock(&window_lock);
+
+	string description = "Block requests: " + to_string(requests.size()) + " outstanding, "
+		+ (scheduled_requests > 0 ? to_string(scheduled_requests) + " held back by rate limits, " : "")
+		+ to_string(completed_requests) + " completed, " + to_string(retried_requests) + " retried ("
+		+ to_string(window_size) + " per peer of " + to_string(block_chunks) + " chunks)";
+
+	pthread_mutex_unlock(&window_lock);
+	return description;
+}
+
+void P2PRequestWindow::requeueLocked(P2PBlockRequest &request)
+{
+	map<unsigned int, P2PDownloadState>::iterator download_iter = downloads.find(request.file_id);
+	if (download_iter == downloads.end())
+	{
+		return;
+	}
+
+	// Put back only the runs of chunks that never arrived, ahead of the untouched blocks
+	P2PDownloadState & state = download_iter->second;
+	unsigned int chunk = request.start + request.count;
+	while (chunk > request.start)
+	{
+		chunk--;
+		if (state.chunks_received[chunk - 1])
+			continue;
+
+		unsigned int run_end = chunk;
+		while (chunk > request.start && !state.chunks_received[chunk - 2])
+			chunk--;
+
+		state.pending_blocks.push_front(make_pair(chunk, run_end - chunk + 1));
+	}
+}
+
+void P2PRequestWindow::pieceFilledLocked(P2PDownloadState &state, unsigned int piece)
+{
+	// A piece with a hash to match waits for its check
+	if (state.b_check_pieces)
+	{
+		state.unchecked_pieces.insert(piece);
+	}
+	else
+	{
+		state.pieces_missing--;
+	}
+}
+
+void P2PRequestWindow::queuePieceLocked(P2PDownloadState &state, unsigned int piece, bool b_first)
+{
+	// Chunks are numbered from 1 - each piece is asked for in blocks of its own, made of the chunks it's missing
+	unsigned int num_chunks = state.chunks_received.size();
+	unsigned int piece_start = piece * state.piece_chunks + 1;
+	unsigned int piece_end = min(piece_start + state.piece_chunks, num_chunks + 1);
+
+	deque<pair<unsigned int, unsigned int> > blocks;
+	for (unsigned int start = piece_start; start < piece_end; )
+	{
+		if (state.chunks_received[start - 1])
+		{
+			start++;
+			continue;
+		}
+
+		unsigned int count = 1;
+		while (count < block_chunks && start + count < piece_end && !state.chunks_received[start + count - 1])
+		{
+			count++;
+		}
+
+		blocks.push_back(make_pair(start, count));
+		start += count;
+	}
+
+	if (b_first)
+		state.pending_blocks.insert(state.pending_blocks.begin(), blocks.begin(), blocks.end());
+	else
+		state.pending_blocks.insert(state.pending_blocks.end(), blocks.begin(), blocks.end());
+}
+
+vector<unsigned int> P2PRequestWindow::peerFilesLocked(int socket_id)
+{
+	// Downloads the peer is still a source for
+	vector<unsigned int> file_ids;
+	map<unsigned int, P2PDownloadState>::iterator iter;
+	for (iter = downloads.begin(); iter != downloads.end(); ++iter)
+	{
+		if (iter->second.peer_failures.count(socket_id) > 0 && iter->second.pending_blocks.size() > 0)
+			file_ids.push_back(iter->first);
+	}
+
+	return file_ids;
+}
+
+bool P2PRequestWindow::takeBlockLocked(P2PDownloadState &state, int socket_id, pair<unsigned int, unsigned int> &block)
+{
+	// A peer with the whole file takes the next block in line
+	map<int, P2PPieceMap>::iterator pieces_iter = state.peer_pieces.find(socket_id);
+	if (pieces_iter == state.peer_pieces.end())
+	{
+		block = state.pending_blocks.front();
+		state.pending_blocks.pop_front();
+		return true;
+	}
+
+	// Otherwise the first one on a piece it has - blocks never cross a piece
+	deque<pair<unsigned int, unsigned int> >::iterator iter;
+	for (iter = state.pending_blocks.begin(); iter != state.pending_blocks.end(); ++iter)
+	{
+		if (pieces_iter->second.contains((iter->first - 1) / state.piece_chunks))
+		{
+			block = *iter;
+			state.pending_blocks.erase(iter);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool P2PRequestWindow::isPieceCheckedLocked(P2PDownloadState &state, unsigned int piece)
+{
+	return (piece < state.piece_chunks_missing.size() && state.piece_chunks_missing[piece] == 0
+		&& state.unchecked_pieces.count(piece) == 0 && state.checking_pieces.count(piece) == 0);
+}
+
+void P2PRequestWindow::finishLocked(map<unsigned int, P2PBlockRequest>::iterator iter)
+{
+	if (!iter->second.b_sent)
+	{
+		scheduled_requests--;
+	}
+
+	// Free the peer's slot in the window
+	map<int, unsigned int>::iterator outstanding_iter = outstanding.find(iter->second.socket_id);
+	if (outstanding_iter != outstanding.end() && outstanding_iter->second > 0)
+	{
+		outstanding_iter->second--;
+	}
+
+	requests.erase(iter);
+}
+
+/**
+ * Upload registry
+ */
+
+P2PUploadRegistry::P2PUploadRegistry()
+{
+	pthread_mutex_init(&registry_lock, NULL);
+}
+
+void P2PUploadRegistry::begin(int socket_id, unsigned int request_id)
+{
+	pthread_mutex_lock(&registry_lock);
+	uploads[make_pair(socket_id, request_id)] = false;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+void P2PUploadRegistry::finish(int socket_id, unsigned int request_id)
+{
+	pthread_mutex_lock(&registry_lock);
+	uploads.erase(make_pair(socket_id, request_id));
+	pthread_mutex_unlock(&registry_lock);
+}
+
+void P2PUploadRegistry::cancel(int socket_id, unsigned int request_id)
+{
+	pthread_mutex_lock(&registry_lock);
+
+	// Uploads that already finished have nothing left to cancel
+	map<pair<int, unsigned int>, bool>::iterator iter = uploads.find(make_pair(socket_id, request_id));
+	if (iter != uploads.end())
+	{
+		iter->second = true;
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+}
+
+bool P2PUploadRegistry::isCancelled(int socket_id, unsigned int request_id)
+{
+	pthread_mutex_lock(&registry_lock);
+
+	map<pair<int, unsigned int>, bool>::iterator iter = uploads.find(make_pair(socket_id, request_id));
+	bool b_cancelled = (iter != uploads.end() && iter->second);
+
+	pthread_mutex_unlock(&registry_lock);
+	return b_cancelled;
+}
+
+void P2PUploadRegistry::removeSocket(int socket_id)
+{
+	pthread_mutex_lock(&registry_lock);
+
+	// Anything still running for the socket stops at its next check
+	map<pair<int, unsigned int>, bool>::iterator iter;
+	for (iter = uploads.begin(); iter != uploads.end(); ++iter)
+	{
+		if (iter->first.first == socket_id)
+			iter->second = true;
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,185 @@
+#ifndef P2PREQUESTWINDOW_H
+#define P2PREQUESTWINDOW_H
+
+using namespace std;
+
+typedef struct {
+	unsigned int request_id;
+	unsigned int file_id;
+	string name;
+	unsigned int size;
+	int socket_id;
+	unsigned int start;
+	unsigned int count;
+	unsigned int remaining;
+	unsigned int bytes;
+	timeval sent;
+	bool b_sent;
+} P2PBlockRequest;
+
+typedef struct {
+	unsigned int depth;
+	unsigned int block_chunks;
+} P2PPeerLimits;
+
+typedef struct {
+	string name;
+	unsigned int size;
+	unsigned int chunk_size;
+	vector<bool> chunks_received;
+	unsigned int chunks_missing;
+	unsigned int piece_chunks;
+	vector<unsigned int> piece_chunks_missing;
+	unsigned int pieces_missing;
+	bool b_check_pieces;
+	set<unsigned int> unchecked_pieces;
+	set<unsigned int> checking_pieces;
+	map<unsigned int, set<int> > piece_peers;
+	map<int, unsigned int> peer_bad_pieces;
+	deque<pair<unsigned int, unsigned int> > pending_blocks;
+	map<int, unsigned int> peer_failures;
+	map<int, P2PPieceMap> peer_pieces;
+} P2PDownloadState;
+
+/**
+ * Block requests a downloader has out, keyed by request id. Each peer gets
+ * up to a window of them at once; a request finishes once every chunk in
+ * its block has been written, and only the chunks still missing go back
+ * out when a request fails, times out or loses its connection. Blocks never
+ * cross a piece, and a piece is done once all of its chunks are - and, for a
+ * file with a content hash, once the whole piece has matched its hash. A
+ * peer that's still downloading the file itself only gets blocks on pieces
+ * the tracker says it has.
+ */
+class P2PRequestWindow
+{
+	private:
+		map<unsigned int, P2PDownloadState> downloads;
+		map<unsigned int, P2PBlockRequest> requests;
+		map<int, unsigned int> outstanding;
+		map<int, P2PPeerLimits> peer_limits;
+		pthread_mutex_t window_lock;
+		unsigned int next_request_id;
+		unsigned int window_size;
+		unsigned int block_chunks;
+		unsigned int request_timeout;
+
+		// Requests held back by the rate limiter, still to be sent
+		unsigned int scheduled_requests;
+
+		// Counters for describe()
+		unsigned long completed_requests;
+		unsigned long retried_requests;
+
+		void requeueLocked(P2PBlockRequest&);
+		void pieceFilledLocked(P2PDownloadState&, unsigned int);
+		void queuePieceLocked(P2PDownloadState&, unsigned int, bool);
+		void finishLocked(map<unsigned int, P2PBlockRequest>::iterator);
+		vector<unsigned int> peerFilesLocked(int);
+		bool takeBlockLocked(P2PDownloadState&, int, pair<unsigned int, unsigned int>&);
+		bool isPieceCheckedLocked(P2PDownloadState&, unsigned int);
+
+	public:
+		P2PRequestWindow();
+		void setWindowSize(unsigned int);
+		void setBlockChunks(unsigned int);
+		void setRequestTimeout(unsigned int);
+
+		// Start tracking a download - every chunk of every piece is needed, except any already received.
+		// Pieces of a file with a content hash also have to be checked before they count.
+		bool addFile(unsigned int, string, unsigned int, unsigned int, unsigned int, vector<bool>&, bool);
+		void removeFile(unsigned int);
+		bool hasFile(unsigned int);
+
+		// Peers that hold the file
+		void addPeer(unsigned int, int);
+		bool hasPeers(unsigned int);
+
+		// A peer part way through the file is only asked for the pieces it has
+		void setPeerPieces(unsigned int, int, P2PPieceMap&);
+
+		// Blocks are waiting, but none on pieces the file's peers have yet
+		bool isStarved(unsigned int);
+
+		// Whether every piece under the byte range is in and, for a file with a content hash, checked
+		bool hasCheckedPieces(unsigned int, unsigned long long, unsigned long long);
+
+		// What the peer agreed to in its hello - it gets no requests until then.
+		// Returns the files the peer holds, which can now be filled.
+		vector<unsigned int> setPeerLimits(int, unsigned int, unsigned int);
+
+		// New requests to send, filling each of the file's peers up to the window
+		vector<P2PBlockRequest> fill(unsigned int);
+
+		// Hold a new request back for the ms given, instead of sending it now
+		void schedule(unsigned int, long);
+
+		// Held-back requests that are due - the ms until the next one, or -1, is filled in
+		vector<P2PBlockRequest> collectDue(int&);
+
+		// Every held-back request, due or not, so it can be timed again
+		vector<P2PBlockRequest> takeScheduled();
+
+		// A chunk was written. When it finishes its request, returns the files
+		// that can use the freed slot - its own, then the others on that peer.
+		vector<unsigned int> completeChunk(unsigned int, unsigned int);
+
+		// Pieces whose chunks are all in but haven't been checked yet - they're marked as being checked
+		vector<unsigned int> takeUncheckedPieces(unsigned int);
+
+		// A piece was checked against its hash. One that didn't match is asked for again, and true is returned.
+		// The peers that sent it are charged for it, and dropped for the file after MAX_PEER_FAILURES.
+		bool finishPieceCheck(unsigned int, unsigned int, bool);
+
+		// The peer can't serve a request - the peer is dropped for that file
+		bool reject(int, unsigned int, unsigned int&);
+
+		// Requests past the timeout - the caller cancels them with the peer
+		vector<P2PBlockRequest> expire();
+
+		// A connection went away - returns the files that lost requests
+		vector<unsigned int> removeSocket(int);
+
+		// Pieces still missing, as runs of start and count - false if the file isn't tracked
+		bool getMissingPieces(unsigned int, vector<unsigned int>&);
+
+		// Pieces done out of the total, and the bytes written so far
+		bool getProgress(unsigned int, unsigned int&, unsigned int&, unsigned long long&);
+
+		// A copy of the chunks written so far, for the resume journal
+		bool getReceivedChunks(unsigned int, vector<bool>&);
+
+		// Peers that hold the file, e.g. to ask for its piece hashes
+		vector<int> getPeers(unsigned int);
+
+		string describe();
+
+		// Defaults
+		static const unsigned int DEFAULT_WINDOW_SIZE = 8;
+		static const unsigned int DEFAULT_BLOCK_CHUNKS = 32;
+		static const unsigned int DEFAULT_REQUEST_TIMEOUT = 10000; // ms
+
+		// Failures in a row before a peer is no longer asked for a file
+		static const unsigned int MAX_PEER_FAILURES = 3;
+};
+
+/**
+ * Block requests an uploader is serving, so a downloader can cancel one
+ * that hasn't been sent yet
+ */
+class P2PUploadRegistry
+{
+	private:
+		map<pair<int, unsigned int>, bool> uploads;
+		pthread_mutex_t registry_lock;
+
+	public:
+		P2PUploadRegistry();
+		void begin(int, unsigned int);
+		void finish(int, unsigned int);
+		void cancel(int, unsigned int);
+		bool isCancelled(int, unsigned int);
+		void removeSocket(int);
+};
+
+#endif
@@ -7,24 +7,59 @@
 P2PServer::P2PServer()
 {
 	max_file_id = 0;
+	reactor_count = 1;
+	pthread_rwlock_init(&file_list_lock, NULL);
+}
+
+void P2PServer::setReactorCount(int count)
+{
+	reactor_count = max(count, 1);
 }
 
 void P2PServer::start()
 {
-	// Open the socket and listen for connections
-	node = P2PPeerNode(27890, 512);
-	node.setBindMaxOffset(1);
-	node.start();
+	// Open one listener per reactor - with more than one, the kernel spreads
+	// new connections across them with SO_REUSEPORT
+	for (int i = 0; i < reactor_count; i++)
+	{
+		P2PServerShard shard;
+		shard.server = this;
+		shard.node = new P2PPeerNode(27890, 512);
+		shard.node->setBindMaxOffset(1);
+		shard.node->setReusePort(reactor_count > 1);
+		shard.node->setWorkerThreads(1, 1); // The tracker doesn't transfer files
+		shard.node->start();
+		shard.sockets_last_modified = shard.node->getSocketsLastModified();
+		shards.push_back(shard);
+	}
 
-	// Create a separate thread to connect & bind
-	pthread_t node_thread;
-	if (pthread_create(&node_thread, NULL, &P2PServer::startActivityListenerThread, (void *)&node) != 0)
+	if (reactor_count > 1)
 	{
-		perror("Error: could not spawn peer listeners");
-		exit(1);
+		cout << "Running " << reactor_count << " reactors" << endl;
+	}
+
+	for (unsigned int i = 0; i < shards.size(); i++)
+	{
+		// Create a separate thread to connect & bind
+		pthread_t node_thread;
+		if (pthread_create(&node_thread, NULL, &P2PServer::startActivityListenerThread, (void *)shards[i].node) != 0)
+		{
+			perror("Error: could not spawn peer listeners");
+			exit(1);
+		}
+
+		// The first shard's requests are handled on this thread
+		if (i == 0) continue;
+
+		pthread_t program_thread;
+		if (pthread_create(&program_thread, NULL, &P2PServer::startProgramThread, (void *)&shards[i]) != 0)
+		{
+			perror("Error: could not spawn request handlers");
+			exit(1);
+		}
 	}
 
-	runProgram();
+	runProgram(shards[0]);
 }
 
 void * P2PServer::startActivityListenerThread(void * arg)
@@ -35,44 +70,62 @@ void * P2PServer::startActivityListenerThread(void * arg)
 	pthread_exit(NULL);
 }
 
-void P2PServer::runProgram()
+void * P2PServer::startProgramThread(void * arg)
+{
+	P2PServerShard * shard;
+	shard = (P2PServerShard *) arg;
+	shard->server->runProgram(*shard);
+	pthread_exit(NULL);
+}
+
+void P2PServer::runProgram(P2PServerShard &shard)
 {
+	P2PPeerNode & node = *shard.node;
+
+	P2PMessage message;
 	bool b_program_active = true;
 	while (b_program_active)
 	{
 		// Handle updates
-		if (socketsModified())
+		if (socketsModified(shard))
 		{
 			// Update socket-dependent logic
-			updateFileList();
+			updateFileList(shard);
 		}
 
-		if (node.countQueueMessages() > 0)
+		// Sleep until the next message, waking up now and then to check the sockets
+		if (node.waitQueueMessage(message, SOCKET_CHECK_INTERVAL))
 		{
-			// Get the oldest message
-			P2PMessage message = node.popQueueMessage();
-
 			// Handle message
-			handleRequest(message.socket_id, message.message);
-		}
-		else
-		{
-			usleep(5000);
+			handleRequest(shard, message.socket_id, message.message);
 		}
 	}
 }
 
-bool P2PServer::socketsModified()
+bool P2PServer::socketsModified(P2PServerShard &shard)
 {
-	timeval node_sockets_lm = node.getSocketsLastModified();
-	return (sockets_last_modified.tv_sec != node_sockets_lm.tv_sec || 
-			sockets_last_modified.tv_usec != node_sockets_lm.tv_usec);
+	timeval node_sockets_lm = shard.node->getSocketsLastModified();
+	return (shard.sockets_last_modified.tv_sec != node_sockets_lm.tv_sec || 
+			shard.sockets_last_modified.tv_usec != node_sockets_lm.tv_usec);
 }
 
-void P2PServer::updateFileList()
+void P2PServer::updateFileList(P2PServerShard &shard)
 {
-	// Get all of the current sockets
-	vector<P2PSocket> sockets = node.getSockets();
+	// Update the last modified time first, so a change made while we work is seen next pass
+	shard.sockets_last_modified = shard.node->getSocketsLastModified();
+
+	// Files registered from here on are held back until we're done, so none is checked against
+	// a socket list taken before its peer connected
+	pthread_rwlock_wrlock(&file_list_lock);
+
+	// Get all of the current sockets, across every shard
+	vector<P2PSocket> sockets;
+	vector<P2PServerShard>::iterator shard_iter;
+	for (shard_iter = shards.begin(); shard_iter != shards.end(); ++shard_iter)
+	{
+		vector<P2PSocket> shard_sockets = shard_iter->node->getSockets();
+		sockets.insert(sockets.end(), shard_sockets.begin(), shard_sockets.end());
+	}
 
 	// Prep work
 	bool b_socket_found;
@@ -83,11 +136,10 @@ void P2PServer::updateFileList()
 	// For each file, ensure that the file's owners are online
 	for (file_iter = file_list.begin(); file_iter < file_list.end(); )
 	{
-		b_socket_found = false;
-
 		// Validate each address attached to each file
 		for (addr_iter = (*file_iter).addresses.begin(); addr_iter < (*file_iter).addresses.end(); )
 		{
+			b_socket_found = false;
 			for (sock_iter = sockets.begin(); sock_iter < sockets.end(); sock_iter++)
 			{
 				if ((*sock_iter).socket_id == (*addr_iter).socket_id)
@@ -100,52 +152,77 @@ void P2PServer::updateFileList()
 			if (b_socket_found)
 				addr_iter++;
 			else
-				(*file_iter).addresses.erase(addr_iter);
+				addr_iter = (*file_iter).addresses.erase(addr_iter);
 		}
 
 		// If a file has no more addresses attached to it, then remove it
 		if ((*file_iter).addresses.size() > 0)
 			file_iter++;
 		else
-			file_list.erase(file_iter);
+			file_iter = file_list.erase(file_iter);
 	}
 
-	// Update the last modified time
-	sockets_last_modified = node.getSocketsLastModified();
+	pthread_rwlock_unlock(&file_list_lock);
 }
 
-void P2PServer::handleRequest(int socket, string request)
+void P2PServer::handleRequest(P2PServerShard &shard, int socket, string &request)
 {
-	// Parse the request
-	vector<string> request_parsed = P2PCommon::parseRequest(request);
+	// Binary requests get binary replies
+	P2PWireHeader header;
+	if (P2PProtocol::readHeader(request.data(), request.length(), header))
+	{
+		handleBinaryRequest(shard, socket, header, request);
+		return;
+	}
+
+	// Parse the request - the lines point into the request, nothing is copied
+	vector<P2PStringView> & request_parsed = shard.request_lines;
+	if (P2PTokenizer::splitLines(P2PStringView(request), request_parsed) == 0)
+	{
+		return;
+	}
 
 	// Trim whitespace from the command
-	request_parsed[0] = P2PCommon::trimWhitespace(request_parsed[0]);
+	P2PStringView command = request_parsed[0].trim();
 
 	// Report to the front
-	cerr << request_parsed[0] << endl;
+	cerr.write(command.data, command.length) << endl;
 
 	// Parse the request for a matching command
-	if (request_parsed[0].compare("addFiles") == 0)
+	if (command.equals("addFiles") && request_parsed.size() >= 2)
 	{
 		cerr << "Adding files" << endl;
 
-		string message = addFiles(socket, request_parsed);
-		write(socket, message.c_str(), message.length());
+		string message = addFiles(shard, socket, request_parsed);
+		shard.node->sendMessageToSocket(message, socket);
 	}
-	else if (request_parsed[0].compare("list") == 0)
+	else if (command.equals("list"))
 	{
 		cerr << "Listing files" << endl;
 
 		string files = listFiles();
-		write(socket, files.c_str(), files.length());
+		shard.node->sendMessageToSocket(files, socket);
 	}
-	else if (request_parsed[0].compare("getFile") == 0)
+	else if (command.equals("getFile") && request_parsed.size() >= 2)
 	{
 		cerr << "Getting file" << endl;
 
-		string message = getFile(request_parsed);
-		write(socket, message.c_str(), message.length());
+		string message = getFile(request_parsed, socket, shard.node->hasContentHashes(socket), shard.node->hasPieceMaps(socket));
+		shard.node->sendMessageToSocket(message, socket);
+	}
+	else if (command.equals("locate"))
+	{
+		cerr << "Locating files" << endl;
+
+		string message = locateFiles(request_parsed, socket, shard.node->hasContentHashes(socket), shard.node->hasPieceMaps(socket));
+		shard.node->sendMessageToSocket(message, socket);
+	}
+	else if (command.equals("havePieces") && request_parsed.size() >= 2)
+	{
+		cerr << "Adding pieces" << endl;
+
+		// Nothing goes back - the peer reports again with the next batch
+		readPieces(shard, socket, request_parsed);
 	}
 	else
 	{
@@ -153,61 +230,283 @@ void P2PServer::handleRequest(int socket, string request)
 	}
 }
 
-string P2PServer::addFiles(int socket, vector<string> files)
+void P2PServer::handleBinaryRequest(P2PServerShard &shard, int socket, P2PWireHeader &header, string &request)
+{
+	P2PWireReader reader(&request[P2PProtocol::WIRE_HEADER_SIZE], header.length);
+
+	if (header.type == P2PProtocol::MSG_ADD_FILES)
+	{
+		cerr << "Adding files" << endl;
+
+		// Read the files being shared
+		int port = reader.getU16();
+		unsigned int count = reader.getU32();
+
+		vector<FileItem> files;
+		for (unsigned int i = 0; i < count && !reader.failed(); i++)
+		{
+			FileItem file_item;
+			file_item.name = reader.getString();
+			file_item.size = reader.getFileSize();
+			file_item.path = reader.getString();
+			file_item.piece_size = 0;
+			files.push_back(file_item);
+		}
+
+		// Clients that hashed the files send each root and piece size after the list
+		for (unsigned int i = 0; i < files.size() && reader.remaining() > 0; i++)
+		{
+			files[i].hash = reader.getString();
+			files[i].piece_size = reader.getU32();
+		}
+
+		string message;
+		if (reader.failed())
+			message = "Could not read the list of files to add.";
+		else
+			message = to_string(registerFiles(shard, socket, port, files)) + " files successfully added to file listing.";
+
+		shard.node->sendMessageToSocket(P2PProtocol::makeMessage(P2PProtocol::MSG_TEXT, 0, 0, message), socket);
+	}
+	else if (header.type == P2PProtocol::MSG_LIST)
+	{
+		cerr << "Listing files" << endl;
+
+		shard.node->sendMessageToSocket(encodeFileListing(), socket);
+	}
+	else if (header.type == P2PProtocol::MSG_GET_FILE)
+	{
+		cerr << "Getting file" << endl;
+
+		shard.node->sendMessageToSocket(encodeFileAddresses(header.file_id, socket,
+			shard.node->hasContentHashes(socket), shard.node->hasPieceMaps(socket)), socket);
+	}
+	else if (header.type == P2PProtocol::MSG_LOCATE)
+	{
+		cerr << "Locating files" << endl;
+
+		shard.node->sendMessageToSocket(encodeLocatedFiles(reader, socket,
+			shard.node->hasContentHashes(socket), shard.node->hasPieceMaps(socket)), socket);
+	}
+	else if (header.type == P2PProtocol::MSG_HAVE_PIECES)
+	{
+		cerr << "Adding pieces" << endl;
+
+		int port = reader.getU16();
+		unsigned int count = reader.getU32();
+
+		map<unsigned int, P2PPieceMap> files;
+		for (unsigned int i = 0; i < count && !reader.failed(); i++)
+		{
+			unsigned int file_id = reader.getU32();
+			files[file_id].read(reader);
+		}
+
+		// Nothing goes back - the peer reports again with the next batch
+		if (!reader.failed())
+		{
+			registerPieces(shard, socket, port, files);
+		}
+	}
+	else
+	{
+		cerr << "Request unknown: binary type " << header.type << endl;
+	}
+}
+
+string P2PServer::addFiles(P2PServerShard &shard, int socket, vector<P2PStringView> &files)
 {
 	// Get the public address / port
-	vector<string> address = P2PCommon::parseAddress(files[1]);
+	P2PStringView address[2];
+	int port;
+	if (P2PTokenizer::split(files[1], ':', address, 2) < 2 || !address[1].trim().toInt(port))
+	{
+		return "Could not read the address to share files from.";
+	}
+
+	// Collect the files - name, size and path, then the root and piece size if the client hashed them, separated by tabs
+	vector<FileItem> file_items;
+	vector<P2PStringView> & seglist = shard.request_fields;
+	for (unsigned int i = 2; i < files.size(); i++)
+	{
+		int size;
+		if (P2PTokenizer::split(files[i], '\t', seglist) < 3 || !seglist[1].toInt(size))
+		{
+			continue;
+		}
+
+		FileItem file_item;
+		file_item.name = seglist[0].toString();
+		file_item.size = size;
+		file_item.path = seglist[2].toString();
+		file_item.piece_size = 0;
 
+		int piece_size;
+		if (seglist.size() >= 5 && seglist[4].trim().toInt(piece_size))
+		{
+			file_item.hash = seglist[3].trim().toString();
+			file_item.piece_size = piece_size;
+		}
+
+		file_items.push_back(file_item);
+	}
+
+	int i = registerFiles(shard, socket, port, file_items);
+
+	return to_string(i) + " files successfully added to file listing.";
+}
+
+int P2PServer::registerFiles(P2PServerShard &shard, int socket, int port, vector<FileItem> &files)
+{
 	// Get the socket's IP address
-	struct sockaddr_in client_address = node.getClientAddressFromSocket(socket);
+	struct sockaddr_in client_address = shard.node->getClientAddressFromSocket(socket);
 	string client_public_address = inet_ntoa(client_address.sin_addr);
 
+	// Adding files changes the catalog
+	pthread_rwlock_wrlock(&file_list_lock);
+
 	int i = 0;
-	vector<string>::iterator iter;
-	for (iter = files.begin() + 2; iter < files.end(); iter++, i++)
+	vector<FileItem>::iterator iter;
+	for (iter = files.begin(); iter < files.end(); iter++, i++)
 	{
-		stringstream line(*iter);
-		string segment;
-		vector<string> seglist;
-		while (getline(line, segment, '\t'))
-		{
-			seglist.push_back(segment);
-		}
-
 		// Create the new FileAddress record
 		FileAddress file_address;
-		file_address.remote_path = seglist[2];
+		file_address.remote_path = (*iter).path;
 		file_address.socket_id = socket;
 		file_address.public_address = client_public_address;
-		file_address.public_port = stoi(address[1]);
+		file_address.public_port = port;
+		file_address.b_partial = false;
 
-		// If the file is new, add a new record
+		// A root that isn't a SHA-256 in hex is ignored, and the file is known by name
+		string digest;
+		if (!P2PSha256::fromHex((*iter).hash, digest) || (*iter).piece_size == 0)
+		{
+			(*iter).hash = "";
+			(*iter).piece_size = 0;
+		}
+
+		// If the file is new, add a new record - files with the same name and size are only the same file without a root
 		FileItem file_item;
-		if (hasFileItemWithNameSize(seglist[0], stoi(seglist[1])))
+		if (!(*iter).hash.empty() && hasFileItemWithHash((*iter).hash))
+		{
+			file_item = getFileItemWithHash((*iter).hash);
+		}
+		else if ((*iter).hash.empty() && hasFileItemWithNameSize((*iter).name, (*iter).size))
 		{
-			file_item = getFileItemWithNameSize(seglist[0], stoi(seglist[1]));
+			file_item = getFileItemWithNameSize((*iter).name, (*iter).size);
 		}
 		else
 		{
-			file_item.name = seglist[0];
-			file_item.size = stoi(seglist[1]);
+			file_item.name = (*iter).name;
+			file_item.size = (*iter).size;
+			file_item.hash = (*iter).hash;
+			file_item.piece_size = (*iter).piece_size;
 			file_item.file_id = ++max_file_id;
 
 			file_list.push_back(file_item);
 		}
 
-		// Don't add the address if we already have it
-		if (!isAddressAttachedToFileItem(file_address, file_item))
+		// Don't add the address if we already have it - a peer that was part way through has it all now
+		int address_index = findAddress(file_item, file_address);
+		if (address_index < 0 || file_item.addresses[address_index].b_partial)
 		{
 			// Add the address to the list
-			file_item.addresses.push_back(file_address);
+			if (address_index < 0)
+				file_item.addresses.push_back(file_address);
+			else
+				file_item.addresses[address_index] = file_address;
 
 			// Update the file item record
 			updateFileItem(file_item);
 		}
 	}
 
-	return to_string(i) + " files successfully added to file listing.";
+	pthread_rwlock_unlock(&file_list_lock);
+
+	return i;
+}
+
+void P2PServer::readPieces(P2PServerShard &shard, int socket, vector<P2PStringView> &request)
+{
+	// Get the public address / port
+	P2PStringView address[2];
+	int port;
+	if (P2PTokenizer::split(request[1], ':', address, 2) < 2 || !address[1].trim().toInt(port))
+	{
+		return;
+	}
+
+	// A line per file - its id, then its runs of pieces, separated by a tab
+	map<unsigned int, P2PPieceMap> files;
+	P2PStringView fields[2];
+	for (unsigned int i = 2; i < request.size(); i++)
+	{
+		int file_id;
+		if (P2PTokenizer::split(request[i], '\t', fields, 2) == 2 && fields[0].trim().toInt(file_id))
+		{
+			files[file_id].parse(fields[1].trim().toString());
+		}
+	}
+
+	registerPieces(shard, socket, port, files);
+}
+
+void P2PServer::registerPieces(P2PServerShard &shard, int socket, int port, map<unsigned int, P2PPieceMap> &files)
+{
+	// Get the socket's IP address
+	struct sockaddr_in client_address = shard.node->getClientAddressFromSocket(socket);
+
+	FileAddress file_address;
+	file_address.remote_path = "";
+	file_address.socket_id = socket;
+	file_address.public_address = inet_ntoa(client_address.sin_addr);
+	file_address.public_port = port;
+	file_address.b_partial = true;
+
+	pthread_rwlock_wrlock(&file_list_lock);
+
+	vector<FileItem>::iterator iter;
+	for (iter = file_list.begin(); iter < file_list.end(); iter++)
+	{
+		// Pieces are only checked in files with a content root
+		map<unsigned int, P2PPieceMap>::iterator pieces_iter = files.find((*iter).file_id);
+		if (pieces_iter == files.end() || (*iter).hash.empty())
+		{
+			continue;
+		}
+
+		unsigned int num_pieces = P2PFileTransfer::countPieces(*iter);
+		pieces_iter->second.trim(num_pieces);
+		if (pieces_iter->second.isEmpty())
+		{
+			continue;
+		}
+
+		// The first report makes the peer a source of the file, later ones add to what it holds
+		int address_index = findAddress(*iter, file_address);
+		if (address_index < 0)
+		{
+			address_index = (*iter).addresses.size();
+			(*iter).addresses.push_back(file_address);
+		}
+
+		FileAddress & peer = (*iter).addresses[address_index];
+		if (!peer.b_partial)
+		{
+			continue;
+		}
+
+		peer.pieces.add(pieces_iter->second);
+
+		// Once it has every piece it's a source like any other
+		if (peer.pieces.isComplete(num_pieces))
+		{
+			peer.b_partial = false;
+			peer.pieces.clear();
+		}
+	}
+
+	pthread_rwlock_unlock(&file_list_lock);
 }
 
 void P2PServer::updateFileItem(FileItem file_item)
@@ -223,9 +522,20 @@ void P2PServer::updateFileItem(FileItem file_item)
 	}
 }
 
+vector<FileItem> P2PServer::getFileListing()
+{
+	// Take a snapshot, so the lock isn't held while replying
+	pthread_rwlock_rdlock(&file_list_lock);
+	vector<FileItem> files = file_list;
+	pthread_rwlock_unlock(&file_list_lock);
+
+	return files;
+}
+
 string P2PServer::listFiles()
 {
-	if (file_list.size() == 0)
+	vector<FileItem> files = getFileListing();
+	if (files.size() == 0)
 	{
 		return "\r\nThere are currently no files stored on the server.\r\n";
 	}
@@ -233,7 +543,7 @@ string P2PServer::listFiles()
 	string files_message = "\r\nFile Listing:\r\n";
 
 	vector<FileItem>::iterator iter;
-	for (iter = file_list.begin(); iter < file_list.end(); iter++)
+	for (iter = files.begin(); iter < files.end(); iter++)
 	{
 		files_message += "\t" + to_string((*iter).file_id) + ") " + (*iter).name + " - (" + to_string((*iter).size) + " B)" "\r\n";
 	}
@@ -241,40 +551,312 @@ string P2PServer::listFiles()
 	return files_message;
 }
 
-string P2PServer::getFile(vector<string> request)
+string P2PServer::encodeFileListing()
+{
+	vector<FileItem> files = getFileListing();
+
+	P2PWireWriter writer;
+	writer.putU32(files.size());
+
+	vector<FileItem>::iterator iter;
+	for (iter = files.begin(); iter < files.end(); iter++)
+	{
+		writer.putU32((*iter).file_id);
+		writer.putU64((*iter).size);
+		writer.putString((*iter).name);
+	}
+
+	return P2PProtocol::makeMessage(P2PProtocol::MSG_LIST_REPLY, 0, 0, writer.getData());
+}
+
+bool P2PServer::findFile(int file_id, FileItem &file_item)
+{
+	pthread_rwlock_rdlock(&file_list_lock);
+
+	// Validate that the file exists
+	bool b_found = hasFileWithId(file_id);
+	if (b_found)
+	{
+		file_item = getFileItem(file_id);
+	}
+
+	pthread_rwlock_unlock(&file_list_lock);
+
+	return b_found;
+}
+
+string P2PServer::getFile(vector<P2PStringView> &request, int socket, bool b_content_hashes, bool b_piece_maps)
 {
 	// Get the File Item info from the file ID
-	int file_id = stoi(request[1]);
+	int file_id;
 
 	// Validate that the file exists
-	if (!hasFileWithId(file_id))
+	FileItem file_item;
+	if (!request[1].trim().toInt(file_id) || !findFile(file_id, file_item))
 	{
 		return "fileAddress\r\nNULL\r\nNULL\r\nNULL\r\nNULL";
 	}
 
-	// Get the file item
-	FileItem file_item = getFileItem(file_id);
-
 	// Compile all of the public addresses
 	string address_list;
+	vector<FileAddress> peers = getPeers(file_item, socket, b_content_hashes && b_piece_maps);
 	vector<FileAddress>::iterator iter;
-	for (iter = file_item.addresses.begin(); iter < file_item.addresses.end(); iter++)
+	for (iter = peers.begin(); iter < peers.end(); iter++)
 	{
-		address_list += "\r\n" + (*iter).public_address + ":" + to_string((*iter).public_port);
+		address_list += "\r\n" + describePeer(*iter);
+	}
+
+	// Clients that know content hashes get the root and piece size after the size
+	string size_info = to_string(file_item.size);
+	if (b_content_hashes)
+	{
+		size_info += "\t" + file_item.hash + "\t" + to_string(file_item.piece_size);
 	}
 
 	// Report the disconnection
 	return "fileAddress\r\n" + to_string(file_id) + "\r\n"
-			+ file_item.name + "\r\n" + to_string(file_item.size)
+			+ file_item.name + "\r\n" + size_info
 			+ address_list;
 }
 
+string P2PServer::encodeFileAddresses(unsigned int file_id, int socket, bool b_content_hashes, bool b_piece_maps)
+{
+	// An unknown file goes back with a file id of zero
+	FileItem file_item;
+	if (!findFile(file_id, file_item))
+	{
+		return P2PProtocol::makeMessage(P2PProtocol::MSG_FILE_ADDRESS, 0, 0, "");
+	}
+
+	vector<FileAddress> peers = getPeers(file_item, socket, b_content_hashes && b_piece_maps);
+
+	P2PWireWriter writer;
+	writer.putString(file_item.name);
+	writer.putU64(file_item.size);
+	writer.putU32(peers.size());
+
+	vector<FileAddress>::iterator iter;
+	for (iter = peers.begin(); iter < peers.end(); iter++)
+	{
+		writer.putString((*iter).public_address);
+		writer.putU16((*iter).public_port);
+	}
+
+	// Clients that know content hashes get the root and piece size after the peers
+	if (b_content_hashes)
+	{
+		writer.putString(file_item.hash);
+		writer.putU32(file_item.piece_size);
+	}
+
+	// Then, for clients that know piece maps, what each peer holds
+	if (b_content_hashes && b_piece_maps)
+	{
+		writePeerPieces(writer, file_item, peers);
+	}
+
+	return P2PProtocol::makeMessage(P2PProtocol::MSG_FILE_ADDRESS, file_id, 0, writer.getData());
+}
+
+vector<FileItem> P2PServer::findFiles(vector<unsigned int> &file_ids, string pattern)
+{
+	// Sorted, so each file in the catalog is a quick lookup
+	sort(file_ids.begin(), file_ids.end());
+
+	// One pass over the catalog for the whole batch
+	vector<FileItem> files;
+	pthread_rwlock_rdlock(&file_list_lock);
+
+	vector<FileItem>::iterator iter;
+	for (iter = file_list.begin(); iter < file_list.end() && files.size() < P2PProtocol::MAX_LOCATE_FILES; iter++)
+	{
+		if (binary_search(file_ids.begin(), file_ids.end(), (unsigned int)(*iter).file_id)
+			|| (pattern.length() > 0 && fnmatch(pattern.c_str(), (*iter).name.c_str(), 0) == 0))
+		{
+			files.push_back(*iter);
+		}
+	}
+
+	pthread_rwlock_unlock(&file_list_lock);
+
+	return files;
+}
+
+string P2PServer::locateFiles(vector<P2PStringView> &request, int socket, bool b_content_hashes, bool b_piece_maps)
+{
+	// A name pattern, which may be empty, then one file id per line
+	string pattern = (request.size() > 1) ? request[1].trim().toString() : "";
+
+	vector<unsigned int> file_ids;
+	for (unsigned int i = 2; i < request.size() && file_ids.size() < P2PProtocol::MAX_LOCATE_FILES; i++)
+	{
+		int file_id;
+		if (request[i].trim().toInt(file_id))
+		{
+			file_ids.push_back(file_id);
+		}
+	}
+
+	vector<FileItem> files = findFiles(file_ids, pattern);
+
+	// One line per file - id, name and size, the root and piece size for clients that know them, then its peers, all tab separated
+	string message = "fileAddresses\r\n" + to_string(files.size());
+
+	vector<FileItem>::iterator iter;
+	for (iter = files.begin(); iter < files.end(); iter++)
+	{
+		message += "\r\n" + to_string((*iter).file_id) + "\t" + (*iter).name + "\t" + to_string((*iter).size);
+		if (b_content_hashes)
+		{
+			message += "\t" + (*iter).hash + "\t" + to_string((*iter).piece_size);
+		}
+
+		vector<FileAddress> peers = getPeers(*iter, socket, b_content_hashes && b_piece_maps);
+		vector<FileAddress>::iterator addr_iter;
+		for (addr_iter = peers.begin(); addr_iter < peers.end(); addr_iter++)
+		{
+			message += "\t" + describePeer(*addr_iter);
+		}
+	}
+
+	return message;
+}
+
+string P2PServer::encodeLocatedFiles(P2PWireReader &reader, int socket, bool b_content_hashes, bool b_piece_maps)
+{
+	string pattern = reader.getString();
+	unsigned int count = reader.getU32();
+
+	vector<unsigned int> file_ids;
+	for (unsigned int i = 0; i < count && i < P2PProtocol::MAX_LOCATE_FILES && !reader.failed(); i++)
+	{
+		file_ids.push_back(reader.getU32());
+	}
+
+	// A malformed request finds nothing
+	vector<FileItem> files;
+	if (!reader.failed())
+	{
+		files = findFiles(file_ids, pattern);
+	}
+
+	P2PWireWriter writer;
+	writer.putU32(files.size());
+
+	vector<vector<FileAddress> > file_peers;
+	vector<FileItem>::iterator iter;
+	for (iter = files.begin(); iter < files.end(); iter++)
+	{
+		writer.putU32((*iter).file_id);
+		writer.putString((*iter).name);
+		writer.putU64((*iter).size);
+
+		file_peers.push_back(getPeers(*iter, socket, b_content_hashes && b_piece_maps));
+		writer.putU32(file_peers.back().size());
+
+		vector<FileAddress>::iterator addr_iter;
+		for (addr_iter = file_peers.back().begin(); addr_iter < file_peers.back().end(); addr_iter++)
+		{
+			writer.putString((*addr_iter).public_address);
+			writer.putU16((*addr_iter).public_port);
+		}
+	}
+
+	// Clients that know content hashes get each root and piece size after the list
+	for (iter = files.begin(); iter < files.end() && b_content_hashes; iter++)
+	{
+		writer.putString((*iter).hash);
+		writer.putU32((*iter).piece_size);
+	}
+
+	// Then, for clients that know piece maps, what each peer of each file holds
+	for (unsigned int f = 0; f < files.size() && b_content_hashes && b_piece_maps; f++)
+	{
+		writePeerPieces(writer, files[f], file_peers[f]);
+	}
+
+	return P2PProtocol::makeMessage(P2PProtocol::MSG_LOCATE_REPLY, 0, 0, writer.getData());
+}
+
+vector<FileAddress> P2PServer::getPeers(FileItem &file_item, int socket, bool b_piece_maps)
+{
+	vector<FileAddress> peers;
+	vector<FileAddress>::iterator iter;
+	for (iter = file_item.addresses.begin(); iter < file_item.addresses.end(); iter++)
+	{
+		if ((*iter).socket_id != (unsigned int) socket && (b_piece_maps || !(*iter).b_partial))
+		{
+			peers.push_back(*iter);
+		}
+	}
+
+	return peers;
+}
+
+string P2PServer::describePeer(FileAddress &file_address)
+{
+	// A peer part way through the file has the pieces it holds after an @
+	string peer = file_address.public_address + ":" + to_string(file_address.public_port);
+	if (file_address.b_partial)
+	{
+		peer += "@" + file_address.pieces.toString();
+	}
+
+	return peer;
+}
+
+void P2PServer::writePeerPieces(P2PWireWriter &writer, FileItem &file_item, vector<FileAddress> &peers)
+{
+	// A peer with the whole file is one run of every piece
+	P2PPieceMap whole_file;
+	whole_file.add(0, P2PFileTransfer::countPieces(file_item));
+
+	vector<FileAddress>::iterator iter;
+	for (iter = peers.begin(); iter < peers.end(); iter++)
+	{
+		if ((*iter).b_partial)
+			(*iter).pieces.write(writer);
+		else
+			whole_file.write(writer);
+	}
+}
+
+bool P2PServer::hasFileItemWithHash(string hash)
+{
+	vector<FileItem>::iterator iter;
+	for (iter = file_list.begin(); iter < file_list.end(); iter++)
+	{
+		if ((*iter).hash.compare(hash) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+FileItem P2PServer::getFileItemWithHash(string hash)
+{
+	FileItem file_item;
+	vector<FileItem>::iterator iter;
+	for (iter = file_list.begin(); iter < file_list.end(); iter++)
+	{
+		if ((*iter).hash.compare(hash) == 0)
+		{
+			file_item = (*iter);
+			break;
+		}
+	}
+
+	return file_item;
+}
+
 bool P2PServer::hasFileItemWithNameSize(string name, int size)
 {
 	vector<FileItem>::iterator iter;
 	for (iter = file_list.begin(); iter < file_list.end(); iter++)
 	{
-		if ((*iter).size == size && (*iter).name.compare(name) == 0)
+		if ((*iter).size == size && (*iter).hash.empty() && (*iter).name.compare(name) == 0)
 		{
 			return true;
 		}
@@ -303,7 +885,7 @@ FileItem P2PServer::getFileItemWithNameSize(string name, int size)
 	vector<FileItem>::iterator iter;
 	for (iter = file_list.begin(); iter < file_list.end(); iter++)
 	{
-		if ((*iter).size == size && (*iter).name.compare(name) == 0)
+		if ((*iter).size == size && (*iter).hash.empty() && (*iter).name.compare(name) == 0)
 		{
 			file_item = (*iter);
 			break;
@@ -329,19 +911,18 @@ FileItem P2PServer::getFileItem(int file_id)
 	return file_item;
 }
 
-bool P2PServer::isAddressAttachedToFileItem(FileAddress file_address, FileItem file_item)
+int P2PServer::findAddress(FileItem &file_item, FileAddress &file_address)
 {
-	vector<FileAddress>::iterator iter;
-	for (iter = file_item.addresses.begin(); iter < file_item.addresses.end(); iter++)
+	for (unsigned int i = 0; i < file_item.addresses.size(); i++)
 	{
-		if ((*iter).public_address == file_address.public_address &&
-			(*iter).public_port == file_address.public_port)
+		if (file_item.addresses[i].public_address == file_address.public_address &&
+			file_item.addresses[i].public_port == file_address.public_port)
 		{
-			return true;
+			return i;
 		}
 	}
 
-	return false;
+	return -1;
 }
 
 bool P2PServer::isSocketAttachedToFileItem(int socket_id, FileItem file_item)
@@ -5,44 +5,84 @@
 
 using namespace std;
 
+class P2PServer;
+
+typedef struct {
+	P2PServer * server;
+	P2PPeerNode * node;
+	timeval sockets_last_modified;
+
+	// Parsing scratch space - each shard handles its requests on one thread
+	vector<P2PStringView> request_lines;
+	vector<P2PStringView> request_fields;
+} P2PServerShard;
+
 class P2PServer
 {
 	private:
 		void initialize();
-		void runProgram();
-		void handleRequest(int, string);
-		string addFiles(int, vector<string>);
+		void runProgram(P2PServerShard&);
+		void handleRequest(P2PServerShard&, int, string&);
+		void handleBinaryRequest(P2PServerShard&, int, P2PWireHeader&, string&);
+		string addFiles(P2PServerShard&, int, vector<P2PStringView>&);
+		int registerFiles(P2PServerShard&, int, int, vector<FileItem>&);
+
+		// Peers part way through a file report the pieces they've checked since last time
+		void readPieces(P2PServerShard&, int, vector<P2PStringView>&);
+		void registerPieces(P2PServerShard&, int, int, map<unsigned int, P2PPieceMap>&);
+
 		string listFiles();
-		void updateFileList();
-		bool socketsModified();
-		string getFile(vector<string>);
+		string encodeFileListing();
+		vector<FileItem> getFileListing();
+		void updateFileList(P2PServerShard&);
+		bool socketsModified(P2PServerShard&);
+		string getFile(vector<P2PStringView>&, int, bool, bool);
+		string encodeFileAddresses(unsigned int, int, bool, bool);
+		bool findFile(int, FileItem&);
+		string locateFiles(vector<P2PStringView>&, int, bool, bool);
+		string encodeLocatedFiles(P2PWireReader&, int, bool, bool);
+		vector<FileItem> findFiles(vector<unsigned int>&, string);
+
+		// The peers a downloader is given - never itself, and peers part way through only if it knows piece maps
+		vector<FileAddress> getPeers(FileItem&, int, bool);
+		string describePeer(FileAddress&);
+		void writePeerPieces(P2PWireWriter&, FileItem&, vector<FileAddress>&);
 
 		bool hasFileWithId(int);
 		FileItem getFileItem(int);
 
+		// Files with a content root are keyed by it - the rest by name and size
+		bool hasFileItemWithHash(string);
+		FileItem getFileItemWithHash(string);
 		bool hasFileItemWithNameSize(string, int);
 		FileItem getFileItemWithNameSize(string, int);
 		void updateFileItem(FileItem);
 
-		bool isAddressAttachedToFileItem(FileAddress, FileItem);
+		int findAddress(FileItem&, FileAddress&);
 		bool isSocketAttachedToFileItem(int, FileItem);
 
 		// Server limits and port
 		int PORT_NUMBER;
 
+		// How often (in ms) an idle request handler checks for closed sockets
+		static const int SOCKET_CHECK_INTERVAL = 100;
+
 		// Thread worker functions
 		static void * startActivityListenerThread(void *);
+		static void * startProgramThread(void *);
 
-		// Keep track of the peer node
-		P2PPeerNode node;
+		// One peer node per reactor thread, each with its own listener and connections
+		vector<P2PServerShard> shards;
+		int reactor_count;
 
-		// Keep a list of the files and active clients
+		// Keep a list of the files and active clients - shared by every shard
 		vector<FileItem> file_list;
-		timeval sockets_last_modified;
 		int max_file_id;
+		pthread_rwlock_t file_list_lock;
 
 	public:
 		P2PServer();
+		void setReactorCount(int);
 		void start();
 };
 
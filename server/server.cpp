@@ -6,8 +6,25 @@ int main(int argc, const char* argv[])
 {
 	cout << "P2P Server is about to start:" << endl;
 
-	// Start up the server
+	// Pick the I/O backend - P2P_IO_BACKEND=io_uring enables the ring
+	if (getenv("P2P_IO_BACKEND") != NULL)
+	{
+		P2PIOBackend::setPreferredBackend(P2PIOBackend::parseBackend(getenv("P2P_IO_BACKEND")));
+	}
+
+	// Pick the wire protocol - P2P_PROTOCOL=text talks to nodes that predate the binary one
+	if (getenv("P2P_PROTOCOL") != NULL)
+	{
+		P2PProtocol::setPreferredProtocol(P2PProtocol::parseProtocol(getenv("P2P_PROTOCOL")));
+	}
+
+	// Start up the server - an optional argument sets the number of reactor threads
 	P2PServer server;
+	if (argc == 2)
+	{
+		server.setReactorCount(atoi(argv[1]));
+	}
+
 	server.start();
 
 	return 0;